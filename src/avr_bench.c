@@ -0,0 +1,258 @@
+/*
+ * Cycle counts for the AVR blink firmware, from simavr
+ *
+ * Runs an ELF built by Makefile.avr (C or assembly) on simavr's ATmega328P
+ * for a few simulated seconds and measures, to the cycle:
+ *   flash   - .text + .data, bytes
+ *   ram     - .data + .bss + the deepest the stack got, bytes
+ *   awake   - cycles from a wakeup to the next SLEEP: one pass of the main
+ *             loop, tick interrupt included; mean and worst
+ *   latency - cycles from Timer1's compare match to the first instruction
+ *             of its interrupt handler (wakeup, vector, JMP)
+ *   isr     - cycles from taking the vector to the end of RETI
+ *   blink   - PB5's half-period, which should be 500 ms
+ * Any of the first four can have a budget; exceeding one, or a blink more
+ * than 0.5% off, fails the run (exit status 1).
+ *
+ * Compile: cc -O2 -o avr_bench avr_bench.c $(pkg-config --cflags --libs simavr)
+ * Run: ./avr_bench [-t seconds] [-f flash] [-r ram] [-a awake] [-l latency] file.elf
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_io.h>
+#include <avr_ioport.h>
+
+#define MCU "atmega328p"
+#define FREQUENCY 16000000
+#define TIMER1_COMPA_VECTOR 11
+#define VECTOR_BYTES 4          // A JMP per vector
+#define OPCODE_RETI 0x9518
+
+#define BLINK_MS 500.0
+#define BLINK_TOLERANCE 0.005
+
+struct cycle_stat {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+struct bench {
+    avr_t *avr;
+    uint64_t raised;            // When the compare match was (0: none waiting)
+    int in_vector;              // The last step took the vector: next is the JMP
+    uint64_t entered;           // When the vector was taken (0: not in the ISR)
+    uint64_t woke;              // When the CPU last woke
+    uint16_t min_sp;
+    uint32_t pb5;
+    uint64_t last_toggle;
+    struct cycle_stat awake, latency, isr, blink;
+};
+
+static void cycle_add(struct cycle_stat *s, uint64_t cycles) {
+    s->count++;
+    s->sum += cycles;
+    if (cycles > s->max) {
+        s->max = cycles;
+    }
+}
+
+static double cycle_mean(const struct cycle_stat *s) {
+    return s->count ? (double)s->sum / s->count : 0;
+}
+
+// Timer1 compare match A became pending (1) or was taken (0)
+static void compa_pending(struct avr_irq_t *irq, uint32_t value, void *param) {
+    struct bench *b = param;
+    (void)irq;
+
+    if (value && !b->raised) {
+        b->raised = b->avr->cycle;
+    }
+}
+
+static void pb5_changed(struct avr_irq_t *irq, uint32_t value, void *param) {
+    struct bench *b = param;
+    (void)irq;
+
+    if (value == b->pb5) {
+        return;     // Another pin of the port was written
+    }
+    b->pb5 = value;
+    if (b->last_toggle) {
+        cycle_add(&b->blink, b->avr->cycle - b->last_toggle);
+    }
+    b->last_toggle = b->avr->cycle;
+}
+
+// simavr sleeps in real time while the MCU does; a benchmark doesn't wait
+static void no_sleep(avr_t *avr, avr_cycle_count_t how_long) {
+    (void)avr;
+    (void)how_long;
+}
+
+// Run for cycles, one instruction (or one sleep) per step
+static int run(struct bench *b, uint64_t cycles) {
+    avr_t *avr = b->avr;
+    int sleeping = 0;
+
+    while (avr->cycle < cycles) {
+        avr_flashaddr_t pc = avr->pc;
+        int reti = avr->state == cpu_Running && (avr->flash[pc] | avr->flash[pc + 1] << 8) == OPCODE_RETI;
+
+        int state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "Firmware stopped at cycle %llu, pc 0x%04x\n",
+                    (unsigned long long)avr->cycle, avr->pc);
+            return -1;
+        }
+
+        uint16_t sp = avr->data[R_SPL] | avr->data[R_SPH] << 8;
+        if (sp && sp < b->min_sp) {
+            b->min_sp = sp;
+        }
+
+        if (b->in_vector) {
+            // The JMP has run: the handler's first instruction is next
+            cycle_add(&b->latency, avr->cycle - b->raised);
+            b->raised = 0;
+            b->in_vector = 0;
+        }
+        if (reti && b->entered) {
+            cycle_add(&b->isr, avr->cycle - b->entered);
+            b->entered = 0;
+        }
+        if (avr->pc == TIMER1_COMPA_VECTOR * VECTOR_BYTES && b->raised) {
+            b->entered = avr->cycle;
+            b->in_vector = 1;
+        }
+
+        // A sleep and the interrupt that ends it are one step; the CPU
+        // woke at the compare match
+        if (sleeping && state == cpu_Running) {
+            b->woke = b->raised ? b->raised : avr->cycle;
+        } else if (!sleeping && state == cpu_Sleeping && b->woke) {
+            cycle_add(&b->awake, avr->cycle - b->woke);
+        }
+        sleeping = state == cpu_Sleeping;
+    }
+    return 0;
+}
+
+// Print one line with its budget; returns 1 if over it
+static int report(const char *name, double mean, uint64_t max, uint64_t budget) {
+    int over = budget && max > budget;
+
+    if (mean >= 0) {
+        printf("  %-16s %10.1f %8llu", name, mean, (unsigned long long)max);
+    } else {
+        printf("  %-16s %10s %8llu", name, "", (unsigned long long)max);
+    }
+    if (budget) {
+        printf(" %8llu  %s\n", (unsigned long long)budget, over ? "OVER BUDGET" : "ok");
+    } else {
+        printf(" %8s\n", "-");
+    }
+    return over;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t seconds] [-f flash] [-r ram] [-a awake] [-l latency] file.elf\n", prog);
+    fprintf(stderr, "  -t  Simulated seconds to run (default 3)\n");
+    fprintf(stderr, "  -f  Budget: flash bytes\n");
+    fprintf(stderr, "  -r  Budget: RAM bytes, stack included\n");
+    fprintf(stderr, "  -a  Budget: cycles awake per wakeup, worst case\n");
+    fprintf(stderr, "  -l  Budget: cycles of interrupt latency, worst case\n");
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = 3;
+    uint64_t budget_flash = 0, budget_ram = 0, budget_awake = 0, budget_latency = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:f:r:a:l:h")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'f':
+            budget_flash = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            budget_ram = strtoull(optarg, NULL, 0);
+            break;
+        case 'a':
+            budget_awake = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            budget_latency = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || seconds <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *path = argv[optind];
+
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(path, &firmware) != 0) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return 2;
+    }
+    firmware.frequency = FREQUENCY;
+
+    struct bench b = {.min_sp = 0xffff};
+    b.avr = avr_make_mcu_by_name(MCU);
+    if (!b.avr) {
+        fprintf(stderr, "simavr has no %s\n", MCU);
+        return 2;
+    }
+    avr_init(b.avr);
+    avr_load_firmware(b.avr, &firmware);
+    b.avr->sleep = no_sleep;
+
+    avr_irq_register_notify(avr_get_interrupt_irq(b.avr, TIMER1_COMPA_VECTOR) + AVR_INT_IRQ_PENDING,
+                            compa_pending, &b);
+    avr_irq_register_notify(avr_io_getirq(b.avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 5), pb5_changed, &b);
+
+    if (run(&b, (uint64_t)(seconds * FREQUENCY)) < 0) {
+        return 1;
+    }
+
+    uint64_t flash = firmware.flashsize;
+    uint64_t stack = b.min_sp <= b.avr->ramend ? b.avr->ramend - b.min_sp : 0;
+    uint64_t ram = firmware.datasize + firmware.bsssize + stack;
+    int over = 0;
+
+    printf("%s: %.2f s simulated on %s @ %d MHz, %llu wakeups\n", path, seconds, MCU,
+           FREQUENCY / 1000000, (unsigned long long)b.awake.count);
+    printf("  %-16s %10s %8s %8s\n", "", "mean", "max", "budget");
+    over |= report("flash (bytes)", -1, flash, budget_flash);
+    over |= report("ram (bytes)", -1, ram, budget_ram);
+    over |= report("awake (cycles)", cycle_mean(&b.awake), b.awake.max, budget_awake);
+    over |= report("latency (cycles)", cycle_mean(&b.latency), b.latency.max, budget_latency);
+    report("isr (cycles)", cycle_mean(&b.isr), b.isr.max, 0);
+
+    double blink_ms = cycle_mean(&b.blink) * 1000.0 / FREQUENCY;
+    int blink_off = !b.blink.count || blink_ms < BLINK_MS * (1 - BLINK_TOLERANCE) ||
+                    blink_ms > BLINK_MS * (1 + BLINK_TOLERANCE);
+    printf("  %-16s %10.3f %8s %8.0f  %s\n", "blink (ms)", blink_ms, "", BLINK_MS,
+           blink_off ? "OFF BY MORE THAN 0.5%" : "ok");
+    if (!b.latency.count) {
+        printf("  (Timer1 compare match A never interrupted)\n");
+    }
+
+    avr_terminate(b.avr);
+    return over || blink_off || !b.latency.count ? 1 : 0;
+}
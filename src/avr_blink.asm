@@ -1,91 +1,152 @@
-
 ; AVR Bare-Metal LED Blink - Assembly Version
 ;
 ; Target: ATmega328P @ 16MHz
-; LED on PB5 (Arduino Uno pin 13)
+; LED on PB5 (Arduino Uno pin 13), heartbeat LED on PB4 (pin 12)
 ;
-; Assemble:
-;   avr-as -mmcu=atmega328p avr_blink.asm -o avr_blink_asm.o
-;   avr-ld -m avr5 avr_blink_asm.o -o avr_blink_asm.elf
-;   avr-objcopy -O ihex avr_blink_asm.elf avr_blink_asm.hex
+; The same program as avr_blink.c: Timer1 in CTC mode interrupts TICK_HZ
+; times a second, the CPU sleeps in IDLE mode between ticks, and each tick
+; runs whichever task's countdown has reached zero. Here the interrupt only
+; sets a flag in GPIOR0 - SBI touches neither a register nor SREG, so the
+; handler is two instructions and saves nothing.
 ;
-; Or use avr-gcc:
-;   avr-gcc -mmcu=atmega328p -nostartfiles avr_blink.asm -o avr_blink_asm.elf
+; GNU assembler syntax, run through the C preprocessor for <avr/io.h>:
+;
+; Assemble:
+;   avr-gcc -mmcu=atmega328p -x assembler-with-cpp -DF_CPU=16000000 -nostartfiles \
+;       avr_blink.asm -o avr_blink_asm.elf
 ;   avr-objcopy -O ihex avr_blink_asm.elf avr_blink_asm.hex
 ;
 ; Flash:
 ;   avrdude -c usbasp -p m328p -U flash:w:avr_blink_asm.hex:i
 ;
 
-.include "/usr/lib/avr/include/avr/iom328pdef.inc"
+#include <avr/io.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000
+#endif
+#ifndef TICK_HZ
+#define TICK_HZ 100
+#endif
+#define TICK_PRESCALER 64
+#define TICK_TOP (F_CPU / TICK_PRESCALER / TICK_HZ - 1)
+
+; Task periods in ticks: 8-bit countdowns
+#define BLINK_TICKS (500 * TICK_HZ / 1000)
+#define HEARTBEAT_TICKS (2000 * TICK_HZ / 1000)
+
+#if TICK_TOP > 65535
+#error "TICK_HZ too low for Timer1 at clk/64"
+#endif
+#if HEARTBEAT_TICKS > 255 || BLINK_TICKS < 1
+#error "TICK_HZ out of range for 8-bit task countdowns"
+#endif
+
+#define TICK_FLAG 0             /* GPIOR0 bit the timer interrupt sets */
 
 ; Register aliases
-.def temp = r16
-.def outer = r18
-.def mid = r19
-.def inner = r20
+#define temp r16
+#define blink_left r18          /* Ticks until blink runs */
+#define heart_left r19          /* Ticks until heartbeat runs */
+
+.section .text
 
 ; Reset vector
 .org 0x0000
-    rjmp main
+    jmp reset
 
-; Skip interrupt vectors (26 vectors × 2 bytes = 52 bytes)
-.org 0x0034
+; Timer1 compare match A (each vector is a 4-byte JMP)
+.org TIMER1_COMPA_vect_num * 4
+    jmp timer1_compa
 
-main:
+; Skip the rest of the interrupt vectors (26 vectors × 4 bytes = 104 bytes)
+.org _VECTORS_SIZE
+
+timer1_compa:
+    sbi _SFR_IO_ADDR(GPIOR0), TICK_FLAG
+    reti
+
+reset:
     ; Initialize stack pointer
     ; RAMEND = 0x08FF for ATmega328P (2KB SRAM)
-    ldi temp, HIGH(RAMEND)
-    out SPH, temp
-    ldi temp, LOW(RAMEND)
-    out SPL, temp
+    ldi temp, hi8(RAMEND)
+    out _SFR_IO_ADDR(SPH), temp
+    ldi temp, lo8(RAMEND)
+    out _SFR_IO_ADDR(SPL), temp
+
+    ; Configure PB5 and PB4 as outputs
+    ldi temp, (1 << PB5) | (1 << PB4)
+    out _SFR_IO_ADDR(DDRB), temp
+
+    ; Switch off what isn't used: the ADC (before its clock stops), the
+    ; analog comparator, and every peripheral clock but Timer1's
+    clr temp
+    sts ADCSRA, temp
+    ldi temp, (1 << ACD)
+    out _SFR_IO_ADDR(ACSR), temp
+    ldi temp, (1 << PRTWI) | (1 << PRTIM2) | (1 << PRTIM0) | (1 << PRSPI) | (1 << PRUSART0) | (1 << PRADC)
+    sts PRR, temp
+
+    ; Timer1: CTC mode, count to TICK_TOP at clk/64, interrupt on match.
+    ; 16-bit registers are written high byte first.
+    clr temp
+    sts TCCR1A, temp
+    ldi temp, hi8(TICK_TOP)
+    sts OCR1AH, temp
+    ldi temp, lo8(TICK_TOP)
+    sts OCR1AL, temp
+    ldi temp, (1 << OCIE1A)
+    sts TIMSK1, temp
+    ldi temp, (1 << WGM12) | (1 << CS11) | (1 << CS10)
+    sts TCCR1B, temp
 
-    ; Configure PB5 as output
-    ; DDRB = 0x04 in I/O space (0x24 in data space)
-    ldi temp, (1 << PB5)    ; temp = 0b00100000
-    out DDRB, temp          ; Write to DDRB
+    ; IDLE sleep (SM2..0 = 000), enabled for good: SLEEP only runs here
+    ldi temp, (1 << SE)
+    out _SFR_IO_ADDR(SMCR), temp
+
+    ; Both tasks run on the first tick
+    ldi blink_left, 1
+    ldi heart_left, 1
 
 loop:
-    ; Turn LED ON
-    ; PORTB = 0x05 in I/O space (0x25 in data space)
-    sbi PORTB, PB5          ; Set bit 5 in PORTB
-
-    ; Delay approximately 500ms
-    ldi outer, 41           ; Outer loop: 41 iterations
-delay_on:
-    ldi mid, 250            ; Middle loop: 250 iterations
-delay_mid_on:
-    ldi inner, 250          ; Inner loop: 250 iterations
-delay_inner_on:
-    dec inner               ; 1 cycle
-    brne delay_inner_on     ; 2 cycles if branch taken, 1 if not
-    dec mid                 ; 1 cycle
-    brne delay_mid_on       ; 2 cycles
-    dec outer               ; 1 cycle
-    brne delay_on           ; 2 cycles
-
-    ; Turn LED OFF
-    cbi PORTB, PB5          ; Clear bit 5 in PORTB
-
-    ; Delay approximately 500ms
-    ldi outer, 41           ; Outer loop
-delay_off:
-    ldi mid, 250            ; Middle loop
-delay_mid_off:
-    ldi inner, 250          ; Inner loop
-delay_inner_off:
-    dec inner               ; 1 cycle
-    brne delay_inner_off    ; 2 cycles
-    dec mid                 ; 1 cycle
-    brne delay_mid_off      ; 2 cycles
-    dec outer               ; 1 cycle
-    brne delay_off          ; 2 cycles
+    ; Sleep unless a tick has come. SEI's next instruction runs before any
+    ; interrupt, so a tick arriving after the check still wakes SLEEP.
+    cli
+    sbic _SFR_IO_ADDR(GPIOR0), TICK_FLAG
+    rjmp tick
+    sei
+    sleep
+    rjmp loop
+
+tick:
+    sei
+    cbi _SFR_IO_ADDR(GPIOR0), TICK_FLAG
+
+    ; Blink task: toggle the LED every BLINK_TICKS
+    dec blink_left
+    brne blink_done
+    ldi blink_left, BLINK_TICKS
+    sbi _SFR_IO_ADDR(PINB), PB5     ; Writing 1 to PINB5 toggles PORTB5
+blink_done:
+
+    ; Heartbeat task: the LED on for one tick, then off until the next beat
+    dec heart_left
+    brne heart_done
+    sbic _SFR_IO_ADDR(PORTB), PB4
+    rjmp heart_off
+    sbi _SFR_IO_ADDR(PORTB), PB4
+    ldi heart_left, 1
+    rjmp heart_done
+heart_off:
+    cbi _SFR_IO_ADDR(PORTB), PB4
+    ldi heart_left, HEARTBEAT_TICKS - 1
+heart_done:
 
     ; Repeat forever
     rjmp loop
 
 ; Notes on timing:
-; Inner loop: 250 * (1 + 2) - 1 = 749 cycles
-; Middle loop: 250 * (749 + 1 + 2) - 1 = 188,249 cycles
-; Outer loop: 41 * (188,249 + 1 + 2) - 1 = 7,718,311 cycles
-; Time: 7,718,311 / 16,000,000 Hz ≈ 0.482 seconds
\ No newline at end of file
+; Tick: 16,000,000 Hz / 64 / (TICK_TOP + 1 = 2500) = 100 Hz
+; Blink: 50 ticks = 500 ms each way; heartbeat: 10 ms on, 1,990 ms off
+; Awake per tick: wakeup, interrupt and about 15 instructions, out of
+; 160,000 cycles
@@ -2,7 +2,18 @@
  * AVR Bare-Metal LED Blink
  *
  * Target: ATmega328P @ 16MHz
- * LED on PB5 (Arduino Uno pin 13)
+ * LED on PB5 (Arduino Uno pin 13), heartbeat LED on PB4 (pin 12)
+ *
+ * No busy-waiting: Timer1 in CTC mode interrupts TICK_HZ times a second,
+ * and between ticks the CPU sleeps. Each tick, a small cooperative
+ * scheduler runs the tasks that are due; a task does its bit of work and
+ * returns how many ticks until it wants to run again. More periodic tasks
+ * are one more function and one more line in tasks[].
+ *
+ * IDLE is the deepest sleep mode Timer1 keeps counting in (it runs from
+ * the I/O clock, which power-save and power-down stop). The CPU is awake
+ * for a few microseconds per tick; everything else the program doesn't
+ * use is switched off in PRR.
  *
  * Compile:
  *   avr-gcc -mmcu=atmega328p -DF_CPU=16000000UL -Os avr_blink.c -o avr_blink.elf
@@ -13,35 +24,132 @@
  *
  * Circuit:
  *   PB5 (Pin 19) ──[330Ω]── LED ── GND
+ *   PB4 (Pin 18) ──[330Ω]── LED ── GND
  */
 
 #include <avr/io.h>
-#include <util/delay.h>
+#include <avr/interrupt.h>
+#include <avr/power.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+// Scheduler tick: 100 Hz, one every 10 ms
+#ifndef TICK_HZ
+#define TICK_HZ 100
+#endif
+#define TICK_PRESCALER 64
+#define MS_TO_TICKS(ms) ((uint16_t)((uint32_t)(ms) * TICK_HZ / 1000))
+
+#if F_CPU / TICK_PRESCALER / TICK_HZ > 65536
+#error "TICK_HZ too low for Timer1 at clk/64"
+#endif
+
+// Ticks since reset. Wraps after 65536; tasks only compare differences.
+static volatile uint16_t ticks;
+
+// Timer1 compare match A: fires every tick, and wakes the CPU from sleep
+ISR(TIMER1_COMPA_vect)
+{
+    ticks++;
+}
+
+// =============================================================================
+// TASKS
+// =============================================================================
+
+// Toggle the LED: on for 500 ms, off for 500 ms
+static uint16_t blink_task(void)
+{
+    // Writing a 1 to a PINx bit toggles the PORTx bit
+    PINB = (1 << PB5);
+    return MS_TO_TICKS(500);
+}
+
+// Flash the heartbeat LED for one tick every 2 seconds
+static uint16_t heartbeat_task(void)
+{
+    if (PORTB & (1 << PB4)) {
+        PORTB &= ~(1 << PB4);
+        return MS_TO_TICKS(2000) - 1;
+    }
+    PORTB |= (1 << PB4);
+    return 1;
+}
+
+struct task {
+    uint16_t (*run)(void);      // Returns ticks until its next run
+    uint16_t due;               // Tick it runs at next
+};
+
+static struct task tasks[] = {
+    {blink_task, 0},
+    {heartbeat_task, 0},
+};
+
+#define TASK_COUNT (sizeof(tasks) / sizeof(tasks[0]))
+
+// =============================================================================
+// SETUP
+// =============================================================================
+
+static void timer1_init(void)
+{
+    // CTC mode (WGM12): count from 0 to OCR1A, interrupt, start over.
+    // 16 MHz / 64 / 100 Hz = 2500 counts per tick.
+    TCCR1A = 0;
+    OCR1A = F_CPU / TICK_PRESCALER / TICK_HZ - 1;
+    TIMSK1 = (1 << OCIE1A);
+    TCCR1B = (1 << WGM12) | (1 << CS11) | (1 << CS10);  // clk/64, starts counting
+}
+
+static void power_init(void)
+{
+    // The ADC keeps drawing current until it is disabled, and only then
+    // may its clock be stopped. The analog comparator is on by default.
+    ADCSRA = 0;
+    ACSR = (1 << ACD);
+    power_all_disable();
+    power_timer1_enable();
+}
 
 int main(void)
 {
-    // Configure PB5 as output
+    // Configure PB5 and PB4 as outputs
     // DDRB: Data Direction Register for Port B
-    // Setting bit 5 = 1 makes PB5 an output
-    DDRB |= (1 << PB5);
+    DDRB |= (1 << PB5) | (1 << PB4);
+
+    power_init();
+    timer1_init();
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sei();
 
     // Infinite loop - microcontrollers never exit!
     while (1) {
-        // Turn LED ON
-        // PORTB: Port B Data Register
-        // Setting bit 5 = 1 outputs HIGH (5V) on PB5
-        PORTB |= (1 << PB5);
-
-        // Wait 500 milliseconds
-        _delay_ms(500);
+        uint16_t now;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            now = ticks;
+        }
 
-        // Turn LED OFF
-        // Clearing bit 5 = 0 outputs LOW (0V) on PB5
-        PORTB &= ~(1 << PB5);
+        // Run whatever is due. Scheduling from the due tick, not from now,
+        // keeps a task's period exact even if it ran late.
+        for (uint8_t i = 0; i < TASK_COUNT; i++) {
+            if ((int16_t)(now - tasks[i].due) >= 0) {
+                tasks[i].due += tasks[i].run();
+            }
+        }
 
-        // Wait 500 milliseconds
-        _delay_ms(500);
+        // Sleep until the next tick, unless one came while the tasks ran.
+        // The instruction after sei() runs before any interrupt, so a tick
+        // between the check and sleep_cpu() still wakes it.
+        cli();
+        if (ticks == now) {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        sei();
     }
 
     return 0;  // Never reached
-}
\ No newline at end of file
+}
@@ -0,0 +1,424 @@
+/*
+ * Display discovery and modesetting shared by simple_video_player and
+ * simple_triangle
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "drm_display.h"
+
+#define MAX_CARDS 16
+
+// Connector type names as the kernel gives them (DRM_MODE_CONNECTOR_*)
+static const char *const connector_types[] = {
+    "Unknown", "VGA", "DVI-I", "DVI-D", "DVI-A", "Composite", "SVIDEO", "LVDS",
+    "Component", "DIN", "DP", "HDMI-A", "HDMI-B", "TV", "eDP", "Virtual",
+    "DSI", "DPI", "Writeback", "SPI", "USB",
+};
+
+static void connector_name(const drmModeConnector *c, char *name, size_t size) {
+    const char *type = c->connector_type < sizeof(connector_types) / sizeof(connector_types[0])
+                       ? connector_types[c->connector_type] : "Unknown";
+    snprintf(name, size, "%s-%u", type, c->connector_type_id);
+}
+
+// Refresh rate from the pixel clock (kHz): vrefresh is rounded to whole Hz
+static double mode_refresh(const drmModeModeInfo *m) {
+    if (m->clock && m->htotal && m->vtotal) {
+        return m->clock * 1000.0 / ((double)m->htotal * m->vtotal);
+    }
+    return m->vrefresh;
+}
+
+int drm_display_parse_mode(const char *s, struct drm_display_want *want) {
+    int w = 0, h = 0, n = 0;
+    double hz = 0;
+
+    if (*s != '@') {
+        if (sscanf(s, "%dx%d%n", &w, &h, &n) != 2 || w <= 0 || h <= 0) {
+            return -1;
+        }
+        s += n;
+    }
+    if (*s == '@') {
+        if (sscanf(s + 1, "%lf%n", &hz, &n) != 1 || hz <= 0) {
+            return -1;
+        }
+        s += 1 + n;
+    }
+    if (*s) {
+        return -1;
+    }
+    want->width = w;
+    want->height = h;
+    want->refresh = hz;
+    return 0;
+}
+
+uint32_t drm_prop_id(int fd, uint32_t object_id, uint32_t object_type, const char *name) {
+    uint32_t id = 0;
+    drmModeObjectProperties *props = drmModeObjectGetProperties(fd, object_id, object_type);
+
+    for (uint32_t i = 0; props && i < props->count_props && !id; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+        if (prop && strcmp(prop->name, name) == 0) {
+            id = prop->prop_id;
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return id;
+}
+
+int drm_plane_type(int fd, uint32_t plane_id) {
+    int type = -1;
+    drmModeObjectProperties *props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+
+    for (uint32_t i = 0; props && i < props->count_props; i++) {
+        drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+        if (prop && strcmp(prop->name, "type") == 0) {
+            type = (int)props->prop_values[i];
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return type;
+}
+
+static int plane_props(int fd, uint32_t plane, struct drm_plane_props *pp) {
+    pp->fb_id = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "FB_ID");
+    pp->crtc_id = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+    pp->src_x = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_X");
+    pp->src_y = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+    pp->src_w = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_W");
+    pp->src_h = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_H");
+    pp->crtc_x = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+    pp->crtc_y = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+    pp->crtc_w = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+    pp->crtc_h = drm_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+    return pp->fb_id && pp->crtc_id && pp->src_w && pp->crtc_w ? 0 : -1;
+}
+
+// The mode want asks for, or NULL if the connector has none like it
+static const drmModeModeInfo *pick_mode(const drmModeConnector *c, const struct drm_display_want *want) {
+    const drmModeModeInfo *preferred = c->count_modes ? &c->modes[0] : NULL;
+    const drmModeModeInfo *best = NULL;
+
+    for (int i = 0; i < c->count_modes; i++) {
+        if (c->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+            preferred = &c->modes[i];
+            break;
+        }
+    }
+    if (!preferred) {
+        return NULL;
+    }
+
+    int w = want->width ? want->width : preferred->hdisplay;
+    int h = want->width ? want->height : preferred->vdisplay;
+    if (!want->width && !want->refresh) {
+        return preferred;
+    }
+    for (int i = 0; i < c->count_modes; i++) {
+        const drmModeModeInfo *m = &c->modes[i];
+        if (m->hdisplay != w || m->vdisplay != h) {
+            continue;
+        }
+        if (!best) {
+            best = m;
+        } else if (want->refresh) {
+            // Nearest the rate asked for
+            if (fabs(mode_refresh(m) - want->refresh) < fabs(mode_refresh(best) - want->refresh)) {
+                best = m;
+            }
+        } else if (m == preferred || (best != preferred && mode_refresh(m) > mode_refresh(best))) {
+            // The preferred mode, or the fastest of the size
+            best = m;
+        }
+    }
+    return best;
+}
+
+// A CRTC for connector c that no output has yet: the one driving it now,
+// if any, or the first its encoders can reach. Returns its index, or -1.
+static int pick_crtc(struct drm_display *d, drmModeRes *res, const drmModeConnector *c) {
+    int taken[64] = {0};
+
+    for (int i = 0; i < d->count; i++) {
+        taken[d->outputs[i].crtc_index] = 1;
+    }
+    if (c->encoder_id) {
+        drmModeEncoder *enc = drmModeGetEncoder(d->fd, c->encoder_id);
+        for (int i = 0; enc && enc->crtc_id && i < res->count_crtcs && i < 64; i++) {
+            if (res->crtcs[i] == enc->crtc_id && !taken[i]) {
+                drmModeFreeEncoder(enc);
+                return i;
+            }
+        }
+        drmModeFreeEncoder(enc);
+    }
+    for (int e = 0; e < c->count_encoders; e++) {
+        drmModeEncoder *enc = drmModeGetEncoder(d->fd, c->encoders[e]);
+        for (int i = 0; enc && i < res->count_crtcs && i < 64; i++) {
+            if ((enc->possible_crtcs & (1u << i)) && !taken[i]) {
+                drmModeFreeEncoder(enc);
+                return i;
+            }
+        }
+        drmModeFreeEncoder(enc);
+    }
+    return -1;
+}
+
+// The CRTC's primary plane: the one scanning out for it now, or the first
+// primary plane that can
+static uint32_t find_primary(struct drm_display *d, struct drm_output *o) {
+    uint32_t found = 0, active = 0;
+    drmModePlaneRes *planes = drmModeGetPlaneResources(d->fd);
+
+    for (uint32_t i = 0; planes && i < planes->count_planes && !active; i++) {
+        drmModePlane *plane = drmModeGetPlane(d->fd, planes->planes[i]);
+        if (plane && (plane->possible_crtcs & (1u << o->crtc_index)) &&
+            drm_plane_type(d->fd, plane->plane_id) == DRM_PLANE_TYPE_PRIMARY) {
+            if (plane->crtc_id == o->crtc_id) {
+                active = plane->plane_id;
+            } else if (!found) {
+                found = plane->plane_id;
+            }
+        }
+        drmModeFreePlane(plane);
+    }
+    drmModeFreePlaneResources(planes);
+    return active ? active : found;
+}
+
+// Add connector c as an output, if it is connected and has what want asks
+static void add_output(struct drm_display *d, drmModeRes *res, const drmModeConnector *c,
+                       const struct drm_display_want *want) {
+    struct drm_output *o = &d->outputs[d->count];
+    char name[32];
+
+    connector_name(c, name, sizeof(name));
+    if (c->connection != DRM_MODE_CONNECTED || (want->output && strcmp(want->output, name) != 0)) {
+        return;
+    }
+    if (want->max_outputs && d->count >= want->max_outputs) {
+        printf("%s: connected too, left alone\n", name);
+        return;
+    }
+    const drmModeModeInfo *mode = pick_mode(c, want);
+    if (!mode) {
+        // As -m asked for it: "1920x1080", "1920x1080@60" or "@144"
+        char asked[48] = "preferred";
+        int n = want->width ? snprintf(asked, sizeof(asked), "%dx%d", want->width, want->height) : 0;
+        if (want->refresh) {
+            snprintf(asked + n, sizeof(asked) - n, "@%g", want->refresh);
+        }
+        fprintf(stderr, "%s: no %s mode\n", name, asked);
+        return;
+    }
+    int crtc = pick_crtc(d, res, c);
+    if (crtc < 0) {
+        fprintf(stderr, "%s: no free CRTC reaches it\n", name);
+        return;
+    }
+
+    memset(o, 0, sizeof(*o));
+    strcpy(o->name, name);
+    o->connector_id = c->connector_id;
+    o->crtc_id = res->crtcs[crtc];
+    o->crtc_index = crtc;
+    o->mode = *mode;
+    o->refresh = mode_refresh(mode);
+    o->primary_plane = find_primary(d, o);
+
+    if (d->atomic) {
+        o->conn_crtc_id = drm_prop_id(d->fd, o->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+        o->crtc_mode_id = drm_prop_id(d->fd, o->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+        o->crtc_active = drm_prop_id(d->fd, o->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+        if (!o->primary_plane || !o->conn_crtc_id || !o->crtc_mode_id || !o->crtc_active ||
+            plane_props(d->fd, o->primary_plane, &o->primary_props) < 0) {
+            fprintf(stderr, "%s: missing atomic properties\n", name);
+            return;
+        }
+    }
+    d->count++;
+}
+
+// Open device and take its outputs. Returns how many it has, or -errno if
+// it can't be opened.
+static int open_device(struct drm_display *d, const char *device, const struct drm_display_want *want,
+                       int quiet) {
+    // SYSCALL: openat(AT_FDCWD, "/dev/dri/cardN", O_RDWR)
+    d->fd = open(device, O_RDWR | O_CLOEXEC);
+    if (d->fd < 0) {
+        if (!quiet || errno != ENOENT) {
+            fprintf(stderr, "Cannot open %s: %s\n", device, strerror(errno));
+        }
+        return -errno;
+    }
+    snprintf(d->device, sizeof(d->device), "%s", device);
+
+    // Every plane, and atomic commits where the driver has them. Asking
+    // for atomic asks for universal planes too.
+    drmSetClientCap(d->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+    d->atomic = drmSetClientCap(d->fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+
+    // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_GETRESOURCES, ...)
+    // Connectors, CRTCs and encoders; then each connector
+    // (DRM_IOCTL_MODE_GETCONNECTOR) and its encoders (..._GETENCODER)
+    drmModeRes *res = drmModeGetResources(d->fd);
+    for (int i = 0; res && i < res->count_connectors && d->count < DRM_DISPLAY_MAX_OUTPUTS; i++) {
+        drmModeConnector *c = drmModeGetConnector(d->fd, res->connectors[i]);
+        if (c) {
+            add_output(d, res, c, want);
+        }
+        drmModeFreeConnector(c);
+    }
+    drmModeFreeResources(res);
+
+    if (!d->count) {
+        close(d->fd);
+        d->fd = -1;
+    }
+    return d->count;
+}
+
+int drm_display_open(struct drm_display *d, const struct drm_display_want *want) {
+    int denied = 0;
+
+    memset(d, 0, sizeof(*d));
+    d->fd = -1;
+
+    if (want->device) {
+        denied = open_device(d, want->device, want, 0) == -EACCES;
+    } else {
+        for (int i = 0; i < MAX_CARDS && !d->count; i++) {
+            char device[32];
+            snprintf(device, sizeof(device), "/dev/dri/card%d", i);
+            denied |= open_device(d, device, want, 1) == -EACCES;
+        }
+    }
+    if (!d->count) {
+        fprintf(stderr, "No connected display%s%s\n", want->output ? " called " : "",
+                want->output ? want->output : "");
+        if (denied) {
+            fprintf(stderr, "Hint: You may need to run as root or be in 'video' group\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void drm_display_close(struct drm_display *d) {
+    for (int i = 0; i < d->count; i++) {
+        if (d->outputs[i].mode_blob) {
+            drmModeDestroyPropertyBlob(d->fd, d->outputs[i].mode_blob);
+        }
+    }
+    if (d->fd >= 0) {
+        close(d->fd);
+    }
+    memset(d, 0, sizeof(*d));
+    d->fd = -1;
+}
+
+static void add_plane(drmModeAtomicReq *req, uint32_t plane, const struct drm_plane_props *pp,
+                      uint32_t crtc_id, uint32_t fb_id, int src_w, int src_h,
+                      int x, int y, int w, int h) {
+    if (!fb_id) {
+        crtc_id = 0;
+        src_w = src_h = x = y = w = h = 0;
+    }
+    drmModeAtomicAddProperty(req, plane, pp->fb_id, fb_id);
+    drmModeAtomicAddProperty(req, plane, pp->crtc_id, crtc_id);
+    drmModeAtomicAddProperty(req, plane, pp->src_x, 0);
+    drmModeAtomicAddProperty(req, plane, pp->src_y, 0);
+    drmModeAtomicAddProperty(req, plane, pp->src_w, (uint64_t)src_w << 16);
+    drmModeAtomicAddProperty(req, plane, pp->src_h, (uint64_t)src_h << 16);
+    drmModeAtomicAddProperty(req, plane, pp->crtc_x, (uint64_t)(int64_t)x);
+    drmModeAtomicAddProperty(req, plane, pp->crtc_y, (uint64_t)(int64_t)y);
+    drmModeAtomicAddProperty(req, plane, pp->crtc_w, w);
+    drmModeAtomicAddProperty(req, plane, pp->crtc_h, h);
+}
+
+// Test req, then commit it. The test changes nothing, so a refused commit
+// leaves the screen as it was, and says so before a nonblocking one would.
+static int commit(struct drm_display *d, drmModeAtomicReq *req, uint32_t flags, void *user_data) {
+    uint32_t test = (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) | DRM_MODE_ATOMIC_TEST_ONLY;
+
+    if (drmModeAtomicCommit(d->fd, req, test, NULL) != 0) {
+        return -1;
+    }
+    return drmModeAtomicCommit(d->fd, req, flags, user_data) == 0 ? 0 : -1;
+}
+
+int drm_output_modeset(struct drm_display *d, struct drm_output *o, uint32_t fb_id) {
+    if (!d->atomic) {
+        // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_SETCRTC, ...)
+        // Configures the display controller: which connector, what mode,
+        // and which framebuffer to scan out
+        if (drmModeSetCrtc(d->fd, o->crtc_id, fb_id, 0, 0, &o->connector_id, 1, &o->mode)) {
+            perror("Cannot set CRTC");
+            return -1;
+        }
+        return 0;
+    }
+
+    // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_ATOMIC, ...)
+    // The same as one state: connector -> CRTC, the CRTC's mode (as a
+    // property blob) and the primary plane showing fb_id over all of it
+    if (!o->mode_blob && drmModeCreatePropertyBlob(d->fd, &o->mode, sizeof(o->mode), &o->mode_blob)) {
+        perror("Cannot create mode blob");
+        return -1;
+    }
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (!req) {
+        return -1;
+    }
+    drmModeAtomicAddProperty(req, o->connector_id, o->conn_crtc_id, o->crtc_id);
+    drmModeAtomicAddProperty(req, o->crtc_id, o->crtc_mode_id, o->mode_blob);
+    drmModeAtomicAddProperty(req, o->crtc_id, o->crtc_active, 1);
+    add_plane(req, o->primary_plane, &o->primary_props, o->crtc_id, fb_id,
+              o->mode.hdisplay, o->mode.vdisplay, 0, 0, o->mode.hdisplay, o->mode.vdisplay);
+    int ret = commit(d, req, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+    drmModeAtomicFree(req);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot set %s to %s: %s\n", o->name, o->mode.name, strerror(errno));
+    }
+    return ret;
+}
+
+int drm_output_commit_plane(struct drm_display *d, struct drm_output *o, uint32_t plane_id,
+                            uint32_t fb_id, int src_w, int src_h, int x, int y, int w, int h,
+                            uint32_t flags, void *user_data) {
+    const struct drm_plane_props *pp = &o->primary_props;
+
+    if (!d->atomic) {
+        return -1;
+    }
+    if (plane_id != o->primary_plane) {
+        if (plane_id != o->overlay_plane) {
+            if (plane_props(d->fd, plane_id, &o->overlay_props) < 0) {
+                return -1;
+            }
+            o->overlay_plane = plane_id;
+        }
+        pp = &o->overlay_props;
+    }
+
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    if (!req) {
+        return -1;
+    }
+    add_plane(req, plane_id, pp, o->crtc_id, fb_id, src_w, src_h, x, y, w, h);
+    int ret = commit(d, req, flags, user_data);
+    drmModeAtomicFree(req);
+    return ret;
+}
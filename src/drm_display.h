@@ -0,0 +1,116 @@
+/*
+ * Display discovery and modesetting shared by simple_video_player and
+ * simple_triangle
+ *
+ * Taking the first connector's first mode and the first CRTC works on a
+ * laptop with one panel. On a box with several outputs, the first CRTC may
+ * be driving another one, or be unable to reach this connector at all.
+ * drm_display_open() does it properly:
+ *
+ * - Device: the first /dev/dri/card* with a display connected, unless one
+ *   is asked for.
+ * - Outputs: every connected connector (or the one asked for by name, as
+ *   the kernel names them: "HDMI-A-1", "DP-2", "eDP-1"), each with a CRTC
+ *   of its own. A CRTC can only drive the connectors its encoders reach
+ *   (possible_crtcs), so the one already driving the connector is kept, and
+ *   otherwise the first free one an encoder reaches is taken.
+ * - Mode: the connector's preferred one, or the one of the size asked for;
+ *   with a refresh rate asked for too, the mode nearest to it. Rates come
+ *   from the pixel clock, so 59.94 and 60 Hz are told apart.
+ *
+ * Where the driver has atomic modesetting, every change to the display is
+ * one atomic commit: the whole new state at once, which the kernel either
+ * takes as a whole or refuses. DRM_MODE_ATOMIC_TEST_ONLY asks whether it
+ * would be taken without changing anything, and DRM_MODE_ATOMIC_NONBLOCK
+ * returns at once, with an event when the commit has reached the screen.
+ * Older drivers get the legacy calls (drmModeSetCrtc(), drmModePageFlip(),
+ * drmModeSetPlane()) instead; drm_present.c uses whichever there is.
+ */
+
+#ifndef DRM_DISPLAY_H
+#define DRM_DISPLAY_H
+
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#define DRM_DISPLAY_MAX_OUTPUTS 8
+
+// The property IDs of a plane an atomic commit sets
+struct drm_plane_props {
+    uint32_t fb_id, crtc_id;
+    uint32_t src_x, src_y, src_w, src_h;        // 16.16 fixed point
+    uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+};
+
+// A connector, the CRTC driving it and the mode it runs at
+struct drm_output {
+    char name[32];              // e.g. "HDMI-A-1"
+    uint32_t connector_id;
+    uint32_t crtc_id;
+    int crtc_index;             // Bit of this CRTC in planes' possible_crtcs
+    uint32_t primary_plane;     // 0: not known (no universal planes)
+    drmModeModeInfo mode;
+    double refresh;             // Hz, exact
+
+    // Atomic property IDs, and the mode as a blob (atomic only)
+    uint32_t conn_crtc_id;
+    uint32_t crtc_mode_id, crtc_active;
+    struct drm_plane_props primary_props;
+    uint32_t mode_blob;
+    uint32_t overlay_plane;     // The last overlay plane drm_output_commit_plane() set up
+    struct drm_plane_props overlay_props;
+};
+
+struct drm_display {
+    int fd;
+    int atomic;                 // Changes go through atomic commits
+    char device[32];
+    int count;
+    struct drm_output outputs[DRM_DISPLAY_MAX_OUTPUTS];
+};
+
+// What drm_display_open() looks for. Zeroed, it takes every connected
+// output of the first card with one, at its preferred mode. A program that
+// drives one output sets max_outputs to 1, so the others keep their CRTCs
+// and what they show.
+struct drm_display_want {
+    const char *device;         // e.g. "/dev/dri/card1"
+    const char *output;         // Connector name
+    int width, height;          // Mode size (0: the preferred mode's)
+    double refresh;             // Hz (0: the preferred mode, or the fastest of the size)
+    int max_outputs;            // Take no more than this many (0: every one)
+};
+
+// Parse a mode as -m takes it into want: "1920x1080", "1920x1080@60" or
+// "@144". Returns 0, or -1 if it isn't one.
+int drm_display_parse_mode(const char *s, struct drm_display_want *want);
+
+// Find the outputs. Returns 0, or -1 if there are none (a message has been
+// printed, and whatever was opened is closed again).
+int drm_display_open(struct drm_display *d, const struct drm_display_want *want);
+
+void drm_display_close(struct drm_display *d);
+
+// The ID of an object's property called name, or 0
+uint32_t drm_prop_id(int fd, uint32_t object_id, uint32_t object_type, const char *name);
+
+// A plane's "type" property: DRM_PLANE_TYPE_OVERLAY, _PRIMARY or _CURSOR,
+// or -1
+int drm_plane_type(int fd, uint32_t plane_id);
+
+// Turn the output on at its mode, scanning out fb_id (of the mode's size)
+// on the primary plane. Waits until it is on screen. Returns 0, or -1 on
+// error.
+int drm_output_modeset(struct drm_display *d, struct drm_output *o, uint32_t fb_id);
+
+// Atomic only: put fb_id (src_w x src_h) on plane_id of the output, scaled
+// to the rectangle at x, y of w x h; fb_id 0 turns the plane off. The
+// commit is tested first. flags adds e.g. DRM_MODE_ATOMIC_NONBLOCK |
+// DRM_MODE_PAGE_FLIP_EVENT (with user_data for the event), or
+// DRM_MODE_ATOMIC_ALLOW_MODESET. Returns 0, or -1 if the driver refuses it.
+int drm_output_commit_plane(struct drm_display *d, struct drm_output *o, uint32_t plane_id,
+                            uint32_t fb_id, int src_w, int src_h, int x, int y, int w, int h,
+                            uint32_t flags, void *user_data);
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * Page-flipped presentation shared by simple_video_player and simple_triangle
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "drm_present.h"
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t) {
+    struct timespec ts = {.tv_sec = (time_t)t, .tv_nsec = (long)((t - (time_t)t) * 1e9)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+int drm_buffer_create(int fd, int width, int height, uint32_t format, struct drm_buffer *b) {
+    int nv12 = format == DRM_FORMAT_NV12;
+
+    memset(b, 0, sizeof(*b));
+
+    // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, ...)
+    // Allocates the memory: system RAM on an integrated GPU, VRAM or RAM
+    // on a discrete one. The driver picks the pitch. Dumb buffers only
+    // know bytes per pixel, so NV12 is one byte per pixel, and half as
+    // many rows again for the UV plane.
+    struct drm_mode_create_dumb create = {
+        .width = width,
+        .height = nv12 ? height + (height + 1) / 2 : height,
+        .bpp = nv12 ? 8 : 32,
+    };
+    if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+        perror("Cannot create dumb buffer");
+        return -1;
+    }
+    b->handle = create.handle;
+    b->pitch = create.pitch;
+    b->size = create.size;
+
+    // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_ADDFB, ...)
+    // Tells DRM: "This buffer can be used as a framebuffer for display"
+    int ret;
+    if (nv12) {
+        uint32_t handles[4] = {b->handle, b->handle};
+        uint32_t pitches[4] = {b->pitch, b->pitch};
+        uint32_t offsets[4] = {0, b->pitch * height};
+        ret = drmModeAddFB2(fd, width, height, format, handles, pitches, offsets, &b->fb_id, 0);
+    } else {
+        ret = drmModeAddFB(fd, width, height, 24, 32, b->pitch, b->handle, &b->fb_id);
+    }
+    if (ret) {
+        perror("Cannot add framebuffer");
+        drm_buffer_destroy(fd, b);
+        return -1;
+    }
+
+    // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_MAP_DUMB, ...), then mmap()
+    struct drm_mode_map_dumb map = {.handle = b->handle};
+    if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+        perror("Cannot get mmap offset");
+        drm_buffer_destroy(fd, b);
+        return -1;
+    }
+    b->map = mmap(NULL, b->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map.offset);
+    if (b->map == MAP_FAILED) {
+        b->map = NULL;
+        perror("Cannot mmap framebuffer");
+        drm_buffer_destroy(fd, b);
+        return -1;
+    }
+    // Start black, not with whatever was there: in NV12, black is Y 16
+    // and UV 128
+    if (nv12) {
+        memset(b->map, 16, b->pitch * height);
+        memset((uint8_t *)b->map + b->pitch * height, 128, b->size - b->pitch * height);
+    } else {
+        memset(b->map, 0, b->size);
+    }
+    return 0;
+}
+
+void drm_buffer_destroy(int fd, struct drm_buffer *b) {
+    if (b->map && fd < 0) free(b->map);     // Offscreen
+    else if (b->map) munmap(b->map, b->size);
+    if (b->fb_id) drmModeRmFB(fd, b->fb_id);
+    if (b->handle) {
+        struct drm_mode_destroy_dumb destroy = {.handle = b->handle};
+        drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    memset(b, 0, sizeof(*b));
+}
+
+// A flip has happened: the pending buffer is on screen now
+static void flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+                         unsigned int tv_usec, void *user_data) {
+    struct drm_presenter *p = user_data;
+    (void)fd;
+    (void)sequence;
+
+    p->front = p->pending;
+    p->pending = -1;
+    p->last_vblank = p->monotonic ? tv_sec + tv_usec / 1e6 : now_sec();
+    p->flips++;
+}
+
+int drm_present_init(struct drm_presenter *p, struct drm_display *d, struct drm_output *o, int count) {
+    const drmModeModeInfo *mode = &o->mode;
+
+    memset(p, 0, sizeof(*p));
+    p->fd = d->fd;
+    p->display = d;
+    p->output = o;
+    p->width = mode->hdisplay;
+    p->height = mode->vdisplay;
+    p->count = count < 1 ? 1 : count > DRM_PRESENT_MAX_BUFFERS ? DRM_PRESENT_MAX_BUFFERS : count;
+    p->pending = -1;
+    p->refresh_interval = 1.0 / (o->refresh > 0 ? o->refresh : 60);
+
+    uint64_t monotonic = 0;
+    drmGetCap(p->fd, DRM_CAP_TIMESTAMP_MONOTONIC, &monotonic);
+    p->monotonic = monotonic != 0;
+
+    for (int i = 0; i < p->count; i++) {
+        if (drm_buffer_create(p->fd, p->width, p->height, DRM_FORMAT_XRGB8888, &p->bufs[i]) < 0) {
+            drm_present_free(p);
+            return -1;
+        }
+    }
+
+    if (drm_output_modeset(d, o, p->bufs[0].fb_id) < 0) {
+        drm_present_free(p);
+        return -1;
+    }
+    p->front = 0;
+    p->back = p->count > 1 ? 1 : 0;
+    p->last_vblank = now_sec();
+    return 0;
+}
+
+int drm_present_init_offscreen(struct drm_presenter *p, int width, int height, int count) {
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    p->width = width;
+    p->height = height;
+    p->count = count < 1 ? 1 : count > DRM_PRESENT_MAX_BUFFERS ? DRM_PRESENT_MAX_BUFFERS : count;
+    p->pending = -1;
+    p->monotonic = 1;
+
+    // Rows padded to cache lines, like the pitch a driver picks
+    for (int i = 0; i < p->count; i++) {
+        struct drm_buffer *b = &p->bufs[i];
+        b->pitch = (width * 4 + 63) & ~63u;
+        b->size = (uint64_t)b->pitch * height;
+        b->map = aligned_alloc(64, b->size);
+        if (!b->map) {
+            perror("Cannot allocate offscreen buffer");
+            drm_present_free(p);
+            return -1;
+        }
+        memset(b->map, 0, b->size);
+    }
+    p->back = p->count > 1 ? 1 : 0;
+    p->last_vblank = now_sec();
+    return 0;
+}
+
+void drm_present_free(struct drm_presenter *p) {
+    if (p->count > 1) {
+        drm_present_wait(p);
+    }
+    for (int i = 0; i < p->count; i++) {
+        drm_buffer_destroy(p->fd, &p->bufs[i]);
+    }
+}
+
+int drm_present_wait(struct drm_presenter *p) {
+    drmEventContext ctx = {
+        .version = 2,
+        .page_flip_handler = flip_handler,
+    };
+
+    while (p->pending >= 0) {
+        struct pollfd pfd = {.fd = p->fd, .events = POLLIN};
+        int ret = poll(&pfd, 1, 1000);
+        if (ret < 0 && errno == EINTR) {
+            continue;  // The flip still completes
+        }
+        if (ret <= 0) {
+            fprintf(stderr, "No page flip event%s\n", ret == 0 ? " for 1 s" : "");
+            p->front = p->pending;
+            p->pending = -1;
+            return -1;
+        }
+        if (drmHandleEvent(p->fd, &ctx) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct drm_buffer *drm_present_back(struct drm_presenter *p) {
+    if (p->count == 1) {
+        return &p->bufs[0];
+    }
+    if (p->back == p->front || p->back == p->pending) {
+        // With two buffers, the other one is still waiting for its flip
+        if (p->count == 2) {
+            drm_present_wait(p);
+        }
+        for (int i = 0; i < p->count; i++) {
+            if (i != p->front && i != p->pending) {
+                p->back = i;
+                break;
+            }
+        }
+    }
+    return &p->bufs[p->back];
+}
+
+// Sleep until the frame before the vblank nearest when (see
+// drm_present_flip()), and return that vblank's time
+static double wait_for_frame(struct drm_presenter *p, double when) {
+    // The vblank nearest `when`: the coming ones are last_vblank plus whole
+    // refresh intervals. A flip requested during a frame happens at the
+    // vblank that ends it, so sleep until the frame before that one.
+    double interval = p->refresh_interval;
+    double now = now_sec();
+    double next = p->last_vblank + interval;
+    if (next < now) {
+        next += (int)((now - next) / interval + 1) * interval;
+    }
+    double target = next;
+    if (when > 0 && when - interval / 2 > next) {
+        target = next + (int)((when - next) / interval + 0.5) * interval;
+        sleep_until(target - interval);
+    }
+    return target;
+}
+
+// Put fb_id on the primary plane, over the whole output
+static int commit_primary(struct drm_presenter *p, uint32_t fb_id, uint32_t flags, void *user_data) {
+    struct drm_output *o = p->output;
+    return drm_output_commit_plane(p->display, o, o->primary_plane, fb_id, p->width, p->height,
+                                   0, 0, p->width, p->height, flags, user_data);
+}
+
+// Show fb_id (buffer index, or DRM_PRESENT_IMPORTED) as drm_present_flip()
+// describes. Returns -1 if it can't be shown.
+static double flip_to(struct drm_presenter *p, uint32_t fb_id, int index, double when) {
+    int format_change = (p->front == DRM_PRESENT_IMPORTED) != (index == DRM_PRESENT_IMPORTED);
+
+    // Only one flip can be queued at a time
+    drm_present_wait(p);
+    double target = wait_for_frame(p, when);
+
+    if (p->display->atomic) {
+        // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_ATOMIC, ...)
+        // Nonblocking: returns at once, and the event comes at the vblank.
+        // A new pixel format is usually just another plane update; if the
+        // driver wants a modeset for it, that one blocks until it is done.
+        if (commit_primary(p, fb_id, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, p) == 0) {
+            p->pending = index;
+            return target;
+        }
+        if (!format_change || commit_primary(p, fb_id, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL) < 0) {
+            perror("Cannot flip");
+            return -1;
+        }
+        p->front = index;
+        p->last_vblank = now_sec();
+        return p->last_vblank;
+    }
+
+    // Between our buffers and imported ones the pixel format changes,
+    // which only a modeset may do. drmModeSetCrtc() returns once the new
+    // framebuffer is on screen.
+    if (format_change) {
+        if (drm_output_modeset(p->display, p->output, fb_id) < 0) {
+            return -1;
+        }
+        p->front = index;
+        p->last_vblank = now_sec();
+        return p->last_vblank;
+    }
+
+    if (drmModePageFlip(p->fd, p->output->crtc_id, fb_id, DRM_MODE_PAGE_FLIP_EVENT, p) != 0) {
+        perror("Cannot flip");
+        return -1;
+    }
+    p->pending = index;
+    return target;
+}
+
+double drm_present_flip(struct drm_presenter *p, double when) {
+    if (p->count == 1) {
+        return now_sec();
+    }
+    if (p->fd < 0) {
+        p->front = p->back;
+        p->last_vblank = now_sec();
+        p->flips++;
+        return p->last_vblank;
+    }
+    double target = flip_to(p, p->bufs[p->back].fb_id, p->back, when);
+    return target < 0 ? now_sec() : target;
+}
+
+double drm_present_flip_fb(struct drm_presenter *p, uint32_t fb_id, double when) {
+    if (p->fd < 0) {
+        return -1;
+    }
+    return flip_to(p, fb_id, DRM_PRESENT_IMPORTED, when);
+}
+
+int drm_present_can_show(struct drm_presenter *p, uint32_t format) {
+    int found = 0;
+
+    if (p->fd < 0 || !p->output->primary_plane) {
+        return 0;
+    }
+    drmModePlane *plane = drmModeGetPlane(p->fd, p->output->primary_plane);
+    for (uint32_t j = 0; plane && j < plane->count_formats; j++) {
+        found |= plane->formats[j] == format;
+    }
+    drmModeFreePlane(plane);
+    return found;
+}
+
+uint32_t drm_present_find_overlay(struct drm_presenter *p, uint32_t format) {
+    uint32_t found = 0;
+
+    if (p->fd < 0) {
+        return 0;
+    }
+
+    // possible_crtcs is a bitmask of CRTC indexes, not IDs
+    drmModePlaneRes *planes = drmModeGetPlaneResources(p->fd);
+    for (uint32_t i = 0; planes && i < planes->count_planes && !found; i++) {
+        drmModePlane *plane = drmModeGetPlane(p->fd, planes->planes[i]);
+        if (plane && (plane->possible_crtcs & (1u << p->output->crtc_index)) && !plane->fb_id &&
+            drm_plane_type(p->fd, plane->plane_id) == DRM_PLANE_TYPE_OVERLAY) {
+            for (uint32_t j = 0; j < plane->count_formats; j++) {
+                if (plane->formats[j] == format) {
+                    found = plane->plane_id;
+                }
+            }
+        }
+        drmModeFreePlane(plane);
+    }
+    drmModeFreePlaneResources(planes);
+    return found;
+}
+
+double drm_present_plane(struct drm_presenter *p, uint32_t plane_id, uint32_t fb_id,
+                         int src_w, int src_h, int x, int y, int w, int h, double when) {
+    if (p->fd < 0) {
+        return -1;
+    }
+    double target = wait_for_frame(p, when);
+
+    if (p->display->atomic) {
+        // The same as one blocking commit, tested first: a plane the
+        // display controller can't scale that much is refused before
+        // anything changes. A flip still pending would make it busy.
+        drm_present_wait(p);
+        if (drm_output_commit_plane(p->display, p->output, plane_id, fb_id, src_w, src_h,
+                                    x, y, w, h, 0, NULL) < 0) {
+            perror("Cannot set overlay plane");
+            return -1;
+        }
+    } else {
+        // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_SETPLANE, ...)
+        // The source rectangle is in 16.16 fixed point, so scaling can
+        // start at fractions of a pixel
+        if (drmModeSetPlane(p->fd, plane_id, p->output->crtc_id, fb_id, 0, x, y, w, h,
+                            0, 0, (uint32_t)src_w << 16, (uint32_t)src_h << 16) != 0) {
+            perror("Cannot set overlay plane");
+            return -1;
+        }
+    }
+    p->last_vblank = now_sec();
+    p->flips++;
+    return target;
+}
@@ -0,0 +1,129 @@
+/*
+ * Page-flipped presentation shared by simple_video_player and simple_triangle
+ *
+ * Drawing into the buffer the display is scanning out shows every frame
+ * half-drawn for a moment, and the scanout catching up with the drawing
+ * halfway down the screen is a tear. Instead, the presenter keeps two or
+ * three dumb buffers: one on screen (front), one being drawn (back), and
+ * with three, one more that is waiting for the next vblank, so that drawing
+ * never waits for the display. A finished back buffer goes on screen with
+ * a page flip (drmModePageFlip() with DRM_MODE_PAGE_FLIP_EVENT), which the
+ * display controller carries out during vertical blanking: no tearing.
+ *
+ * Each flip's completion event carries the time of the vblank it happened
+ * at. From those times and the mode's refresh interval, the presenter
+ * predicts the coming vblanks, so a frame that should be seen at time T is
+ * flipped at the vblank nearest T, instead of after a sleep that is only
+ * good to the millisecond.
+ *
+ * With one buffer, the presenter draws straight to the screen and never
+ * flips, like the programs did originally.
+ *
+ * Framebuffers made elsewhere - a hardware decoder's frames, imported from
+ * DMA-BUFs - go on screen the same way, with drm_present_flip_fb(). A legacy
+ * page flip can't change the pixel format, so switching between those and
+ * the presenter's own XRGB8888 buffers sets the CRTC again instead; an
+ * atomic commit may, and only falls back to a modeset if the driver says
+ * it needs one.
+ *
+ * An overlay plane sits on top of the primary plane, and the display
+ * controller scales what it shows and converts it from YUV while scanning
+ * out: drm_present_plane() puts a framebuffer of any size there, in any
+ * rectangle of the screen, at the same vblanks as a flip would.
+ *
+ * For benchmarks, an offscreen presenter (drm_present_init_offscreen())
+ * has buffers in plain memory and no display: drawing is the same, but a
+ * flip only swaps the buffers and returns at once.
+ */
+
+#ifndef DRM_PRESENT_H
+#define DRM_PRESENT_H
+
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "drm_display.h"
+
+#define DRM_PRESENT_MAX_BUFFERS 3
+#define DRM_PRESENT_IMPORTED DRM_PRESENT_MAX_BUFFERS  // front/pending: a drm_present_flip_fb() framebuffer
+
+// One dumb buffer, registered as a framebuffer and mapped
+struct drm_buffer {
+    uint32_t handle;
+    uint32_t fb_id;
+    uint32_t pitch;             // Bytes per row: may be more than width * 4
+    uint64_t size;
+    uint32_t *map;              // XRGB8888 pixels, or NV12: Y rows, then UV rows
+};
+
+struct drm_presenter {
+    int fd;                     // -1: offscreen
+    struct drm_display *display;
+    struct drm_output *output;
+    int width, height;
+    int count;                  // Buffers (1..DRM_PRESENT_MAX_BUFFERS)
+    struct drm_buffer bufs[DRM_PRESENT_MAX_BUFFERS];
+    int front;                  // On screen
+    int back;                   // Being drawn
+    int pending;                // Flipped, waiting for its vblank (-1: none)
+    int monotonic;              // Flip events carry CLOCK_MONOTONIC times
+    double refresh_interval;    // Seconds between vblanks
+    double last_vblank;         // When the last flip happened (CLOCK_MONOTONIC)
+    unsigned int flips;         // Flips completed
+};
+
+// Create a width x height buffer of format (DRM_FORMAT_XRGB8888 or
+// DRM_FORMAT_NV12), cleared to black. Returns 0, or -1 on error.
+int drm_buffer_create(int fd, int width, int height, uint32_t format, struct drm_buffer *b);
+void drm_buffer_destroy(int fd, struct drm_buffer *b);
+
+// Create count buffers of the output's mode size and turn the output on,
+// showing the first one. Returns 0, or -1 on error (a message has been
+// printed, and whatever was set up is freed again).
+int drm_present_init(struct drm_presenter *p, struct drm_display *d, struct drm_output *o, int count);
+
+// count buffers of width x height in memory, for drawing as fast as the CPU
+// goes. Nothing is shown, and framebuffers of others can't be. Returns 0,
+// or -1 if out of memory.
+int drm_present_init_offscreen(struct drm_presenter *p, int width, int height, int count);
+
+// Wait for the last flip, then free the buffers
+void drm_present_free(struct drm_presenter *p);
+
+// The buffer to draw the next frame into. It is neither on screen nor
+// waiting to be; with two buffers this may have to wait for a flip.
+struct drm_buffer *drm_present_back(struct drm_presenter *p);
+
+// Put the back buffer on screen at the vblank nearest time when
+// (CLOCK_MONOTONIC seconds; 0: the next one). The call sleeps until the
+// frame before that vblank, then flips without waiting for it. Returns the
+// time the frame is expected on screen. With one buffer there is nothing
+// to flip: returns the current time.
+double drm_present_flip(struct drm_presenter *p, double when);
+
+// The same for a framebuffer of the caller's, e.g. an imported DMA-BUF of
+// the mode's size. Returns -1 if it can't be shown. The framebuffer has to
+// stay until two more flips have been asked for: the second one waits for
+// the first to replace it on screen.
+double drm_present_flip_fb(struct drm_presenter *p, uint32_t fb_id, double when);
+
+// Whether the output's primary plane can scan out format (a DRM_FORMAT_*
+// fourcc), and so drm_present_flip_fb() can show framebuffers of it
+int drm_present_can_show(struct drm_presenter *p, uint32_t format);
+
+// A free overlay plane of the output's CRTC that reads format, or 0 if there is none
+uint32_t drm_present_find_overlay(struct drm_presenter *p, uint32_t format);
+
+// Show a src_w x src_h framebuffer on plane_id, scaled to the rectangle at
+// x, y of w x h pixels, at the vblank nearest when, as drm_present_flip()
+// does. fb_id 0 turns the plane off. Returns when it is expected on
+// screen, or -1 if the plane can't show it (e.g. can't scale that much).
+double drm_present_plane(struct drm_presenter *p, uint32_t plane_id, uint32_t fb_id,
+                         int src_w, int src_h, int x, int y, int w, int h, double when);
+
+// Wait until no flip is pending. Returns 0, or -1 on error.
+int drm_present_wait(struct drm_presenter *p);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * Framebuffer fill and copy kernels shared by simple_triangle and
+ * simple_video_player
+ */
+
+#include <string.h>
+
+#include "fb_blit.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// =============================================================================
+// Generic
+// =============================================================================
+
+static void fill_row_generic(uint32_t *dst, int count, uint32_t color) {
+    for (int i = 0; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+static void copy_row_generic(uint32_t *dst, const uint32_t *src, int count) {
+    memcpy(dst, src, (size_t)count * 4);
+}
+
+#if defined(__x86_64__)
+
+// =============================================================================
+// SSE2 (every x86-64 CPU)
+// =============================================================================
+
+// Non-temporal stores need aligned addresses: single pixels up to the
+// first aligned one, whole vectors from there, single pixels for the rest.
+// The row kernels leave the streamed stores unfenced: fb_blit_flush() does
+// that once for a whole rectangle or frame, not after every row.
+
+static void fill_row_sse2(uint32_t *dst, int count, uint32_t color) {
+    __m128i v = _mm_set1_epi32((int)color);
+    int i = 0;
+
+    for (; i < count && ((uintptr_t)(dst + i) & 15); i++) {
+        dst[i] = color;
+    }
+    for (; i + 16 <= count; i += 16) {
+        _mm_stream_si128((__m128i *)(dst + i), v);
+        _mm_stream_si128((__m128i *)(dst + i + 4), v);
+        _mm_stream_si128((__m128i *)(dst + i + 8), v);
+        _mm_stream_si128((__m128i *)(dst + i + 12), v);
+    }
+    for (; i + 4 <= count; i += 4) {
+        _mm_stream_si128((__m128i *)(dst + i), v);
+    }
+    for (; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+static void copy_row_sse2(uint32_t *dst, const uint32_t *src, int count) {
+    int i = 0;
+
+    for (; i < count && ((uintptr_t)(dst + i) & 15); i++) {
+        dst[i] = src[i];
+    }
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 12));
+        _mm_stream_si128((__m128i *)(dst + i), a);
+        _mm_stream_si128((__m128i *)(dst + i + 4), b);
+        _mm_stream_si128((__m128i *)(dst + i + 8), c);
+        _mm_stream_si128((__m128i *)(dst + i + 12), d);
+    }
+    for (; i + 4 <= count; i += 4) {
+        _mm_stream_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+    for (; i < count; i++) {
+        dst[i] = src[i];
+    }
+}
+
+// =============================================================================
+// AVX2
+// =============================================================================
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static void fill_row_avx2(uint32_t *dst, int count, uint32_t color) {
+    __m256i v = _mm256_set1_epi32((int)color);
+    int i = 0;
+
+    for (; i < count && ((uintptr_t)(dst + i) & 31); i++) {
+        dst[i] = color;
+    }
+    for (; i + 32 <= count; i += 32) {
+        _mm256_stream_si256((__m256i *)(dst + i), v);
+        _mm256_stream_si256((__m256i *)(dst + i + 8), v);
+        _mm256_stream_si256((__m256i *)(dst + i + 16), v);
+        _mm256_stream_si256((__m256i *)(dst + i + 24), v);
+    }
+    for (; i + 8 <= count; i += 8) {
+        _mm256_stream_si256((__m256i *)(dst + i), v);
+    }
+    for (; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+static void copy_row_avx2(uint32_t *dst, const uint32_t *src, int count) {
+    int i = 0;
+
+    for (; i < count && ((uintptr_t)(dst + i) & 31); i++) {
+        dst[i] = src[i];
+    }
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 24));
+        _mm256_stream_si256((__m256i *)(dst + i), a);
+        _mm256_stream_si256((__m256i *)(dst + i + 8), b);
+        _mm256_stream_si256((__m256i *)(dst + i + 16), c);
+        _mm256_stream_si256((__m256i *)(dst + i + 24), d);
+    }
+    for (; i + 8 <= count; i += 8) {
+        _mm256_stream_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+    for (; i < count; i++) {
+        dst[i] = src[i];
+    }
+}
+
+#pragma GCC pop_options
+
+#endif  // __x86_64__
+
+#if defined(__aarch64__)
+
+// =============================================================================
+// NEON (every ARMv8 core)
+// =============================================================================
+
+// STNP stores a pair of registers with a non-temporal hint. It has no
+// intrinsic, and needs no more alignment than the (16-byte) vectors.
+static inline void stnp_neon(uint32_t *dst, uint32x4_t a, uint32x4_t b) {
+    __asm__ volatile("stnp %q1, %q2, [%0]" : : "r"(dst), "w"(a), "w"(b) : "memory");
+}
+
+static void fill_row_neon(uint32_t *dst, int count, uint32_t color) {
+    uint32x4_t v = vdupq_n_u32(color);
+    int i = 0;
+
+    for (; i < count && ((uintptr_t)(dst + i) & 15); i++) {
+        dst[i] = color;
+    }
+    for (; i + 16 <= count; i += 16) {
+        stnp_neon(dst + i, v, v);
+        stnp_neon(dst + i + 8, v, v);
+    }
+    for (; i + 4 <= count; i += 4) {
+        vst1q_u32(dst + i, v);
+    }
+    for (; i < count; i++) {
+        dst[i] = color;
+    }
+}
+
+static void copy_row_neon(uint32_t *dst, const uint32_t *src, int count) {
+    int i = 0;
+
+    for (; i < count && ((uintptr_t)(dst + i) & 15); i++) {
+        dst[i] = src[i];
+    }
+    for (; i + 16 <= count; i += 16) {
+        uint32x4_t a = vld1q_u32(src + i);
+        uint32x4_t b = vld1q_u32(src + i + 4);
+        uint32x4_t c = vld1q_u32(src + i + 8);
+        uint32x4_t d = vld1q_u32(src + i + 12);
+        stnp_neon(dst + i, a, b);
+        stnp_neon(dst + i + 8, c, d);
+    }
+    for (; i + 4 <= count; i += 4) {
+        vst1q_u32(dst + i, vld1q_u32(src + i));
+    }
+    for (; i < count; i++) {
+        dst[i] = src[i];
+    }
+}
+
+#endif  // __aarch64__
+
+// =============================================================================
+// Dispatch
+// =============================================================================
+
+static void (*fill_row)(uint32_t *, int, uint32_t) = fill_row_generic;
+static void (*copy_row)(uint32_t *, const uint32_t *, int) = copy_row_generic;
+
+const char *fb_blit_init(void) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        fill_row = fill_row_avx2;
+        copy_row = copy_row_avx2;
+        return "avx2";
+    }
+    fill_row = fill_row_sse2;
+    copy_row = copy_row_sse2;
+    return "sse2";
+#elif defined(__aarch64__)
+    fill_row = fill_row_neon;
+    copy_row = copy_row_neon;
+    return "neon";
+#else
+    return "generic";
+#endif
+}
+
+void fb_fill_row(uint32_t *dst, int count, uint32_t color) {
+    fill_row(dst, count, color);
+}
+
+void fb_copy_row(uint32_t *dst, const uint32_t *src, int count) {
+    copy_row(dst, src, count);
+}
+
+void fb_fill_rect(uint32_t *fb, int stride, struct fb_rect r, uint32_t color) {
+    for (int y = r.y0; y < r.y1 && r.x0 < r.x1; y++) {
+        fill_row(fb + (size_t)y * stride + r.x0, r.x1 - r.x0, color);
+    }
+    fb_blit_flush();
+}
+
+void fb_copy_rect(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride,
+                  int width, int height) {
+    for (int y = 0; y < height; y++) {
+        copy_row(dst + (size_t)y * dst_stride, src + (size_t)y * src_stride, width);
+    }
+    fb_blit_flush();
+}
+
+void fb_blit_flush(void) {
+#if defined(__x86_64__)
+    _mm_sfence();  // Orders the streamed stores before the page flip
+#endif
+}
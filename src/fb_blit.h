@@ -0,0 +1,49 @@
+/*
+ * Framebuffer fill and copy kernels shared by simple_triangle and
+ * simple_video_player
+ *
+ * Dumb buffers are usually mapped write-combined: the CPU never reads them
+ * back from cache, and writes go out in bus-sized bursts when whole lines
+ * are written in order. Storing a pixel at a time from a C loop works
+ * against that. The kernels here write 16 (SSE2, NEON) or 32 (AVX2) bytes
+ * per store, with non-temporal stores that bypass the cache: on a buffer
+ * that is mapped cached instead, they also save reading each line in
+ * before overwriting it.
+ *
+ * The implementation is picked at runtime from the CPU's features by
+ * fb_blit_init(), as vpn_crypto.c does.
+ */
+
+#ifndef FB_BLIT_H
+#define FB_BLIT_H
+
+#include <stdint.h>
+
+// A rectangle of pixels: x0 <= x < x1, y0 <= y < y1. Empty if x0 >= x1.
+struct fb_rect {
+    int x0, y0, x1, y1;
+};
+
+// Pick the kernels for this CPU. Returns their name, e.g. "avx2".
+const char *fb_blit_init(void);
+
+// Set count pixels at dst to color. The row functions don't wait for
+// their stores: call fb_blit_flush() once the rows are written.
+void fb_fill_row(uint32_t *dst, int count, uint32_t color);
+
+// Copy count pixels from src to dst
+void fb_copy_row(uint32_t *dst, const uint32_t *src, int count);
+
+// Set the pixels of r in fb (stride pixels per row) to color
+void fb_fill_rect(uint32_t *fb, int stride, struct fb_rect r, uint32_t color);
+
+// Copy a width x height block of pixels from src to dst (strides in pixels)
+void fb_copy_rect(uint32_t *dst, int dst_stride, const uint32_t *src, int src_stride,
+                  int width, int height);
+
+// Finish the non-temporal stores of the row functions, so they are seen
+// before whatever comes next (the page flip). Only covers the calling
+// thread's stores. The rect functions do this themselves.
+void fb_blit_flush(void);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Vertex buffers and their per-frame transform, for simple_triangle
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fb_mesh.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// =============================================================================
+// Transform kernels
+// =============================================================================
+
+// count is a multiple of FB_MESH_ALIGN, the arrays are 32-byte aligned
+
+static void transform_generic(const struct fb_transform *t, const float *x, const float *y,
+                              float *out_x, float *out_y, int count) {
+    for (int i = 0; i < count; i++) {
+        out_x[i] = t->xx * x[i] + t->xy * y[i] + t->tx;
+        out_y[i] = t->yx * x[i] + t->yy * y[i] + t->ty;
+    }
+}
+
+#if defined(__x86_64__)
+
+// SSE (every x86-64 CPU): 4 vertices at a time
+static void transform_sse(const struct fb_transform *t, const float *x, const float *y,
+                          float *out_x, float *out_y, int count) {
+    __m128 xx = _mm_set1_ps(t->xx), xy = _mm_set1_ps(t->xy), tx = _mm_set1_ps(t->tx);
+    __m128 yx = _mm_set1_ps(t->yx), yy = _mm_set1_ps(t->yy), ty = _mm_set1_ps(t->ty);
+
+    for (int i = 0; i < count; i += 4) {
+        __m128 vx = _mm_load_ps(x + i), vy = _mm_load_ps(y + i);
+        _mm_store_ps(out_x + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(xx, vx), _mm_mul_ps(xy, vy)), tx));
+        _mm_store_ps(out_y + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(yx, vx), _mm_mul_ps(yy, vy)), ty));
+    }
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+// AVX2: 8 vertices at a time
+static void transform_avx2(const struct fb_transform *t, const float *x, const float *y,
+                           float *out_x, float *out_y, int count) {
+    __m256 xx = _mm256_set1_ps(t->xx), xy = _mm256_set1_ps(t->xy), tx = _mm256_set1_ps(t->tx);
+    __m256 yx = _mm256_set1_ps(t->yx), yy = _mm256_set1_ps(t->yy), ty = _mm256_set1_ps(t->ty);
+
+    for (int i = 0; i < count; i += 8) {
+        __m256 vx = _mm256_load_ps(x + i), vy = _mm256_load_ps(y + i);
+        _mm256_store_ps(out_x + i,
+                        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(xx, vx), _mm256_mul_ps(xy, vy)), tx));
+        _mm256_store_ps(out_y + i,
+                        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(yx, vx), _mm256_mul_ps(yy, vy)), ty));
+    }
+}
+
+#pragma GCC pop_options
+
+#endif  // __x86_64__
+
+#if defined(__aarch64__)
+
+// NEON (every ARMv8 core): 4 vertices at a time
+static void transform_neon(const struct fb_transform *t, const float *x, const float *y,
+                           float *out_x, float *out_y, int count) {
+    float32x4_t tx = vdupq_n_f32(t->tx), ty = vdupq_n_f32(t->ty);
+
+    for (int i = 0; i < count; i += 4) {
+        float32x4_t vx = vld1q_f32(x + i), vy = vld1q_f32(y + i);
+        vst1q_f32(out_x + i, vmlaq_n_f32(vmlaq_n_f32(tx, vx, t->xx), vy, t->xy));
+        vst1q_f32(out_y + i, vmlaq_n_f32(vmlaq_n_f32(ty, vx, t->yx), vy, t->yy));
+    }
+}
+
+#endif  // __aarch64__
+
+static void (*transform)(const struct fb_transform *, const float *, const float *,
+                         float *, float *, int) = transform_generic;
+
+// =============================================================================
+// Public API
+// =============================================================================
+
+const char *fb_mesh_init(void) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        transform = transform_avx2;
+        return "avx2";
+    }
+    transform = transform_sse;
+    return "sse";
+#elif defined(__aarch64__)
+    transform = transform_neon;
+    return "neon";
+#else
+    return "generic";
+#endif
+}
+
+int fb_mesh_alloc(struct fb_mesh *m, int count) {
+    size_t padded = (size_t)(count + FB_MESH_ALIGN - 1) / FB_MESH_ALIGN * FB_MESH_ALIGN;
+    size_t bytes = padded * sizeof(float);
+
+    m->count = count;
+    m->x = aligned_alloc(32, bytes ? bytes : 32);
+    m->y = aligned_alloc(32, bytes ? bytes : 32);
+    if (!m->x || !m->y) {
+        fb_mesh_free(m);
+        return -1;
+    }
+    memset(m->x, 0, bytes);
+    memset(m->y, 0, bytes);
+    return 0;
+}
+
+void fb_mesh_free(struct fb_mesh *m) {
+    free(m->x);
+    free(m->y);
+    m->x = m->y = NULL;
+    m->count = 0;
+}
+
+void fb_transform_rotate(struct fb_transform *t, float angle, float scale, float tx, float ty) {
+    // The only sine and cosine of the frame
+    float c = cosf(angle) * scale;
+    float s = sinf(angle) * scale;
+
+    t->xx = c;
+    t->xy = -s;
+    t->tx = tx;
+    t->yx = s;
+    t->yy = c;
+    t->ty = ty;
+}
+
+void fb_mesh_transform(const struct fb_transform *t, const struct fb_mesh *in, struct fb_mesh *out) {
+    int count = (in->count + FB_MESH_ALIGN - 1) / FB_MESH_ALIGN * FB_MESH_ALIGN;
+    transform(t, in->x, in->y, out->x, out->y, count);
+}
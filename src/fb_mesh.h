@@ -0,0 +1,46 @@
+/*
+ * Vertex buffers and their per-frame transform, for simple_triangle
+ *
+ * Rotating each vertex on its own means a sinf() and a cosf() per vertex,
+ * for the same angle every time, and x, y pairs scattered over memory. A
+ * mesh keeps its vertices as a structure of arrays instead - every x, then
+ * every y - so a SIMD register holds the same coordinate of 4 or 8
+ * vertices. The rotation, scale and move to the screen become one 2x3
+ * matrix per frame, and fb_mesh_transform() applies it to the whole mesh:
+ * two multiplies and adds per coordinate, 8 vertices at a time with AVX2.
+ */
+
+#ifndef FB_MESH_H
+#define FB_MESH_H
+
+// x' = xx * x + xy * y + tx, y' = yx * x + yy * y + ty
+struct fb_transform {
+    float xx, xy, tx;
+    float yx, yy, ty;
+};
+
+// count vertices, as two arrays. Both are 32-byte aligned and padded to a
+// multiple of FB_MESH_ALIGN, so the kernels never need a scalar tail.
+#define FB_MESH_ALIGN 8
+
+struct fb_mesh {
+    int count;
+    float *x;
+    float *y;
+};
+
+// Pick the transform kernel for this CPU. Returns its name, e.g. "avx2".
+const char *fb_mesh_init(void);
+
+// Allocate a mesh of count vertices, all (0, 0). Returns 0, or -1 if out of
+// memory.
+int fb_mesh_alloc(struct fb_mesh *m, int count);
+void fb_mesh_free(struct fb_mesh *m);
+
+// Rotate by angle (radians, clockwise on screen), scale, then move by tx, ty
+void fb_transform_rotate(struct fb_transform *t, float angle, float scale, float tx, float ty);
+
+// Transform every vertex of in into out, which has at least as many
+void fb_mesh_transform(const struct fb_transform *t, const struct fb_mesh *in, struct fb_mesh *out);
+
+#endif
@@ -0,0 +1,494 @@
+/*
+ * Filled-triangle rasterizer for simple_triangle
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "fb_raster.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define SUBPIXEL (1 << FB_RASTER_SUBPIXEL_BITS)
+#define BLOCK 8
+
+// A triangle set up for drawing: for each edge i, E_i at the center of
+// pixel (x, y) is c[i] + a[i] * x + b[i] * y, and the pixel is inside if all
+// three are >= 0. The top-left rule is already in c.
+struct fb_raster_tri {
+    int64_t a[3], b[3], c[3];
+    struct fb_rect box;         // Pixels it may touch, within the screen
+    uint32_t color;
+};
+
+// The triangles touching one tile, in the order they were added
+struct fb_raster_bin {
+    int *tris;
+    int count, alloc;
+};
+
+// =============================================================================
+// Block kernels
+// =============================================================================
+
+// Color the pixels of an 8x8 block (rows stride pixels apart) that are
+// inside all three edges. e holds the edge functions at the top-left
+// pixel, dx and dy what they grow by a pixel to the right and down. Inside
+// is e >= 0, so the sign bit of e0 | e1 | e2 is set just for pixels outside.
+// An edge the whole block is inside comes as 0s, so it never is.
+
+static void block_generic(uint32_t *dst, int stride, const int32_t e[3],
+                          const int32_t dx[3], const int32_t dy[3], uint32_t color) {
+    int32_t row0 = e[0], row1 = e[1], row2 = e[2];
+
+    for (int y = 0; y < BLOCK; y++) {
+        int32_t e0 = row0, e1 = row1, e2 = row2;
+        for (int x = 0; x < BLOCK; x++) {
+            if ((e0 | e1 | e2) >= 0) {
+                dst[x] = color;
+            }
+            e0 += dx[0];
+            e1 += dx[1];
+            e2 += dx[2];
+        }
+        row0 += dy[0];
+        row1 += dy[1];
+        row2 += dy[2];
+        dst += stride;
+    }
+}
+
+#if defined(__x86_64__)
+
+// SSE2 (every x86-64 CPU): a row is two vectors of 4 pixels
+static void block_sse2(uint32_t *dst, int stride, const int32_t e[3],
+                       const int32_t dx[3], const int32_t dy[3], uint32_t color) {
+    __m128i lo[3], hi[3], step[3];
+    __m128i col = _mm_set1_epi32((int)color);
+
+    for (int i = 0; i < 3; i++) {
+        lo[i] = _mm_setr_epi32(e[i], e[i] + dx[i], e[i] + 2 * dx[i], e[i] + 3 * dx[i]);
+        hi[i] = _mm_add_epi32(lo[i], _mm_set1_epi32(4 * dx[i]));
+        step[i] = _mm_set1_epi32(dy[i]);
+    }
+    for (int y = 0; y < BLOCK; y++) {
+        __m128i out_lo = _mm_srai_epi32(_mm_or_si128(_mm_or_si128(lo[0], lo[1]), lo[2]), 31);
+        __m128i out_hi = _mm_srai_epi32(_mm_or_si128(_mm_or_si128(hi[0], hi[1]), hi[2]), 31);
+        __m128i old_lo = _mm_load_si128((const __m128i *)dst);
+        __m128i old_hi = _mm_load_si128((const __m128i *)(dst + 4));
+        _mm_store_si128((__m128i *)dst,
+                        _mm_or_si128(_mm_and_si128(out_lo, old_lo), _mm_andnot_si128(out_lo, col)));
+        _mm_store_si128((__m128i *)(dst + 4),
+                        _mm_or_si128(_mm_and_si128(out_hi, old_hi), _mm_andnot_si128(out_hi, col)));
+        for (int i = 0; i < 3; i++) {
+            lo[i] = _mm_add_epi32(lo[i], step[i]);
+            hi[i] = _mm_add_epi32(hi[i], step[i]);
+        }
+        dst += stride;
+    }
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+// AVX2: a row is one vector
+static void block_avx2(uint32_t *dst, int stride, const int32_t e[3],
+                       const int32_t dx[3], const int32_t dy[3], uint32_t color) {
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i row[3], step[3];
+    __m256i col = _mm256_set1_epi32((int)color);
+
+    for (int i = 0; i < 3; i++) {
+        row[i] = _mm256_add_epi32(_mm256_set1_epi32(e[i]),
+                                  _mm256_mullo_epi32(lanes, _mm256_set1_epi32(dx[i])));
+        step[i] = _mm256_set1_epi32(dy[i]);
+    }
+    for (int y = 0; y < BLOCK; y++) {
+        __m256i out = _mm256_or_si256(_mm256_or_si256(row[0], row[1]), row[2]);
+        __m256i old = _mm256_load_si256((const __m256i *)dst);
+        // blendv picks by each byte's top bit: only the top byte of each
+        // pixel's mask has the sign bit, so spread it first
+        out = _mm256_srai_epi32(out, 31);
+        _mm256_store_si256((__m256i *)dst, _mm256_blendv_epi8(col, old, out));
+        for (int i = 0; i < 3; i++) {
+            row[i] = _mm256_add_epi32(row[i], step[i]);
+        }
+        dst += stride;
+    }
+}
+
+#pragma GCC pop_options
+
+#endif  // __x86_64__
+
+#if defined(__aarch64__)
+
+// NEON (every ARMv8 core): a row is two vectors of 4 pixels
+static void block_neon(uint32_t *dst, int stride, const int32_t e[3],
+                       const int32_t dx[3], const int32_t dy[3], uint32_t color) {
+    static const int32_t lane_index[4] = {0, 1, 2, 3};
+    int32x4_t lanes = vld1q_s32(lane_index);
+    int32x4_t lo[3], hi[3], step[3];
+    uint32x4_t col = vdupq_n_u32(color);
+
+    for (int i = 0; i < 3; i++) {
+        lo[i] = vmlaq_n_s32(vdupq_n_s32(e[i]), lanes, dx[i]);
+        hi[i] = vaddq_s32(lo[i], vdupq_n_s32(4 * dx[i]));
+        step[i] = vdupq_n_s32(dy[i]);
+    }
+    for (int y = 0; y < BLOCK; y++) {
+        uint32x4_t out_lo = vreinterpretq_u32_s32(vshrq_n_s32(vorrq_s32(vorrq_s32(lo[0], lo[1]), lo[2]), 31));
+        uint32x4_t out_hi = vreinterpretq_u32_s32(vshrq_n_s32(vorrq_s32(vorrq_s32(hi[0], hi[1]), hi[2]), 31));
+        vst1q_u32(dst, vbslq_u32(out_lo, vld1q_u32(dst), col));
+        vst1q_u32(dst + 4, vbslq_u32(out_hi, vld1q_u32(dst + 4), col));
+        for (int i = 0; i < 3; i++) {
+            lo[i] = vaddq_s32(lo[i], step[i]);
+            hi[i] = vaddq_s32(hi[i], step[i]);
+        }
+        dst += stride;
+    }
+}
+
+#endif  // __aarch64__
+
+static void (*draw_block)(uint32_t *, int, const int32_t *, const int32_t *, const int32_t *,
+                          uint32_t) = block_generic;
+
+// =============================================================================
+// Tiles
+// =============================================================================
+
+// Draw t over the part of tile (tx, ty) it touches. The tile is buffered
+// at buf, FB_RASTER_TILE pixels per row.
+static void draw_tri(const struct fb_raster_tri *t, uint32_t *buf, int tx, int ty) {
+    int x0 = t->box.x0 > tx ? t->box.x0 : tx;
+    int y0 = t->box.y0 > ty ? t->box.y0 : ty;
+    int x1 = t->box.x1 < tx + FB_RASTER_TILE ? t->box.x1 : tx + FB_RASTER_TILE;
+    int y1 = t->box.y1 < ty + FB_RASTER_TILE ? t->box.y1 : ty + FB_RASTER_TILE;
+
+    // Tiles start at multiples of the block size, so blocks don't leave them
+    x0 &= ~(BLOCK - 1);
+    y0 &= ~(BLOCK - 1);
+    for (int by = y0; by < y1; by += BLOCK) {
+        for (int bx = x0; bx < x1; bx += BLOCK) {
+            int32_t e[3], dx[3], dy[3];
+            int inside = 0, i;
+
+            for (i = 0; i < 3; i++) {
+                // E is linear, so over the block it is smallest and largest
+                // at two of the corners
+                int64_t at = t->c[i] + t->a[i] * bx + t->b[i] * by;
+                int64_t span_x = t->a[i] * (BLOCK - 1), span_y = t->b[i] * (BLOCK - 1);
+                int64_t min = at + (span_x < 0 ? span_x : 0) + (span_y < 0 ? span_y : 0);
+                int64_t max = at + (span_x > 0 ? span_x : 0) + (span_y > 0 ? span_y : 0);
+
+                if (max < 0) {
+                    break;      // Outside this edge
+                }
+                if (min >= 0) {
+                    e[i] = dx[i] = dy[i] = 0;
+                    inside++;
+                } else {
+                    // The edge crosses the block, so E stays within the
+                    // block's span of 0 there: 32 bits are plenty
+                    e[i] = (int32_t)at;
+                    dx[i] = (int32_t)t->a[i];
+                    dy[i] = (int32_t)t->b[i];
+                }
+            }
+            if (i < 3) {
+                continue;
+            }
+
+            uint32_t *dst = buf + (by - ty) * FB_RASTER_TILE + (bx - tx);
+            if (inside == 3) {
+                for (int y = 0; y < BLOCK; y++) {
+                    for (int x = 0; x < BLOCK; x++) {
+                        dst[y * FB_RASTER_TILE + x] = t->color;
+                    }
+                }
+            } else {
+                draw_block(dst, FB_RASTER_TILE, e, dx, dy, t->color);
+            }
+        }
+    }
+}
+
+// Draw tiles until none are left. Each thread calling this has its own
+// buffer; the tile's framebuffer pixels are written by one thread only.
+static void draw_tiles(struct fb_raster *r) {
+    _Alignas(32) uint32_t buf[FB_RASTER_TILE * FB_RASTER_TILE];
+    int tiles = r->tiles_x * r->tiles_y;
+    int n;
+
+    while ((n = atomic_fetch_add(&r->next_tile, 1)) < tiles) {
+        struct fb_raster_bin *bin = &r->bins[n];
+        if (!bin->count) {
+            continue;
+        }
+
+        int tx = n % r->tiles_x * FB_RASTER_TILE;
+        int ty = n / r->tiles_x * FB_RASTER_TILE;
+        int w = r->width - tx < FB_RASTER_TILE ? r->width - tx : FB_RASTER_TILE;
+        int h = r->height - ty < FB_RASTER_TILE ? r->height - ty : FB_RASTER_TILE;
+
+        for (int i = 0; i < FB_RASTER_TILE * FB_RASTER_TILE; i++) {
+            buf[i] = r->background;
+        }
+        for (int i = 0; i < bin->count; i++) {
+            draw_tri(&r->tris[bin->tris[i]], buf, tx, ty);
+        }
+        for (int y = 0; y < h; y++) {
+            fb_copy_row(r->fb + (size_t)(ty + y) * r->stride + tx, buf + y * FB_RASTER_TILE, w);
+        }
+        bin->count = 0;
+    }
+    fb_blit_flush();  // Once for all of this thread's tiles
+}
+
+// =============================================================================
+// Thread pool
+// =============================================================================
+
+static void *raster_worker(void *arg) {
+    struct fb_raster *r = arg;
+    unsigned int seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (!r->quit && r->generation == seen) {
+            pthread_cond_wait(&r->start, &r->lock);
+        }
+        if (r->quit) {
+            pthread_mutex_unlock(&r->lock);
+            return NULL;
+        }
+        seen = r->generation;
+        pthread_mutex_unlock(&r->lock);
+
+        draw_tiles(r);
+
+        pthread_mutex_lock(&r->lock);
+        if (--r->busy == 0) {
+            pthread_cond_signal(&r->done);
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+// =============================================================================
+// Public API
+// =============================================================================
+
+int fb_raster_init(struct fb_raster *r, int width, int height, int threads) {
+    memset(r, 0, sizeof(*r));
+    r->width = width;
+    r->height = height;
+    r->tiles_x = (width + FB_RASTER_TILE - 1) / FB_RASTER_TILE;
+    r->tiles_y = (height + FB_RASTER_TILE - 1) / FB_RASTER_TILE;
+    r->bins = calloc(r->tiles_x * r->tiles_y, sizeof(*r->bins));
+    if (!r->bins) {
+        perror("Cannot allocate tile bins");
+        return -1;
+    }
+
+    draw_block = block_generic;
+    r->impl = "generic";
+#if defined(__x86_64__)
+    draw_block = block_sse2;
+    r->impl = "sse2";
+    if (__builtin_cpu_supports("avx2")) {
+        draw_block = block_avx2;
+        r->impl = "avx2";
+    }
+#elif defined(__aarch64__)
+    draw_block = block_neon;            // NEON is part of every ARMv8 core
+    r->impl = "neon";
+#endif
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->start, NULL);
+    pthread_cond_init(&r->done, NULL);
+    r->threads = 1;
+    r->workers = calloc(threads, sizeof(*r->workers));
+    if (!r->workers) {
+        perror("Cannot allocate raster threads");
+        fb_raster_free(r);
+        return -1;
+    }
+    for (; r->threads < threads; r->threads++) {
+        int err = pthread_create(&r->workers[r->threads - 1], NULL, raster_worker, r);
+        if (err) {
+            fprintf(stderr, "Cannot start raster thread: %s\n", strerror(err));
+            fb_raster_free(r);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void fb_raster_free(struct fb_raster *r) {
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_broadcast(&r->start);
+    pthread_mutex_unlock(&r->lock);
+    for (int i = 0; i < r->threads - 1; i++) {
+        pthread_join(r->workers[i], NULL);
+    }
+    free(r->workers);
+    pthread_cond_destroy(&r->done);
+    pthread_cond_destroy(&r->start);
+    pthread_mutex_destroy(&r->lock);
+
+    for (int i = 0; r->bins && i < r->tiles_x * r->tiles_y; i++) {
+        free(r->bins[i].tris);
+    }
+    free(r->bins);
+    free(r->tris);
+    memset(r, 0, sizeof(*r));
+}
+
+void fb_raster_begin(struct fb_raster *r, uint32_t *fb, int stride, uint32_t background) {
+    r->fb = fb;
+    r->stride = stride;
+    r->background = background;
+    r->tri_count = 0;
+    r->bounds = (struct fb_rect){0, 0, 0, 0};
+}
+
+int fb_raster_triangle(struct fb_raster *r, float x0, float y0, float x1, float y1,
+                       float x2, float y2, uint32_t color) {
+    const float guard = FB_RASTER_GUARD;
+    float xs[3] = {x0, x1, x2}, ys[3] = {y0, y1, y2};
+    int64_t vx[3], vy[3];
+
+    for (int i = 0; i < 3; i++) {
+        if (!(xs[i] > -guard && xs[i] < r->width + guard &&
+              ys[i] > -guard && ys[i] < r->height + guard)) {
+            return 0;
+        }
+        vx[i] = lrintf(xs[i] * SUBPIXEL);
+        vy[i] = lrintf(ys[i] * SUBPIXEL);
+    }
+
+    // Twice the signed area. Wound the other way, swap two vertices so the
+    // inside is where all three edge functions are positive.
+    int64_t area = (vx[1] - vx[0]) * (vy[2] - vy[0]) - (vy[1] - vy[0]) * (vx[2] - vx[0]);
+    if (area == 0) {
+        return 0;
+    }
+    if (area < 0) {
+        int64_t t = vx[1]; vx[1] = vx[2]; vx[2] = t;
+        t = vy[1]; vy[1] = vy[2]; vy[2] = t;
+    }
+
+    // Pixels whose center the bounding box may contain, on screen
+    struct fb_rect box;
+    int64_t min_x = vx[0], max_x = vx[0], min_y = vy[0], max_y = vy[0];
+    for (int i = 1; i < 3; i++) {
+        if (vx[i] < min_x) min_x = vx[i];
+        if (vx[i] > max_x) max_x = vx[i];
+        if (vy[i] < min_y) min_y = vy[i];
+        if (vy[i] > max_y) max_y = vy[i];
+    }
+    box.x0 = min_x < 0 ? 0 : (int)(min_x >> FB_RASTER_SUBPIXEL_BITS);
+    box.y0 = min_y < 0 ? 0 : (int)(min_y >> FB_RASTER_SUBPIXEL_BITS);
+    box.x1 = (int)(max_x >> FB_RASTER_SUBPIXEL_BITS) + 1;
+    box.y1 = (int)(max_y >> FB_RASTER_SUBPIXEL_BITS) + 1;
+    if (box.x1 > r->width) box.x1 = r->width;
+    if (box.y1 > r->height) box.y1 = r->height;
+    if (box.x0 >= box.x1 || box.y0 >= box.y1) {
+        return 0;
+    }
+
+    if (r->tri_count == r->tri_alloc) {
+        int alloc = r->tri_alloc ? r->tri_alloc * 2 : 64;
+        struct fb_raster_tri *tris = realloc(r->tris, alloc * sizeof(*tris));
+        if (!tris) {
+            return -1;
+        }
+        r->tris = tris;
+        r->tri_alloc = alloc;
+    }
+    struct fb_raster_tri *t = &r->tris[r->tri_count];
+
+    // Edge from vertex i to j: E(p) = (p - vi) x (vj - vi), in 1/256ths of a
+    // pixel squared, at pixel centers. Growing with y alone (a == 0) it is
+    // a top edge, growing with x (a > 0) a left edge: pixels on those count
+    // as inside, the ones on the others don't (hence the -1).
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        int64_t a = vy[i] - vy[j];
+        int64_t b = vx[j] - vx[i];
+        int top_left = a > 0 || (a == 0 && b > 0);
+
+        t->a[i] = a * SUBPIXEL;
+        t->b[i] = b * SUBPIXEL;
+        t->c[i] = a * (SUBPIXEL / 2 - vx[i]) + b * (SUBPIXEL / 2 - vy[i]) - (top_left ? 0 : 1);
+    }
+    t->box = box;
+    t->color = color;
+
+    // Bin it into every tile its box touches
+    int tx0 = box.x0 / FB_RASTER_TILE, tx1 = (box.x1 - 1) / FB_RASTER_TILE;
+    int ty0 = box.y0 / FB_RASTER_TILE, ty1 = (box.y1 - 1) / FB_RASTER_TILE;
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            struct fb_raster_bin *bin = &r->bins[ty * r->tiles_x + tx];
+            if (bin->count == bin->alloc) {
+                int alloc = bin->alloc ? bin->alloc * 2 : 16;
+                int *tris = realloc(bin->tris, alloc * sizeof(*tris));
+                if (!tris) {
+                    return -1;  // Leaves it out of the tiles still to come
+                }
+                bin->tris = tris;
+                bin->alloc = alloc;
+            }
+            bin->tris[bin->count++] = r->tri_count;
+        }
+    }
+    r->tri_count++;
+
+    if (r->bounds.x0 >= r->bounds.x1) {
+        r->bounds = box;
+    } else {
+        if (box.x0 < r->bounds.x0) r->bounds.x0 = box.x0;
+        if (box.y0 < r->bounds.y0) r->bounds.y0 = box.y0;
+        if (box.x1 > r->bounds.x1) r->bounds.x1 = box.x1;
+        if (box.y1 > r->bounds.y1) r->bounds.y1 = box.y1;
+    }
+    return 0;
+}
+
+struct fb_rect fb_raster_end(struct fb_raster *r) {
+    atomic_store(&r->next_tile, 0);
+    if (r->threads > 1) {
+        pthread_mutex_lock(&r->lock);
+        r->busy = r->threads - 1;
+        r->generation++;
+        pthread_cond_broadcast(&r->start);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    draw_tiles(r);
+
+    if (r->threads > 1) {
+        pthread_mutex_lock(&r->lock);
+        while (r->busy) {
+            pthread_cond_wait(&r->done, &r->lock);
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    return r->bounds;
+}
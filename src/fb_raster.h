@@ -0,0 +1,93 @@
+/*
+ * Filled-triangle rasterizer for simple_triangle
+ *
+ * Each triangle becomes three edge functions: E(x, y) is positive on the
+ * inside of an edge, zero on it and negative outside, and grows by a
+ * constant from one pixel to the next. A pixel is in the triangle if its
+ * center is inside all three edges. The vertices are snapped to 1/16th of a
+ * pixel (FB_RASTER_SUBPIXEL_BITS) and everything after that is integer
+ * math, so edges shared by two triangles are exact: with the top-left rule
+ * deciding pixels whose center is exactly on an edge, every pixel along it
+ * belongs to one of the two triangles, never both or neither.
+ *
+ * The screen is split into FB_RASTER_TILE x FB_RASTER_TILE tiles. Adding a
+ * triangle only sets up its edges and bins it: its index goes into the list
+ * of every tile its bounding box touches. fb_raster_end() then hands the
+ * tiles out to a pool of threads. Each tile is drawn, its triangles in the
+ * order they were added, into a buffer of the thread's own that stays in
+ * L1 cache, and written to the framebuffer once, with the streaming copy of
+ * fb_blit.h. Tiles nothing touches aren't written at all.
+ *
+ * Within a tile, the edges are tested at the corners of 8x8 pixel blocks:
+ * blocks outside an edge are skipped and blocks inside all three are
+ * filled outright. Only blocks the triangle's outline crosses are tested
+ * pixel by pixel, a row of 8 pixels at a time with SSE2, AVX2 or NEON.
+ */
+
+#ifndef FB_RASTER_H
+#define FB_RASTER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "fb_blit.h"
+
+#define FB_RASTER_SUBPIXEL_BITS 4       // Vertices snap to 1/16th of a pixel
+#define FB_RASTER_TILE 64               // Pixels per tile side; a multiple of 8
+#define FB_RASTER_GUARD 8192            // Triangles reaching further off screen are dropped
+
+struct fb_raster_tri;
+struct fb_raster_bin;
+
+struct fb_raster {
+    int width, height;
+    int tiles_x, tiles_y;
+    const char *impl;           // Block kernel, e.g. "avx2"
+
+    // The frame being drawn
+    uint32_t *fb;
+    int stride;                 // Pixels per framebuffer row
+    uint32_t background;
+    struct fb_raster_tri *tris;
+    int tri_count, tri_alloc;
+    struct fb_raster_bin *bins; // One per tile
+    struct fb_rect bounds;      // What the triangles touch
+
+    // Thread pool: workers, plus the thread calling fb_raster_end()
+    int threads;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;       // A frame is ready to draw
+    pthread_cond_t done;        // The last worker finished it
+    unsigned int generation;    // Frames handed out
+    int busy;                   // Workers still drawing it
+    int quit;
+    atomic_int next_tile;
+};
+
+// Set up a rasterizer for a width x height screen, drawing with threads
+// threads (0: one per CPU). Returns 0, or -1 on error (a message has been
+// printed, and whatever was set up is freed again).
+int fb_raster_init(struct fb_raster *r, int width, int height, int threads);
+
+// Stop the threads and free everything
+void fb_raster_free(struct fb_raster *r);
+
+// Start a frame in fb (stride pixels per row). Tiles that triangles touch
+// are filled with background before those are drawn over it.
+void fb_raster_begin(struct fb_raster *r, uint32_t *fb, int stride, uint32_t background);
+
+// Add a triangle, in pixels, filled with color. Either winding works, and
+// triangles drawn later cover earlier ones. Returns 0, or -1 if it can't be
+// stored.
+int fb_raster_triangle(struct fb_raster *r, float x0, float y0, float x1, float y1,
+                       float x2, float y2, uint32_t color);
+
+// Draw the frame's triangles. Every FB_RASTER_TILE-pixel tile they touch
+// is rewritten whole, background included, so what was under those tiles
+// is gone; tiles no triangle touches are left alone. Returns the rectangle
+// the triangles are in.
+struct fb_rect fb_raster_end(struct fb_raster *r);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Frame-time profiling shared by simple_triangle and simple_video_player
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "frame_prof.h"
+
+#define DRAIN_NS 5000000        // Reporter wakeups: 5 ms, ring room for 800k fps
+
+static const char *stage_names[FRAME_STAGES] = {
+    "clear", "transform", "raster", "scale", "blit", "flip",
+};
+
+void frame_prof_end(struct frame_prof *p) {
+    double now = frame_prof_now();
+    unsigned int t = atomic_load_explicit(&p->tail, memory_order_relaxed);
+
+    // The first frame counts from its own start
+    p->cur.frame_us = (float)((now - (p->last_end ? p->last_end : p->mark)) * 1e6);
+    for (int i = 0; !p->last_end && i < FRAME_STAGES; i++) {
+        p->cur.frame_us += p->cur.stage_us[i];
+    }
+    p->last_end = now;
+
+    if (t - atomic_load_explicit(&p->head, memory_order_acquire) >= FRAME_PROF_RING) {
+        atomic_fetch_add_explicit(&p->lost, 1, memory_order_relaxed);
+        return;
+    }
+    p->ring[t & (FRAME_PROF_RING - 1)] = p->cur;
+    atomic_store_explicit(&p->tail, t + 1, memory_order_release);
+}
+
+static void hist_add(struct frame_hist *h, float us) {
+    int bucket = (int)(us / FRAME_PROF_BUCKET_US);
+
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+    h->buckets[bucket < 0 ? 0 : bucket < FRAME_PROF_BUCKETS ? bucket : FRAME_PROF_BUCKETS - 1]++;
+}
+
+// The time q of the samples are at most, in ms (upper end of the bucket)
+static double hist_quantile(const struct frame_hist *h, double q) {
+    uint64_t want = (uint64_t)(q * h->count + 0.5), seen = 0;
+
+    for (int i = 0; i < FRAME_PROF_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want && seen) {
+            double ms = (i + 1) * FRAME_PROF_BUCKET_US / 1000.0;
+            return ms < h->max_us / 1000.0 ? ms : h->max_us / 1000.0;
+        }
+    }
+    return h->max_us / 1000.0;
+}
+
+static double hist_mean(const struct frame_hist *h) {
+    return h->count ? h->sum_us / h->count / 1000.0 : 0;
+}
+
+// Take everything the frame loop has pushed
+static void drain(struct frame_prof *p) {
+    unsigned int h = atomic_load_explicit(&p->head, memory_order_relaxed);
+    unsigned int t = atomic_load_explicit(&p->tail, memory_order_acquire);
+
+    for (; h != t; h++) {
+        const struct frame_sample *s = &p->ring[h & (FRAME_PROF_RING - 1)];
+        for (int i = 0; i < FRAME_STAGES; i++) {
+            hist_add(&p->stages[i], s->stage_us[i]);
+        }
+        hist_add(&p->frames, s->frame_us);
+        hist_add(&p->recent, s->frame_us);
+    }
+    atomic_store_explicit(&p->head, h, memory_order_release);
+}
+
+static void report_recent(struct frame_prof *p, double now) {
+    double elapsed = now - (p->next_report - p->interval_sec);
+
+    printf("[PROF] %.1f fps, frame mean %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           elapsed > 0 ? p->recent.count / elapsed : 0, hist_mean(&p->recent),
+           hist_quantile(&p->recent, 0.99), p->recent.max_us / 1000.0);
+    memset(&p->recent, 0, sizeof(p->recent));
+}
+
+static void *reporter_thread(void *arg) {
+    struct frame_prof *p = arg;
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = DRAIN_NS};
+
+    while (!atomic_load(&p->stop)) {
+        nanosleep(&delay, NULL);
+        drain(p);
+
+        double now = frame_prof_now();
+        if (p->interval_sec && now >= p->next_report) {
+            report_recent(p, now);
+            p->next_report = now + p->interval_sec;
+        }
+    }
+    return NULL;
+}
+
+int frame_prof_start(struct frame_prof *p, int interval_sec) {
+    memset(p, 0, sizeof(*p));
+    p->interval_sec = interval_sec > 0 ? interval_sec : 0;
+    p->next_report = frame_prof_now() + p->interval_sec;
+
+    int err = pthread_create(&p->reporter, NULL, reporter_thread, p);
+    if (err) {
+        fprintf(stderr, "Cannot start frame profiler: %s\n", strerror(err));
+        return -1;
+    }
+    p->running = 1;
+    return 0;
+}
+
+void frame_prof_stop(struct frame_prof *p) {
+    if (!p->running) {
+        return;
+    }
+    atomic_store(&p->stop, 1);
+    pthread_join(p->reporter, NULL);
+    p->running = 0;
+    drain(p);
+
+    if (!p->frames.count) {
+        return;
+    }
+    double elapsed = p->frames.sum_us / 1e6;
+    uint64_t lost = atomic_load(&p->lost);
+    printf("\n=== Frame times: %llu frames in %.2f s, %.1f fps ===\n",
+           (unsigned long long)p->frames.count, elapsed, p->frames.count / elapsed);
+    printf("  %-10s %8s %8s %8s %8s\n", "ms", "mean", "p50", "p99", "max");
+    printf("  %-10s %8.3f %8.3f %8.3f %8.3f\n", "frame", hist_mean(&p->frames),
+           hist_quantile(&p->frames, 0.5), hist_quantile(&p->frames, 0.99),
+           p->frames.max_us / 1000.0);
+    for (int i = 0; i < FRAME_STAGES; i++) {
+        const struct frame_hist *h = &p->stages[i];
+        if (h->max_us == 0) {
+            continue;   // Not a stage of this program
+        }
+        printf("  %-10s %8.3f %8.3f %8.3f %8.3f\n", stage_names[i], hist_mean(h),
+               hist_quantile(h, 0.5), hist_quantile(h, 0.99), h->max_us / 1000.0);
+    }
+    if (lost) {
+        printf("  (%llu more frames did not fit the ring)\n", (unsigned long long)lost);
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * Frame-time profiling shared by simple_triangle and simple_video_player
+ *
+ * "Frame N rendered" every 60 frames says nothing about where a frame's
+ * time goes. The frame loop marks the end of each stage of a frame -
+ * clearing, rasterizing, sws_scale, copying to the framebuffer, waiting
+ * for the flip - and what a frame took per stage goes into a ring:
+ *
+ * - The ring has one producer, the frame loop, and one consumer, the
+ *   reporter thread, so a push is a plain store and an index update: no
+ *   lock, no locked instruction, and no printf() on the frame loop. A
+ *   frame that finds the ring full only counts as lost.
+ * - The reporter empties the ring every few milliseconds into histograms
+ *   of FRAME_PROF_BUCKET_US resolution, per stage and for the whole frame,
+ *   and with an interval set prints fps and frame times every so often.
+ * - frame_prof_stop() prints the run's fps, and the mean, p50, p99 and
+ *   worst time of the frame and of each stage.
+ *
+ * A frame's time is from the end of the frame before to its own end, so
+ * the frame times add up to the run and their inverse is the frame rate.
+ */
+
+#ifndef FRAME_PROF_H
+#define FRAME_PROF_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define FRAME_PROF_RING 4096            // Frames in flight to the reporter (a power of two)
+#define FRAME_PROF_BUCKET_US 10         // Histogram resolution
+#define FRAME_PROF_BUCKETS 10000        // Up to 100 ms; longer counts as the last bucket
+
+enum frame_stage {
+    FRAME_STAGE_CLEAR,          // Erasing the last frame
+    FRAME_STAGE_TRANSFORM,      // Moving the vertices
+    FRAME_STAGE_RASTER,         // Filling the triangles
+    FRAME_STAGE_SCALE,          // sws_scale: YUV to RGB, to the screen's size
+    FRAME_STAGE_BLIT,           // Copying to the framebuffer, or back from the GPU
+    FRAME_STAGE_FLIP,           // Waiting for the flip (or the overlay plane)
+    FRAME_STAGES
+};
+
+struct frame_sample {
+    float stage_us[FRAME_STAGES];
+    float frame_us;
+};
+
+struct frame_hist {
+    uint64_t count;
+    double sum_us;
+    float max_us;
+    uint32_t buckets[FRAME_PROF_BUCKETS];
+};
+
+struct frame_prof {
+    // Frame loop side
+    _Atomic unsigned int tail __attribute__((aligned(64)));    // Next slot to fill
+    struct frame_sample cur;
+    double mark;                // When the last stage ended
+    double last_end;            // When the last frame ended (0: none yet)
+    _Atomic uint64_t lost;      // Frames the ring had no room for
+
+    // Reporter side
+    _Atomic unsigned int head __attribute__((aligned(64)));    // Next slot to take
+    struct frame_hist stages[FRAME_STAGES];
+    struct frame_hist frames;
+    struct frame_hist recent;   // Frames since the last report
+    int interval_sec;           // Between reports (0: only frame_prof_stop()'s)
+    double next_report;
+    pthread_t reporter;
+    int running;
+    _Atomic int stop;
+
+    struct frame_sample ring[FRAME_PROF_RING];
+};
+
+static inline double frame_prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Start the reporter, printing every interval_sec seconds (0: only at the
+// end). p is big - keep it static. Returns 0, or -1 if the thread can't
+// start.
+int frame_prof_start(struct frame_prof *p, int interval_sec);
+
+// Stop the reporter and print the summary of the run (nothing if it never
+// started)
+void frame_prof_stop(struct frame_prof *p);
+
+// A frame starts: stage times count from here
+static inline void frame_prof_begin(struct frame_prof *p) {
+    p->mark = frame_prof_now();
+    for (int i = 0; i < FRAME_STAGES; i++) {
+        p->cur.stage_us[i] = 0;
+    }
+}
+
+// The time since the last mark (or frame_prof_begin()) went to stage. A
+// stage may be marked more than once a frame; the times add up.
+static inline void frame_prof_mark(struct frame_prof *p, enum frame_stage stage) {
+    double now = frame_prof_now();
+    p->cur.stage_us[stage] += (float)((now - p->mark) * 1e6);
+    p->mark = now;
+}
+
+// The frame is done: hand it to the reporter
+void frame_prof_end(struct frame_prof *p);
+
+#endif
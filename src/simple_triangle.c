@@ -1,6 +1,35 @@
 // simple_triangle.c
 // Rotating triangle using direct DRM/KMS
 // CPU renders triangle, DRM displays it - no GPU rendering, no shaders!
+//
+// Triangles are filled by the tiled rasterizer of fb_raster.h, on a thread
+// per CPU (-t to choose). -n draws a grid of that many instead of one.
+//
+// The vertices are one mesh (fb_mesh.h), built once: each frame computes a
+// single rotation matrix and transforms the whole mesh with it, 8 vertices
+// at a time, instead of a sinf() and cosf() per vertex.
+//
+// Each frame is drawn into a back buffer and page-flipped on screen at the
+// next vblank (see drm_present.h), which also paces the loop.
+//
+// Erasing the last frame doesn't have to clear the whole screen: the
+// triangles only ever touched their bounding box, so each buffer remembers
+// the box drawn into it and only that is cleared, with the SIMD fill of
+// fb_blit.h. -F clears everything every frame instead, for comparison.
+//
+// At exit, the time frames took - each stage and the whole - is printed
+// (see frame_prof.h). -B draws that many frames offscreen, with no display
+// and nothing to wait for, to measure what drawing alone costs.
+//
+// The display is found by drm_display.h: the first connected output, or
+// the one -o names, at its preferred mode or the one -m asks for. Only that
+// one output is driven; any others are left as they are.
+//
+// Compile:
+//   gcc -o simple_triangle simple_triangle.c drm_display.c drm_present.c fb_blit.c fb_mesh.c fb_raster.c frame_prof.c -ldrm -lm -pthread
+//
+// Run:
+//   ./simple_triangle [-F] [-n triangles] [-t threads] [-B frames] [-o output] [-m mode]
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,12 +42,42 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "drm_display.h"
+#include "drm_present.h"
+#include "fb_blit.h"
+#include "fb_mesh.h"
+#include "fb_raster.h"
+#include "frame_prof.h"
+
+// DRM/Display state
+struct drm_display display = {.fd = -1};
+struct drm_display_want want;       // -o and -m
+struct drm_presenter presenter;
+
 // Screen dimensions (we'll get actual size from connected display)
 int screen_width = 1920;
 int screen_height = 1080;
 
-// Framebuffer pointer (mmap'd memory)
+// Framebuffer pointer (mmap'd memory): the back buffer being drawn
 uint32_t *framebuffer = NULL;
+int fb_stride = 1920;       // Pixels per framebuffer row (pitch / 4)
+
+// The rasterizer filling the triangles
+struct fb_raster raster;
+
+// Triangle vertices: three per triangle, around the screen's center (model),
+// then where they are this frame (screen)
+struct fb_mesh model;
+struct fb_mesh screen;
+
+// Options
+int full_clear = 0;         // -F: clear the whole screen every frame
+int triangle_count = 1;     // -n: triangles per frame
+int raster_threads = 0;     // -t: rasterizer threads (0: one per CPU)
+int benchmark_frames = 0;   // -B: draw this many frames offscreen, as fast as possible
+
+// Where each frame's time goes (see frame_prof.h)
+static struct frame_prof prof;
 
 // Global flag for graceful exit
 volatile int keep_running = 1;
@@ -33,243 +92,198 @@ void signal_handler(int signum) {
 // SOFTWARE TRIANGLE RASTERIZATION (CPU does the work!)
 // =============================================================================
 
-// Draw a single pixel
-void put_pixel(int x, int y, uint32_t color) {
-    if (x >= 0 && x < screen_width && y >= 0 && y < screen_height) {
-        // Direct memory write to framebuffer
-        // Format: 0xAARRGGBB (32-bit XRGB8888)
-        framebuffer[y * screen_width + x] = color;
-    }
-}
-
-// Draw a line using Bresenham's algorithm
-void draw_line(int x0, int y0, int x1, int y1, uint32_t color) {
-    int dx = abs(x1 - x0);
-    int dy = abs(y1 - y0);
-    int sx = x0 < x1 ? 1 : -1;
-    int sy = y0 < y1 ? 1 : -1;
-    int err = dx - dy;
-
-    while (1) {
-        put_pixel(x0, y0, color);
-
-        if (x0 == x1 && y0 == y1) break;
-
-        int e2 = 2 * err;
-        if (e2 > -dy) {
-            err -= dy;
-            x0 += sx;
-        }
-        if (e2 < dx) {
-            err += dx;
-            y0 += sy;
-        }
-    }
+// Fill a rectangle of the screen with a color
+void clear_rect(struct fb_rect r, uint32_t color) {
+    // Writing directly to framebuffer memory (mmap'd), row by row: rows
+    // may be padded to the driver's pitch. Each row is one SIMD fill.
+    fb_fill_rect(framebuffer, fb_stride, r, color);
 }
 
 // Fill the screen with a color
 void clear_screen(uint32_t color) {
-    // This is a simple memset-like operation
-    // Writing directly to framebuffer memory (mmap'd)
-    for (int i = 0; i < screen_width * screen_height; i++) {
-        framebuffer[i] = color;
-    }
+    struct fb_rect all = {0, 0, screen_width, screen_height};
+    clear_rect(all, color);
 }
 
-// Draw a filled triangle (simple scanline algorithm)
-void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color) {
-    // For simplicity, just draw the outline
-    // (Full triangle filling would make code longer)
-    draw_line(x0, y0, x1, y1, color);
-    draw_line(x1, y1, x2, y2, color);
-    draw_line(x2, y2, x0, y0, color);
+// Queue a filled triangle for this frame. fb_raster_end() draws them all:
+// every pixel whose center is inside the three edges, found with integer
+// edge functions, 8x8 pixel blocks at a time, on all the threads at once.
+void draw_triangle(float x0, float y0, float x1, float y1, float x2, float y2, uint32_t color) {
+    fb_raster_triangle(&raster, x0, y0, x1, y1, x2, y2, color);
 }
 
-// Rotate a point around origin
-void rotate_point(float *x, float *y, float angle) {
-    float cos_a = cosf(angle);
-    float sin_a = sinf(angle);
-    float new_x = *x * cos_a - *y * sin_a;
-    float new_y = *x * sin_a + *y * cos_a;
-    *x = new_x;
-    *y = new_y;
+// Build the model: one triangle in the middle of the screen, or a grid of
+// them that turns as a whole. The grid fits in a square that stays on
+// screen at every angle.
+int build_model(void) {
+    int cols = (int)ceilf(sqrtf((float)triangle_count));
+    int rows = (triangle_count + cols - 1) / cols;
+    float side = (screen_width < screen_height ? screen_width : screen_height) / sqrtf(2.0f);
+    float cell = side / cols;
+    float size = triangle_count == 1 ? 200.0f : 0.35f * cell;
+
+    if (fb_mesh_alloc(&model, 3 * triangle_count) < 0 ||
+        fb_mesh_alloc(&screen, 3 * triangle_count) < 0) {
+        fprintf(stderr, "Cannot allocate %d vertices\n", 3 * triangle_count);
+        fb_mesh_free(&model);
+        return -1;
+    }
+    for (int i = 0; i < triangle_count; i++) {
+        float cx = triangle_count == 1 ? 0.0f : (i % cols + 0.5f) * cell - side / 2;
+        float cy = triangle_count == 1 ? 0.0f : (i / cols + 0.5f) * cell - rows * cell / 2;
+
+        model.x[3 * i] = cx;             model.y[3 * i] = cy - size;         // Top
+        model.x[3 * i + 1] = cx - size;  model.y[3 * i + 1] = cy + size;     // Bottom-left
+        model.x[3 * i + 2] = cx + size;  model.y[3 * i + 2] = cy + size;     // Bottom-right
+    }
+    return 0;
 }
 
 // =============================================================================
-// MAIN PROGRAM
+// DRM/KMS SETUP
 // =============================================================================
 
-int main() {
-    int ret;
+void cleanup_drm() {
+    // Wait for the last flip, unmap and destroy the framebuffers
+    drm_present_free(&presenter);
 
-    printf("=== Simple Rotating Triangle (Direct DRM) ===\n\n");
-
-    // Register signal handlers for graceful exit
-    signal(SIGINT, signal_handler);   // Ctrl+C
-    signal(SIGTERM, signal_handler);  // kill command
-
-    // =========================================================================
-    // STEP 1: OPEN DRM DEVICE
-    // =========================================================================
-    printf("Step 1: Opening DRM device...\n");
-    // SYSCALL: openat(AT_FDCWD, "/dev/dri/card1", O_RDWR)
-    int drm_fd = open("/dev/dri/card1", O_RDWR);
-    if (drm_fd < 0) {
-        perror("Cannot open /dev/dri/card0");
-        printf("Hint: You may need to run as root or be in 'video' group\n");
-        return 1;
-    }
-    printf("✓ DRM device opened (fd=%d)\n\n", drm_fd);
-
-    // =========================================================================
-    // STEP 2: GET DISPLAY RESOURCES
-    // =========================================================================
-    printf("Step 2: Querying display resources...\n");
-    // SYSCALL: ioctl(drm_fd, DRM_IOCTL_MODE_GETRESOURCES, ...)
-    // This returns: connectors, CRTCs, encoders available
-    drmModeRes *resources = drmModeGetResources(drm_fd);
-    if (!resources) {
-        perror("Cannot get DRM resources");
-        close(drm_fd);
-        return 1;
-    }
-    printf("✓ Found %d connectors, %d CRTCs, %d encoders\n\n",
-           resources->count_connectors,
-           resources->count_crtcs,
-           resources->count_encoders);
+    // Close DRM device
+    drm_display_close(&display);
+}
 
+// Steps 1-7: find the display and put our framebuffers on it
+int setup_drm() {
     // =========================================================================
-    // STEP 3: FIND CONNECTED DISPLAY
+    // STEPS 1-3: OPEN DRM DEVICE, FIND CONNECTED DISPLAY, PICK ITS MODE
     // =========================================================================
-    printf("Step 3: Finding connected display...\n");
-    drmModeConnector *connector = NULL;
-    for (int i = 0; i < resources->count_connectors; i++) {
-        // SYSCALL: ioctl(drm_fd, DRM_IOCTL_MODE_GETCONNECTOR, ...)
-        // Queries each connector (HDMI, DisplayPort, etc.)
-        connector = drmModeGetConnector(drm_fd, resources->connectors[i]);
-        if (connector->connection == DRM_MODE_CONNECTED) {
-            printf("✓ Found connected display: connector %d\n", connector->connector_id);
-            break;
-        }
-        drmModeFreeConnector(connector);
-        connector = NULL;
-    }
-
-    if (!connector) {
-        fprintf(stderr, "No connected display found\n");
-        drmModeFreeResources(resources);
-        close(drm_fd);
-        return 1;
+    printf("Steps 1-3: Finding a connected display...\n");
+    // Connectors, their encoders and the CRTCs those reach, and the modes
+    // (see drm_display.c for the syscalls). We draw on one output: -o picks
+    // which, and the others are left as they are.
+    want.max_outputs = 1;
+    if (drm_display_open(&display, &want) < 0) {
+        return -1;
     }
+    struct drm_output *output = &display.outputs[0];
+    printf("✓ %s: %s, %s modesetting\n", display.device, output->name,
+           display.atomic ? "atomic" : "legacy");
 
     // Get display resolution
-    drmModeModeInfo mode = connector->modes[0];  // First (preferred) mode
-    screen_width = mode.hdisplay;
-    screen_height = mode.vdisplay;
-    printf("✓ Display resolution: %dx%d @ %dHz\n\n",
-           screen_width, screen_height, mode.vrefresh);
+    screen_width = output->mode.hdisplay;
+    screen_height = output->mode.vdisplay;
+    printf("✓ Display resolution: %dx%d @ %.2fHz (CRTC %u)\n\n",
+           screen_width, screen_height, output->refresh, output->crtc_id);
 
     // =========================================================================
-    // STEP 4: CREATE FRAMEBUFFER
+    // STEPS 4-7: CREATE FRAMEBUFFERS, MAP THEM, SET DISPLAY MODE
     // =========================================================================
-    printf("Step 4: Creating framebuffer...\n");
+    printf("Steps 4-7: Creating framebuffers and setting display mode...\n");
 
-    // Create a "dumb buffer" (simple buffer in system RAM or VRAM)
-    struct drm_mode_create_dumb create_dumb = {
-        .width = screen_width,
-        .height = screen_height,
-        .bpp = 32,  // 32 bits per pixel (XRGB8888)
-    };
-
-    // SYSCALL: ioctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb)
-    // This allocates memory for the framebuffer
-    // On integrated GPU: allocates in system RAM
-    // On discrete GPU: might allocate in VRAM or system RAM
-    ret = drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb);
-    if (ret < 0) {
-        perror("Cannot create dumb buffer");
-        return 1;
+    // Two dumb buffers: the display scans out one while we draw the other,
+    // and a page flip swaps them (see drm_present.c for the syscalls)
+    if (drm_present_init(&presenter, &display, output, 2) < 0) {
+        cleanup_drm();
+        return -1;
     }
 
-    uint32_t fb_handle = create_dumb.handle;
-    uint32_t fb_pitch = create_dumb.pitch;  // Bytes per row
-    uint64_t fb_size = create_dumb.size;    // Total size in bytes
+    printf("✓ %d framebuffers created and mapped:\n", presenter.count);
+    printf("  - Size: %lu bytes (%.2f MB) each\n", presenter.bufs[0].size,
+           presenter.bufs[0].size / 1024.0 / 1024.0);
+    printf("  - Pitch: %u bytes/row\n", presenter.bufs[0].pitch);
+    printf("✓ Display mode set!\n");
+    printf("  - Display controller is now scanning out framebuffer 0\n");
+    printf("  - We draw into the other one and flip it on screen\n\n");
+    return 0;
+}
 
-    printf("✓ Dumb buffer created:\n");
-    printf("  - Handle: %u\n", fb_handle);
-    printf("  - Size: %lu bytes (%.2f MB)\n", fb_size, fb_size / 1024.0 / 1024.0);
-    printf("  - Pitch: %u bytes/row\n\n", fb_pitch);
+// =============================================================================
+// MAIN PROGRAM
+// =============================================================================
 
-    // =========================================================================
-    // STEP 5: ADD FRAMEBUFFER TO DRM
-    // =========================================================================
-    printf("Step 5: Registering framebuffer with DRM...\n");
-
-    uint32_t fb_id;
-    // SYSCALL: ioctl(drm_fd, DRM_IOCTL_MODE_ADDFB, ...)
-    // Tells DRM: "This buffer can be used as a framebuffer for display"
-    ret = drmModeAddFB(drm_fd, screen_width, screen_height, 24, 32,
-                       fb_pitch, fb_handle, &fb_id);
-    if (ret) {
-        perror("Cannot add framebuffer");
-        return 1;
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "Fn:t:B:o:m:h")) != -1) {
+        switch (opt) {
+        case 'F':
+            full_clear = 1;
+            break;
+        case 'n':
+            triangle_count = atoi(optarg);
+            if (triangle_count < 1) {
+                fprintf(stderr, "-n needs at least 1 triangle\n");
+                return 1;
+            }
+            break;
+        case 't':
+            raster_threads = atoi(optarg);
+            break;
+        case 'B':
+            benchmark_frames = atoi(optarg);
+            if (benchmark_frames < 1) {
+                fprintf(stderr, "-B needs at least 1 frame\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            want.output = optarg;
+            break;
+        case 'm':
+            if (drm_display_parse_mode(optarg, &want) < 0) {
+                fprintf(stderr, "-m needs WxH, WxH@Hz or @Hz, not %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-F] [-n triangles] [-t threads] [-B frames] [-o output] [-m mode]\n",
+                    argv[0]);
+            fprintf(stderr, "  -F  Clear the whole screen every frame, not just the last triangles\n");
+            fprintf(stderr, "  -n  Draw a grid of this many triangles (default 1)\n");
+            fprintf(stderr, "  -t  Rasterize on this many threads (default: one per CPU)\n");
+            fprintf(stderr, "  -B  Benchmark: draw this many frames offscreen at %dx%d, as fast as\n"
+                            "      possible, and report fps and frame times\n", screen_width, screen_height);
+            fprintf(stderr, "  -o  Display on this connector, e.g. HDMI-A-1 (default: the first connected)\n");
+            fprintf(stderr, "  -m  Display mode: 1920x1080, 1920x1080@60 or @144 (default: preferred)\n");
+            return opt == 'h' ? 0 : 1;
+        }
     }
-    printf("✓ Framebuffer registered (fb_id=%u)\n\n", fb_id);
 
-    // =========================================================================
-    // STEP 6: MAP FRAMEBUFFER TO USER SPACE
-    // =========================================================================
-    printf("Step 6: Mapping framebuffer to userspace...\n");
+    printf("=== Simple Rotating Triangle (Direct DRM) ===\n\n");
+    printf("Fill kernels: %s, %s clear\n\n", fb_blit_init(), full_clear ? "full" : "dirty-rectangle");
 
-    // First, get the mmap offset
-    struct drm_mode_map_dumb map_dumb = {
-        .handle = fb_handle,
-    };
+    // Register signal handlers for graceful exit
+    signal(SIGINT, signal_handler);   // Ctrl+C
+    signal(SIGTERM, signal_handler);  // kill command
 
-    // SYSCALL: ioctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb)
-    // Returns: offset we can use with mmap()
-    ret = drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb);
-    if (ret) {
-        perror("Cannot get mmap offset");
+    if (benchmark_frames) {
+        // No display: the same drawing into two buffers in memory, and
+        // flips that don't wait for anything
+        printf("Benchmark: %d frames offscreen at %dx%d\n\n", benchmark_frames,
+               screen_width, screen_height);
+        if (drm_present_init_offscreen(&presenter, screen_width, screen_height, 2) < 0) {
+            return 1;
+        }
+    } else if (setup_drm() < 0) {
         return 1;
     }
 
-    // Now map it to our process address space
-    // SYSCALL: mmap(NULL, fb_size, PROT_READ|PROT_WRITE, MAP_SHARED, drm_fd, map_dumb.offset)
-    // This gives us direct memory access to the framebuffer!
-    framebuffer = mmap(NULL, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                       drm_fd, map_dumb.offset);
-    if (framebuffer == MAP_FAILED) {
-        perror("Cannot mmap framebuffer");
+    // Tiles, their triangle lists and the threads that draw them
+    if (fb_raster_init(&raster, screen_width, screen_height, raster_threads) < 0) {
+        cleanup_drm();
         return 1;
     }
+    printf("✓ Rasterizer: %dx%d tiles of %d pixels, %d threads, %s blocks\n",
+           raster.tiles_x, raster.tiles_y, FB_RASTER_TILE, raster.threads, raster.impl);
 
-    printf("✓ Framebuffer mapped to address: %p\n", framebuffer);
-    printf("  - Now CPU can write directly to display memory!\n\n");
-
-    // =========================================================================
-    // STEP 7: SET DISPLAY MODE (MODESETTING)
-    // =========================================================================
-    printf("Step 7: Setting display mode...\n");
-
-    // Find a CRTC (display controller) to use
-    uint32_t crtc_id = resources->crtcs[0];  // Use first CRTC
-
-    // SYSCALL: ioctl(drm_fd, DRM_IOCTL_MODE_SETCRTC, ...)
-    // This configures the display controller:
-    // - Which connector to use (HDMI, DP, etc.)
-    // - What resolution/refresh rate
-    // - Which framebuffer to scan out
-    ret = drmModeSetCrtc(drm_fd, crtc_id, fb_id, 0, 0,
-                         &connector->connector_id, 1, &mode);
-    if (ret) {
-        perror("Cannot set CRTC");
+    const char *transform_impl = fb_mesh_init();
+    if (build_model() < 0) {
+        fb_raster_free(&raster);
+        cleanup_drm();
         return 1;
     }
+    printf("✓ Mesh: %d triangles, %s transform\n\n", triangle_count, transform_impl);
 
-    printf("✓ Display mode set!\n");
-    printf("  - Display controller is now scanning out our framebuffer\n");
-    printf("  - Whatever we write to framebuffer appears on screen!\n\n");
+    // Frame times go to the profiler's thread; benchmarks report every second
+    frame_prof_start(&prof, benchmark_frames ? 1 : 0);
 
     // =========================================================================
     // STEP 8: RENDER LOOP
@@ -277,86 +291,92 @@ int main() {
     printf("Step 8: Starting render loop...\n");
     printf("Press Ctrl+C to exit gracefully...\n\n");
 
-    // Triangle vertices (in screen space, centered)
-    float cx = screen_width / 2.0f;   // Center X
-    float cy = screen_height / 2.0f;  // Center Y
-    float size = 200.0f;              // Triangle size
+    static const uint32_t colors[] = {
+        0x00FF0000, 0x0000FF00, 0x000000FF, 0x00FFFF00, 0x0000FFFF, 0x00FF00FF,
+    };
 
-    // Original triangle vertices (relative to center)
-    float v0x = 0.0f, v0y = -size;      // Top
-    float v1x = -size, v1y = size;      // Bottom-left
-    float v2x = size, v2y = size;       // Bottom-right
+    // What the last frame drawn into each buffer touched. New buffers are
+    // all black already.
+    struct fb_rect dirty[DRM_PRESENT_MAX_BUFFERS] = {{0, 0, 0, 0}};
 
-    for (int frame = 0; keep_running; frame++) {
+    for (int frame = 0; keep_running && (!benchmark_frames || frame < benchmark_frames); frame++) {
         float angle = (frame % 360) * M_PI / 180.0f;  // Degrees to radians, wrap at 360
 
         // =====================================================================
         // CPU RENDERING (Software rasterization)
         // =====================================================================
 
-        // Clear screen (write black pixels to entire framebuffer)
-        // This is a simple memory write operation - NO GPU involved!
-        clear_screen(0x00000000);  // Black
-
-        // Rotate triangle vertices
-        float r0x = v0x, r0y = v0y;
-        float r1x = v1x, r1y = v1y;
-        float r2x = v2x, r2y = v2y;
-
-        rotate_point(&r0x, &r0y, angle);
-        rotate_point(&r1x, &r1y, angle);
-        rotate_point(&r2x, &r2y, angle);
-
-        // Convert to screen coordinates
-        int x0 = (int)(cx + r0x);
-        int y0 = (int)(cy + r0y);
-        int x1 = (int)(cx + r1x);
-        int y1 = (int)(cy + r1y);
-        int x2 = (int)(cx + r2x);
-        int y2 = (int)(cy + r2y);
-
-        // Draw triangle (CPU draws lines pixel by pixel)
-        // Colors: Red, Green, Blue for each edge
-        draw_line(x0, y0, x1, y1, 0x00FF0000);  // Red
-        draw_line(x1, y1, x2, y2, 0x0000FF00);  // Green
-        draw_line(x2, y2, x0, y0, 0x000000FF);  // Blue
+        frame_prof_begin(&prof);
+
+        // Draw into the buffer that is not on screen
+        struct drm_buffer *back = drm_present_back(&presenter);
+        framebuffer = back->map;
+        fb_stride = back->pitch / 4;
+        struct fb_rect *back_dirty = &dirty[back - presenter.bufs];
+
+        // Erase the triangles drawn into this buffer last time: the rest of
+        // it is black already. This is a simple memory write operation - NO
+        // GPU involved!
+        if (full_clear) {
+            clear_screen(0x00000000);  // Black
+        } else {
+            clear_rect(*back_dirty, 0x00000000);
+        }
+        frame_prof_mark(&prof, FRAME_STAGE_CLEAR);
+
+        // Rotate the mesh and move it to the screen's center: one matrix
+        // for every vertex. Sub-pixel positions count, so no rounding to
+        // whole pixels.
+        struct fb_transform to_screen;
+        fb_transform_rotate(&to_screen, angle, 1.0f, screen_width / 2.0f, screen_height / 2.0f);
+        fb_mesh_transform(&to_screen, &model, &screen);
+        frame_prof_mark(&prof, FRAME_STAGE_TRANSFORM);
+
+        fb_raster_begin(&raster, framebuffer, fb_stride, 0x00000000);
+        for (int i = 0; i < triangle_count; i++) {
+            const float *x = screen.x + 3 * i, *y = screen.y + 3 * i;
+            draw_triangle(x[0], y[0], x[1], y[1], x[2], y[2], colors[i % 6]);
+        }
+
+        // Fill them in (CPU computes every pixel), and remember where they are
+        *back_dirty = fb_raster_end(&raster);
+        frame_prof_mark(&prof, FRAME_STAGE_RASTER);
 
         // =====================================================================
         // DISPLAY UPDATE
         // =====================================================================
 
-        // The framebuffer is already mapped to display memory!
-        // The display controller continuously reads from it
-        // So the triangle appears IMMEDIATELY - no page flip needed
-
-        // Optional: We could use page flipping for smoother animation:
-        // drmModePageFlip(drm_fd, crtc_id, fb_id, DRM_MODE_PAGE_FLIP_EVENT, NULL);
-
-        if (frame % 60 == 0) {
+        // The display controller continuously reads from the front buffer,
+        // so drawing into it would show half-drawn frames and tear. Instead,
+        // flip the finished back buffer on screen during the next vblank.
+        // SYSCALL: ioctl(fd, DRM_IOCTL_MODE_ATOMIC, ...), or ..._PAGE_FLIP
+        // Only one flip can be queued, so the next frame's flip waits for
+        // this one: the loop runs at the display's refresh rate.
+        drm_present_flip(&presenter, 0);
+        frame_prof_mark(&prof, FRAME_STAGE_FLIP);
+        frame_prof_end(&prof);
+
+        if (frame % 60 == 0 && !benchmark_frames) {
             printf("Frame %d rendered (angle=%.1f°)\n", frame, frame * 1.0f);
         }
-
-        usleep(16666);  // ~60 FPS
     }
 
+    // Where the time went
+    frame_prof_stop(&prof);
+
     printf("\n=== Cleanup ===\n");
 
     // =========================================================================
     // CLEANUP
     // =========================================================================
 
-    // Unmap framebuffer
-    munmap(framebuffer, fb_size);
-
-    // Destroy framebuffer
-    drmModeRmFB(drm_fd, fb_id);
+    // Stop the rasterizer threads, free the mesh
+    fb_raster_free(&raster);
+    fb_mesh_free(&model);
+    fb_mesh_free(&screen);
 
-    // Free resources
-    drmModeFreeConnector(connector);
-    drmModeFreeResources(resources);
-
-    // Close DRM device
-    close(drm_fd);
+    // Framebuffers, display resources, DRM device
+    cleanup_drm();
 
     printf("✓ All resources cleaned up\n");
 
@@ -2,39 +2,91 @@
 // Minimal video player using FFmpeg + Direct DRM/KMS
 // Decodes video with CPU, displays via framebuffer - educational, not optimized!
 //
+// With -H, the GPU or a V4L2 video decoder decodes instead, and its frames
+// go on screen as they are: no colour conversion, no copy (see HARDWARE
+// DECODING below). Without hardware for the stream, decoding falls back to
+// the CPU.
+//
+// With -P, decoding and display run on separate threads, with a queue of
+// decoded frames between them (see PIPELINED PLAYBACK below).
+//
+// With -z, sws_scale writes each frame straight into the mapped DRM buffer
+// instead of a separate RGB frame that is then copied over pixel by pixel.
+//
+// With an audio stream, the sound card (ALSA) is the clock that frames are
+// timed by; frames that are late anyway are dropped (see AUDIO OUTPUT AND
+// MASTER CLOCK below). -A plays without audio.
+//
+// Local files are read through mmap() with read-ahead, and a demux thread
+// keeps packets queued ahead of the decoder (see INPUT and PREFETCH below).
+// -s starts at a given time, via the keyframe index.
+//
+// With -O, an overlay plane scales the video to the screen instead of
+// sws_scale (see OVERLAY PLANE SCALING below).
+//
+// Frames are drawn into a back buffer and page-flipped on screen at the
+// vblank nearest their PTS (see drm_present.h); -b 1 draws on screen.
+//
+// At exit, the time frames took - converting, copying, waiting for the
+// flip, and the whole - is printed (see frame_prof.h). -B is a benchmark:
+// no display, no audio, no waiting for frames' times, just decoding and
+// drawing into buffers in memory as fast as possible.
+//
+// The display is the first connected output, or the one -o names, at its
+// preferred mode or the one -m asks for (see drm_display.h); only that one
+// output is driven. A mode whose
+// refresh rate matches the video's, e.g. -m 1920x1080@23.976, shows every
+// frame for the same time.
+//
 // Compile:
-//   gcc -o simple_video_player simple_video_player.c \
-//       -lavformat -lavcodec -lavutil -lswscale -ldrm -lm
+//   gcc -o simple_video_player simple_video_player.c drm_display.c drm_present.c fb_blit.c frame_prof.c -lavformat -lavcodec -lavutil -lswscale -lswresample -ldrm -lasound -lm -pthread
 //
 // Run:
-//   sudo ./simple_video_player video.mp4
+//   sudo ./simple_video_player [-P] [-z] [-b buffers] [-H hwaccel] [-O] [-A] [-s seconds] [-B]
+//       [-o output] [-m mode] video.mp4
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <alsa/asoundlib.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "drm_display.h"
+#include "drm_present.h"
+#include "fb_blit.h"
+#include "frame_prof.h"
 
 // FFmpeg headers
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
 #include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
 
 // =============================================================================
 // GLOBAL STATE
 // =============================================================================
 
 // DRM/Display state
-int drm_fd = -1;
-uint32_t *framebuffer = NULL;
-uint32_t fb_handle = 0;
-uint32_t fb_id = 0;
-uint64_t fb_size = 0;
+struct drm_display display = {.fd = -1};
+struct drm_display_want want;   // -o and -m
+int drm_fd = -1;                // display.fd, for importing frames
+struct drm_presenter presenter;
+uint32_t *framebuffer = NULL;  // The buffer being drawn (see drm_present.h)
+uint32_t fb_pitch = 0;      // Bytes per framebuffer row: may be more than width * 4
 int screen_width = 1920;
 int screen_height = 1080;
 
@@ -47,8 +99,43 @@ AVPacket *packet = NULL;
 struct SwsContext *sws_ctx = NULL;
 int video_stream_index = -1;
 
+// Audio state
+AVCodecContext *audio_ctx = NULL;
+SwrContext *swr_ctx = NULL;
+snd_pcm_t *pcm = NULL;
+int audio_stream_index = -1;
+
+// Hardware decoding state (-H)
+AVBufferRef *hw_device_ctx = NULL;
+enum AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;  // Frames the hardware decodes into
+int hw_direct = 0;          // Show them as they are, instead of copying them back
+AVFrame *sw_frame = NULL;   // A hardware frame copied back for sws_scale
+
+// Overlay plane state (-O)
+#define OVERLAY_BUFFERS 2   // drmModeSetPlane() returns once the new one is on screen
+uint32_t overlay_plane = 0;
+int overlay_x, overlay_y, overlay_w, overlay_h;  // Where the video goes on screen
+struct drm_buffer overlay_bufs[OVERLAY_BUFFERS];
+int overlay_next = 0;
+
 // Timing
 double video_start_time = 0.0;
+double frame_duration = 1.0 / 30;  // Seconds per frame, from the stream's frame rate
+
+// Options
+int zero_copy = 0;          // -z: scale straight into the framebuffer
+int num_buffers = 2;        // -b: framebuffers to flip between (1: draw on screen)
+const char *hwaccel = NULL; // -H: "auto", "vaapi", "drm" or "v4l2m2m"
+int use_overlay = 0;        // -O: let an overlay plane scale the video
+int scale_flags = SWS_BILINEAR;  // How sws_scale scales to the screen
+int no_audio = 0;           // -A: play without audio
+double start_pts = 0.0;     // -s: where to start, in seconds
+int benchmark = 0;          // -B: draw offscreen, as fast as possible
+
+// Where each frame's time goes (see frame_prof.h)
+static struct frame_prof prof;
+
+#define FRAME_QUEUE_SIZE 8  // -P: decoded frames queued for display
 
 // =============================================================================
 // UTILITY FUNCTIONS
@@ -61,9 +148,12 @@ double get_time() {
     return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// Sleep for a specific duration
-void sleep_ms(int milliseconds) {
-    usleep(milliseconds * 1000);
+// Sleep until get_time() reaches t: to the microsecond, not the whole
+// millisecond
+void sleep_until(double t) {
+    struct timespec ts = {.tv_sec = (time_t)t, .tv_nsec = (long)((t - (time_t)t) * 1e9)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
 }
 
 // =============================================================================
@@ -73,104 +163,544 @@ void sleep_ms(int milliseconds) {
 int setup_drm() {
     printf("=== Setting up DRM/KMS ===\n");
 
-    // Step 1: Open DRM device
-    printf("Opening DRM device...\n");
-    drm_fd = open("/dev/dri/card1", O_RDWR);
-    if (drm_fd < 0) {
-        perror("Cannot open /dev/dri/card1");
+    // Steps 1-3: Open the DRM device, find a connected display, its CRTC
+    // and mode (see drm_display.c). The video plays on one output: -o
+    // picks which, and the others are left as they are.
+    want.max_outputs = 1;
+    if (drm_display_open(&display, &want) < 0) {
         return -1;
     }
-    printf("✓ DRM device opened (fd=%d)\n", drm_fd);
+    struct drm_output *output = &display.outputs[0];
+    drm_fd = display.fd;
+    printf("✓ %s: %s, %s modesetting\n", display.device, output->name,
+           display.atomic ? "atomic" : "legacy");
 
-    // Step 2: Get display resources
-    drmModeRes *resources = drmModeGetResources(drm_fd);
-    if (!resources) {
-        perror("Cannot get DRM resources");
+    // Get display resolution
+    screen_width = output->mode.hdisplay;
+    screen_height = output->mode.vdisplay;
+    printf("✓ Display: %dx%d @ %.2fHz\n", screen_width, screen_height, output->refresh);
+
+    // Steps 4-7: Create the framebuffers, map them and set the display
+    // mode (see drm_present.c)
+    if (drm_present_init(&presenter, &display, output, num_buffers) < 0) {
         return -1;
     }
-    printf("✓ Found %d connectors\n", resources->count_connectors);
+    printf("✓ %d framebuffer%s created: %.2f MB each, pitch %u\n", presenter.count,
+           presenter.count > 1 ? "s" : "", presenter.bufs[0].size / 1024.0 / 1024.0,
+           presenter.bufs[0].pitch);
+    printf("✓ Display mode set - ready to render!\n\n");
+    return 0;
+}
+
+void cleanup_drm() {
+    drm_present_free(&presenter);
+    drm_display_close(&display);
+    drm_fd = -1;
+}
+
+// =============================================================================
+// HARDWARE DECODING (-H)
+// =============================================================================
+//
+// Decoding 4K on the CPU takes most of the CPU, and converting the result
+// from YUV to RGB and copying it to the framebuffer takes much of the rest.
+// Most machines have a video decoder in hardware, though, and a display
+// controller that reads YUV itself:
+//
+//   hardware decoder       -> NV12 frame (Y plane, then interleaved UV) in
+//        |                    video memory
+//        v
+//   av_hwframe_map()       -> exported as DMA-BUF file descriptors
+//        |                    (AV_PIX_FMT_DRM_PRIME)
+//        v
+//   drmPrimeFDToHandle()   -> the same memory, as buffers on our DRM device
+//        |
+//        v
+//   drmModeAddFB2()        -> an NV12 framebuffer of those buffers
+//        |
+//        v
+//   drm_present_flip_fb()  -> on screen, without the CPU touching a pixel
+//
+// -H picks the hardware:
+//   vaapi                - Intel and AMD GPUs (libva)
+//   v4l2request, drm     - V4L2 stateless decoders on ARM SoCs (the request
+//                          API), in FFmpeg builds that have them
+//   v4l2m2m              - V4L2 stateful (mem2mem) decoders on ARM SoCs,
+//                          e.g. h264_v4l2m2m
+//   auto                 - the first of these that works
+//
+// The display shows the frame as it is, unscaled, so that takes a video of
+// the screen's size, a primary plane that reads NV12, and page flips (-b 2
+// or 3). Otherwise the hardware still decodes, but frames are copied back
+// to memory (av_hwframe_transfer_data()) and go through sws_scale as before.
+
+// Imported frames on screen, waiting for their flip, or just replaced:
+// frame n's framebuffer is free once frame n + 2 is flipped (see
+// drm_present_flip_fb()), so it can be reused for frame n + 3
+#define PRIME_FBS 3
+
+struct prime_fb {
+    AVFrame *frame;             // Holds the decoder's surface until it is off screen
+    uint32_t fb_id;
+};
+
+struct prime_fb prime_fbs[PRIME_FBS];
+int prime_next = 0;
+
+// Find a hardware decoder for codec id on the hardware named name (see
+// above), and set hw_pix_fmt to what it decodes into. Returns NULL if
+// there is none here.
+const AVCodec *find_hw_decoder(enum AVCodecID id, const char *name) {
+    if (strcmp(name, "v4l2m2m") == 0) {
+        // A decoder of its own, which opens /dev/videoN itself. It hands
+        // out DMA-BUFs when asked for DRM_PRIME frames.
+        char m2m_name[64];
+        snprintf(m2m_name, sizeof(m2m_name), "%s_v4l2m2m", avcodec_get_name(id));
+        const AVCodec *codec = avcodec_find_decoder_by_name(m2m_name);
+        if (codec) {
+            hw_pix_fmt = AV_PIX_FMT_DRM_PRIME;
+        }
+        return codec;
+    }
 
-    // Step 3: Find connected display
-    drmModeConnector *connector = NULL;
-    for (int i = 0; i < resources->count_connectors; i++) {
-        connector = drmModeGetConnector(drm_fd, resources->connectors[i]);
-        if (connector->connection == DRM_MODE_CONNECTED) {
-            printf("✓ Found connected display\n");
+    // The software decoder, with a hwaccel for this type of device
+    enum AVHWDeviceType type = av_hwdevice_find_type_by_name(name);
+    const AVCodec *codec = avcodec_find_decoder(id);
+    if (type == AV_HWDEVICE_TYPE_NONE || !codec) {
+        return NULL;
+    }
+    for (int i = 0;; i++) {
+        const AVCodecHWConfig *config = avcodec_get_hw_config(codec, i);
+        if (!config) {
+            return NULL;  // The codec has no hwaccel for it
+        }
+        if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) &&
+            config->device_type == type) {
+            hw_pix_fmt = config->pix_fmt;
             break;
         }
-        drmModeFreeConnector(connector);
-        connector = NULL;
     }
 
-    if (!connector) {
-        fprintf(stderr, "No connected display\n");
-        return -1;
+    // Open the device: the default one (the first render node) will do
+    if (av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0) < 0) {
+        hw_pix_fmt = AV_PIX_FMT_NONE;
+        return NULL;
+    }
+    return codec;
+}
+
+// The decoder offers the formats it can decode this stream into, best
+// first; the hardware one is only there if the hardware can decode it
+enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *formats) {
+    for (const enum AVPixelFormat *f = formats; *f != AV_PIX_FMT_NONE; f++) {
+        if (*f == hw_pix_fmt) {
+            return *f;
+        }
     }
+    if (hw_pix_fmt != AV_PIX_FMT_NONE) {
+        fprintf(stderr, "Hardware can't decode this stream, decoding on the CPU\n");
+    }
+    return avcodec_default_get_format(ctx, formats);
+}
 
-    // Get display resolution
-    drmModeModeInfo mode = connector->modes[0];
-    screen_width = mode.hdisplay;
-    screen_height = mode.vdisplay;
-    printf("✓ Display: %dx%d @ %dHz\n", screen_width, screen_height, mode.vrefresh);
-
-    // Step 4: Create framebuffer
-    struct drm_mode_create_dumb create_dumb = {
-        .width = screen_width,
-        .height = screen_height,
-        .bpp = 32,
-    };
-
-    if (drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb) < 0) {
-        perror("Cannot create dumb buffer");
-        return -1;
+// Register a DRM_PRIME frame's DMA-BUFs as one framebuffer
+int import_prime_frame(const AVFrame *prime, uint32_t *fb_id) {
+    const AVDRMFrameDescriptor *desc = (const AVDRMFrameDescriptor *)prime->data[0];
+    uint32_t object_handles[AV_DRM_MAX_PLANES] = {0};
+    uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+    uint64_t modifiers[4] = {0};
+    int planes = 0;
+    int ret = -1;
+
+    // SYSCALL: ioctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, ...)
+    // Each DMA-BUF becomes a buffer on our device, sharing its memory
+    for (int i = 0; i < desc->nb_objects; i++) {
+        if (drmPrimeFDToHandle(drm_fd, desc->objects[i].fd, &object_handles[i]) != 0) {
+            perror("Cannot import DMA-BUF");
+            goto out;
+        }
     }
 
-    fb_handle = create_dumb.handle;
-    fb_size = create_dumb.size;
-    printf("✓ Framebuffer created: %.2f MB\n", fb_size / 1024.0 / 1024.0);
+    // NV12 comes as one layer of two planes, or (from VAAPI, depending on
+    // the version) as a layer of Y (R8) and a layer of UV (GR88)
+    uint32_t format = desc->layers[0].format;
+    if (desc->nb_layers == 2 && desc->layers[0].format == DRM_FORMAT_R8 &&
+        desc->layers[1].format == DRM_FORMAT_GR88) {
+        format = DRM_FORMAT_NV12;
+    } else if (desc->nb_layers != 1) {
+        fprintf(stderr, "Cannot import a frame of %d layers\n", desc->nb_layers);
+        goto out;
+    }
+    for (int l = 0; l < desc->nb_layers; l++) {
+        for (int p = 0; p < desc->layers[l].nb_planes && planes < 4; p++, planes++) {
+            const AVDRMPlaneDescriptor *plane = &desc->layers[l].planes[p];
+            handles[planes] = object_handles[plane->object_index];
+            pitches[planes] = plane->pitch;
+            offsets[planes] = plane->offset;
+            modifiers[planes] = desc->objects[plane->object_index].format_modifier;
+        }
+    }
 
-    // Step 5: Add framebuffer
-    uint32_t pitch = create_dumb.pitch;
-    if (drmModeAddFB(drm_fd, screen_width, screen_height, 24, 32,
-                     pitch, fb_handle, &fb_id)) {
-        perror("Cannot add framebuffer");
-        return -1;
+    // SYSCALL: ioctl(drm_fd, DRM_IOCTL_MODE_ADDFB2, ...)
+    // The modifier says how the decoder laid the pixels out (linear, or
+    // tiled the way the GPU likes); the display needs to read them that way
+    uint32_t flags = modifiers[0] != DRM_FORMAT_MOD_INVALID ? DRM_MODE_FB_MODIFIERS : 0;
+    if (drmModeAddFB2WithModifiers(drm_fd, prime->width, prime->height, format,
+                                   handles, pitches, offsets, flags ? modifiers : NULL,
+                                   fb_id, flags) != 0) {
+        perror("Cannot add NV12 framebuffer");
+        goto out;
     }
-    printf("✓ Framebuffer registered (fb_id=%u)\n", fb_id);
+    ret = 0;
+
+out:
+    // The framebuffer holds on to the buffers itself
+    for (int i = 0; i < desc->nb_objects; i++) {
+        if (object_handles[i]) {
+            struct drm_gem_close gem_close = {.handle = object_handles[i]};
+            drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+        }
+    }
+    return ret;
+}
+
+void release_prime_fb(struct prime_fb *fb) {
+    if (fb->fb_id) {
+        drmModeRmFB(drm_fd, fb->fb_id);
+        fb->fb_id = 0;
+    }
+    av_frame_unref(fb->frame);  // The decoder may reuse the surface now
+}
 
-    // Step 6: Map framebuffer to userspace
-    struct drm_mode_map_dumb map_dumb = {.handle = fb_handle};
-    if (drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb)) {
-        perror("Cannot get mmap offset");
+// Put a hardware frame on screen as it is at time when. Returns when it is
+// expected there, or -1 if the display can't take it.
+double present_prime_frame(AVFrame *hw_frame, double when) {
+    struct prime_fb *fb = &prime_fbs[prime_next];
+    prime_next = (prime_next + 1) % PRIME_FBS;
+    release_prime_fb(fb);  // Off screen by now (see PRIME_FBS)
+
+    // VAAPI frames are exported as DMA-BUFs; V4L2 ones are DMA-BUFs already
+    int ret;
+    if (hw_frame->format == AV_PIX_FMT_DRM_PRIME) {
+        ret = av_frame_ref(fb->frame, hw_frame);
+    } else {
+        fb->frame->format = AV_PIX_FMT_DRM_PRIME;
+        ret = av_hwframe_map(fb->frame, hw_frame, AV_HWFRAME_MAP_READ);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Cannot export frame as DMA-BUF\n");
+        release_prime_fb(fb);
         return -1;
     }
 
-    framebuffer = mmap(NULL, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                       drm_fd, map_dumb.offset);
-    if (framebuffer == MAP_FAILED) {
-        perror("Cannot mmap framebuffer");
+    if (import_prime_frame(fb->frame, &fb->fb_id) < 0) {
+        release_prime_fb(fb);
         return -1;
     }
-    printf("✓ Framebuffer mapped at %p\n", framebuffer);
+    double shown;
+    if (overlay_plane) {
+        shown = drm_present_plane(&presenter, overlay_plane, fb->fb_id,
+                                  fb->frame->width, fb->frame->height,
+                                  overlay_x, overlay_y, overlay_w, overlay_h, when);
+    } else {
+        shown = drm_present_flip_fb(&presenter, fb->fb_id, when);
+    }
+    if (shown < 0) {
+        release_prime_fb(fb);
+    }
+    return shown;
+}
+
+// Find the hardware decoder -H asks for, and whether the display can show
+// its frames as they are. Returns the decoder, or NULL to decode on the CPU.
+const AVCodec *setup_hwaccel(const AVCodecParameters *codecpar) {
+    static const char *const auto_order[] = {"vaapi", "v4l2request", "drm", "v4l2m2m"};
+    const AVCodec *codec = NULL;
+
+    if (strcmp(hwaccel, "auto") == 0) {
+        for (int i = 0; i < 4 && !codec; i++) {
+            codec = find_hw_decoder(codecpar->codec_id, auto_order[i]);
+        }
+    } else {
+        codec = find_hw_decoder(codecpar->codec_id, hwaccel);
+    }
+    if (!codec) {
+        fprintf(stderr, "No hardware decoder (%s) for %s, decoding on the CPU\n",
+                hwaccel, avcodec_get_name(codecpar->codec_id));
+        return NULL;
+    }
+
+    hw_direct = overlay_plane ||
+                (presenter.count > 1 &&
+                 codecpar->width == screen_width && codecpar->height == screen_height &&
+                 drm_present_can_show(&presenter, DRM_FORMAT_NV12));
+    if (!hw_direct && hw_pix_fmt == AV_PIX_FMT_DRM_PRIME) {
+        // V4L2 mem2mem frames can't be copied back: have it decode into
+        // memory instead
+        hw_pix_fmt = AV_PIX_FMT_NONE;
+    }
+
+    printf("✓ Hardware decoder: %s, frames %s\n", codec->name,
+           hw_direct ? "shown as NV12 framebuffers" : "copied back for scaling");
+    return codec;
+}
+
+void cleanup_hwaccel() {
+    drm_present_wait(&presenter);  // Nothing is removed while waiting to go on screen
+    for (int i = 0; i < PRIME_FBS; i++) {
+        if (prime_fbs[i].frame) {
+            release_prime_fb(&prime_fbs[i]);
+            av_frame_free(&prime_fbs[i].frame);
+        }
+    }
+    if (sw_frame) av_frame_free(&sw_frame);
+    av_buffer_unref(&hw_device_ctx);
+}
+
+// =============================================================================
+// OVERLAY PLANE SCALING (-O)
+// =============================================================================
+//
+// Scaling 1080p to a 4K screen with sws_scale means computing 8 million
+// RGB pixels per frame on the CPU, and writing 32 MB. The display
+// controller can do it for free: an overlay plane scans out a framebuffer
+// of any size scaled to a rectangle of the screen, and reads YUV itself.
+// The CPU's part shrinks to handing it the frame in NV12:
+//
+//   hardware frames (-H)  -> imported as they are (see HARDWARE DECODING)
+//   software frames       -> YUV420P to NV12 at the video's size: no
+//                            scaling, just interleaving U and V
+//
+// Without a plane that reads NV12 (or one that turns the frames down, for
+// scaling too much, say), the CPU scales as before, with swscale's fast
+// bilinear path, which has SIMD code for x86 and ARM.
+
+void fall_back_to_cpu_scaling() {
+    overlay_plane = 0;
+    scale_flags = SWS_FAST_BILINEAR;
+}
+
+// Find an overlay plane for a width x height video, and NV12 buffers for
+// it to show
+void setup_overlay(int width, int height) {
+    overlay_plane = drm_present_find_overlay(&presenter, DRM_FORMAT_NV12);
+    if (!overlay_plane) {
+        fprintf(stderr, "No overlay plane for NV12, scaling on the CPU\n");
+        fall_back_to_cpu_scaling();
+        return;
+    }
+
+    // Fit the video to the screen, keeping its shape
+    overlay_w = screen_width;
+    overlay_h = (int)((int64_t)screen_width * height / width);
+    if (overlay_h > screen_height) {
+        overlay_h = screen_height;
+        overlay_w = (int)((int64_t)screen_height * width / height);
+    }
+    overlay_x = (screen_width - overlay_w) / 2;
+    overlay_y = (screen_height - overlay_h) / 2;
 
-    // Step 7: Set display mode
-    uint32_t crtc_id = resources->crtcs[0];
-    if (drmModeSetCrtc(drm_fd, crtc_id, fb_id, 0, 0,
-                       &connector->connector_id, 1, &mode)) {
-        perror("Cannot set CRTC");
+    for (int i = 0; i < OVERLAY_BUFFERS; i++) {
+        if (drm_buffer_create(drm_fd, width, height, DRM_FORMAT_NV12, &overlay_bufs[i]) < 0) {
+            fall_back_to_cpu_scaling();
+            return;
+        }
+    }
+    printf("✓ Overlay plane %u: %dx%d scaled to %dx%d at %d,%d\n", overlay_plane,
+           width, height, overlay_w, overlay_h, overlay_x, overlay_y);
+}
+
+void cleanup_overlay() {
+    if (overlay_plane) {
+        drm_present_plane(&presenter, overlay_plane, 0, 0, 0, 0, 0, 0, 0, 0);
+    }
+    for (int i = 0; i < OVERLAY_BUFFERS; i++) {
+        drm_buffer_destroy(drm_fd, &overlay_bufs[i]);
+    }
+}
+
+// Convert a frame in memory to NV12 in an overlay buffer, and show it on
+// the plane at time when. Returns when it is expected there, or -1.
+double draw_overlay_frame(AVFrame *decoded, double when) {
+    struct drm_buffer *b = &overlay_bufs[overlay_next];
+    overlay_next = (overlay_next + 1) % OVERLAY_BUFFERS;
+
+    // Same size in and out: the scaler only converts
+    sws_ctx = sws_getCachedContext(sws_ctx,
+        codec_ctx->width, codec_ctx->height, decoded->format,
+        codec_ctx->width, codec_ctx->height, AV_PIX_FMT_NV12,
+        SWS_POINT, NULL, NULL, NULL);
+    if (!sws_ctx) {
+        fprintf(stderr, "Cannot create NV12 converter\n");
         return -1;
     }
-    printf("✓ Display mode set - ready to render!\n\n");
+    uint8_t *dst[4] = {(uint8_t *)b->map, (uint8_t *)b->map + b->pitch * codec_ctx->height};
+    int dst_stride[4] = {(int)b->pitch, (int)b->pitch};
+    sws_scale(sws_ctx, (const uint8_t * const*)decoded->data, decoded->linesize,
+              0, codec_ctx->height, dst, dst_stride);
+    frame_prof_mark(&prof, FRAME_STAGE_SCALE);
+
+    double shown = drm_present_plane(&presenter, overlay_plane, b->fb_id,
+                                     codec_ctx->width, codec_ctx->height,
+                                     overlay_x, overlay_y, overlay_w, overlay_h, when);
+    frame_prof_mark(&prof, FRAME_STAGE_FLIP);
+    return shown;
+}
 
-    drmModeFreeConnector(connector);
-    drmModeFreeResources(resources);
-    return 0;
+// =============================================================================
+// INPUT: MEMORY-MAPPED FILE WITH READ-AHEAD
+// =============================================================================
+//
+// avformat_open_input() reads a file with read() calls of 32 KB, each one
+// waiting for the disk - or, on network storage, for a round trip - only
+// when the demuxer needs the data. For local files we give it our own
+// AVIOContext instead:
+//
+// - The file is mmap()ed, so a read is a memcpy from the page cache.
+// - READAHEAD_SIZE ahead of the demuxer, madvise(MADV_WILLNEED) has the
+//   kernel fetch the next stretch in the background, so it is there when
+//   the demuxer gets to it.
+// - Where mmap() doesn't work (a 32-bit process and a file of several GB,
+//   some FUSE file systems), pread() with posix_fadvise(POSIX_FADV_WILLNEED)
+//   does the same.
+//
+// Anything else (a pipe, a URL) goes through FFmpeg's own I/O, as before.
+
+#define IO_BUFFER_SIZE (256 * 1024)        // What the demuxer reads at a time
+#define READAHEAD_SIZE (8 * 1024 * 1024)    // How far ahead the kernel fetches
+
+struct input_file {
+    int fd;
+    const uint8_t *map;         // The whole file, or NULL: pread()
+    int64_t size;
+    int64_t pos;                // Where the demuxer reads next
+    int64_t advised;            // Read-ahead asked for up to here
+};
+
+struct input_file input = {.fd = -1};
+AVIOContext *input_avio = NULL;
+
+// Keep the kernel READAHEAD_SIZE ahead of the demuxer, asking for half of
+// it at a time
+void input_readahead(struct input_file *in) {
+    if (in->advised >= in->size || in->pos + READAHEAD_SIZE / 2 < in->advised) {
+        return;
+    }
+    int64_t start = in->advised > in->pos ? in->advised : in->pos;
+    start &= ~(int64_t)(sysconf(_SC_PAGESIZE) - 1);  // madvise() wants page alignment
+    int64_t len = in->pos + READAHEAD_SIZE - start;
+    if (start + len > in->size) {
+        len = in->size - start;
+    }
+    if (in->map) {
+        madvise((void *)(in->map + start), len, MADV_WILLNEED);
+    } else {
+        posix_fadvise(in->fd, start, len, POSIX_FADV_WILLNEED);
+    }
+    in->advised = start + len;
 }
 
-void cleanup_drm() {
-    if (framebuffer) munmap(framebuffer, fb_size);
-    if (fb_id) drmModeRmFB(drm_fd, fb_id);
-    if (drm_fd >= 0) close(drm_fd);
+int input_read(void *opaque, uint8_t *buf, int buf_size) {
+    struct input_file *in = opaque;
+    if (in->pos >= in->size) {
+        return AVERROR_EOF;
+    }
+    input_readahead(in);
+
+    int n = in->size - in->pos < buf_size ? (int)(in->size - in->pos) : buf_size;
+    if (in->map) {
+        memcpy(buf, in->map + in->pos, n);
+    } else {
+        n = pread(in->fd, buf, n, in->pos);
+        if (n < 0) {
+            return AVERROR(errno);
+        }
+        if (n == 0) {
+            return AVERROR_EOF;
+        }
+    }
+    in->pos += n;
+    return n;
+}
+
+int64_t input_seek(void *opaque, int64_t offset, int whence) {
+    struct input_file *in = opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return in->size;
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = in->pos + offset;
+        break;
+    case SEEK_END:
+        pos = in->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > in->size) {
+        return AVERROR(EINVAL);
+    }
+    // Read-ahead starts over from the new position (an index at the end
+    // of the file, or a seek)
+    in->pos = pos;
+    in->advised = pos;
+    return pos;
+}
+
+void close_input() {
+    if (input_avio) {
+        av_freep(&input_avio->buffer);
+        avio_context_free(&input_avio);
+    }
+    if (input.map) munmap((void *)input.map, input.size);
+    if (input.fd >= 0) close(input.fd);
+    input.map = NULL;
+    input.fd = -1;
+}
+
+// Set up our I/O for filename if it is a regular file. Returns 0, or -1 to
+// leave it to FFmpeg.
+int open_input(const char *filename) {
+    struct stat st;
+
+    input.fd = open(filename, O_RDONLY);
+    if (input.fd < 0 || fstat(input.fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        goto fail;
+    }
+    input.size = st.st_size;
+    input.pos = 0;
+    input.advised = 0;
+
+    // SYSCALL: mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+    // Pages are only read from the file when touched (or advised)
+    void *map = (size_t)st.st_size == (uint64_t)st.st_size ?
+                mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input.fd, 0) : MAP_FAILED;
+    input.map = map == MAP_FAILED ? NULL : map;
+    if (input.map) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    } else {
+        posix_fadvise(input.fd, 0, 0, POSIX_FADV_SEQUENTIAL);  // Doubles the kernel's read-ahead
+    }
+
+    uint8_t *buffer = av_malloc(IO_BUFFER_SIZE);
+    input_avio = buffer ? avio_alloc_context(buffer, IO_BUFFER_SIZE, 0, &input,
+                                             input_read, NULL, input_seek) : NULL;
+    if (!input_avio) {
+        av_free(buffer);
+        goto fail;
+    }
+    printf("✓ Reading through %s, %d MB read-ahead\n",
+           input.map ? "mmap" : "pread", READAHEAD_SIZE / (1024 * 1024));
+    return 0;
+
+fail:
+    close_input();
+    return -1;
 }
 
 // =============================================================================
@@ -180,15 +710,31 @@ void cleanup_drm() {
 int setup_ffmpeg(const char *filename) {
     printf("=== Setting up FFmpeg ===\n");
 
-    // Step 1: Open video file
+    // Step 1: Open video file (a local one through our own I/O, see INPUT)
     printf("Opening video file: %s\n", filename);
+    format_ctx = avformat_alloc_context();
+    if (!format_ctx) {
+        fprintf(stderr, "Cannot allocate format context\n");
+        return -1;
+    }
+    if (open_input(filename) == 0) {
+        format_ctx->pb = input_avio;
+        format_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
     if (avformat_open_input(&format_ctx, filename, NULL, NULL) < 0) {
         fprintf(stderr, "Cannot open video file\n");
         return -1;
     }
-    printf("✓ Video file opened\n");
-
-    // Step 2: Read stream info
+    printf("✓ Video file opened (%s)\n", format_ctx->iformat->long_name);
+
+    // Step 2: Read stream info. MP4 and Matroska headers describe the
+    // streams already, so a little probing fills in the rest; the default
+    // reads up to 5 MB and 5 s of the file first.
+    const char *container = format_ctx->iformat->name;
+    if (strstr(container, "mp4") || strstr(container, "matroska")) {
+        format_ctx->probesize = 1024 * 1024;
+        format_ctx->max_analyze_duration = AV_TIME_BASE / 2;
+    }
     if (avformat_find_stream_info(format_ctx, NULL) < 0) {
         fprintf(stderr, "Cannot find stream info\n");
         return -1;
@@ -216,8 +762,17 @@ int setup_ffmpeg(const char *filename) {
     printf("  - FPS: %.2f\n",
            av_q2d(format_ctx->streams[video_stream_index]->r_frame_rate));
 
-    // Step 5: Find decoder
-    const AVCodec *codec = avcodec_find_decoder(codecpar->codec_id);
+    // With -O, find an overlay plane to scale the video (see OVERLAY PLANE
+    // SCALING); hardware frames can go there whatever their size
+    if (use_overlay) {
+        setup_overlay(codecpar->width, codecpar->height);
+    }
+
+    // Step 5: Find decoder (with -H, a hardware one if there is one)
+    const AVCodec *codec = hwaccel ? setup_hwaccel(codecpar) : NULL;
+    if (!codec) {
+        codec = avcodec_find_decoder(codecpar->codec_id);
+    }
     if (!codec) {
         fprintf(stderr, "Codec not supported\n");
         return -1;
@@ -236,19 +791,40 @@ int setup_ffmpeg(const char *filename) {
         return -1;
     }
 
+    // Decode on every core: frame threads work on several frames at once,
+    // slice threads split up one frame (streams coded in several slices)
+    codec_ctx->thread_count = 0;  // 0 = one per core
+    codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    if (hw_device_ctx) {
+        codec_ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+        // Frames on screen and in -P's queue keep their surfaces from the
+        // decoder, which would run out of them otherwise
+        codec_ctx->extra_hw_frames = PRIME_FBS + FRAME_QUEUE_SIZE;
+    }
+    codec_ctx->get_format = get_hw_format;
+
     // Step 7: Open codec
     if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
         fprintf(stderr, "Cannot open codec\n");
         return -1;
     }
-    printf("✓ Codec opened\n");
+    printf("✓ Codec opened (%d threads, %s)\n", codec_ctx->thread_count,
+           codec_ctx->active_thread_type == FF_THREAD_FRAME ? "frame threading" :
+           codec_ctx->active_thread_type == FF_THREAD_SLICE ? "slice threading" : "no threading");
 
     // Step 8: Allocate frames
     frame = av_frame_alloc();
     frame_rgb = av_frame_alloc();
     packet = av_packet_alloc();
+    sw_frame = av_frame_alloc();
+    int prime_frames = 0;
+    for (int i = 0; i < PRIME_FBS; i++) {
+        prime_fbs[i].frame = av_frame_alloc();
+        prime_frames += prime_fbs[i].frame != NULL;
+    }
 
-    if (!frame || !frame_rgb || !packet) {
+    if (!frame || !frame_rgb || !packet || !sw_frame || prime_frames < PRIME_FBS) {
         fprintf(stderr, "Cannot allocate frames\n");
         return -1;
     }
@@ -264,7 +840,7 @@ int setup_ffmpeg(const char *filename) {
     sws_ctx = sws_getContext(
         codec_ctx->width, codec_ctx->height, codec_ctx->pix_fmt,
         screen_width, screen_height, AV_PIX_FMT_RGB32,
-        SWS_BILINEAR, NULL, NULL, NULL);
+        scale_flags, NULL, NULL, NULL);
 
     if (!sws_ctx) {
         fprintf(stderr, "Cannot create scaler\n");
@@ -278,12 +854,15 @@ int setup_ffmpeg(const char *filename) {
 }
 
 void cleanup_ffmpeg() {
+    cleanup_overlay();
+    cleanup_hwaccel();
     if (sws_ctx) sws_freeContext(sws_ctx);
     if (frame) av_frame_free(&frame);
     if (frame_rgb) av_frame_free(&frame_rgb);
     if (packet) av_packet_free(&packet);
     if (codec_ctx) avcodec_free_context(&codec_ctx);
     if (format_ctx) avformat_close_input(&format_ctx);
+    close_input();  // After the demuxer: it may still read while closing
 }
 
 // =============================================================================
@@ -296,49 +875,639 @@ void render_frame_to_framebuffer(AVFrame *rgb_frame) {
     uint32_t *src = (uint32_t *)rgb_frame->data[0];
     int src_stride = rgb_frame->linesize[0] / 4;  // Convert bytes to pixels
 
-    // Center the video on screen if it's smaller
-    int offset_x = (screen_width - codec_ctx->width) / 2;
-    int offset_y = (screen_height - codec_ctx->height) / 2;
+    // sws has already scaled the frame to the screen size (setup_ffmpeg()).
+    // Copy line by line (framebuffer rows are fb_pitch bytes apart), with
+    // the SIMD copy of fb_blit.h
+    fb_copy_rect(framebuffer, fb_pitch / 4, src, src_stride, screen_width, screen_height);
+}
+
+// =============================================================================
+// AUDIO OUTPUT AND MASTER CLOCK
+// =============================================================================
+//
+// Whoever watches a video notices audio running even 50 ms off the
+// picture, and the sound card plays at whatever rate its crystal gives it,
+// not quite the system clock's: timed by get_time() alone, the two drift
+// apart by seconds over a film. So with an audio stream, the sound card is
+// the clock:
+//
+//   demuxer -> audio packet queue -> audio thread: decode, resample to
+//                                    stereo S16, snd_pcm_writei()
+//   media time now = PTS of the last sample written
+//                    - what ALSA still has queued (snd_pcm_delay())
+//
+// The video frames go on screen when that clock reaches their PTS. Without
+// audio (or with -A), media time runs from the start of playback by
+// get_time(), as before.
+//
+// A frame that is more than a frame late when it is ready is dropped, as
+// showing it would only make the ones after it late too. While frames are
+// late, the decoder skips work: first frames nothing refers to
+// (AVDISCARD_NONREF, B-frames mostly), then, further behind, everything
+// but keyframes.
+
+#define PACKET_QUEUE_SIZE 256       // Audio packets: a few seconds
+#define AUDIO_LATENCY_US 100000     // ALSA buffer: what can play without us
+
+// Media time is get_time() + clock_offset
+pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+double clock_offset = 0.0;
+int clock_from_audio = 0;           // clock_offset follows the sound card
+
+atomic_int frames_late = 0;         // How far the presenter is behind, in frames
+int frames_dropped = 0;
+int audio_failed = 0;               // ALSA gave up: the audio thread only empties the queue
+
+struct packet_queue {
+    AVPacket *packets[PACKET_QUEUE_SIZE];
+    int head;                   // Oldest packet
+    int count;
+    int finished;               // The demuxer is done: no more packets come
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+struct packet_queue audio_queue;
+pthread_t audio_thread_id;
+int audio_running = 0;
+atomic_int audio_dropped = 0;       // No audio thread to play them: audio packets are dropped
+
+int packet_queue_init(struct packet_queue *q) {
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    for (int i = 0; i < PACKET_QUEUE_SIZE; i++) {
+        q->packets[i] = av_packet_alloc();
+        if (!q->packets[i]) {
+            return -1;  // packet_queue_free() cleans up
+        }
+    }
+    return 0;
+}
+
+void packet_queue_free(struct packet_queue *q) {
+    for (int i = 0; i < PACKET_QUEUE_SIZE; i++) {
+        av_packet_free(&q->packets[i]);
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+// Queue a packet, waiting for room. Its data moves into the queue; src is
+// left blank.
+void packet_queue_push(struct packet_queue *q, AVPacket *src) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == PACKET_QUEUE_SIZE) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    av_packet_move_ref(q->packets[(q->head + q->count) % PACKET_QUEUE_SIZE], src);
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Take the oldest packet into dst, waiting for one. Returns -1 once the
+// demuxer has finished and the queue is empty.
+int packet_queue_pop(struct packet_queue *q, AVPacket *dst) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->finished) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    av_packet_move_ref(dst, q->packets[q->head]);
+    q->head = (q->head + 1) % PACKET_QUEUE_SIZE;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+void packet_queue_finish(struct packet_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->finished = 1;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Start media time at start_pts, now
+void start_clock() {
+    video_start_time = get_time();
+    pthread_mutex_lock(&clock_lock);
+    clock_offset = start_pts - video_start_time;
+    clock_from_audio = 0;
+    pthread_mutex_unlock(&clock_lock);
+}
+
+// When (get_time()) media time reaches pts
+double media_to_time(double pts) {
+    pthread_mutex_lock(&clock_lock);
+    double t = pts - clock_offset;
+    pthread_mutex_unlock(&clock_lock);
+    return t;
+}
+
+// The sound card says media time is media_now
+void audio_clock_update(double media_now) {
+    double offset = media_now - get_time();
+
+    pthread_mutex_lock(&clock_lock);
+    if (!clock_from_audio || fabs(offset - clock_offset) > 0.1) {
+        // The first reading, or after an underrun: take it as it is
+        clock_offset = offset;
+        clock_from_audio = 1;
+    } else {
+        // snd_pcm_delay() wobbles by a period or so between readings:
+        // follow the trend, so frame times don't wobble with it
+        clock_offset += (offset - clock_offset) * 0.05;
+    }
+    pthread_mutex_unlock(&clock_lock);
+}
+
+// How much to skip decoding, given how far behind the presenter is
+enum AVDiscard decode_skip(const AVPacket *pkt) {
+    int late = atomic_load_explicit(&frames_late, memory_order_relaxed);
+    enum AVDiscard skip = late > 8 ? AVDISCARD_NONKEY : late > 2 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
+    // Frames after skipped reference frames decode wrong: once skipping
+    // those, only stop at a keyframe
+    if (codec_ctx->skip_frame == AVDISCARD_NONKEY && skip < AVDISCARD_NONKEY &&
+        !(pkt->flags & AV_PKT_FLAG_KEY)) {
+        return AVDISCARD_NONKEY;
+    }
+    return skip;
+}
+
+// Find the audio stream, and open its decoder and the sound card. Returns
+// 0, or -1 if there is no audio to play (video then runs on get_time()).
+int setup_audio() {
+    printf("=== Setting up audio ===\n");
+    for (int i = 0; i < (int)format_ctx->nb_streams; i++) {
+        if (format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            audio_stream_index = i;
+            break;
+        }
+    }
+    if (audio_stream_index < 0) {
+        printf("No audio stream: timing video by the system clock\n\n");
+        return -1;
+    }
+
+    AVStream *stream = format_ctx->streams[audio_stream_index];
+    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    audio_ctx = codec ? avcodec_alloc_context3(codec) : NULL;
+    if (!audio_ctx || avcodec_parameters_to_context(audio_ctx, stream->codecpar) < 0 ||
+        avcodec_open2(audio_ctx, codec, NULL) < 0) {
+        fprintf(stderr, "Cannot open audio decoder\n");
+        goto fail;
+    }
+
+    // Resample to interleaved stereo S16 at the stream's rate: what every
+    // sound card takes
+    AVChannelLayout stereo;
+    av_channel_layout_default(&stereo, 2);
+    if (swr_alloc_set_opts2(&swr_ctx, &stereo, AV_SAMPLE_FMT_S16, audio_ctx->sample_rate,
+                            &audio_ctx->ch_layout, audio_ctx->sample_fmt,
+                            audio_ctx->sample_rate, 0, NULL) < 0 ||
+        swr_init(swr_ctx) < 0) {
+        fprintf(stderr, "Cannot create audio resampler\n");
+        goto fail;
+    }
+
+    // ALSA's default device: its plug layer converts to whatever the
+    // hardware takes
+    int err = snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
+    if (err == 0) {
+        err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+                                 2, audio_ctx->sample_rate, 1, AUDIO_LATENCY_US);
+    }
+    if (err < 0) {
+        fprintf(stderr, "Cannot open ALSA device: %s\n", snd_strerror(err));
+        goto fail;
+    }
+
+    if (packet_queue_init(&audio_queue) < 0) {
+        fprintf(stderr, "Cannot allocate audio packet queue\n");
+        packet_queue_free(&audio_queue);
+        goto fail;
+    }
+    printf("✓ Audio stream #%d: %s, %d Hz, to ALSA (the master clock)\n\n",
+           audio_stream_index, codec->long_name, audio_ctx->sample_rate);
+    return 0;
+
+fail:
+    fprintf(stderr, "Playing without audio: timing video by the system clock\n\n");
+    if (pcm) snd_pcm_close(pcm);
+    pcm = NULL;
+    if (swr_ctx) swr_free(&swr_ctx);
+    if (audio_ctx) avcodec_free_context(&audio_ctx);
+    audio_stream_index = -1;
+    return -1;
+}
+
+// Play one decoded audio frame. next_pts is where it starts if it has no
+// PTS of its own, and moves on to where it ends.
+void play_audio_frame(AVFrame *af, double *next_pts, uint8_t **buf, int *buf_samples) {
+    AVRational time_base = format_ctx->streams[audio_stream_index]->time_base;
+    int rate = audio_ctx->sample_rate;
 
-    // Copy line by line
-    for (int y = 0; y < screen_height && y < codec_ctx->height; y++) {
-        for (int x = 0; x < screen_width && x < codec_ctx->width; x++) {
-            int dst_idx = (y + offset_y) * screen_width + (x + offset_x);
-            int src_idx = y * src_stride + x;
+    if (audio_failed) {
+        return;
+    }
+    if (af->pts != AV_NOPTS_VALUE) {
+        *next_pts = af->pts * av_q2d(time_base);
+    }
+    if (*next_pts + (double)af->nb_samples / rate <= start_pts) {
+        return;  // Before -s's start: the video from there is not shown either
+    }
 
-            if (dst_idx >= 0 && dst_idx < screen_width * screen_height) {
-                framebuffer[dst_idx] = src[src_idx];
+    int max_samples = swr_get_out_samples(swr_ctx, af->nb_samples);
+    if (max_samples > *buf_samples) {
+        uint8_t *grown = realloc(*buf, (size_t)max_samples * 2 * sizeof(int16_t));
+        if (!grown) {
+            return;
+        }
+        *buf = grown;
+        *buf_samples = max_samples;
+    }
+    int samples = swr_convert(swr_ctx, buf, max_samples,
+                              (const uint8_t **)af->extended_data, af->nb_samples);
+
+    // SYSCALL: ioctl(pcm fd, SNDRV_PCM_IOCTL_WRITEI_FRAMES, ...)
+    // Blocks while ALSA's buffer is full: this is what paces the thread
+    int16_t *p = (int16_t *)*buf;
+    for (int left = samples; left > 0;) {
+        snd_pcm_sframes_t n = snd_pcm_writei(pcm, p, left);
+        if (n < 0) {
+            // An underrun (we were late) stops the device; start it again
+            if (snd_pcm_recover(pcm, (int)n, 1) < 0) {
+                fprintf(stderr, "Audio write failed: %s\n", snd_strerror((int)n));
+                audio_failed = 1;
+                return;
             }
+            continue;
+        }
+        p += n * 2;
+        left -= n;
+    }
+    *next_pts += (double)(samples > 0 ? samples : 0) / rate;
+
+    snd_pcm_sframes_t delay = 0;
+    if (snd_pcm_delay(pcm, &delay) == 0) {
+        audio_clock_update(*next_pts - (double)delay / rate);
+    }
+}
+
+// Audio thread: decode and play the queued packets
+void *audio_thread(void *arg) {
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *af = av_frame_alloc();
+    uint8_t *buf = NULL;
+    int buf_samples = 0;
+    double next_pts = 0.0;
+    (void)arg;
+
+    while (packet_queue_pop(&audio_queue, pkt) == 0) {
+        if (!af || avcodec_send_packet(audio_ctx, pkt) < 0) {
+            av_packet_unref(pkt);
+            continue;  // Keep emptying the queue, or the demuxer waits for ever
+        }
+        av_packet_unref(pkt);
+        while (avcodec_receive_frame(audio_ctx, af) == 0) {
+            play_audio_frame(af, &next_pts, &buf, &buf_samples);
+        }
+    }
+
+    if (af) {
+        avcodec_send_packet(audio_ctx, NULL);
+        while (avcodec_receive_frame(audio_ctx, af) == 0) {
+            play_audio_frame(af, &next_pts, &buf, &buf_samples);
+        }
+    }
+    snd_pcm_drain(pcm);  // Let the last of it play
+
+    free(buf);
+    av_frame_free(&af);
+    av_packet_free(&pkt);
+    return NULL;
+}
+
+void start_audio() {
+    if (audio_stream_index >= 0) {
+        audio_running = pthread_create(&audio_thread_id, NULL, audio_thread, NULL) == 0;
+        if (!audio_running) {
+            fprintf(stderr, "Cannot start audio thread\n");
+            atomic_store(&audio_dropped, 1);  // The demux thread still reads audio_stream_index
+        }
+    }
+}
+
+// Media time starts, and the audio with it, once the first video frame is
+// ready to show: otherwise the time the decoder takes to get going makes
+// the first frames late
+pthread_once_t playback_once = PTHREAD_ONCE_INIT;
+
+void start_playback_once() {
+    start_clock();
+    start_audio();
+}
+
+void start_playback() {
+    pthread_once(&playback_once, start_playback_once);
+}
+
+// Hand an audio packet to the audio thread. If the queue is full before
+// any video shows, there may be no video to wait for: start anyway. Without
+// an audio thread, nothing would ever make room: drop it.
+void queue_audio_packet(AVPacket *pkt) {
+    pthread_mutex_lock(&audio_queue.lock);
+    int full = audio_queue.count == PACKET_QUEUE_SIZE;
+    pthread_mutex_unlock(&audio_queue.lock);
+    if (full) {
+        start_playback();
+    }
+    if (atomic_load(&audio_dropped)) {
+        av_packet_unref(pkt);
+        return;
+    }
+    packet_queue_push(&audio_queue, pkt);
+}
+
+// The demuxer is done: wait for the audio to finish playing
+void finish_audio() {
+    start_playback();  // Audio-only, as far as we could decode
+    if (audio_running) {
+        packet_queue_finish(&audio_queue);
+        pthread_join(audio_thread_id, NULL);
+        audio_running = 0;
+    }
+}
+
+void cleanup_audio() {
+    if (!audio_ctx) {
+        return;
+    }
+    packet_queue_free(&audio_queue);
+    snd_pcm_close(pcm);
+    swr_free(&swr_ctx);
+    avcodec_free_context(&audio_ctx);
+}
+
+// =============================================================================
+// PREFETCH: THE DEMUX THREAD
+// =============================================================================
+//
+// av_read_frame() blocks whenever the data isn't there yet, and on network
+// storage that can be for a long time. The demuxer gets a thread of its
+// own, which reads ahead into bounded packet queues:
+//
+//   demux thread -> video packet queue -> decoder (playback loop, or -P's
+//                |                        decode thread)
+//                -> audio packet queue -> audio thread
+//
+// A stall of the storage then only shows once it outlasts what the queues
+// hold: up to PACKET_QUEUE_SIZE packets each, several seconds.
+
+struct packet_queue video_queue;
+pthread_t demux_thread_id;
+
+void *demux_thread(void *arg) {
+    AVPacket *pkt = av_packet_alloc();
+    (void)arg;
+
+    while (pkt && av_read_frame(format_ctx, pkt) >= 0) {
+        if (pkt->stream_index == video_stream_index) {
+            packet_queue_push(&video_queue, pkt);
+        } else if (pkt->stream_index == audio_stream_index) {
+            queue_audio_packet(pkt);
+        } else {
+            av_packet_unref(pkt);  // Subtitles, data streams
         }
     }
+
+    av_packet_free(&pkt);
+    packet_queue_finish(&video_queue);
+    if (audio_stream_index >= 0) {
+        packet_queue_finish(&audio_queue);
+    }
+    return NULL;
+}
+
+int start_demux() {
+    if (packet_queue_init(&video_queue) < 0) {
+        fprintf(stderr, "Cannot allocate packet queue\n");
+        packet_queue_free(&video_queue);
+        return -1;
+    }
+    if (pthread_create(&demux_thread_id, NULL, demux_thread, NULL) != 0) {
+        fprintf(stderr, "Cannot start demux thread\n");
+        packet_queue_free(&video_queue);
+        return -1;
+    }
+    return 0;
+}
+
+void stop_demux() {
+    pthread_join(demux_thread_id, NULL);
+    packet_queue_free(&video_queue);
+}
+
+// =============================================================================
+// SEEKING (-s)
+// =============================================================================
+//
+// Decoding can only start at a keyframe. The demuxer's index (an MP4's
+// sample table, a Matroska file's cues) lists them with their file
+// positions, so the start goes straight to the last keyframe before the
+// wanted time - no reading through the file to find one. The frames from
+// there up to the wanted time are decoded but not shown (present_frame()).
+
+int seek_to_start() {
+    AVStream *st = format_ctx->streams[video_stream_index];
+    int64_t ts = (int64_t)(start_pts / av_q2d(st->time_base));
+
+    int idx = av_index_search_timestamp(st, ts, AVSEEK_FLAG_BACKWARD);
+    if (idx >= 0) {
+        const AVIndexEntry *entry = avformat_index_get_entry(st, idx);
+        printf("✓ Keyframe %d of %d at %.3fs\n", idx, avformat_index_get_entries_count(st),
+               entry->timestamp * av_q2d(st->time_base));
+        ts = entry->timestamp;
+    }
+    // Without an index entry, the demuxer looks for one itself
+    if (av_seek_frame(format_ctx, video_stream_index, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        fprintf(stderr, "Cannot seek to %.3fs, playing from the start\n", start_pts);
+        start_pts = 0.0;
+        return -1;
+    }
+    printf("✓ Starting at %.3fs\n\n", start_pts);
+    return 0;
 }
 
 // =============================================================================
 // MAIN PLAYBACK LOOP
 // =============================================================================
 
-int play_video() {
-    printf("=== Starting Playback ===\n");
+// Convert a frame in memory to RGB in the back buffer, and flip it on
+// screen at time when. Returns when it is expected there, or -1.
+double draw_frame(AVFrame *decoded, double when) {
+    // The scaler is made again whenever the frames' format changes, e.g.
+    // once the first frame shows what a hardware decoder copies back
+    sws_ctx = sws_getCachedContext(sws_ctx,
+        codec_ctx->width, codec_ctx->height, decoded->format,
+        screen_width, screen_height, AV_PIX_FMT_RGB32,
+        scale_flags, NULL, NULL, NULL);
+    if (!sws_ctx) {
+        fprintf(stderr, "Cannot create scaler\n");
+        return -1;
+    }
 
-    video_start_time = get_time();
-    int frame_count = 0;
+    // Draw into the back buffer, once it is off screen
+    struct drm_buffer *back = drm_present_back(&presenter);
+    framebuffer = back->map;
+    fb_pitch = back->pitch;
+    frame_prof_mark(&prof, FRAME_STAGE_FLIP);
+
+    if (zero_copy) {
+        // Convert and scale straight into the scanout buffer: the scaler
+        // writes every pixel once, in order, which is what write-combined
+        // memory is good at
+        uint8_t *dst[4] = {(uint8_t *)framebuffer};
+        int dst_stride[4] = {(int)fb_pitch};
+        sws_scale(sws_ctx, (const uint8_t * const*)decoded->data, decoded->linesize,
+                  0, codec_ctx->height, dst, dst_stride);
+        frame_prof_mark(&prof, FRAME_STAGE_SCALE);
+    } else {
+        // Convert frame from YUV to RGB and scale to screen size
+        sws_scale(sws_ctx,
+                 (const uint8_t * const*)decoded->data,
+                 decoded->linesize,
+                 0,
+                 codec_ctx->height,
+                 frame_rgb->data,
+                 frame_rgb->linesize);
+        frame_prof_mark(&prof, FRAME_STAGE_SCALE);
+
+        // Render to framebuffer (direct memory write to display!)
+        render_frame_to_framebuffer(frame_rgb);
+        frame_prof_mark(&prof, FRAME_STAGE_BLIT);
+    }
 
-    AVRational time_base = format_ctx->streams[video_stream_index]->time_base;
-    AVRational frame_rate = format_ctx->streams[video_stream_index]->r_frame_rate;
-    double frame_duration = av_q2d(av_inv_q(frame_rate));  // Seconds per frame
+    // Flip it on screen at the vblank nearest its presentation time
+    double shown = drm_present_flip(&presenter, when);
+    frame_prof_mark(&prof, FRAME_STAGE_FLIP);
+    return shown;
+}
+
+// Show one decoded frame when its time has come
+void present_frame(AVFrame *decoded, AVRational time_base, int frame_count) {
+    // Calculate presentation time. Raw elementary streams (.h264) may have
+    // none: such frames are shown as soon as they are decoded.
+    int64_t ts = decoded->best_effort_timestamp;
+    int untimed = ts == AV_NOPTS_VALUE;
+    double pts = untimed ? 0 : ts * av_q2d(time_base);
+
+    // After a seek, decoding starts at the keyframe before the start
+    if (!untimed && pts < start_pts) {
+        return;
+    }
+
+    // And when the master clock gets there - except in a benchmark, where
+    // every frame is drawn as soon as it is decoded
+    start_playback();
+    int at_once = benchmark || untimed;
+    double when = at_once ? 0 : media_to_time(pts);
+
+    // Already more than a frame late, it would only make the frames after
+    // it late too: drop it. The decoder hears how late we are.
+    double late = get_time() - when;
+    atomic_store(&frames_late, late > 0 && !at_once ? (int)(late / frame_duration) : 0);
+    if (late > frame_duration && !at_once) {
+        frames_dropped++;
+        return;
+    }
+
+    // With one buffer, drawing is displaying: wait until it's time to
+    // display this frame
+    if (presenter.count == 1 && !at_once) {
+        sleep_until(when);
+    }
+
+    frame_prof_begin(&prof);
+    double shown = -1;
+    if (hw_pix_fmt != AV_PIX_FMT_NONE && decoded->format == hw_pix_fmt) {
+        if (hw_direct) {
+            shown = present_prime_frame(decoded, when);
+            frame_prof_mark(&prof, FRAME_STAGE_FLIP);
+            if (shown < 0) {
+                fprintf(stderr, "Display can't show hardware frames, copying them back\n");
+                hw_direct = 0;
+            }
+        }
+        if (shown < 0) {
+            // Copy the frame back to memory, as NV12 usually
+            av_frame_unref(sw_frame);
+            if (av_hwframe_transfer_data(sw_frame, decoded, 0) < 0) {
+                fprintf(stderr, "Cannot copy hardware frame back\n");
+                return;
+            }
+            decoded = sw_frame;
+            frame_prof_mark(&prof, FRAME_STAGE_BLIT);
+        }
+    }
+    if (shown < 0 && overlay_plane) {
+        shown = draw_overlay_frame(decoded, when);
+        if (shown < 0) {
+            fprintf(stderr, "Overlay plane can't show frames, scaling on the CPU\n");
+            fall_back_to_cpu_scaling();
+        }
+    }
+    if (shown < 0) {
+        shown = draw_frame(decoded, when);
+        if (shown < 0) {
+            return;
+        }
+    }
+    frame_prof_end(&prof);
+
+    // Progress indicator: drift is how far off its time the frame shows
+    if (frame_count % 60 == 0 && !at_once) {
+        printf("Frame %d rendered (PTS: %.2fs, drift: %.3fms, dropped: %d)\n",
+               frame_count, pts, (shown - when) * 1000, frames_dropped);
+    }
+}
+
+void print_frame_timing() {
+    AVStream *st = format_ctx->streams[video_stream_index];
+    AVRational frame_rate = st->r_frame_rate.num ? st->r_frame_rate : st->avg_frame_rate;
+    if (frame_rate.num && frame_rate.den) {
+        frame_duration = av_q2d(av_inv_q(frame_rate));
+    }
 
     printf("Frame duration: %.3f ms (%.2f fps)\n",
            frame_duration * 1000, 1.0 / frame_duration);
     printf("Starting playback...\n\n");
+}
 
-    while (av_read_frame(format_ctx, packet) >= 0) {
-        // Only process video packets
-        if (packet->stream_index != video_stream_index) {
-            av_packet_unref(packet);
-            continue;
-        }
+int play_video() {
+    printf("=== Starting Playback ===\n");
+
+    int frame_count = 0;
+
+    AVRational time_base = format_ctx->streams[video_stream_index]->time_base;
+    print_frame_timing();
 
-        // Send packet to decoder
+    // The demux thread reads ahead: only video packets come out here
+    if (start_demux() < 0) {
+        return -1;
+    }
+    while (packet_queue_pop(&video_queue, packet) == 0) {
+        // Send packet to decoder, which skips frames while we are late
+        codec_ctx->skip_frame = decode_skip(packet);
         if (avcodec_send_packet(codec_ctx, packet) < 0) {
             fprintf(stderr, "Error sending packet\n");
             av_packet_unref(packet);
@@ -347,41 +1516,191 @@ int play_video() {
 
         // Receive decoded frame
         while (avcodec_receive_frame(codec_ctx, frame) == 0) {
-            frame_count++;
+            present_frame(frame, time_base, ++frame_count);
+        }
 
-            // Calculate presentation time
-            double pts = frame->pts * av_q2d(time_base);
-            double current_time = get_time() - video_start_time;
+        av_packet_unref(packet);
+    }
 
-            // Wait until it's time to display this frame
-            double sleep_time = pts - current_time;
-            if (sleep_time > 0) {
-                sleep_ms((int)(sleep_time * 1000));
-            }
+    // Drain the decoder: with frame threading, the last few frames are
+    // still in flight when the file ends
+    avcodec_send_packet(codec_ctx, NULL);
+    while (avcodec_receive_frame(codec_ctx, frame) == 0) {
+        present_frame(frame, time_base, ++frame_count);
+    }
+    stop_demux();
+    finish_audio();
 
-            // Convert frame from YUV to RGB and scale to screen size
-            sws_scale(sws_ctx,
-                     (const uint8_t * const*)frame->data,
-                     frame->linesize,
-                     0,
-                     codec_ctx->height,
-                     frame_rgb->data,
-                     frame_rgb->linesize);
-
-            // Render to framebuffer (direct memory write to display!)
-            render_frame_to_framebuffer(frame_rgb);
-
-            // Progress indicator
-            if (frame_count % 60 == 0) {
-                printf("Frame %d rendered (PTS: %.2fs, drift: %.3fms)\n",
-                       frame_count, pts, (current_time - pts) * 1000);
-            }
+    printf("\n✓ Playback complete (%d frames, %d dropped)\n", frame_count, frames_dropped);
+    return 0;
+}
+
+// =============================================================================
+// PIPELINED PLAYBACK (-P)
+// =============================================================================
+//
+// play_video() does one thing at a time: while a frame is being scaled and
+// copied to the screen, nothing is decoded, and while it waits for a
+// frame's time, nothing at all happens. A 4K frame that is expensive to
+// decode then makes everything behind it late. The pipeline gives each
+// part its own thread:
+//
+//   decode thread:  video packet queue (see PREFETCH) ->
+//                   avcodec_send_packet/receive_frame
+//        |          (the decoder runs its own frame/slice threads too)
+//        v
+//   frame queue:    up to FRAME_QUEUE_SIZE decoded frames
+//        |
+//        v
+//   presenter:      wait for the frame's PTS -> sws_scale -> framebuffer
+//
+// The queue lets the decoder run ahead while frames are cheap, so an
+// expensive one (a keyframe, say) is absorbed instead of showing up as a
+// late frame. When it is full, the decoder waits: memory stays bounded.
+
+struct frame_queue {
+    AVFrame *frames[FRAME_QUEUE_SIZE];
+    int head;                   // Oldest frame
+    int count;
+    int finished;               // The decoder is done: no more frames come
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+int frame_queue_init(struct frame_queue *q) {
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        q->frames[i] = av_frame_alloc();
+        if (!q->frames[i]) {
+            return -1;  // frame_queue_free() cleans up
         }
+    }
+    return 0;
+}
 
-        av_packet_unref(packet);
+void frame_queue_free(struct frame_queue *q) {
+    for (int i = 0; i < FRAME_QUEUE_SIZE; i++) {
+        av_frame_free(&q->frames[i]);
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+// Queue a decoded frame, waiting for room. The frame's buffers move into
+// the queue (no copy); src is left blank.
+void frame_queue_push(struct frame_queue *q, AVFrame *src) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == FRAME_QUEUE_SIZE) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    av_frame_move_ref(q->frames[(q->head + q->count) % FRAME_QUEUE_SIZE], src);
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Take the oldest frame into dst, waiting for one. Returns -1 once the
+// decoder has finished and the queue is empty.
+int frame_queue_pop(struct frame_queue *q, AVFrame *dst) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->finished) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    av_frame_move_ref(dst, q->frames[q->head]);
+    q->head = (q->head + 1) % FRAME_QUEUE_SIZE;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+void frame_queue_finish(struct frame_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->finished = 1;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Decode thread: decode the demuxed packets into the queue
+void *decode_thread(void *arg) {
+    struct frame_queue *q = arg;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *decoded = av_frame_alloc();
+
+    while (pkt && decoded && packet_queue_pop(&video_queue, pkt) == 0) {
+        codec_ctx->skip_frame = decode_skip(pkt);
+        if (avcodec_send_packet(codec_ctx, pkt) < 0) {
+            fprintf(stderr, "Error sending packet\n");
+        }
+        while (avcodec_receive_frame(codec_ctx, decoded) == 0) {
+            frame_queue_push(q, decoded);
+        }
+        av_packet_unref(pkt);
+    }
+
+    // Drain the decoder's frame threads
+    if (pkt && decoded) {
+        avcodec_send_packet(codec_ctx, NULL);
+        while (avcodec_receive_frame(codec_ctx, decoded) == 0) {
+            frame_queue_push(q, decoded);
+        }
+    }
+
+    av_frame_free(&decoded);
+    av_packet_free(&pkt);
+    frame_queue_finish(q);
+    return NULL;
+}
+
+int play_video_pipelined() {
+    struct frame_queue queue;
+    pthread_t decoder;
+
+    printf("=== Starting Pipelined Playback ===\n");
+    if (frame_queue_init(&queue) < 0) {
+        fprintf(stderr, "Cannot allocate frame queue\n");
+        frame_queue_free(&queue);
+        return -1;
+    }
+
+    int frame_count = 0;
+    AVRational time_base = format_ctx->streams[video_stream_index]->time_base;
+    print_frame_timing();
+
+    if (start_demux() < 0) {
+        frame_queue_free(&queue);
+        return -1;
+    }
+    if (pthread_create(&decoder, NULL, decode_thread, &queue) != 0) {
+        fprintf(stderr, "Cannot start decode thread\n");
+        while (packet_queue_pop(&video_queue, packet) == 0) {
+            av_packet_unref(packet);  // Let the demux thread finish
+        }
+        stop_demux();
+        frame_queue_free(&queue);
+        return -1;
+    }
+
+    // This thread presents: frames come out of the queue in decode order
+    while (frame_queue_pop(&queue, frame) == 0) {
+        present_frame(frame, time_base, ++frame_count);
+        av_frame_unref(frame);
     }
 
-    printf("\n✓ Playback complete (%d frames)\n", frame_count);
+    pthread_join(decoder, NULL);
+    stop_demux();
+    finish_audio();
+    frame_queue_free(&queue);
+    printf("\n✓ Playback complete (%d frames, %d dropped)\n", frame_count, frames_dropped);
     return 0;
 }
 
@@ -389,36 +1708,122 @@ int play_video() {
 // MAIN
 // =============================================================================
 
+void print_usage(const char *prog_name) {
+    printf("Usage: %s [-P] [-z] [-b buffers] [-H hwaccel] [-O] [-A] [-s seconds] [-B]\n"
+           "       [-o output] [-m mode] <video_file>\n", prog_name);
+    printf("  -P    Pipelined: decode on its own thread, ahead of display\n");
+    printf("  -z    Zero-copy: scale frames straight into the framebuffer\n");
+    printf("  -b N  Framebuffers to page-flip between: 2 or 3 (default 2), 1 draws on screen\n");
+    printf("  -H X  Decode in hardware: auto, vaapi, v4l2request, drm or v4l2m2m\n");
+    printf("  -O    Overlay: let a display plane scale the video instead of the CPU\n");
+    printf("  -A    No audio: time the video by the system clock\n");
+    printf("  -s T  Start T seconds in\n");
+    printf("  -B    Benchmark: decode and draw offscreen as fast as possible, report fps and frame times\n");
+    printf("  -o C  Display on connector C, e.g. HDMI-A-1 (default: the first connected)\n");
+    printf("  -m M  Display mode: 1920x1080, 1920x1080@60 or @144 (default: preferred)\n");
+    printf("\nExample:\n");
+    printf("  sudo %s video.mp4\n", prog_name);
+    printf("\nNote: Requires root or video group for DRM access\n");
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <video_file>\n", argv[0]);
-        printf("\nExample:\n");
-        printf("  sudo %s video.mp4\n", argv[0]);
-        printf("\nNote: Requires root or video group for DRM access\n");
+    int pipelined = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Pzb:H:OAs:Bo:m:h")) != -1) {
+        switch (opt) {
+        case 'P':
+            pipelined = 1;
+            break;
+        case 'z':
+            zero_copy = 1;
+            break;
+        case 'b':
+            num_buffers = atoi(optarg);
+            if (num_buffers < 1 || num_buffers > DRM_PRESENT_MAX_BUFFERS) {
+                fprintf(stderr, "Buffer count must be 1..%d\n", DRM_PRESENT_MAX_BUFFERS);
+                return 1;
+            }
+            break;
+        case 'H':
+            hwaccel = optarg;
+            break;
+        case 'O':
+            use_overlay = 1;
+            break;
+        case 'A':
+            no_audio = 1;
+            break;
+        case 's':
+            start_pts = atof(optarg);
+            break;
+        case 'B':
+            benchmark = 1;
+            no_audio = 1;  // Nothing to keep in time with
+            break;
+        case 'o':
+            want.output = optarg;
+            break;
+        case 'm':
+            if (drm_display_parse_mode(optarg, &want) < 0) {
+                fprintf(stderr, "-m needs WxH, WxH@Hz or @Hz, not %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
         return 1;
     }
 
     printf("=== Simple Video Player ===\n");
     printf("Educational video player using FFmpeg + Direct DRM\n\n");
+    fb_blit_init();
 
-    // Setup DRM display
-    if (setup_drm() < 0) {
+    // Setup DRM display, or in a benchmark, buffers of its size in memory
+    if (benchmark) {
+        printf("Benchmark: drawing offscreen at %dx%d\n\n", screen_width, screen_height);
+        if (drm_present_init_offscreen(&presenter, screen_width, screen_height, num_buffers) < 0) {
+            return 1;
+        }
+    } else if (setup_drm() < 0) {
         fprintf(stderr, "DRM setup failed\n");
         return 1;
     }
 
     // Setup FFmpeg decoder
-    if (setup_ffmpeg(argv[1]) < 0) {
+    if (setup_ffmpeg(argv[optind]) < 0) {
         fprintf(stderr, "FFmpeg setup failed\n");
         cleanup_drm();
         return 1;
     }
 
-    // Play the video
-    play_video();
+    // Setup the audio output (the clock), unless there is none
+    if (!no_audio) {
+        setup_audio();
+    }
+
+    // Go to -s's start
+    if (start_pts > 0) {
+        seek_to_start();
+    }
+
+    // Play the video; benchmarks report frame times every second
+    frame_prof_start(&prof, benchmark ? 1 : 0);
+    if (pipelined) {
+        play_video_pipelined();
+    } else {
+        play_video();
+    }
+    frame_prof_stop(&prof);
 
     // Cleanup
     printf("\n=== Cleanup ===\n");
+    cleanup_audio();
     cleanup_ffmpeg();
     cleanup_drm();
     printf("✓ All resources cleaned up\n");
@@ -9,81 +9,116 @@
  * 5. Receives encrypted packets from server
  * 6. Decrypts and injects back into TUN device
  *
+ * Packets are sealed with AES-256-GCM or ChaCha20-Poly1305 (see
+ * vpn_crypto.h) under a session key derived from the pre-shared key given
+ * with -k. -c picks the cipher to ask the server for; by default it is the
+ * fastest one this CPU runs in hardware.
+ *
  * Applications using this VPN don't know it exists - they just use normal
  * socket programming, and the kernel routes their traffic through tun0.
  *
- * Compile: gcc -o simple_vpn_client simple_vpn_client.c
- * Run: sudo ./simple_vpn_client <server_ip>
+ * With -q N the client opens a multi-queue TUN device and N connections to
+ * the server, and runs one event loop thread per (queue, connection) pair,
+ * each pinned to its own CPU.
+ *
+ * With -u packets are tunneled as UDP datagrams (see vpn_udp.h) instead of
+ * length-prefixed frames on a TCP stream. TCP stays the default, as a
+ * fallback for networks that block UDP. A UDP session survives the client
+ * changing networks, and a server restart: the client resumes it with the
+ * session ticket from its last handshake and keeps sending, so the tunnel
+ * is back one round trip after the server is (see vpn_udp.h).
+ *
+ * With -P N a single session runs as a pipeline instead of one loop: a
+ * thread per stage (TUN reader, N crypto threads, socket sender, and the
+ * same back), handing batches along through lock-free rings (see
+ * vpn_ring.h). -B bounds the batches in flight per direction.
+ *
+ * With -a the client sets up its TUN device itself (address, -M MTU, link
+ * up) instead of waiting for it to be done by hand.
+ *
+ * Over UDP, unless -M fixes the MTU, the client searches for the path MTU
+ * with PROBE datagrams the server answers, and keeps the TUN MTU at what
+ * the path carries once our overhead is added (see vpn_mtu.h). With -q, the
+ * first queue searches for all of them; the -P pipeline does not search.
+ * TCP SYNs written to TUN get their MSS clamped to the TUN MTU.
+ *
+ * With -o the TUN device runs with TSO/USO offloads (see vpn_offload.h):
+ * over TCP to a server that uses -o too, super-packets cross the tunnel
+ * whole; otherwise they are cut up before sending, and runs of TCP
+ * segments from the server are coalesced before they are written to TUN.
+ *
+ * Nothing is logged per packet: each loop keeps counters that -s / -S
+ * report, and -T N logs a sample of the packets (see vpn_stats.h).
+ *
+ * Compile: gcc -O2 -o simple_vpn_client simple_vpn_client.c vpn_batch.c vpn_crypto.c vpn_crypto_simd.c vpn_mtu.c vpn_offload.c vpn_pool.c vpn_ring.c vpn_stats.c vpn_stream.c vpn_tun.c vpn_udp.c -pthread
+ * Run: sudo ./simple_vpn_client [-u] [-q queues] [-k keyfile] [-c cipher] [-o] [-P n] [-B n]
+ *        [-a addr/len] [-M mtu] [-s sec] [-S path] [-T n] <server_ip>
  */
 
+#define _GNU_SOURCE  // sendmmsg(), recvmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <linux/if.h>
-#include <linux/if_tun.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <time.h>
 
-#define SERVER_PORT 5555
-#define TUN_DEVICE "/dev/net/tun"
-#define BUFFER_SIZE 2048
-#define XOR_KEY 0x42  // Simple XOR "encryption" key (must match server!)
-
-// Create and configure TUN device
-int create_tun_device(char *dev_name) {
-    struct ifreq ifr;
-    int tun_fd, err;
+#include "vpn_batch.h"
+#include "vpn_crypto.h"
+#include "vpn_mtu.h"
+#include "vpn_offload.h"
+#include "vpn_pool.h"
+#include "vpn_ring.h"
+#include "vpn_stats.h"
+#include "vpn_stream.h"
+#include "vpn_tun.h"
+#include "vpn_udp.h"
 
-    // Open the TUN device
-    tun_fd = open(TUN_DEVICE, O_RDWR);
-    if (tun_fd < 0) {
-        perror("Failed to open /dev/net/tun");
-        return -1;
-    }
-
-    memset(&ifr, 0, sizeof(ifr));
-
-    // IFF_TUN: TUN device (Layer 3, IP packets)
-    // IFF_NO_PI: No packet information (just raw IP packets)
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-    strncpy(ifr.ifr_name, dev_name, IFNAMSIZ);
-
-    // Create the TUN interface
-    err = ioctl(tun_fd, TUNSETIFF, (void *)&ifr);
-    if (err < 0) {
-        perror("Failed to configure TUN device");
-        close(tun_fd);
-        return -1;
-    }
-
-    printf("[TUN] Created TUN device: %s\n", ifr.ifr_name);
-    printf("[TUN] Configure it with:\n");
-    printf("      sudo ip addr add 10.8.0.2/24 dev %s\n", ifr.ifr_name);
-    printf("      sudo ip link set %s up\n", ifr.ifr_name);
-    printf("      sudo ip route add 8.8.8.8/32 dev %s\n", ifr.ifr_name);
+#define SERVER_PORT 5555
 
-    return tun_fd;
-}
+static unsigned char psk[VPN_KEY_SIZE];         // Pre-shared key (-k), must match server!
+static int wanted_cipher = VPN_CIPHER_AUTO;     // -c
+static int tun_offload;                         // -o: TUN packets carry a virtio-net header
+static int tun_gso_types;                       // Super-packet types our TUN takes (VPN_GSO_*)
+static struct sockaddr_in server_sockaddr;      // Where connect_to_server() connected to
+static const char *tun_dev;                     // Our TUN device's name
+static atomic_int tun_mtu_now = VPN_PMTU_DEFAULT; // Its MTU: TCP SYNs to TUN are clamped to this
 
-// Simple XOR encryption/decryption (symmetric)
-void xor_crypt(unsigned char *data, int len, unsigned char key) {
-    for (int i = 0; i < len; i++) {
-        data[i] ^= key;
-    }
-}
+// Sending side of one event loop: the packets queued for the next send
+// (TUN reads, or segments cut from them into buffers of our own) and where
+// they go
+struct tx_link {
+    int fd;                                 // Server socket
+    int udp;                                // Datagrams instead of frames
+    const struct vpn_aead *aead;
+    uint32_t session_id;                    // UDP
+    uint64_t tx_seq;                        // Last frame/datagram sent: the nonce counter
+    int peer_gso;                           // Super-packet types the server takes whole
+    struct vpn_pool *pool;
+    struct vpn_stats *stats;
+    unsigned char *bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+    struct vpn_pkt *owned[VPN_BATCH_MAX];   // Segment buffers, given back once sent
+    int count;
+    int num_owned;
+};
 
-// Connect to VPN server
-int connect_to_server(const char *server_ip, int port) {
+// Connect to VPN server. type is SOCK_STREAM (TCP) or SOCK_DGRAM (UDP);
+// for UDP, connect() only fixes the peer address for send()/recv().
+int connect_to_server(const char *server_ip, int port, int type) {
     int sock_fd;
     struct sockaddr_in server_addr;
 
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sock_fd = socket(AF_INET, type, 0);
     if (sock_fd < 0) {
         perror("Failed to create socket");
         return -1;
@@ -99,29 +134,331 @@ int connect_to_server(const char *server_ip, int port) {
         return -1;
     }
 
-    printf("[CLIENT] Connecting to server %s:%d...\n", server_ip, port);
+    printf("[CLIENT] Connecting to server %s:%d (%s)...\n", server_ip, port,
+           type == SOCK_DGRAM ? "UDP" : "TCP");
 
     if (connect(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Failed to connect to server");
         close(sock_fd);
         return -1;
     }
+    server_sockaddr = server_addr;
 
     printf("[CLIENT] Connected to VPN server!\n");
     return sock_fd;
 }
 
+// Open a TCP session: send our hello, wait for the server's answer and
+// derive the session key from the two. *peer_gso is set to the super-packet
+// types the server takes whole, 0 unless both ends use offloads.
+int tcp_handshake(int server_fd, struct vpn_aead *aead, int *peer_gso) {
+    struct vpn_hello hello, reply;
+
+    if (vpn_hello_init(&hello, wanted_cipher) < 0) {
+        fprintf(stderr, "[CLIENT] Handshake with server failed\n");
+        return -1;
+    }
+    hello.gso = tun_gso_types;
+    if (write(server_fd, &hello, sizeof(hello)) != sizeof(hello) ||
+        vpn_read_full(server_fd, &reply, sizeof(reply)) < 0) {
+        fprintf(stderr, "[CLIENT] Handshake with server failed\n");
+        return -1;
+    }
+    if (vpn_hello_complete(&hello, &reply, psk, aead) < 0) {
+        fprintf(stderr, "[CLIENT] Server picked a cipher this CPU can't run (%s)\n",
+                vpn_cipher_name(reply.cipher));
+        return -1;
+    }
+    *peer_gso = tun_offload ? reply.gso : 0;
+
+    printf("[CRYPTO] Session cipher: %s%s\n", aead->impl,
+           *peer_gso ? ", super-packets whole" : "");
+    return 0;
+}
+
+// With offloads: decide how a packet read from TUN leaves for a peer that
+// takes the super-packet types in peer_gso. Returns 1 to send *data/*len as
+// they are, 0 to cut it up with it, or -1 to drop it.
+static int offload_prepare(int peer_gso, unsigned char **data, int *len,
+                           struct vpn_gso_iter *it) {
+    if (peer_gso && vpn_offload_whole(*data, *len, peer_gso)) {
+        return 1;
+    }
+    if (!peer_gso) {
+        int plain = vpn_offload_to_plain(data, len);
+        if (plain != 0) {
+            return plain;
+        }
+    }
+    return vpn_gso_begin(it, *data, *len) < 0 ? -1 : 0;
+}
+
+// Cut the next segment into a buffer from pool, behind an empty virtio-net
+// header for a peer that takes them. Returns NULL once every segment is
+// cut, or when the pool is empty (the rest of the burst is lost).
+static struct vpn_pkt *offload_next_segment(struct tx_link *l, struct vpn_gso_iter *it) {
+    int vnet = l->peer_gso ? VPN_VNET_HDR_SIZE : 0;
+    struct vpn_pool *pool = l->pool;
+    struct vpn_pkt *seg = vpn_pkt_get(pool);
+    if (!seg) {
+        vpn_stat_add(l->stats, VPN_STAT_DROP_QUEUE, 1);
+        return NULL;
+    }
+    int len = vpn_gso_next(it, seg->data + vnet);
+    if (len == 0) {
+        vpn_pkt_put(pool, seg);
+        return NULL;
+    }
+    memset(seg->data, 0, vnet);
+    seg->len = vnet + len;
+    return seg;
+}
+
+// Inject a batch of decrypted packets into TUN. With offloads, ordinary
+// packets get their runs of TCP segments coalesced first, while a session
+// with super-packets whole (peer_gso) already has a header on each.
+static void deliver_to_tun(struct vpn_stats *stats, int tun_fd, struct vpn_aead_op *ops, int n,
+                           int peer_gso) {
+    struct vpn_gro_pkt pkts[VPN_BATCH_MAX];
+    uint64_t bytes = 0;
+    int mtu = atomic_load_explicit(&tun_mtu_now, memory_order_relaxed);
+
+    for (int i = 0; i < n; i++) {
+        bytes += ops[i].len;
+        if (vpn_trace(stats)) {
+            printf("[SERVER→TUN] Received %d bytes from server, decrypted, injecting to TUN\n",
+                   ops[i].len);
+        }
+        if (peer_gso) {
+            vpn_clamp_mss_vnet(ops[i].data, ops[i].len, mtu);
+        } else {
+            vpn_clamp_mss(ops[i].data, ops[i].len, mtu);
+        }
+    }
+    vpn_stat_batch(stats, VPN_STAT_RX_PACKETS, n, bytes);
+
+    // Writing a decrypted packet to the TUN device injects it into the
+    // kernel's network stack, which routes it to the application socket
+    if (!tun_offload || peer_gso) {
+        for (int i = 0; i < n; i++) {
+            if (write(tun_fd, ops[i].data, ops[i].len) < 0) {
+                perror("Failed to write to TUN device");
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        pkts[i].data = ops[i].data;
+        pkts[i].len = ops[i].len;
+    }
+    n = vpn_gro_coalesce(pkts, n);
+    for (int i = 0; i < n; i++) {
+        if (vpn_offload_write(tun_fd, &pkts[i].hdr, pkts[i].data, pkts[i].len) < 0) {
+            perror("Failed to write to TUN device");
+        }
+    }
+}
+
+// Verify, decrypt and inject a batch of frames from the server.
+// Returns -1 if one doesn't verify: the stream is corrupt or forged.
+static int open_frames(struct vpn_stats *stats, const struct vpn_aead *aead, int tun_fd,
+                       struct vpn_aead_op *ops, int n, int peer_gso) {
+    // Decrypt the whole batch in place, inside the receive ring
+    if (vpn_stats_open(stats, aead, ops, n) != n) {
+        return -1;
+    }
+    deliver_to_tun(stats, tun_fd, ops, n, peer_gso);
+    return 0;
+}
+
+// Seal and send the queued packets as frames. Returns -1 on a send error.
+static int send_frames(struct tx_link *l) {
+    struct iovec iov[VPN_BATCH_MAX];
+    struct vpn_aead_op ops[VPN_BATCH_MAX];
+
+    for (int i = 0; i < l->count; i++) {
+        // Packet length first (for framing, in the headroom), then
+        // the sealed packet: one contiguous frame
+        unsigned char *frame = l->bufs[i] - VPN_FRAME_HDR_SIZE;
+        uint16_t frame_len = htons(l->lens[i] + VPN_TAG_SIZE);
+        memcpy(frame, &frame_len, VPN_FRAME_HDR_SIZE);
+        iov[i].iov_base = frame;
+        iov[i].iov_len = VPN_FRAME_HDR_SIZE + l->lens[i] + VPN_TAG_SIZE;
+
+        ops[i] = (struct vpn_aead_op){
+            .data = l->bufs[i], .len = l->lens[i],
+            .aad = frame, .aad_len = VPN_FRAME_HDR_SIZE,
+        };
+        vpn_aead_nonce(ops[i].nonce, VPN_DIR_TO_SERVER, ++l->tx_seq);
+    }
+
+    // Encrypt the whole batch in place
+    vpn_stats_seal(l->stats, l->aead, ops, l->count);
+
+    // One writev() sends every frame of the batch
+    return vpn_writev_all(l->fd, iov, l->count);
+}
+
+// A send on the UDP socket failed. After a network change (Wi-Fi to
+// cellular, say) the socket still sends from the source address connect()
+// picked, which may be gone: connect it again, so the kernel picks one on
+// the new route. The server follows the session to the new address as soon
+// as a datagram from it verifies.
+static void udp_send_failed(int fd, const char *what) {
+    if (errno == EADDRNOTAVAIL || errno == EINVAL || errno == ENETUNREACH ||
+        errno == ENETDOWN || errno == EDESTADDRREQ) {
+        struct sockaddr unspec = {.sa_family = AF_UNSPEC};
+        connect(fd, &unspec, sizeof(unspec));
+        connect(fd, (struct sockaddr *)&server_sockaddr, sizeof(server_sockaddr));
+    } else if (errno != ECONNREFUSED && errno != EAGAIN && errno != EINTR && errno != EMSGSIZE) {
+        // EMSGSIZE: bigger than the route takes, until the TUN MTU follows it
+        perror(what);
+    }
+}
+
+// Seal and send the queued packets as datagrams, one sendmmsg() for the
+// whole batch. A datagram that can't be sent is just a lost packet: skip
+// it and send the rest.
+static void send_datagrams(struct tx_link *l) {
+    struct iovec iov[VPN_BATCH_MAX];
+    struct mmsghdr msgs[VPN_BATCH_MAX];
+    struct vpn_aead_op ops[VPN_BATCH_MAX];
+    int count = l->count;
+
+    if (vpn_trace(l->stats)) {
+        printf("[TUN→SERVER] Sending datagrams #%llu-#%llu\n",
+               (unsigned long long)l->tx_seq + 1, (unsigned long long)l->tx_seq + count);
+    }
+
+    memset(msgs, 0, sizeof(msgs[0]) * count);
+    for (int i = 0; i < count; i++) {
+        unsigned char *dgram = l->bufs[i] - VPN_UDP_HDR_SIZE;
+        vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_DATA, l->session_id, ++l->tx_seq);
+        ops[i] = (struct vpn_aead_op){
+            .data = l->bufs[i], .len = l->lens[i],
+            .aad = dgram, .aad_len = VPN_UDP_HDR_SIZE,
+        };
+        vpn_aead_nonce(ops[i].nonce, VPN_DIR_TO_SERVER, l->tx_seq);
+
+        iov[i].iov_base = dgram;
+        iov[i].iov_len = VPN_UDP_HDR_SIZE + l->lens[i] + VPN_TAG_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Encrypt the whole batch in place
+    vpn_stats_seal(l->stats, l->aead, ops, count);
+
+    int sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(l->fd, msgs + sent, count - sent, 0);
+        if (n < 0) {
+            udp_send_failed(l->fd, "Failed to send datagrams to server");
+            vpn_stat_add(l->stats, VPN_STAT_DROP_QUEUE, 1);
+            n = 1;
+        }
+        sent += n;
+    }
+}
+
+// Send whatever is queued and give the segment buffers back.
+// Returns -1 on a send error.
+static int tx_flush(struct tx_link *l) {
+    uint64_t bytes = 0;
+    int ret = 0;
+    for (int i = 0; i < l->count; i++) {
+        bytes += l->lens[i];
+    }
+    if (l->udp) {
+        send_datagrams(l);
+    } else {
+        ret = send_frames(l);
+    }
+    vpn_stat_batch(l->stats, VPN_STAT_TX_PACKETS, l->count, bytes);
+    for (int i = 0; i < l->num_owned; i++) {
+        vpn_pkt_put(l->pool, l->owned[i]);
+    }
+    l->num_owned = 0;
+    l->count = 0;
+    return ret;
+}
+
+// Send a batch of packets read from TUN: each as it is, or, with offloads,
+// cut into segments when it is a super-packet the server can't take whole.
+// Returns -1 on a send error.
+static int send_tun_packets(struct tx_link *l, unsigned char **bufs, int *lens, int count) {
+    for (int i = 0; i < count; i++) {
+        unsigned char *data = bufs[i];
+        int len = lens[i];
+        struct vpn_gso_iter it;
+        int whole = tun_offload ? offload_prepare(l->peer_gso, &data, &len, &it) : 1;
+
+        while (whole >= 0) {
+            if (whole == 0) {
+                struct vpn_pkt *seg = offload_next_segment(l, &it);
+                if (!seg) {
+                    break;
+                }
+                l->owned[l->num_owned++] = seg;
+                data = seg->data;
+                len = seg->len;
+            }
+            l->bufs[l->count] = data;
+            l->lens[l->count] = len;
+            if (++l->count == VPN_BATCH_MAX && tx_flush(l) < 0) {
+                return -1;
+            }
+            if (whole == 1) {
+                break;
+            }
+        }
+    }
+    return l->count > 0 ? tx_flush(l) : 0;
+}
+
 // Main event loop: multiplex between TUN device and server socket
-void vpn_event_loop(int tun_fd, int server_fd) {
-    unsigned char buffer[BUFFER_SIZE];
+void vpn_event_loop(int tun_fd, int server_fd, const struct vpn_aead *aead, int peer_gso,
+                    struct vpn_stats *stats) {
+    struct vpn_pool pool;
+    unsigned char *bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+    struct vpn_aead_op ops[VPN_BATCH_MAX];
+    uint64_t rx_seq = 0;                    // Frames received: the nonce counter
+    struct vpn_batch_stats tun_stats = {0}, rx_stats = {0};
+    unsigned int report_seen = 0;
+    struct vpn_stream rx;
     fd_set read_fds;
     int max_fd;
-    int nread;
 
     printf("[VPN] Starting event loop...\n");
     printf("[VPN] All traffic to 8.8.8.8 will be tunneled through VPN!\n");
     printf("[VPN] Try: ping 8.8.8.8\n");
 
+    // Frames from the server are reassembled in a ring; TUN packets are read
+    // into pool buffers, which have room for the length prefix in front.
+    // With offloads, the second half of the pool takes cut segments.
+    if (vpn_stream_init(&rx, VPN_STREAM_SIZE) < 0) {
+        perror("Failed to set up receive ring");
+        return;
+    }
+    if (vpn_pool_init(&pool, (tun_offload ? 2 : 1) * VPN_BATCH_MAX) < 0) {
+        perror("Failed to set up packet buffers");
+        vpn_stream_free(&rx);
+        return;
+    }
+
+    for (int i = 0; i < VPN_BATCH_MAX; i++) {
+        bufs[i] = vpn_pkt_get(&pool)->data;
+    }
+    struct tx_link tx = {
+        .fd = server_fd, .aead = aead, .peer_gso = peer_gso, .pool = &pool, .stats = stats,
+    };
+
+    // The TUN device is drained in batches, so reads must stop at EAGAIN
+    // instead of blocking once it is empty
+    fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL, 0) | O_NONBLOCK);
+
     max_fd = (tun_fd > server_fd) ? tun_fd : server_fd;
 
     while (1) {
@@ -131,7 +468,13 @@ void vpn_event_loop(int tun_fd, int server_fd) {
 
         // Block until data is available on either TUN device or server socket
         int ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        uint64_t wakeup = vpn_stats_clock();
+        if (vpn_batch_report_requested(&report_seen)) {
+            vpn_batch_print("TUN→SERVER", &tun_stats);
+            vpn_batch_print("SERVER→TUN", &rx_stats);
+        }
         if (ret < 0) {
+            if (errno == EINTR) continue;
             perror("select() failed");
             break;
         }
@@ -140,84 +483,1374 @@ void vpn_event_loop(int tun_fd, int server_fd) {
         // This is when an application on this machine sends a packet that
         // matches our routing table (e.g., ping 8.8.8.8)
         if (FD_ISSET(tun_fd, &read_fds)) {
-            nread = read(tun_fd, buffer, BUFFER_SIZE);
-            if (nread < 0) {
+            // Take everything that is queued (up to VPN_BATCH_MAX packets)
+            int count = vpn_read_batch(tun_fd, bufs, lens, VPN_BATCH_MAX,
+                                       tun_offload ? VPN_GSO_READ_MAX : VPN_PKT_MAX);
+            if (count < 0) {
                 perror("Failed to read from TUN device");
                 break;
             }
 
-            printf("[TUN→SERVER] Read %d bytes from TUN (app sent packet), encrypting and forwarding to server\n", nread);
-
-            // Encrypt the packet
-            xor_crypt(buffer, nread, XOR_KEY);
-
-            // Send packet length first (for framing)
-            uint16_t packet_len = htons(nread);
-            if (write(server_fd, &packet_len, sizeof(packet_len)) < 0) {
-                perror("Failed to send packet length to server");
-                break;
+            if (vpn_trace(stats)) {
+                printf("[TUN→SERVER] Read %d packets from TUN (app sent packets), encrypting and forwarding to server\n", count);
             }
 
-            // Send encrypted packet to server
-            if (write(server_fd, buffer, nread) < 0) {
-                perror("Failed to send packet to server");
+            if (send_tun_packets(&tx, bufs, lens, count) < 0) {
+                perror("Failed to send packets to server");
                 break;
             }
+            vpn_batch_record(&tun_stats, count);
         }
 
         // Data from server (server → app)
         // These are response packets (e.g., ping replies) coming back
         if (FD_ISSET(server_fd, &read_fds)) {
-            // Read packet length first
-            uint16_t packet_len;
-            nread = read(server_fd, &packet_len, sizeof(packet_len));
-            if (nread <= 0) {
+            // One read() takes whatever has arrived - part of a frame or
+            // many frames - and the reassembler cuts complete frames out of it
+            ssize_t n = vpn_stream_fill(&rx, server_fd);
+            if (n <= 0) {
                 printf("[SERVER] Server disconnected\n");
                 break;
             }
-            packet_len = ntohs(packet_len);
 
-            // Read encrypted packet
-            nread = read(server_fd, buffer, packet_len);
-            if (nread <= 0) {
-                printf("[SERVER] Server disconnected\n");
+            unsigned char *packet;
+            uint16_t packet_len;
+            uint16_t rx_hdrs[VPN_BATCH_MAX];
+            int frames = 0, n_ops = 0;
+            int more;
+            while ((more = vpn_stream_next_frame(&rx, VPN_PKT_MAX + VPN_TAG_SIZE,
+                                                 &packet, &packet_len)) == 1) {
+                if (packet_len <= VPN_TAG_SIZE) {
+                    more = -1;
+                    break;
+                }
+                rx_hdrs[n_ops] = htons(packet_len);
+                ops[n_ops] = (struct vpn_aead_op){
+                    .data = packet, .len = packet_len - VPN_TAG_SIZE,
+                    .aad = &rx_hdrs[n_ops], .aad_len = sizeof(rx_hdrs[n_ops]),
+                };
+                vpn_aead_nonce(ops[n_ops].nonce, VPN_DIR_TO_CLIENT, ++rx_seq);
+                frames++;
+
+                // Frames stay valid in the ring until the next fill, so they
+                // are opened a batch at a time
+                if (++n_ops == VPN_BATCH_MAX) {
+                    if (open_frames(stats, aead, tun_fd, ops, n_ops, peer_gso) < 0) {
+                        more = -1;
+                        break;
+                    }
+                    n_ops = 0;
+                }
+            }
+            if (more == 0 && n_ops > 0 && open_frames(stats, aead, tun_fd, ops, n_ops, peer_gso) < 0) {
+                more = -1;
+            }
+            vpn_batch_record(&rx_stats, frames);
+
+            if (more < 0) {
+                fprintf(stderr, "[SERVER] Bad or forged frame, dropping connection\n");
                 break;
             }
+        }
+        vpn_stats_wakeup(stats, wakeup);
+    }
 
-            printf("[SERVER→TUN] Received %d bytes from server, decrypting and injecting to TUN\n", nread);
+    vpn_batch_print("TUN→SERVER", &tun_stats);
+    vpn_batch_print("SERVER→TUN", &rx_stats);
+    vpn_stream_free(&rx);
+    vpn_pool_free(&pool);
+}
 
-            // Decrypt the packet
-            xor_crypt(buffer, nread, XOR_KEY);
+// The UDP session an event loop runs, and what it takes to start the next
+struct udp_session {
+    uint32_t id;
+    int keyed;                      // Packets can flow
+    int resuming;                   // Our RESUME has not been answered yet
+    struct vpn_hello hello;         // Not keyed: the HELLO we repeat
+    struct vpn_resume resume;       // Resuming: the RESUME we repeat
+    struct vpn_aead aead;
+    struct vpn_ticket ticket;       // From the last full HELLO (cipher 0: none)
+    struct vpn_replay_window replay;
+};
 
-            // Write decrypted packet to TUN device
-            // This injects the packet into the kernel's network stack
-            // The kernel will route it to the appropriate application socket
-            if (write(tun_fd, buffer, nread) < 0) {
-                perror("Failed to write to TUN device");
+// Send the session's HELLO, asking the server for a session key. It is
+// padded to the size of the answer, or the server ignores it.
+static void send_udp_hello(int udp_fd, const struct udp_session *s) {
+    unsigned char dgram[VPN_UDP_HDR_SIZE + VPN_UDP_HELLO_SIZE] = {0};
+
+    vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_HELLO, s->id, 0);
+    memcpy(dgram + VPN_UDP_HDR_SIZE, &s->hello, VPN_HELLO_SIZE);
+    if (send(udp_fd, dgram, sizeof(dgram), 0) < 0) {
+        udp_send_failed(udp_fd, "Failed to send hello");
+    }
+}
+
+// Send the session's RESUME: the ticket, and a tag that proves we hold its
+// secret
+static void send_udp_resume(int udp_fd, struct udp_session *s, struct vpn_stats *stats) {
+    unsigned char dgram[VPN_UDP_HDR_SIZE + VPN_RESUME_SIZE + VPN_TAG_SIZE];
+
+    vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_RESUME, s->id, 0);
+    memcpy(dgram + VPN_UDP_HDR_SIZE, &s->resume, VPN_RESUME_SIZE);
+    struct vpn_aead_op op = {
+        .data = dgram + VPN_UDP_HDR_SIZE + VPN_RESUME_SIZE, .len = 0,
+        .aad = dgram, .aad_len = VPN_UDP_HDR_SIZE + VPN_RESUME_SIZE,
+    };
+    vpn_aead_nonce(op.nonce, VPN_DIR_TO_SERVER, 0);
+    vpn_stats_seal(stats, &s->aead, &op, 1);
+    if (send(udp_fd, dgram, sizeof(dgram), 0) < 0) {
+        udp_send_failed(udp_fd, "Failed to send resume");
+    }
+}
+
+// Start a new session: with a ticket, resume it and count it as keyed at
+// once, so packets go out right behind the RESUME; else say HELLO and wait.
+// Either way the first setup datagram goes out now. tx (if not NULL) starts
+// counting from 0 for the new session. Returns 0, or -1 if no salt could be
+// drawn.
+static int udp_session_start(struct udp_session *s, struct tx_link *tx, int udp_fd,
+                             struct vpn_stats *stats) {
+    s->id = vpn_udp_new_session_id();
+    memset(&s->replay, 0, sizeof(s->replay));
+    vpn_aead_wipe(&s->aead);
+    if (tx) {
+        tx->session_id = s->id;
+        tx->tx_seq = 0;
+    }
+
+    if (s->ticket.cipher && vpn_resume_init(&s->ticket, &s->resume, &s->aead) == 0) {
+        s->keyed = 1;
+        s->resuming = 1;
+        printf("[VPN] Resuming as session %08x\n", s->id);
+        send_udp_resume(udp_fd, s, stats);
+        return 0;
+    }
+
+    s->keyed = 0;
+    s->resuming = 0;
+    if (vpn_hello_init(&s->hello, wanted_cipher) < 0) {
+        perror("Failed to draw a session salt");
+        return -1;
+    }
+    printf("[VPN] Starting session %08x\n", s->id);
+    send_udp_hello(udp_fd, s);
+    return 0;
+}
+
+// Send a PROBE padded to make an outer IPv4 datagram of size bytes, in buf
+// (room for VPN_PKT_MAX, plus the header in front)
+static void send_udp_probe(int udp_fd, struct tx_link *tx, unsigned char *buf, int size,
+                           struct vpn_stats *stats) {
+    int pad = size - VPN_UDP_OVERHEAD;
+
+    vpn_udp_build_hdr((struct vpn_udp_hdr *)buf, VPN_UDP_PROBE, tx->session_id, ++tx->tx_seq);
+    memset(buf + VPN_UDP_HDR_SIZE, 0, pad);
+    struct vpn_aead_op op = {
+        .data = buf + VPN_UDP_HDR_SIZE, .len = pad,
+        .aad = buf, .aad_len = VPN_UDP_HDR_SIZE,
+    };
+    vpn_aead_nonce(op.nonce, VPN_DIR_TO_SERVER, tx->tx_seq);
+    vpn_stats_seal(stats, tx->aead, &op, 1);
+    if (send(udp_fd, buf, VPN_UDP_HDR_SIZE + pad + VPN_TAG_SIZE, 0) < 0) {
+        udp_send_failed(udp_fd, "Failed to send probe");
+    }
+}
+
+// Fit the TUN MTU to a path MTU: room for our overhead
+static void apply_path_mtu(int path_mtu) {
+    int mtu = path_mtu - VPN_UDP_OVERHEAD;
+
+    if (set_tun_mtu(tun_dev, mtu) < 0) {
+        perror("[MTU] Failed to set the TUN MTU");
+        return;
+    }
+    atomic_store(&tun_mtu_now, mtu);
+    printf("[MTU] Path MTU %d: %s mtu %d\n", path_mtu, tun_dev, mtu);
+}
+
+// The server's answers to our HELLO or RESUME, and its RETRYs. Returns 1 if
+// the session has to start over, -1 on a fatal error, 0 otherwise.
+static int handle_udp_setup(struct udp_session *s, int type, unsigned char *buffer, int n,
+                            struct vpn_stats *stats) {
+    if (type == VPN_UDP_HELLO) {
+        struct vpn_hello reply;
+        int has_ticket = n == VPN_UDP_HDR_SIZE + VPN_HELLO_SIZE + VPN_TICKET_SIZE;
+        if (s->keyed || (n != VPN_UDP_HDR_SIZE + VPN_HELLO_SIZE && !has_ticket)) {
+            return 0;  // A late duplicate of the answer
+        }
+        memcpy(&reply, buffer + VPN_UDP_HDR_SIZE, sizeof(reply));
+        if (vpn_hello_complete(&s->hello, &reply, psk, &s->aead) < 0) {
+            fprintf(stderr, "[CLIENT] Server picked a cipher this CPU can't run (%s)\n",
+                    vpn_cipher_name(reply.cipher));
+            return -1;
+        }
+        if (has_ticket) {
+            vpn_ticket_accept(&s->ticket, psk, &s->hello, &reply,
+                              buffer + VPN_UDP_HDR_SIZE + VPN_HELLO_SIZE);
+        }
+        s->keyed = 1;
+        printf("[CRYPTO] Session cipher: %s\n", s->aead.impl);
+        return 0;
+    }
+
+    if (type == VPN_UDP_RESUME) {
+        if (!s->resuming || n != VPN_UDP_HDR_SIZE + VPN_TAG_SIZE) {
+            return 0;
+        }
+        struct vpn_aead_op op = {
+            .data = buffer + VPN_UDP_HDR_SIZE, .len = 0,
+            .aad = buffer, .aad_len = VPN_UDP_HDR_SIZE,
+        };
+        vpn_aead_nonce(op.nonce, VPN_DIR_TO_CLIENT, 0);
+        if (vpn_stats_open(stats, &s->aead, &op, 1) == 1) {
+            s->resuming = 0;
+            printf("[CRYPTO] Session resumed: %s\n", s->aead.impl);
+        }
+        return 0;
+    }
+
+    // RETRY. Anyone could send one, but only one that names our session
+    // gets this far, and all it can do is make us start a new one.
+    if (n != VPN_UDP_HDR_SIZE + 1) {
+        return 0;
+    }
+    if (buffer[VPN_UDP_HDR_SIZE] == VPN_RETRY_TICKET && s->resuming) {
+        printf("[VPN] Server refused our ticket\n");
+        memset(&s->ticket, 0, sizeof(s->ticket));
+        return 1;
+    }
+    // While resuming, our packets may just have overtaken the RESUME; it is
+    // repeated until answered
+    if (buffer[VPN_UDP_HDR_SIZE] == VPN_RETRY_NO_SESSION && s->keyed && !s->resuming) {
+        printf("[VPN] Server lost session %08x\n", s->id);
+        return 1;
+    }
+    return 0;
+}
+
+// UDP event loop: every TUN packet becomes one datagram with a
+// session/sequence header, every valid datagram becomes one TUN packet.
+// Both directions move up to VPN_BATCH_MAX datagrams per syscall. With
+// probe_pmtu, the loop also searches for the path MTU and keeps the TUN MTU
+// fitted to it.
+void vpn_udp_event_loop(int tun_fd, int udp_fd, int probe_pmtu, struct vpn_stats *stats) {
+    struct vpn_pool pool;
+    unsigned char *bufs[VPN_BATCH_MAX];
+    unsigned char *rx_bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+    struct iovec rx_iov[VPN_BATCH_MAX];
+    struct mmsghdr msgs[VPN_BATCH_MAX];
+    struct vpn_aead_op ops[VPN_BATCH_MAX];
+    uint64_t rx_seqs[VPN_BATCH_MAX];
+    int rx_types[VPN_BATCH_MAX];
+    struct vpn_batch_stats tx_stats = {0}, rx_stats = {0};
+    unsigned int report_seen = 0;
+    struct udp_session session = {0};
+    struct vpn_pmtu pmtu;
+    unsigned char *probe_buf = NULL;
+    int path_mtu = 0;               // As applied to the TUN device
+    time_t last_tx = 0, last_setup;
+    fd_set read_fds;
+    int max_fd = (tun_fd > udp_fd) ? tun_fd : udp_fd;
+
+    printf("[VPN] Starting UDP event loop...\n");
+
+    // One pool buffer per packet of each batch, plus one per cut segment
+    // with offloads, and one for probes. Headers go in the headroom, so a
+    // datagram is always one contiguous run in one buffer.
+    if (vpn_pool_init(&pool, (tun_offload ? 3 : 2) * VPN_BATCH_MAX + 1) < 0) {
+        perror("Failed to set up packet buffers");
+        return;
+    }
+    for (int i = 0; i < VPN_BATCH_MAX; i++) {
+        bufs[i] = vpn_pkt_get(&pool)->data;
+        rx_bufs[i] = vpn_pkt_get(&pool)->data - VPN_UDP_HDR_SIZE;
+        rx_iov[i].iov_base = rx_bufs[i];
+        rx_iov[i].iov_len = VPN_UDP_HDR_SIZE + VPN_PKT_MAX + VPN_TAG_SIZE;
+    }
+    if (probe_pmtu) {
+        // Start at the route's MTU; the search takes it down if the path
+        // is narrower
+        probe_buf = vpn_pkt_get(&pool)->data - VPN_UDP_HDR_SIZE;
+        path_mtu = vpn_pmtu_socket(udp_fd);
+        vpn_pmtu_init(&pmtu, path_mtu, time(NULL));
+        apply_path_mtu(path_mtu);
+    }
+    // Datagrams always carry ordinary packets
+    struct tx_link tx = {
+        .fd = udp_fd, .udp = 1, .aead = &session.aead, .pool = &pool, .stats = stats,
+    };
+    fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    // No packets flow until the server has answered our HELLO
+    if (udp_session_start(&session, &tx, udp_fd, stats) < 0) {
+        goto out;
+    }
+    last_setup = time(NULL);
+
+    while (1) {
+        time_t now = time(NULL);
+        if (!session.keyed || session.resuming) {
+            // HELLOs and RESUMEs get lost like any datagram: repeat until answered
+            if (now - last_setup >= VPN_UDP_HELLO_RETRY_SEC) {
+                if (session.resuming) {
+                    send_udp_resume(udp_fd, &session, stats);
+                } else {
+                    send_udp_hello(udp_fd, &session);
+                }
+                last_setup = now;
+            }
+        }
+        if (session.keyed && now - last_tx >= VPN_UDP_KEEPALIVE_SEC) {
+            // Keep the session (and any NAT mapping on the way) alive while
+            // idle. The keepalive is sealed too (just a tag), so nobody else
+            // can use one to steer the session to another address.
+            unsigned char dgram[VPN_UDP_HDR_SIZE + VPN_TAG_SIZE];
+            vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_KEEPALIVE, session.id, ++tx.tx_seq);
+            struct vpn_aead_op op = {
+                .data = dgram + VPN_UDP_HDR_SIZE, .len = 0,
+                .aad = dgram, .aad_len = VPN_UDP_HDR_SIZE,
+            };
+            vpn_aead_nonce(op.nonce, VPN_DIR_TO_SERVER, tx.tx_seq);
+            vpn_stats_seal(stats, &session.aead, &op, 1);
+            if (send(udp_fd, dgram, sizeof(dgram), 0) < 0) {
+                udp_send_failed(udp_fd, "Failed to send keepalive");
+            }
+            last_tx = now;
+        }
+        int probing = probe_pmtu && session.keyed && !session.resuming;
+        if (probing) {
+            int size = vpn_pmtu_next_probe(&pmtu, now);
+            if (size) {
+                send_udp_probe(udp_fd, &tx, probe_buf, size, stats);
+            }
+        }
+
+        FD_ZERO(&read_fds);
+        FD_SET(tun_fd, &read_fds);
+        FD_SET(udp_fd, &read_fds);
+
+        struct timeval timeout = {
+            .tv_sec = session.keyed && !session.resuming ? VPN_UDP_KEEPALIVE_SEC
+                                                         : VPN_UDP_HELLO_RETRY_SEC,
+            .tv_usec = 0,
+        };
+        if (probing && vpn_pmtu_timeout(&pmtu, now) < timeout.tv_sec) {
+            timeout.tv_sec = vpn_pmtu_timeout(&pmtu, now);
+        }
+        int ret = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
+        uint64_t wakeup = vpn_stats_clock();
+        if (vpn_batch_report_requested(&report_seen)) {
+            vpn_batch_print("TUN→SERVER", &tx_stats);
+            vpn_batch_print("SERVER→TUN", &rx_stats);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            perror("select() failed");
+            break;
+        }
+
+        // Data from TUN device (app → server): one packet, one datagram
+        if (FD_ISSET(tun_fd, &read_fds)) {
+            int count = vpn_read_batch(tun_fd, bufs, lens, VPN_BATCH_MAX,
+                                       tun_offload ? VPN_GSO_READ_MAX : VPN_PKT_MAX);
+            if (count < 0) {
+                perror("Failed to read from TUN device");
+                break;
+            }
+            if (!session.keyed) {
+                // No session key yet: drop, like a link that is still down
+                vpn_stat_add(stats, VPN_STAT_DROP_NO_ROUTE, count);
+                count = 0;
+            }
+
+            if (count > 0) {
+                if (vpn_trace(stats)) {
+                    printf("[TUN→SERVER] Read %d packets from TUN\n", count);
+                }
+                send_tun_packets(&tx, bufs, lens, count);
+                vpn_batch_record(&tx_stats, count);
+                last_tx = time(NULL);
+            }
+        }
+
+        // Data from server (server → app)
+        if (FD_ISSET(udp_fd, &read_fds)) {
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < VPN_BATCH_MAX; i++) {
+                msgs[i].msg_hdr.msg_iov = &rx_iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int count = recvmmsg(udp_fd, msgs, VPN_BATCH_MAX, MSG_DONTWAIT, NULL);
+            if (count < 0) {
+                // ICMP port unreachable from an earlier send shows up here
+                if (errno != ECONNREFUSED && errno != EINTR && errno != EAGAIN) {
+                    perror("Failed to receive datagrams");
+                }
+                continue;
+            }
+            vpn_batch_record(&rx_stats, count);
+
+            // Collect the datagrams worth decrypting, then open them in one batch
+            int n_ops = 0;
+            int restart = 0;
+            for (int i = 0; i < count; i++) {
+                unsigned char *buffer = rx_bufs[i];
+                int n = msgs[i].msg_len;
+
+                uint32_t rx_session;
+                uint64_t seq;
+                int type = vpn_udp_parse_hdr(buffer, n, &rx_session, &seq);
+                if (type < 0 || rx_session != session.id) {
+                    continue;
+                }
+
+                if (type == VPN_UDP_HELLO || type == VPN_UDP_RESUME || type == VPN_UDP_RETRY) {
+                    int was_keyed = session.keyed;
+                    int setup = handle_udp_setup(&session, type, buffer, n, stats);
+                    if (setup < 0) {
+                        goto out;
+                    }
+                    restart |= setup;
+                    if (!was_keyed && session.keyed) {
+                        last_tx = 0;  // Send a keepalive right away, so the server sees the key work
+                    }
+                    continue;
+                }
+
+                int packet_len = n - VPN_UDP_HDR_SIZE - VPN_TAG_SIZE;
+                int size_ok = type == VPN_UDP_PROBE ? packet_len == 2 : packet_len > 0;
+                if ((type != VPN_UDP_DATA && type != VPN_UDP_PROBE) || !session.keyed || !size_ok) {
+                    continue;
+                }
+                if (!vpn_replay_check(&session.replay, seq)) {
+                    vpn_stat_add(stats, VPN_STAT_DROP_REPLAY, 1);
+                    continue;  // Duplicate or too old
+                }
+
+                ops[n_ops] = (struct vpn_aead_op){
+                    .data = buffer + VPN_UDP_HDR_SIZE, .len = packet_len,
+                    .aad = buffer, .aad_len = VPN_UDP_HDR_SIZE,
+                };
+                vpn_aead_nonce(ops[n_ops].nonce, VPN_DIR_TO_CLIENT, seq);
+                rx_seqs[n_ops] = seq;
+                rx_types[n_ops] = type;
+                n_ops++;
+            }
+
+            vpn_stats_open(stats, &session.aead, ops, n_ops);
+
+            int n_valid = 0;
+            for (int i = 0; i < n_ops; i++) {
+                // Forged datagrams are dropped. The second check catches a
+                // datagram that was duplicated within this batch.
+                if (!ops[i].ok) {
+                    continue;
+                }
+                if (!vpn_replay_check(&session.replay, rx_seqs[i])) {
+                    vpn_stat_add(stats, VPN_STAT_DROP_REPLAY, 1);
+                    continue;
+                }
+                vpn_replay_update(&session.replay, rx_seqs[i]);
+                if (rx_types[i] == VPN_UDP_PROBE) {
+                    // The server's answer: the UDP payload size that got there
+                    if (probe_pmtu) {
+                        vpn_pmtu_acked(&pmtu, (ops[i].data[0] << 8 | ops[i].data[1]) + 28, time(NULL));
+                    }
+                    continue;
+                }
+                ops[n_valid++] = ops[i];
+            }
+            deliver_to_tun(stats, tun_fd, ops, n_valid, 0);
+
+            // Only once this batch is done with the old key
+            if (restart) {
+                if (udp_session_start(&session, &tx, udp_fd, stats) < 0) {
+                    break;
+                }
+                last_setup = time(NULL);
+            }
+        }
+        if (probe_pmtu && pmtu.mtu && pmtu.mtu != path_mtu) {
+            path_mtu = pmtu.mtu;
+            apply_path_mtu(path_mtu);
+        }
+        vpn_stats_wakeup(stats, wakeup);
+    }
+
+out:
+    vpn_batch_print("TUN→SERVER", &tx_stats);
+    vpn_batch_print("SERVER→TUN", &rx_stats);
+    vpn_aead_wipe(&session.aead);
+    memset(&session.ticket, 0, sizeof(session.ticket));
+    vpn_pool_free(&pool);
+}
+
+// =============================================================================
+// Pipelined mode (-P): one thread per stage
+// =============================================================================
+//
+//   TUN reader ──► crypto 0..N-1 (seal) ──► sender ──► socket
+//   TUN writer ◄── crypto 0..N-1 (open) ◄── receiver ◄── socket
+//
+// Batches of up to VPN_BATCH_MAX packets travel through SPSC rings (see
+// vpn_ring.h). The first stage of each direction deals batches out to the
+// crypto threads in turn, and the last collects them in the same order, so
+// packets leave in the order they came in: TCP frame numbers stay in
+// sequence. Each direction owns -B batches, with their buffers: a batch
+// goes back to the first stage once the last is done with it. When all are
+// in flight the first stage stops reading, and the kernel queues (TUN
+// txqueuelen, socket buffer) take the backpressure.
+
+#define MAX_PIPE_CRYPTO 16
+#define PIPE_DEFAULT_DEPTH 16              // -B
+
+struct pipe_batch {
+    int count;
+    struct vpn_pkt *pkts[VPN_BATCH_MAX];    // Owned by the batch for good
+    struct vpn_aead_op ops[VPN_BATCH_MAX];  // The packets in flight (aad: their header)
+    uint64_t seqs[VPN_BATCH_MAX];           // Their sequence/frame numbers
+};
+
+// One direction: free batches → first stage → crypto[i] → last stage
+struct pipe_dir {
+    struct pipe_batch *batches;
+    struct vpn_ring free;
+    struct vpn_ring in[MAX_PIPE_CRYPTO], out[MAX_PIPE_CRYPTO];
+    struct vpn_waiter first_wait, last_wait;
+};
+
+struct pipeline {
+    int tun_fd, sock_fd, udp;
+    const struct vpn_aead *aead;
+    struct udp_session *session;            // UDP; only the receiver changes it
+    int num_crypto, depth;
+    struct vpn_pool pool;
+    struct pipe_dir tx, rx;
+    struct vpn_waiter crypto_wait[MAX_PIPE_CRYPTO];
+    struct vpn_stats *reader_stats, *sender_stats, *receiver_stats, *writer_stats;
+    struct vpn_stats *crypto_stats[MAX_PIPE_CRYPTO];
+    _Atomic uint64_t tx_seq;                // Last sequence/frame number handed out
+    atomic_int resuming;                    // UDP: copy of session->resuming, for the sender
+    atomic_int stop;
+    int restart;                            // UDP: the session was lost
+};
+
+static void pipe_stop(struct pipeline *pl) {
+    atomic_store(&pl->stop, 1);
+    vpn_waiter_notify(&pl->tx.first_wait);
+    vpn_waiter_notify(&pl->tx.last_wait);
+    vpn_waiter_notify(&pl->rx.first_wait);
+    vpn_waiter_notify(&pl->rx.last_wait);
+    for (int i = 0; i < pl->num_crypto; i++) {
+        vpn_waiter_notify(&pl->crypto_wait[i]);
+    }
+}
+
+// Rings hold every batch of their direction, so a push can't fail
+static void pipe_push(struct vpn_ring *r, struct pipe_batch *b, struct vpn_waiter *w) {
+    vpn_ring_push(r, b);
+    vpn_waiter_notify(w);
+}
+
+// Take the next batch off r, waiting on w while it is empty. Returns NULL
+// once the pipeline stops, or when timeout_ms (-1: none) passes first.
+static struct pipe_batch *pipe_pop(struct pipeline *pl, struct vpn_ring *r, struct vpn_waiter *w,
+                                   int timeout_ms) {
+    for (;;) {
+        uint32_t seen = vpn_waiter_prepare(w);
+        if (atomic_load_explicit(&pl->stop, memory_order_relaxed)) {
+            return NULL;
+        }
+        struct pipe_batch *b = vpn_ring_pop(r);
+        if (b) {
+            return b;
+        }
+        if (!vpn_waiter_wait(w, seen, timeout_ms)) {
+            return NULL;
+        }
+    }
+}
+
+// Wait until fd is readable. Returns 1, or 0 if the pipeline stops first.
+static int pipe_poll(struct pipeline *pl, int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    while (!atomic_load_explicit(&pl->stop, memory_order_relaxed)) {
+        // Wake up now and then to notice a stop
+        if (poll(&pfd, 1, 100) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// TUN reader: fill free batches with packets and deal them out for sealing
+static void *pipe_tun_reader(void *arg) {
+    struct pipeline *pl = arg;
+    unsigned char *bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+    int next = 0;
+
+    struct pipe_batch *b;
+    while ((b = pipe_pop(pl, &pl->tx.free, &pl->tx.first_wait, -1))) {
+        int count = 0;
+        while (count == 0 && pipe_poll(pl, pl->tun_fd)) {
+            for (int i = 0; i < VPN_BATCH_MAX; i++) {
+                vpn_pkt_reset(b->pkts[i]);
+                bufs[i] = b->pkts[i]->data;
+            }
+            count = vpn_read_batch(pl->tun_fd, bufs, lens, VPN_BATCH_MAX, VPN_PKT_MAX);
+            if (count < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("Failed to read from TUN device");
+                pipe_stop(pl);
+            }
+        }
+        if (count <= 0) {
+            break;
+        }
+
+        uint64_t seq = atomic_fetch_add(&pl->tx_seq, count) + 1;
+        for (int i = 0; i < count; i++) {
+            b->ops[i] = (struct vpn_aead_op){.data = bufs[i], .len = lens[i]};
+            b->seqs[i] = seq + i;
+        }
+        b->count = count;
+        if (vpn_trace(pl->reader_stats)) {
+            printf("[TUN→SERVER] Read %d packets from TUN, to crypto %d\n", count, next);
+        }
+        pipe_push(&pl->tx.in[next], b, &pl->crypto_wait[next]);
+        next = (next + 1) % pl->num_crypto;
+    }
+    return NULL;
+}
+
+// Crypto: put each packet's header in front of it and seal the batch
+static void pipe_seal(struct pipeline *pl, struct pipe_batch *b, struct vpn_stats *stats) {
+    for (int i = 0; i < b->count; i++) {
+        struct vpn_aead_op *op = &b->ops[i];
+        if (pl->udp) {
+            unsigned char *dgram = op->data - VPN_UDP_HDR_SIZE;
+            vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_DATA, pl->session->id,
+                              b->seqs[i]);
+            op->aad = dgram;
+            op->aad_len = VPN_UDP_HDR_SIZE;
+        } else {
+            unsigned char *frame = op->data - VPN_FRAME_HDR_SIZE;
+            uint16_t frame_len = htons(op->len + VPN_TAG_SIZE);
+            memcpy(frame, &frame_len, VPN_FRAME_HDR_SIZE);
+            op->aad = frame;
+            op->aad_len = VPN_FRAME_HDR_SIZE;
+        }
+        vpn_aead_nonce(op->nonce, VPN_DIR_TO_SERVER, b->seqs[i]);
+    }
+    vpn_stats_seal(stats, pl->aead, b->ops, b->count);
+}
+
+struct pipe_crypto_arg {
+    struct pipeline *pl;
+    int id;
+};
+
+// Crypto thread: seal what the reader deals us, open what the receiver does
+static void *pipe_crypto(void *arg) {
+    struct pipe_crypto_arg *ca = arg;
+    struct pipeline *pl = ca->pl;
+    int id = ca->id;
+    struct vpn_waiter *w = &pl->crypto_wait[id];
+    struct vpn_stats *stats = pl->crypto_stats[id];
+
+    while (!atomic_load_explicit(&pl->stop, memory_order_relaxed)) {
+        uint32_t seen = vpn_waiter_prepare(w);
+        struct pipe_batch *b;
+        int busy = 0;
+
+        if ((b = vpn_ring_pop(&pl->tx.in[id]))) {
+            pipe_seal(pl, b, stats);
+            pipe_push(&pl->tx.out[id], b, &pl->tx.last_wait);
+            busy = 1;
+        }
+        if ((b = vpn_ring_pop(&pl->rx.in[id]))) {
+            vpn_stats_open(stats, pl->aead, b->ops, b->count);
+            pipe_push(&pl->rx.out[id], b, &pl->rx.last_wait);
+            busy = 1;
+        }
+        if (!busy) {
+            vpn_waiter_wait(w, seen, -1);
+        }
+    }
+    return NULL;
+}
+
+// UDP: a sealed keepalive, so the session (and NAT mappings) stay up
+static void pipe_send_keepalive(struct pipeline *pl) {
+    unsigned char dgram[VPN_UDP_HDR_SIZE + VPN_TAG_SIZE];
+    uint64_t seq = atomic_fetch_add(&pl->tx_seq, 1) + 1;
+
+    vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_KEEPALIVE, pl->session->id, seq);
+    struct vpn_aead_op op = {
+        .data = dgram + VPN_UDP_HDR_SIZE, .len = 0,
+        .aad = dgram, .aad_len = VPN_UDP_HDR_SIZE,
+    };
+    vpn_aead_nonce(op.nonce, VPN_DIR_TO_SERVER, seq);
+    vpn_stats_seal(pl->sender_stats, pl->aead, &op, 1);
+    if (send(pl->sock_fd, dgram, sizeof(dgram), 0) < 0) {
+        udp_send_failed(pl->sock_fd, "Failed to send keepalive");
+    }
+}
+
+// Socket sender: collect sealed batches in dealing order and send them. For
+// UDP it also keeps the session alive and repeats an unanswered RESUME.
+static void *pipe_sender(void *arg) {
+    struct pipeline *pl = arg;
+    struct iovec iov[VPN_BATCH_MAX];
+    struct mmsghdr msgs[VPN_BATCH_MAX];
+    time_t last_tx = 0, last_setup = time(NULL);   // A keepalive first: the server sees the key work
+    int next = 0;
+
+    while (!atomic_load_explicit(&pl->stop, memory_order_relaxed)) {
+        struct pipe_batch *b = pipe_pop(pl, &pl->tx.out[next], &pl->tx.last_wait,
+                                        pl->udp ? 1000 : -1);
+        time_t now = time(NULL);
+        if (pl->udp && atomic_load(&pl->resuming) && now - last_setup >= VPN_UDP_HELLO_RETRY_SEC) {
+            send_udp_resume(pl->sock_fd, pl->session, pl->sender_stats);
+            last_setup = now;
+        }
+        if (!b) {
+            if (pl->udp && now - last_tx >= VPN_UDP_KEEPALIVE_SEC) {
+                pipe_send_keepalive(pl);
+                last_tx = now;
+            }
+            continue;
+        }
+
+        uint64_t bytes = 0;
+        for (int i = 0; i < b->count; i++) {
+            struct vpn_aead_op *op = &b->ops[i];
+            iov[i].iov_base = (void *)op->aad;
+            iov[i].iov_len = op->aad_len + op->len + VPN_TAG_SIZE;
+            bytes += op->len;
+        }
+        if (pl->udp) {
+            memset(msgs, 0, sizeof(msgs[0]) * b->count);
+            for (int i = 0; i < b->count; i++) {
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            for (int sent = 0; sent < b->count; ) {
+                int n = sendmmsg(pl->sock_fd, msgs + sent, b->count - sent, 0);
+                if (n < 0) {
+                    udp_send_failed(pl->sock_fd, "Failed to send datagrams to server");
+                    vpn_stat_add(pl->sender_stats, VPN_STAT_DROP_QUEUE, 1);
+                    n = 1;
+                }
+                sent += n;
+            }
+        } else if (vpn_writev_all(pl->sock_fd, iov, b->count) < 0) {
+            perror("Failed to send packets to server");
+            pipe_stop(pl);
+            break;
+        }
+        vpn_stat_batch(pl->sender_stats, VPN_STAT_TX_PACKETS, b->count, bytes);
+        last_tx = now;
+
+        pipe_push(&pl->tx.free, b, &pl->tx.first_wait);
+        next = (next + 1) % pl->num_crypto;
+    }
+    return NULL;
+}
+
+// Receiver, TCP: cut frames out of the stream into batches. Frames are
+// copied out of the ring (with their length prefix, the associated data),
+// since they outlive the next read.
+static void pipe_receive_frames(struct pipeline *pl) {
+    struct vpn_stream rx;
+    uint64_t rx_seq = 0;
+    int next = 0;
+
+    if (vpn_stream_init(&rx, VPN_STREAM_SIZE) < 0) {
+        perror("Failed to set up receive ring");
+        pipe_stop(pl);
+        return;
+    }
+
+    struct pipe_batch *b;
+    while ((b = pipe_pop(pl, &pl->rx.free, &pl->rx.first_wait, -1))) {
+        b->count = 0;
+        while (b->count < VPN_BATCH_MAX) {
+            unsigned char *payload;
+            uint16_t len;
+            int more = vpn_stream_next_frame(&rx, VPN_PKT_MAX + VPN_TAG_SIZE, &payload, &len);
+            if (more < 0 || (more == 1 && len <= VPN_TAG_SIZE)) {
+                fprintf(stderr, "[CLIENT] Corrupt stream from server\n");
+                goto stop;
+            }
+            if (more == 1) {
+                struct vpn_pkt *pkt = b->pkts[b->count];
+                vpn_pkt_reset(pkt);
+                uint16_t frame_len = htons(len);
+                memcpy(pkt->data - VPN_FRAME_HDR_SIZE, &frame_len, VPN_FRAME_HDR_SIZE);
+                memcpy(pkt->data, payload, len);
+                struct vpn_aead_op *op = &b->ops[b->count++];
+                *op = (struct vpn_aead_op){
+                    .data = pkt->data, .len = len - VPN_TAG_SIZE,
+                    .aad = pkt->data - VPN_FRAME_HDR_SIZE, .aad_len = VPN_FRAME_HDR_SIZE,
+                };
+                vpn_aead_nonce(op->nonce, VPN_DIR_TO_CLIENT, ++rx_seq);
+                continue;
+            }
+
+            // Send off what we have before waiting for more
+            if (b->count > 0) {
+                break;
+            }
+            if (!pipe_poll(pl, pl->sock_fd)) {
+                goto stop;
+            }
+            ssize_t n = vpn_stream_fill(&rx, pl->sock_fd);
+            if (n <= 0) {
+                if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                    continue;
+                }
+                printf("[SERVER] Server disconnected\n");
+                goto stop;
+            }
+        }
+        pipe_push(&pl->rx.in[next], b, &pl->crypto_wait[next]);
+        next = (next + 1) % pl->num_crypto;
+    }
+    vpn_stream_free(&rx);
+    return;
+
+stop:
+    pipe_stop(pl);
+    vpn_stream_free(&rx);
+}
+
+// Receiver, UDP: receive into batches, keep the DATA of our session, and
+// handle the server's answers and RETRYs here
+static void pipe_receive_datagrams(struct pipeline *pl) {
+    struct udp_session *s = pl->session;
+    struct iovec iov[VPN_BATCH_MAX];
+    struct mmsghdr msgs[VPN_BATCH_MAX];
+    int next = 0;
+
+    // A batch that ends up empty is filled again
+    struct pipe_batch *b = NULL;
+    while (b || (b = pipe_pop(pl, &pl->rx.free, &pl->rx.first_wait, -1))) {
+        int count = 0;
+        while (count <= 0 && pipe_poll(pl, pl->sock_fd)) {
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < VPN_BATCH_MAX; i++) {
+                vpn_pkt_reset(b->pkts[i]);
+                iov[i].iov_base = b->pkts[i]->data - VPN_UDP_HDR_SIZE;
+                iov[i].iov_len = VPN_UDP_HDR_SIZE + VPN_PKT_MAX + VPN_TAG_SIZE;
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            count = recvmmsg(pl->sock_fd, msgs, VPN_BATCH_MAX, MSG_DONTWAIT, NULL);
+            // ICMP port unreachable from an earlier send shows up here
+            if (count < 0 && errno != ECONNREFUSED && errno != EINTR && errno != EAGAIN) {
+                perror("Failed to receive datagrams");
+            }
+        }
+        if (count <= 0) {
+            break;
+        }
+
+        b->count = 0;
+        for (int i = 0; i < count; i++) {
+            unsigned char *buffer = iov[i].iov_base;
+            int n = msgs[i].msg_len;
+            uint32_t rx_session;
+            uint64_t seq;
+            int type = vpn_udp_parse_hdr(buffer, n, &rx_session, &seq);
+            if (type < 0 || rx_session != s->id) {
+                continue;
+            }
+
+            if (type == VPN_UDP_HELLO || type == VPN_UDP_RESUME || type == VPN_UDP_RETRY) {
+                int ret = handle_udp_setup(s, type, buffer, n, pl->receiver_stats);
+                atomic_store(&pl->resuming, s->resuming);
+                if (ret != 0) {
+                    pl->restart = ret > 0;
+                    pipe_stop(pl);
+                    return;
+                }
+                continue;
+            }
+
+            int packet_len = n - VPN_UDP_HDR_SIZE - VPN_TAG_SIZE;
+            if (type != VPN_UDP_DATA || packet_len <= 0) {
+                continue;
+            }
+            struct vpn_aead_op *op = &b->ops[b->count];
+            *op = (struct vpn_aead_op){
+                .data = buffer + VPN_UDP_HDR_SIZE, .len = packet_len,
+                .aad = buffer, .aad_len = VPN_UDP_HDR_SIZE,
+            };
+            vpn_aead_nonce(op->nonce, VPN_DIR_TO_CLIENT, seq);
+            b->seqs[b->count++] = seq;
+        }
+
+        if (b->count == 0) {
+            continue;
+        }
+        pipe_push(&pl->rx.in[next], b, &pl->crypto_wait[next]);
+        next = (next + 1) % pl->num_crypto;
+        b = NULL;
+    }
+}
+
+static void *pipe_receiver(void *arg) {
+    struct pipeline *pl = arg;
+
+    if (pl->udp) {
+        pipe_receive_datagrams(pl);
+    } else {
+        pipe_receive_frames(pl);
+    }
+    return NULL;
+}
+
+// TUN writer: collect opened batches in dealing order and inject them
+static void *pipe_tun_writer(void *arg) {
+    struct pipeline *pl = arg;
+    struct udp_session *s = pl->session;
+    int next = 0;
+
+    struct pipe_batch *b;
+    while ((b = pipe_pop(pl, &pl->rx.out[next], &pl->rx.last_wait, -1))) {
+        int n_valid = 0;
+        for (int i = 0; i < b->count; i++) {
+            if (!b->ops[i].ok) {
+                if (!pl->udp) {
+                    fprintf(stderr, "[SERVER] Bad or forged frame, dropping connection\n");
+                    pipe_stop(pl);
+                    return NULL;
+                }
+                continue;  // Forged datagram
+            }
+            if (pl->udp) {
+                // Only now that it verified: duplicates and old datagrams go
+                if (!vpn_replay_check(&s->replay, b->seqs[i])) {
+                    vpn_stat_add(pl->writer_stats, VPN_STAT_DROP_REPLAY, 1);
+                    continue;
+                }
+                vpn_replay_update(&s->replay, b->seqs[i]);
+            }
+            b->ops[n_valid++] = b->ops[i];
+        }
+        deliver_to_tun(pl->writer_stats, pl->tun_fd, b->ops, n_valid, 0);
+
+        pipe_push(&pl->rx.free, b, &pl->rx.first_wait);
+        next = (next + 1) % pl->num_crypto;
+    }
+    return NULL;
+}
+
+static int pipe_dir_init(struct pipeline *pl, struct pipe_dir *d) {
+    d->batches = calloc(pl->depth, sizeof(d->batches[0]));
+    if (!d->batches || vpn_ring_init(&d->free, pl->depth) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < pl->num_crypto; i++) {
+        if (vpn_ring_init(&d->in[i], pl->depth) < 0 || vpn_ring_init(&d->out[i], pl->depth) < 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < pl->depth; i++) {
+        for (int j = 0; j < VPN_BATCH_MAX; j++) {
+            d->batches[i].pkts[j] = vpn_pkt_get(&pl->pool);
+        }
+    }
+    return 0;
+}
+
+static void pipe_dir_free(struct pipeline *pl, struct pipe_dir *d) {
+    free(d->batches);
+    vpn_ring_free(&d->free);
+    for (int i = 0; i < pl->num_crypto; i++) {
+        vpn_ring_free(&d->in[i]);
+        vpn_ring_free(&d->out[i]);
+    }
+}
+
+// Every batch back in the free ring, the others empty
+static void pipe_dir_reset(struct pipeline *pl, struct pipe_dir *d) {
+    vpn_ring_reset(&d->free);
+    for (int i = 0; i < pl->num_crypto; i++) {
+        vpn_ring_reset(&d->in[i]);
+        vpn_ring_reset(&d->out[i]);
+    }
+    for (int i = 0; i < pl->depth; i++) {
+        vpn_ring_push(&d->free, &d->batches[i]);
+    }
+}
+
+// Run the stage threads until the pipeline stops
+static int pipe_run_stages(struct pipeline *pl) {
+    pthread_t sender, receiver, writer, crypto[MAX_PIPE_CRYPTO];
+    struct pipe_crypto_arg args[MAX_PIPE_CRYPTO];
+    int started = 0;
+
+    atomic_store(&pl->stop, 0);
+    pl->restart = 0;
+    pipe_dir_reset(pl, &pl->tx);
+    pipe_dir_reset(pl, &pl->rx);
+
+    for (int i = 0; i < pl->num_crypto; i++) {
+        args[i] = (struct pipe_crypto_arg){.pl = pl, .id = i};
+        if (pthread_create(&crypto[i], NULL, pipe_crypto, &args[i]) != 0) {
+            goto fail;
+        }
+        started++;
+    }
+    if (pthread_create(&writer, NULL, pipe_tun_writer, pl) != 0) {
+        goto fail;
+    }
+    if (pthread_create(&sender, NULL, pipe_sender, pl) != 0) {
+        pipe_stop(pl);
+        pthread_join(writer, NULL);
+        goto fail;
+    }
+    if (pthread_create(&receiver, NULL, pipe_receiver, pl) != 0) {
+        pipe_stop(pl);
+        pthread_join(writer, NULL);
+        pthread_join(sender, NULL);
+        goto fail;
+    }
+    pipe_tun_reader(pl);                    // The reader stage is us
+
+    pthread_join(receiver, NULL);
+    pthread_join(sender, NULL);
+    pthread_join(writer, NULL);
+    for (int i = 0; i < started; i++) {
+        pthread_join(crypto[i], NULL);
+    }
+    return 0;
+
+fail:
+    perror("Failed to start pipeline threads");
+    pipe_stop(pl);
+    for (int i = 0; i < started; i++) {
+        pthread_join(crypto[i], NULL);
+    }
+    return -1;
+}
+
+// UDP, before the stages start: wait for the answer to our HELLO.
+// Returns 0 once keyed, or -1 on a fatal error.
+static int pipe_udp_wait_keyed(struct pipeline *pl) {
+    struct udp_session *s = pl->session;
+    struct pollfd pfd = {.fd = pl->sock_fd, .events = POLLIN};
+    unsigned char buffer[VPN_UDP_HDR_SIZE + VPN_HELLO_SIZE + VPN_TICKET_SIZE];
+    time_t last_setup = time(NULL);
+
+    while (!s->keyed) {
+        time_t now = time(NULL);
+        if (now - last_setup >= VPN_UDP_HELLO_RETRY_SEC) {
+            send_udp_hello(pl->sock_fd, s);
+            last_setup = now;
+        }
+        if (poll(&pfd, 1, VPN_UDP_HELLO_RETRY_SEC * 1000) <= 0) {
+            continue;
+        }
+
+        ssize_t n = recv(pl->sock_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        uint32_t rx_session;
+        uint64_t seq;
+        int type = n > 0 ? vpn_udp_parse_hdr(buffer, n, &rx_session, &seq) : -1;
+        if (type == VPN_UDP_HELLO && rx_session == s->id &&
+            handle_udp_setup(s, type, buffer, n, pl->receiver_stats) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Pipelined event loop. tcp_aead is the key of a TCP session (already
+// handshaken); for UDP (udp_fd as sock_fd) the session is set up here, and
+// started over whenever the server loses it.
+void vpn_pipeline_run(int tun_fd, int sock_fd, int udp, const struct vpn_aead *tcp_aead,
+                      int num_crypto, int depth) {
+    struct udp_session session = {0};
+    struct pipeline *pl = calloc(1, sizeof(*pl));
+    char name[32];
+
+    if (!pl) {
+        perror("Failed to set up pipeline");
+        return;
+    }
+    *pl = (struct pipeline){
+        .tun_fd = tun_fd, .sock_fd = sock_fd, .udp = udp,
+        .aead = udp ? &session.aead : tcp_aead, .session = &session,
+        .num_crypto = num_crypto, .depth = depth,
+    };
+    printf("[VPN] Starting pipelined event loop (%s, %d crypto threads, %d batches in flight)...\n",
+           udp ? "UDP" : "TCP", num_crypto, depth);
+
+    // Each direction's batches own their buffers for good
+    if (vpn_pool_init(&pl->pool, 2 * depth * VPN_BATCH_MAX) < 0 ||
+        pipe_dir_init(pl, &pl->tx) < 0 || pipe_dir_init(pl, &pl->rx) < 0) {
+        perror("Failed to set up pipeline");
+        goto out;
+    }
+    pl->reader_stats = vpn_stats_new("tun reader");
+    pl->sender_stats = vpn_stats_new("sender");
+    pl->receiver_stats = vpn_stats_new("receiver");
+    pl->writer_stats = vpn_stats_new("tun writer");
+    for (int i = 0; i < num_crypto; i++) {
+        snprintf(name, sizeof(name), "crypto %d", i);
+        pl->crypto_stats[i] = vpn_stats_new(name);
+    }
+    fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    do {
+        if (udp) {
+            // Packets only flow once the session is keyed, so the session
+            // key stays the same while the stages run
+            if (udp_session_start(&session, NULL, sock_fd, pl->receiver_stats) < 0 ||
+                pipe_udp_wait_keyed(pl) < 0) {
                 break;
             }
+            atomic_store(&pl->resuming, session.resuming);
+        }
+        atomic_store(&pl->tx_seq, 0);
+        if (pipe_run_stages(pl) < 0) {
+            break;
+        }
+    } while (pl->restart);
+
+out:
+    vpn_aead_wipe(&session.aead);
+    memset(&session.ticket, 0, sizeof(session.ticket));
+    pipe_dir_free(pl, &pl->tx);
+    pipe_dir_free(pl, &pl->rx);
+    vpn_pool_free(&pl->pool);
+    free(pl);
+}
+
+// One (TUN queue, server connection) pair served by its own thread
+struct client_worker {
+    int id;
+    int tun_fd;
+    int server_fd;
+    int udp;
+    struct vpn_aead aead;       // TCP: this connection's session key
+    int peer_gso;               // TCP: super-packet types the server takes whole
+    int probe_pmtu;             // UDP: this queue searches for the path MTU
+    struct vpn_stats *stats;
+    pthread_t thread;
+};
+
+static void *client_worker_main(void *arg) {
+    struct client_worker *cw = arg;
+
+    int cpu = pin_thread_to_cpu(cw->id);
+    if (cpu >= 0) {
+        printf("[VPN] Queue %d pinned to CPU %d\n", cw->id, cpu);
+    }
+
+    if (cw->udp) {
+        vpn_udp_event_loop(cw->tun_fd, cw->server_fd, cw->probe_pmtu, cw->stats);
+    } else {
+        vpn_event_loop(cw->tun_fd, cw->server_fd, &cw->aead, cw->peer_gso, cw->stats);
+    }
+    return NULL;
+}
+
+// -a: configure the TUN device ourselves; otherwise wait for it to be done
+// by hand. Either way, note the MTU it ends up with.
+static void setup_tun(const char *tun_name, const char *addr, int mtu) {
+    tun_dev = tun_name;
+    if (addr) {
+        if (configure_tun_device(tun_name, addr, mtu) < 0) {
+            exit(1);
         }
+    } else {
+        printf("\n[SETUP] Please configure the TUN device in another terminal:\n");
+        printf("        sudo ip addr add 10.8.0.2/24 dev %s\n", tun_name);
+        printf("        sudo ip link set %s up\n", tun_name);
+        printf("        sudo ip route add 8.8.8.8/32 dev %s\n", tun_name);
+        printf("\n[SETUP] This routes 8.8.8.8 through the VPN tunnel\n");
+        printf("[SETUP] Press Enter when ready (or start with -a 10.8.0.2/24)...");
+        getchar();
+    }
+
+    mtu = get_tun_mtu(tun_name);
+    if (mtu > 0) {
+        atomic_store(&tun_mtu_now, mtu);
     }
 }
 
 void print_usage(const char *prog_name) {
-    printf("Usage: %s <server_ip>\n", prog_name);
+    printf("Usage: %s [-u] [-q queues] [-k keyfile] [-c cipher] [-o] [-P threads] [-B depth]\n"
+           "          [-a addr/len] [-M mtu] [-s sec] [-S path] [-T n] <server_ip>\n", prog_name);
+    printf("  -u         Tunnel over UDP datagrams instead of a TCP stream\n");
+    printf("  -q N       Use an N-queue TUN device with one thread and server connection per queue\n");
+    printf("  -k FILE    Pre-shared key: 64 hex digits, the same file as the server's\n");
+    printf("  -c CIPHER  aes-gcm, chacha20 or auto (default: the fastest this CPU has)\n");
+    printf("  -o         TUN offloads (GSO super-packets, receive coalescing)\n");
+    printf("  -P N       Pipelined: a thread per stage, with N crypto threads\n");
+    printf("  -B N       With -P: batches in flight per direction (default %d)\n", PIPE_DEFAULT_DEPTH);
+    printf("  -a ADDR/LEN  Configure the TUN device (e.g. -a 10.8.0.2/24) and bring it up,\n");
+    printf("             instead of waiting for it to be done by hand\n");
+    printf("  -M MTU     With -a: the TUN device's MTU (default: over UDP, found by probing)\n");
+    printf("  -s SEC     Print a traffic summary every SEC seconds\n");
+    printf("  -S PATH    Dump all counters to each connection on unix socket PATH\n");
+    printf("  -T N       Trace: log one packet in N\n");
     printf("Example: %s 192.168.1.100\n", prog_name);
 }
 
 int main(int argc, char *argv[]) {
     int tun_fd, server_fd;
     char tun_name[IFNAMSIZ] = "tun0";
+    int num_queues = 1;
+    int use_udp = 0;
+    const char *key_file = NULL;
+    int stats_interval = 0;
+    const char *stats_socket = NULL;
+    const char *tun_addr = NULL;
+    int tun_mtu = 0;
+    int num_crypto = 0;
+    int pipe_depth = PIPE_DEFAULT_DEPTH;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "uq:k:c:oP:B:a:M:s:S:T:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            use_udp = 1;
+            break;
+        case 'q':
+            num_queues = atoi(optarg);
+            if (num_queues < 1 || num_queues > MAX_TUN_QUEUES) {
+                fprintf(stderr, "Queue count must be 1..%d\n", MAX_TUN_QUEUES);
+                exit(1);
+            }
+            break;
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'c':
+            wanted_cipher = vpn_cipher_parse(optarg);
+            if (wanted_cipher < 0 || !(wanted_cipher == VPN_CIPHER_AUTO || vpn_cipher_supported(wanted_cipher))) {
+                fprintf(stderr, "Unknown or unsupported cipher: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'o':
+            tun_offload = 1;
+            break;
+        case 'P':
+            num_crypto = atoi(optarg);
+            if (num_crypto < 1 || num_crypto > MAX_PIPE_CRYPTO) {
+                fprintf(stderr, "Crypto thread count must be 1..%d\n", MAX_PIPE_CRYPTO);
+                exit(1);
+            }
+            break;
+        case 'B':
+            pipe_depth = atoi(optarg);
+            if (pipe_depth < 2 || pipe_depth > 1024) {
+                fprintf(stderr, "Pipeline depth must be 2..1024\n");
+                exit(1);
+            }
+            break;
+        case 'a':
+            tun_addr = optarg;
+            break;
+        case 'M':
+            tun_mtu = atoi(optarg);
+            if (tun_mtu < 68 || tun_mtu > 65535) {
+                fprintf(stderr, "MTU must be 68..65535\n");
+                exit(1);
+            }
+            break;
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+        case 'S':
+            stats_socket = optarg;
+            break;
+        case 'T':
+            vpn_trace_every = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
 
-    if (argc != 2) {
+    if (optind != argc - 1) {
         print_usage(argv[0]);
         exit(1);
     }
+    if (tun_mtu && !tun_addr) {
+        fprintf(stderr, "-M requires -a\n");
+        exit(1);
+    }
+    if (num_crypto && (num_queues > 1 || tun_offload)) {
+        fprintf(stderr, "-P can't be combined with -q or -o\n");
+        exit(1);
+    }
+    const char *server_ip = argv[optind];
+    int sock_type = use_udp ? SOCK_DGRAM : SOCK_STREAM;
+    int *gso_types = tun_offload ? &tun_gso_types : NULL;
 
     printf("=== Simple VPN Client ===\n");
+    if (vpn_load_key(key_file, psk) < 0 || vpn_stats_start(stats_interval, stats_socket) < 0) {
+        exit(1);
+    }
+    vpn_batch_install_report_signal();
+
+    // Multi-queue mode: one TUN queue and one server connection per thread
+    if (num_queues > 1) {
+        struct client_worker workers[MAX_TUN_QUEUES];
+        int tun_fds[MAX_TUN_QUEUES];
+
+        if (create_tun_queues(tun_name, num_queues, tun_fds, gso_types) < 0) {
+            fprintf(stderr, "Failed to create TUN device\n");
+            exit(1);
+        }
 
+        setup_tun(tun_name, tun_addr, tun_mtu);
+
+        for (int i = 0; i < num_queues; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "queue %d", i);
+            workers[i].id = i;
+            workers[i].tun_fd = tun_fds[i];
+            workers[i].udp = use_udp;
+            workers[i].probe_pmtu = i == 0 && !tun_mtu;
+            workers[i].stats = vpn_stats_new(name);
+            // UDP: each queue is its own session with its own sequence space
+            workers[i].server_fd = connect_to_server(server_ip, SERVER_PORT, sock_type);
+            if (workers[i].server_fd < 0 ||
+                (!use_udp && tcp_handshake(workers[i].server_fd, &workers[i].aead,
+                                           &workers[i].peer_gso) < 0)) {
+                exit(1);
+            }
+        }
+
+        for (int i = 0; i < num_queues; i++) {
+            if (pthread_create(&workers[i].thread, NULL, client_worker_main, &workers[i]) != 0) {
+                perror("Failed to start queue thread");
+                exit(1);
+            }
+        }
+
+        for (int i = 0; i < num_queues; i++) {
+            pthread_join(workers[i].thread, NULL);
+            close(workers[i].server_fd);
+            close(tun_fds[i]);
+        }
+
+        printf("\n[CLIENT] Shutting down\n");
+        return 0;
+    }
     // Step 1: Create TUN device
-    tun_fd = create_tun_device(tun_name);
+    tun_fd = create_tun_device(tun_name, gso_types);
     if (tun_fd < 0) {
         fprintf(stderr, "Failed to create TUN device\n");
         fprintf(stderr, "Make sure:\n");
@@ -226,23 +1859,32 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    printf("\n[SETUP] Please configure the TUN device in another terminal:\n");
-    printf("        sudo ip addr add 10.8.0.2/24 dev tun0\n");
-    printf("        sudo ip link set tun0 up\n");
-    printf("        sudo ip route add 8.8.8.8/32 dev tun0\n");
-    printf("\n[SETUP] This routes 8.8.8.8 through the VPN tunnel\n");
-    printf("[SETUP] Press Enter when ready...");
-    getchar();
+    setup_tun(tun_name, tun_addr, tun_mtu);
 
     // Step 2: Connect to VPN server
-    server_fd = connect_to_server(argv[1], SERVER_PORT);
+    server_fd = connect_to_server(server_ip, SERVER_PORT, sock_type);
     if (server_fd < 0) {
         close(tun_fd);
         exit(1);
     }
 
     // Step 3: Run VPN event loop
-    vpn_event_loop(tun_fd, server_fd);
+    if (num_crypto && use_udp) {
+        vpn_pipeline_run(tun_fd, server_fd, 1, NULL, num_crypto, pipe_depth);
+    } else if (use_udp) {
+        vpn_udp_event_loop(tun_fd, server_fd, !tun_mtu, vpn_stats_new("udp"));
+    } else {
+        struct vpn_aead aead;
+        int peer_gso;
+        if (tcp_handshake(server_fd, &aead, &peer_gso) == 0) {
+            if (num_crypto) {
+                vpn_pipeline_run(tun_fd, server_fd, 0, &aead, num_crypto, pipe_depth);
+            } else {
+                vpn_event_loop(tun_fd, server_fd, &aead, peer_gso, vpn_stats_new("tcp"));
+            }
+        }
+        vpn_aead_wipe(&aead);
+    }
 
     // Cleanup
     close(server_fd);
@@ -8,73 +8,153 @@
  * 4. Decrypts and injects into TUN device (kernel routes them)
  * 5. Reads responses from TUN device and sends back to client
  *
- * Compile: gcc -o simple_vpn_server simple_vpn_server.c
- * Run: sudo ./simple_vpn_server
+ * Three event loop modes are available:
+ *   select - the original loop: one client, blocking sockets (default)
+ *   epoll  - many concurrent clients, edge-triggered epoll, non-blocking
+ *            sockets; TUN packets are routed to the client that owns the
+ *            packet's destination IP
+ *   uring  - the epoll workers, with io_uring doing their I/O instead:
+ *            fixed buffer TUN reads, multishot accept and UDP receives into
+ *            pool buffers, batches submitted and reaped with one syscall
+ *            (see vpn_uring.h)
+ *
+ * In epoll and uring mode, -t N runs N worker threads on a multi-queue TUN
+ * device: one TUN queue, one SO_REUSEPORT listener and one epoll set (or
+ * io_uring) per worker, each pinned to its own CPU.
+ *
+ * Packets are routed by hash lookups that take no lock (see vpn_route.h):
+ * tunnel IP → client, tunnel IP → worker, and with -R, longest-prefix match
+ * of subnets routed behind clients.
+ *
+ * epoll and uring mode serve two transports on the same port: UDP
+ * datagrams (one tunneled packet per datagram, see vpn_udp.h) and the
+ * original TCP stream with length-prefixed frames, kept as a fallback for
+ * networks that block UDP. The select loop is TCP only.
+ *
+ * Every connection or session starts with a hello exchange that derives a
+ * session key from the pre-shared key (-k); packets are then sealed with
+ * AES-256-GCM or ChaCha20-Poly1305, whichever the client asks for and this
+ * CPU supports (see vpn_crypto.h). UDP clients also get a session ticket,
+ * so that after a server restart they resume in one round trip, sending
+ * packets right away (see vpn_udp.h).
+ *
+ * With -a the server sets up its TUN device itself (address, -M MTU, link
+ * up, IP forwarding) and starts without waiting for anyone. Without -M the
+ * MTU leaves room for the UDP transport's overhead on a 1500-byte path.
+ * UDP clients find the actual path MTU with PROBE datagrams, which the
+ * server answers, and TCP SYNs written to TUN get their MSS clamped to its
+ * MTU (see vpn_mtu.h).
+ *
+ * With -o (epoll/uring mode) the TUN device runs with TSO/USO offloads:
+ * bursts of a flow are read as one super-packet, tunneled whole to clients
+ * that also use -o over TCP and cut into ordinary packets for everyone
+ * else, and runs of TCP segments from clients are coalesced before they are
+ * written to TUN (see vpn_offload.h).
+ *
+ * With -X IFACE (epoll/uring mode) UDP datagrams to the server's port skip
+ * the kernel's network stack: an XDP program on IFACE steers them into one
+ * AF_XDP socket per worker, on the NIC queue with the worker's number, and
+ * they are decrypted and written to TUN from the frames they arrived in
+ * (see vpn_xdp.h). Everything else, replies included, takes the stack.
+ *
+ * Nothing is logged per packet: each loop keeps counters that -s / -S
+ * report, and -T N logs a sample of the packets (see vpn_stats.h).
+ *
+ * Compile: gcc -O2 -o simple_vpn_server simple_vpn_server.c vpn_batch.c vpn_crypto.c vpn_crypto_simd.c vpn_mtu.c vpn_offload.c vpn_pool.c vpn_route.c vpn_stats.c vpn_stream.c vpn_tun.c vpn_udp.c vpn_uring.c vpn_xdp.c -pthread
+ * Run: sudo ./simple_vpn_server [-m select|epoll|uring] [-t threads]
+ *        [-k keyfile] [-o] [-R subnet=ip] [-a addr/len] [-M mtu] [-X iface]
+ *        [-s sec] [-S path] [-T n]
  */
 
+#define _GNU_SOURCE  // accept4(), sendmmsg(), recvmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <linux/if.h>
-#include <linux/if_tun.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <time.h>
 
-#define SERVER_PORT 5555
-#define TUN_DEVICE "/dev/net/tun"
-#define BUFFER_SIZE 2048
-#define XOR_KEY 0x42  // Simple XOR "encryption" key (NOT SECURE!)
+#include "vpn_batch.h"
+#include "vpn_crypto.h"
+#include "vpn_mtu.h"
+#include "vpn_offload.h"
+#include "vpn_pool.h"
+#include "vpn_route.h"
+#include "vpn_stats.h"
+#include "vpn_stream.h"
+#include "vpn_tun.h"
+#include "vpn_udp.h"
+#include "vpn_uring.h"
+#include "vpn_xdp.h"
 
-// Create and configure TUN device
-int create_tun_device(char *dev_name) {
-    struct ifreq ifr;
-    int tun_fd, err;
+#define SERVER_PORT 5555
 
-    // Open the TUN device
-    tun_fd = open(TUN_DEVICE, O_RDWR);
-    if (tun_fd < 0) {
-        perror("Failed to open /dev/net/tun");
-        return -1;
-    }
+// epoll mode limits
+#define MAX_CLIENTS 16384                              // Per worker
+#define MAX_EVENTS 64
+#define CLIENT_TX_SIZE (256 * 1024)                   // Holds at least one full-size frame
+#define HANDOFF_SLOTS 256                             // Cross-worker packets in flight
+#define WORKER_POOL_SIZE (3 * VPN_BATCH_MAX + HANDOFF_SLOTS)  // Packet buffers per worker
 
-    memset(&ifr, 0, sizeof(ifr));
+static unsigned char psk[VPN_KEY_SIZE];   // Pre-shared key (-k), must match the clients'
+static struct vpn_aead ticket_key;        // Seals the session tickets of UDP clients
+static int tun_offload;                   // -o: TUN packets carry a virtio-net header
+static int tun_gso_types;                 // Super-packet types our TUN takes (VPN_GSO_*)
+static int use_uring;                     // -m uring: workers run vpn_uring_loop()
+static int tun_mtu_now = VPN_PMTU_DEFAULT; // TCP SYNs to TUN are clamped to this
+static const char *xdp_ifname;            // -X: receive UDP through AF_XDP on this interface
+static struct vpn_xdp xdp;                // ... with this program attached to it
 
-    // IFF_TUN: TUN device (Layer 3, IP packets)
-    // IFF_NO_PI: No packet information (just raw IP packets)
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-    strncpy(ifr.ifr_name, dev_name, IFNAMSIZ);
+// Create the UDP socket for the datagram transport. With reuseport, the
+// kernel hashes each peer's 4-tuple to one of the sockets, so a peer's
+// datagrams keep arriving at the same worker.
+int create_udp_socket(int port, int reuseport) {
+    struct sockaddr_in server_addr;
+    int opt = 1;
 
-    // Create the TUN interface
-    err = ioctl(tun_fd, TUNSETIFF, (void *)&ifr);
-    if (err < 0) {
-        perror("Failed to configure TUN device");
-        close(tun_fd);
+    int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock_fd < 0) {
+        perror("Failed to create UDP socket");
         return -1;
     }
 
-    printf("[TUN] Created TUN device: %s\n", ifr.ifr_name);
-    printf("[TUN] Configure it with:\n");
-    printf("      sudo ip addr add 10.8.0.1/24 dev %s\n", ifr.ifr_name);
-    printf("      sudo ip link set %s up\n", ifr.ifr_name);
+    if (reuseport && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Failed to set SO_REUSEPORT");
+        close(sock_fd);
+        return -1;
+    }
 
-    return tun_fd;
-}
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
 
-// Simple XOR encryption/decryption (symmetric)
-void xor_crypt(unsigned char *data, int len, unsigned char key) {
-    for (int i = 0; i < len; i++) {
-        data[i] ^= key;
+    if (bind(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Failed to bind UDP socket");
+        close(sock_fd);
+        return -1;
     }
+
+    printf("[SERVER] Listening on UDP port %d\n", port);
+    return sock_fd;
 }
 
-// Create TCP server socket
-int create_server_socket(int port) {
+// Create TCP server socket. With reuseport, several sockets can listen on
+// the same port and the kernel load-balances new connections across them.
+int create_server_socket(int port, int reuseport) {
     int sock_fd;
     struct sockaddr_in server_addr;
     int opt = 1;
@@ -87,6 +167,11 @@ int create_server_socket(int port) {
 
     // Allow address reuse
     setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Failed to set SO_REUSEPORT");
+        close(sock_fd);
+        return -1;
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -109,16 +194,87 @@ int create_server_socket(int port) {
     return sock_fd;
 }
 
+// Answer the client's hello on a blocking connection (select mode) and
+// derive the session key
+int tcp_handshake(int client_fd, struct vpn_aead *aead) {
+    struct vpn_hello hello, reply;
+
+    if (vpn_read_full(client_fd, &hello, sizeof(hello)) < 0 ||
+        vpn_hello_answer(&hello, &reply, psk, aead) < 0 ||
+        write(client_fd, &reply, sizeof(reply)) != sizeof(reply)) {
+        fprintf(stderr, "[SERVER] Handshake with client failed\n");
+        return -1;
+    }
+
+    printf("[CRYPTO] Session cipher: %s\n", aead->impl);
+    return 0;
+}
+
+// Verify, decrypt and inject a batch of frames from the client.
+// Returns -1 if one doesn't verify: the stream is corrupt or forged.
+static int open_frames(struct vpn_stats *stats, const struct vpn_aead *aead, int tun_fd,
+                       struct vpn_aead_op *ops, int n) {
+    // Decrypt the whole batch in place, inside the receive ring
+    if (vpn_stats_open(stats, aead, ops, n) != n) {
+        return -1;
+    }
+
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        if (vpn_trace(stats)) {
+            printf("[CLIENT→TUN] Received %d bytes from client, decrypted, injecting to TUN\n", ops[i].len);
+        }
+        bytes += ops[i].len;
+        vpn_clamp_mss(ops[i].data, ops[i].len, tun_mtu_now);
+
+        // Write decrypted packet to TUN device
+        // The kernel will route this packet based on the IP destination
+        if (write(tun_fd, ops[i].data, ops[i].len) < 0) {
+            perror("Failed to write to TUN device");
+        }
+    }
+    vpn_stat_batch(stats, VPN_STAT_RX_PACKETS, n, bytes);
+    return 0;
+}
+
 // Main event loop: multiplex between TUN device and client socket
-void vpn_event_loop(int tun_fd, int client_fd) {
-    unsigned char buffer[BUFFER_SIZE];
+void vpn_event_loop(int tun_fd, int client_fd, const struct vpn_aead *aead) {
+    struct vpn_pool pool;
+    unsigned char *bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+    struct iovec iov[VPN_BATCH_MAX];
+    struct vpn_aead_op ops[VPN_BATCH_MAX];
+    uint64_t tx_seq = 0, rx_seq = 0;        // Frames sent/received: the nonce counters
+    struct vpn_batch_stats tun_stats = {0}, rx_stats = {0};
+    unsigned int report_seen = 0;
+    struct vpn_stream rx;
+    struct vpn_stats *stats = vpn_stats_new("select");
     fd_set read_fds;
     int max_fd;
-    int nread;
 
     printf("[VPN] Starting event loop...\n");
     printf("[VPN] Forwarding packets between client and TUN device\n");
 
+    // Frames from the client are reassembled in a ring; TUN packets are read
+    // into pool buffers, which have room for the length prefix in front
+    if (vpn_stream_init(&rx, VPN_STREAM_SIZE) < 0) {
+        perror("Failed to set up receive ring");
+        return;
+    }
+    if (vpn_pool_init(&pool, VPN_BATCH_MAX) < 0) {
+        perror("Failed to set up packet buffers");
+        vpn_stream_free(&rx);
+        return;
+    }
+
+    for (int i = 0; i < VPN_BATCH_MAX; i++) {
+        bufs[i] = vpn_pkt_get(&pool)->data;
+    }
+
+    // The TUN device is drained in batches, so reads must stop at EAGAIN
+    // instead of blocking once it is empty
+    fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL, 0) | O_NONBLOCK);
+
     max_fd = (tun_fd > client_fd) ? tun_fd : client_fd;
 
     while (1) {
@@ -128,7 +284,13 @@ void vpn_event_loop(int tun_fd, int client_fd) {
 
         // Block until data is available on either TUN device or client socket
         int ret = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        uint64_t wakeup = vpn_stats_clock();
+        if (vpn_batch_report_requested(&report_seen)) {
+            vpn_batch_print("TUN→CLIENT", &tun_stats);
+            vpn_batch_print("CLIENT→TUN", &rx_stats);
+        }
         if (ret < 0) {
+            if (errno == EINTR) continue;
             perror("select() failed");
             break;
         }
@@ -136,109 +298,2340 @@ void vpn_event_loop(int tun_fd, int client_fd) {
         // Data from TUN device (kernel → client)
         // These are response packets that need to go back to the VPN client
         if (FD_ISSET(tun_fd, &read_fds)) {
-            nread = read(tun_fd, buffer, BUFFER_SIZE);
-            if (nread < 0) {
+            // Take everything that is queued (up to VPN_BATCH_MAX packets)
+            int count = vpn_read_batch(tun_fd, bufs, lens, VPN_BATCH_MAX, VPN_PKT_MAX);
+            if (count < 0) {
                 perror("Failed to read from TUN device");
                 break;
             }
 
-            printf("[TUN→CLIENT] Read %d bytes from TUN, encrypting and sending to client\n", nread);
+            if (vpn_trace(stats)) {
+                printf("[TUN→CLIENT] Read %d packets from TUN, encrypting and sending to client\n", count);
+            }
 
-            // Encrypt the packet
-            xor_crypt(buffer, nread, XOR_KEY);
+            uint64_t bytes = 0;
+            for (int i = 0; i < count; i++) {
+                bytes += lens[i];
+                // Packet length first (for framing, in the headroom), then
+                // the sealed packet: one contiguous frame
+                unsigned char *frame = bufs[i] - VPN_FRAME_HDR_SIZE;
+                uint16_t frame_len = htons(lens[i] + VPN_TAG_SIZE);
+                memcpy(frame, &frame_len, VPN_FRAME_HDR_SIZE);
+                iov[i].iov_base = frame;
+                iov[i].iov_len = VPN_FRAME_HDR_SIZE + lens[i] + VPN_TAG_SIZE;
 
-            // Send packet length first (for framing)
-            uint16_t packet_len = htons(nread);
-            if (write(client_fd, &packet_len, sizeof(packet_len)) < 0) {
-                perror("Failed to send packet length to client");
-                break;
+                ops[i] = (struct vpn_aead_op){
+                    .data = bufs[i], .len = lens[i],
+                    .aad = frame, .aad_len = VPN_FRAME_HDR_SIZE,
+                };
+                vpn_aead_nonce(ops[i].nonce, VPN_DIR_TO_CLIENT, ++tx_seq);
             }
 
-            // Send encrypted packet to client
-            if (write(client_fd, buffer, nread) < 0) {
-                perror("Failed to send packet to client");
+            // Encrypt the whole batch in place
+            vpn_stats_seal(stats, aead, ops, count);
+
+            // One writev() sends every frame of the batch
+            if (vpn_writev_all(client_fd, iov, count) < 0) {
+                perror("Failed to send packets to client");
                 break;
             }
+            vpn_batch_record(&tun_stats, count);
+            vpn_stat_batch(stats, VPN_STAT_TX_PACKETS, count, bytes);
         }
 
         // Data from client (client → TUN → kernel → internet)
         // These are outgoing packets from the VPN client
         if (FD_ISSET(client_fd, &read_fds)) {
-            // Read packet length first
-            uint16_t packet_len;
-            nread = read(client_fd, &packet_len, sizeof(packet_len));
-            if (nread <= 0) {
+            // One read() takes whatever has arrived - part of a frame or
+            // many frames - and the reassembler cuts complete frames out of it
+            ssize_t n = vpn_stream_fill(&rx, client_fd);
+            if (n <= 0) {
                 printf("[CLIENT] Client disconnected\n");
                 break;
             }
-            packet_len = ntohs(packet_len);
 
-            // Read encrypted packet
-            nread = read(client_fd, buffer, packet_len);
-            if (nread <= 0) {
-                printf("[CLIENT] Client disconnected\n");
+            unsigned char *packet;
+            uint16_t packet_len;
+            uint16_t rx_hdrs[VPN_BATCH_MAX];
+            int frames = 0, n_ops = 0;
+            int more;
+            while ((more = vpn_stream_next_frame(&rx, VPN_PKT_MAX + VPN_TAG_SIZE,
+                                                 &packet, &packet_len)) == 1) {
+                if (packet_len <= VPN_TAG_SIZE) {
+                    more = -1;
+                    break;
+                }
+                rx_hdrs[n_ops] = htons(packet_len);
+                ops[n_ops] = (struct vpn_aead_op){
+                    .data = packet, .len = packet_len - VPN_TAG_SIZE,
+                    .aad = &rx_hdrs[n_ops], .aad_len = sizeof(rx_hdrs[n_ops]),
+                };
+                vpn_aead_nonce(ops[n_ops].nonce, VPN_DIR_TO_SERVER, ++rx_seq);
+                frames++;
+
+                // Frames stay valid in the ring until the next fill, so they
+                // are opened a batch at a time
+                if (++n_ops == VPN_BATCH_MAX) {
+                    if (open_frames(stats, aead, tun_fd, ops, n_ops) < 0) {
+                        more = -1;
+                        break;
+                    }
+                    n_ops = 0;
+                }
+            }
+            if (more == 0 && n_ops > 0 && open_frames(stats, aead, tun_fd, ops, n_ops) < 0) {
+                more = -1;
+            }
+            vpn_batch_record(&rx_stats, frames);
+
+            if (more < 0) {
+                fprintf(stderr, "[CLIENT] Bad or forged frame, dropping connection\n");
                 break;
             }
+        }
+        vpn_stats_wakeup(stats, wakeup);
+    }
 
-            printf("[CLIENT→TUN] Received %d bytes from client, decrypting and injecting to TUN\n", nread);
+    vpn_batch_print("TUN→CLIENT", &tun_stats);
+    vpn_batch_print("CLIENT→TUN", &rx_stats);
+    vpn_stream_free(&rx);
+    vpn_pool_free(&pool);
+}
 
-            // Decrypt the packet
-            xor_crypt(buffer, nread, XOR_KEY);
+// =============================================================================
+// EPOLL MODE: many clients, one or more worker threads
+// =============================================================================
+//
+// Each worker owns one TUN queue, one SO_REUSEPORT listen socket, one epoll
+// set and the clients the kernel handed to its listener. Workers share
+// nothing while forwarding; the only shared state is the owner map below,
+// which is consulted when a TUN packet arrives on a queue whose worker does
+// not hold the destination client (rare, since tun steers replies back to the
+// queue that wrote the request).
 
-            // Write decrypted packet to TUN device
-            // The kernel will route this packet based on the IP destination
-            if (write(tun_fd, buffer, nread) < 0) {
-                perror("Failed to write to TUN device");
-                break;
+// One connected VPN client: a TCP connection or a UDP session
+struct vpn_client {
+    int fd;                                 // TCP: own socket; UDP: the worker's socket
+    int udp;
+    struct sockaddr_in addr;                // Outer address (UDP: latest seen)
+    uint32_t inner_ip;                      // Tunnel IP (network order), from its first packet
+    int index;                              // In the worker's clients[]
+
+    // Session key, set up by the hello exchange
+    int keyed;
+    struct vpn_aead aead;
+    uint64_t tx_seq;                        // Last frame/sequence number sent (nonce counter)
+    int gso;                                // TCP with -o on both ends: super-packet types the
+                                            // client takes whole; its frames carry a virtio-net header
+
+    // TCP stream state
+    struct vpn_stream rx;                   // Bytes received but not yet handed to TUN
+    uint64_t rx_seq;                        // Last frame number received
+    unsigned char *tx_buf;                  // Frame bytes the socket could not take yet
+    size_t tx_len;
+    size_t tx_batched;                      // Frame bytes in the tx batch, not sent yet
+
+    // UDP session state
+    uint32_t session_id;
+    struct vpn_replay_window replay;
+    time_t last_rx;
+    struct vpn_hello hello_rx, hello_tx;    // Kept to answer a resent HELLO the same way
+    unsigned char ticket[VPN_TICKET_SIZE];  // Sent with hello_tx
+    int resumed;                            // Set up by a RESUME with this salt
+    unsigned char resume_salt[VPN_SALT_SIZE];
+
+    // uring mode: requests in flight that point at us (we are only freed
+    // once they have all completed), and whether one waits for POLLOUT
+    int uring_refs;
+    int pollout_armed;
+};
+
+// Packets read from TUN in one wakeup, waiting to be sealed and sent
+struct tx_batch {
+    int count;
+    struct tx_entry {
+        struct vpn_client *c;
+        struct iovec iov;               // Header (in the headroom) + sealed packet
+    } entries[VPN_BATCH_MAX];
+    struct vpn_aead_op ops[VPN_BATCH_MAX];
+    struct vpn_pkt *owned[VPN_BATCH_MAX];   // Segment buffers, given back once sent
+    int num_owned;
+};
+
+struct vpn_worker {
+    int id;
+    int tun_fd;
+    int listen_fd;
+    int udp_fd;
+    int epoll_fd;
+    int event_fd;                           // Wakes us when packets are handed off to us
+    pthread_t thread;
+
+    struct vpn_client *clients[MAX_CLIENTS];
+    int num_clients;
+    struct vpn_route_table by_inner_ip;     // Tunnel IP → clients[] index
+    struct vpn_route_table by_session;      // UDP session id → clients[] index
+    int route_reader;                       // Our vpn_route reader id
+    struct vpn_client *dead[MAX_CLIENTS];   // Removed, freed after the wakeup (see worker_full())
+    int num_dead;
+
+    // Per-worker packet buffers: one batch in each direction, plus spares
+    // for packets handed off to other workers
+    struct vpn_pool pool;
+    struct vpn_pkt *tun_pkts[VPN_BATCH_MAX];
+    struct vpn_pkt *udp_pkts[VPN_BATCH_MAX];
+    struct vpn_pkt *tun_fixed[VPN_BATCH_MAX];       // uring: registered as buf_index i, or NULL
+    struct tx_batch tx;
+
+    // -X: an AF_XDP socket on the NIC queue with our id, with its own UMEM
+    struct vpn_pool xsk_pool;
+    struct vpn_xsk xsk;                     // fd -1 without one
+
+    struct vpn_batch_stats tun_stats;       // Packets per TUN read batch
+    struct vpn_batch_stats udp_stats;       // Datagrams per recvmmsg()
+    struct vpn_batch_stats tcp_stats;       // Frames per socket read
+    unsigned int report_seen;
+    struct vpn_stats *stats;                // Counters for the stats reporter
+
+    // Handoff queue, filled by other workers (slow path only). It holds
+    // their buffers, which go back to them once sent.
+    pthread_mutex_t handoff_lock;
+    struct vpn_pkt *handoff[HANDOFF_SLOTS];
+    unsigned int handoff_head, handoff_tail;
+    struct vpn_pkt *handoff_rx[VPN_BATCH_MAX];      // Batch taken off the queue
+
+    // uring mode
+    struct vpn_uring ring;
+    struct vpn_uring_bufring udp_ring;      // udp_pkts, for the multishot recvmsg
+    struct msghdr udp_msg;                  // Its template: room for the source address
+    int stopping;                           // Reaping the last requests: don't re-arm
+};
+
+// uring mode: each request's user_data says what it is in the low bits,
+// plus a tun_pkts index or struct vpn_client pointer in the rest
+enum {
+    URING_TUN,          // Fixed buffer read into tun_pkts[index]
+    URING_UDP,          // Multishot recvmsg on the UDP socket
+    URING_ACCEPT,       // Multishot accept on the listen socket
+    URING_HANDOFF,      // Multishot poll on the eventfd
+    URING_RECV,         // Receive into a client's stream ring
+    URING_POLLOUT,      // A client's socket can take its queued bytes
+    URING_XDP,          // Multishot poll on the AF_XDP socket
+};
+#define URING_KIND_BITS 3
+#define URING_KIND(data) ((int)((data) & ((1 << URING_KIND_BITS) - 1)))
+#define URING_CLIENT(data) ((struct vpn_client *)(uintptr_t)((data) - URING_KIND(data)))
+
+// A multishot recvmsg puts a header and the source address in front of
+// each datagram; both go in the buffer's headroom, before the UDP header
+#define URING_UDP_PREFIX (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in))
+_Static_assert(URING_UDP_PREFIX + VPN_UDP_HDR_SIZE <= VPN_PKT_HEADROOM,
+               "no headroom for the recvmsg header");
+
+// Shared by all workers and read without locks (see vpn_route.h):
+// - owners: which worker holds the client for a tunnel IP (written on
+//   learn/disconnect)
+// - subnets: routed subnets behind clients (-R), prefix → the client's
+//   tunnel IP
+static struct vpn_route_table owners, subnets;
+
+static struct vpn_worker *workers[MAX_TUN_QUEUES];
+static int num_workers;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Find where a packet for inner destination dst_ip goes: a local client, or
+// else (NULL) the worker in *owner (-1: nobody). A tunnel IP goes to its
+// client, any other address to the client it is routed behind (-R).
+static struct vpn_client *find_route(struct vpn_worker *w, uint32_t dst_ip, int *owner) {
+    uint32_t hop = ntohl(dst_ip);
+
+    // A client with connections on several workers is reached through the
+    // one on this worker, if there is one
+    uint32_t i = vpn_route_get(&w->by_inner_ip, hop, 32);
+    if (i != VPN_ROUTE_NONE) {
+        return w->clients[i];
+    }
+    uint32_t worker = vpn_route_get(&owners, hop, 32);
+
+    if (worker == VPN_ROUTE_NONE) {
+        hop = vpn_route_match(&subnets, hop, NULL);
+        if (hop != VPN_ROUTE_NONE) {
+            i = vpn_route_get(&w->by_inner_ip, hop, 32);
+            if (i != VPN_ROUTE_NONE) {
+                return w->clients[i];
             }
+            worker = vpn_route_get(&owners, hop, 32);
         }
     }
+    *owner = worker == VPN_ROUTE_NONE ? -1 : (int)worker;
+    return NULL;
 }
 
-int main() {
-    int tun_fd, server_fd, client_fd;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char tun_name[IFNAMSIZ] = "tun0";
+// Drop c's claim on its tunnel IP: hand it to another local connection of
+// the same client if there is one, else give it up
+static void release_inner_ip(struct vpn_worker *w, struct vpn_client *c) {
+    uint32_t ip = ntohl(c->inner_ip);
 
-    printf("=== Simple VPN Server ===\n");
+    if (!c->inner_ip || !vpn_route_del(&w->by_inner_ip, ip, 32, c->index)) {
+        return;  // Not the connection the IP pointed at
+    }
+    for (int i = 0; i < w->num_clients; i++) {
+        if (w->clients[i] != c && w->clients[i]->inner_ip == c->inner_ip) {
+            vpn_route_set(&w->by_inner_ip, ip, 32, i);
+            return;
+        }
+    }
+    // Only if it still points at us: another worker may have taken it over
+    // in the meantime, e.g. a reconnect landing elsewhere
+    vpn_route_del(&owners, ip, 32, w->id);
+}
 
-    // Step 1: Create TUN device
-    tun_fd = create_tun_device(tun_name);
-    if (tun_fd < 0) {
-        fprintf(stderr, "Failed to create TUN device\n");
-        exit(1);
+static void set_client_inner_ip(struct vpn_worker *w, struct vpn_client *c, uint32_t ip) {
+    if (c->inner_ip == ip) {
+        return;
     }
+    release_inner_ip(w, c);
+    c->inner_ip = ip;
+    if (vpn_route_set(&w->by_inner_ip, ntohl(ip), 32, c->index) < 0 ||
+        vpn_route_set(&owners, ntohl(ip), 32, w->id) < 0) {
+        perror("Failed to add client route");
+    }
+}
 
-    printf("\n[SETUP] Please configure the TUN device in another terminal:\n");
-    printf("        sudo ip addr add 10.8.0.1/24 dev tun0\n");
-    printf("        sudo ip link set tun0 up\n");
-    printf("        sudo sysctl -w net.ipv4.ip_forward=1\n");
-    printf("\n[SETUP] Press Enter when ready...");
-    getchar();
+// Take c into the worker's client table
+static void add_client(struct vpn_worker *w, struct vpn_client *c) {
+    c->index = w->num_clients;
+    w->clients[w->num_clients++] = c;
+    if (c->udp && vpn_route_set(&w->by_session, c->session_id, 32, c->index) < 0) {
+        perror("Failed to add UDP session");
+    }
+}
 
-    // Step 2: Create server socket
-    server_fd = create_server_socket(SERVER_PORT);
-    if (server_fd < 0) {
-        close(tun_fd);
-        exit(1);
+// Move the last client into the hole c leaves in clients[], and point its
+// table entries at its new index
+static void unlink_client(struct vpn_worker *w, struct vpn_client *c) {
+    struct vpn_client *last = w->clients[--w->num_clients];
+    int from = last->index;
+
+    if (c->udp) {
+        vpn_route_del(&w->by_session, c->session_id, 32, c->index);
+    }
+    if (last == c) {
+        return;
+    }
+    w->clients[c->index] = last;
+    last->index = c->index;
+    if (last->inner_ip && vpn_route_del(&w->by_inner_ip, ntohl(last->inner_ip), 32, from)) {
+        vpn_route_set(&w->by_inner_ip, ntohl(last->inner_ip), 32, last->index);
+    }
+    if (last->udp) {
+        vpn_route_set(&w->by_session, last->session_id, 32, last->index);
     }
+}
 
-    // Step 3: Accept client connection
-    printf("[SERVER] Waiting for client connection...\n");
-    client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-    if (client_fd < 0) {
-        perror("Failed to accept client");
-        close(server_fd);
-        close(tun_fd);
-        exit(1);
+static void remove_client(struct vpn_worker *w, struct vpn_client *c) {
+    printf("[SERVER] Client %s:%d %s\n",
+           inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port),
+           c->udp ? "session expired" : "disconnected");
+
+    // Closing the fd also removes it from the epoll set. In uring mode,
+    // shutting it down first completes the requests still waiting on it.
+    // UDP sessions share the worker's socket, which stays open.
+    if (!c->udp) {
+        if (use_uring) {
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        close(c->fd);
     }
+    c->fd = -1;
 
-    printf("[SERVER] Client connected from %s:%d\n",
-           inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+    release_inner_ip(w, c);
+    unlink_client(w, c);
+
+    // Later events in the same epoll_wait() batch may still point at c,
+    // so it is only freed once the batch has been handled
+    w->dead[w->num_dead++] = c;
+}
+
+// No room for another client. Removed clients count until they are freed:
+// in uring mode they can stay in dead[] across wakeups, and clients[] and
+// dead[] together must not hold more than MAX_CLIENTS.
+static int worker_full(const struct vpn_worker *w) {
+    return w->num_clients + w->num_dead >= MAX_CLIENTS;
+}
+
+// Free the clients removed in this wakeup. In uring mode one that still
+// has requests in flight waits for a later wakeup.
+static void free_dead_clients(struct vpn_worker *w) {
+    int kept = 0;
+
+    for (int i = 0; i < w->num_dead; i++) {
+        if (w->dead[i]->uring_refs > 0) {
+            w->dead[kept++] = w->dead[i];
+            continue;
+        }
+        vpn_stream_free(&w->dead[i]->rx);
+        vpn_aead_wipe(&w->dead[i]->aead);
+        free(w->dead[i]->tx_buf);
+        free(w->dead[i]);
+    }
+    w->num_dead = kept;
+}
+
+// uring mode: receive into the free space of a client's stream ring
+static void uring_arm_recv(struct vpn_worker *w, struct vpn_client *c) {
+    unsigned char *dst;
+    size_t space = vpn_stream_space(&c->rx, &dst);
+    struct io_uring_sqe *sqe = vpn_uring_sqe(&w->ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)dst;
+    sqe->len = space;
+    sqe->user_data = (uintptr_t)c | URING_RECV;
+    c->uring_refs++;
+}
+
+// uring mode: wait for room in the socket, once
+static void uring_arm_pollout(struct vpn_worker *w, struct vpn_client *c) {
+    if (c->pollout_armed) {
+        return;
+    }
+    struct io_uring_sqe *sqe = vpn_uring_sqe(&w->ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uintptr_t)c | URING_POLLOUT;
+    c->uring_refs++;
+    c->pollout_armed = 1;
+}
+
+// Watch for EPOLLOUT only while there is queued data, otherwise every
+// edge-triggered wakeup would also report "writable"
+static void update_client_events(struct vpn_worker *w, struct vpn_client *c) {
+    if (use_uring) {
+        if (c->tx_len) {
+            uring_arm_pollout(w, c);
+        }
+        return;
+    }
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLET | (c->tx_len ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Write as much of the pending tx data as the socket accepts.
+// Returns -1 if the connection is broken.
+static int flush_client_tx(struct vpn_worker *w, struct vpn_client *c) {
+    size_t sent = 0;
+
+    while (sent < c->tx_len) {
+        ssize_t n = write(c->fd, c->tx_buf + sent, c->tx_len - sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        sent += n;
+    }
+
+    memmove(c->tx_buf, c->tx_buf + sent, c->tx_len - sent);
+    c->tx_len -= sent;
+    if (c->tx_len == 0) {
+        update_client_events(w, c);
+    }
+    return 0;
+}
+
+// Queue the unsent part of one frame, skipping its first skip bytes.
+// Returns 0, or -1 if it doesn't fit.
+static int queue_frame(struct vpn_client *c, const struct iovec *iov, size_t skip) {
+    if (c->tx_len + (iov->iov_len - skip) > CLIENT_TX_SIZE) {
+        return -1;
+    }
+    memcpy(c->tx_buf + c->tx_len, (unsigned char *)iov->iov_base + skip, iov->iov_len - skip);
+    c->tx_len += iov->iov_len - skip;
+    return 0;
+}
+
+// Send length-prefixed frames to a client with one writev(), without
+// blocking. iov holds one entry (header + payload) per frame.
+// Every frame is written or queued whole. The client numbers frames by
+// their order in the stream, so a sealed frame can't be dropped: the ones
+// that won't fit are dropped before they are sealed (tx_batch_add()).
+// Returns -1 if the connection is broken.
+static int send_frames_to_client(struct vpn_worker *w, struct vpn_client *c,
+                                 struct iovec *iov, int num_frames) {
+    // Keep frame order: if something is already queued, queue behind it
+    if (c->tx_len > 0) {
+        for (int i = 0; i < num_frames; i++) {
+            if (queue_frame(c, &iov[i], 0) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    ssize_t n = writev(c->fd, iov, num_frames);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        n = 0;
+    }
+
+    // Skip the frames that went out and queue the rest. They fit: the
+    // queue was empty, and the batch holds no more than it takes.
+    size_t written = n;
+    for (int i = 0; i < num_frames; i++) {
+        if (written >= iov[i].iov_len) {
+            written -= iov[i].iov_len;
+            continue;
+        }
+        if (queue_frame(c, &iov[i], written) < 0) {
+            return -1;
+        }
+        written = 0;
+    }
+
+    if (c->tx_len > 0) {
+        update_client_events(w, c);  // Wait for EPOLLOUT
+    }
+    return 0;
+}
+
+// Add a plaintext packet to the batch for client c. The header goes in the
+// buffer's headroom; the packet is sealed in place at flush time. The
+// buffer must stay untouched until then. Returns -1 if a TCP client's
+// queue has no room left for the frame: it is dropped (like a full NIC
+// queue would) before it takes a frame number.
+static int tx_batch_add(struct vpn_worker *w, struct tx_batch *b, struct vpn_client *c,
+                        struct vpn_pkt *pkt) {
+    int hdr_len = c->udp ? VPN_UDP_HDR_SIZE : VPN_FRAME_HDR_SIZE;
+    size_t frame_len = hdr_len + pkt->len + VPN_TAG_SIZE;
+
+    if (!c->udp) {
+        if (c->tx_len + c->tx_batched + frame_len > CLIENT_TX_SIZE) {
+            vpn_stat_add(w->stats, VPN_STAT_DROP_QUEUE, 1);  // Not keeping up
+            return -1;
+        }
+        c->tx_batched += frame_len;
+    }
+
+    struct vpn_aead_op *op = &b->ops[b->count];
+    struct tx_entry *e = &b->entries[b->count++];
+    unsigned char *hdr = pkt->data - hdr_len;
+
+    e->c = c;
+    ++c->tx_seq;
+    if (c->udp) {
+        vpn_udp_build_hdr((struct vpn_udp_hdr *)hdr, VPN_UDP_DATA, c->session_id, c->tx_seq);
+    } else {
+        uint16_t wire_len = htons(pkt->len + VPN_TAG_SIZE);
+        memcpy(hdr, &wire_len, VPN_FRAME_HDR_SIZE);
+    }
+    e->iov.iov_base = hdr;
+    e->iov.iov_len = frame_len;
+
+    // The header is authenticated along with the packet
+    *op = (struct vpn_aead_op){
+        .data = pkt->data, .len = pkt->len,
+        .aad = hdr, .aad_len = hdr_len,
+    };
+    vpn_aead_nonce(op->nonce, VPN_DIR_TO_CLIENT, c->tx_seq);
+    return 0;
+}
+
+// Seal the batch: each run of packets for the same client is one
+// vpn_aead_seal_batch() call under that client's key
+static void tx_batch_seal(struct vpn_worker *w, struct tx_batch *b) {
+    for (int i = 0; i < b->count; ) {
+        int run = 1;
+        while (i + run < b->count && b->entries[i + run].c == b->entries[i].c) {
+            run++;
+        }
+        vpn_stats_seal(w->stats, &b->entries[i].c->aead, &b->ops[i], run);
+        i += run;
+    }
+}
+
+// Send everything in the batch: all UDP datagrams with one sendmmsg(),
+// and each TCP client's frames with one writev()
+static void tx_batch_flush(struct vpn_worker *w, struct tx_batch *b) {
+    struct mmsghdr msgs[VPN_BATCH_MAX];
+    struct iovec iov[VPN_BATCH_MAX];
+    int done[VPN_BATCH_MAX] = {0};
+    int num_msgs = 0;
+    uint64_t bytes = 0;
 
-    // Step 4: Run VPN event loop
-    vpn_event_loop(tun_fd, client_fd);
+    tx_batch_seal(w, b);
+
+    for (int i = 0; i < b->count; i++) {
+        struct tx_entry *e = &b->entries[i];
+        bytes += b->ops[i].len;
+        if (!e->c->udp) continue;
+
+        memset(&msgs[num_msgs], 0, sizeof(msgs[0]));
+        msgs[num_msgs].msg_hdr.msg_name = &e->c->addr;
+        msgs[num_msgs].msg_hdr.msg_namelen = sizeof(e->c->addr);
+        msgs[num_msgs].msg_hdr.msg_iov = &e->iov;
+        msgs[num_msgs].msg_hdr.msg_iovlen = 1;
+        num_msgs++;
+    }
+
+    // Like a NIC, a full socket buffer just drops datagrams; the inner
+    // protocol will retransmit if it cares
+    int sent = 0;
+    while (sent < num_msgs) {
+        int n = sendmmsg(w->udp_fd, msgs + sent, num_msgs - sent, 0);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Failed to send datagrams to clients");
+            }
+            vpn_stat_add(w->stats, VPN_STAT_DROP_QUEUE, 1);
+            n = 1;  // sendmmsg() failed on the first message: skip it
+        }
+        sent += n;
+    }
+
+    // Group each TCP client's frames (in order) into one writev()
+    for (int i = 0; i < b->count; i++) {
+        struct vpn_client *c = b->entries[i].c;
+        if (c->udp || done[i]) continue;
+
+        int num_frames = 0;
+        for (int j = i; j < b->count; j++) {
+            if (b->entries[j].c != c) continue;
+            iov[num_frames++] = b->entries[j].iov;
+            done[j] = 1;
+        }
+        c->tx_batched = 0;
+
+        if (c->fd >= 0 && send_frames_to_client(w, c, iov, num_frames) < 0) {
+            remove_client(w, c);
+        }
+    }
+
+    vpn_stat_batch(w->stats, VPN_STAT_TX_PACKETS, b->count, bytes);
+    for (int i = 0; i < b->num_owned; i++) {
+        vpn_pkt_put(&w->pool, b->owned[i]);
+    }
+    b->num_owned = 0;
+    b->count = 0;
+}
+
+// Queue a TUN packet for client c, flushing the batch when it is full.
+// With offloads, a super-packet the client can't take whole is cut into
+// ordinary packets here, in buffers of our own.
+static void send_tun_packet(struct vpn_worker *w, struct tx_batch *b,
+                            struct vpn_client *c, struct vpn_pkt *pkt) {
+    if (b->count == VPN_BATCH_MAX) {
+        tx_batch_flush(w, b);
+    }
+    if (!tun_offload || (c->gso && vpn_offload_whole(pkt->data, pkt->len, c->gso))) {
+        tx_batch_add(w, b, c, pkt);
+        return;
+    }
+    if (!c->gso) {
+        int plain = vpn_offload_to_plain(&pkt->data, &pkt->len);
+        if (plain > 0) {
+            tx_batch_add(w, b, c, pkt);
+        }
+        if (plain != 0) {
+            return;  // Sent, or malformed and dropped
+        }
+    }
+
+    // Cut the super-packet up. For a client that takes virtio-net headers,
+    // each segment gets an empty one.
+    struct vpn_gso_iter it;
+    int vnet = c->gso ? VPN_VNET_HDR_SIZE : 0;
+    if (vpn_gso_begin(&it, pkt->data, pkt->len) < 0) {
+        return;
+    }
+    while (1) {
+        struct vpn_pkt *seg = vpn_pkt_get(&w->pool);
+        if (!seg) {
+            vpn_stat_add(w->stats, VPN_STAT_DROP_QUEUE, 1);
+            return;  // Out of buffers: the rest of the burst is lost
+        }
+        int len = vpn_gso_next(&it, seg->data + vnet);
+        if (len == 0) {
+            vpn_pkt_put(&w->pool, seg);
+            return;
+        }
+        memset(seg->data, 0, vnet);
+        seg->len = vnet + len;
+
+        if (b->count == VPN_BATCH_MAX) {
+            tx_batch_flush(w, b);
+        }
+        if (tx_batch_add(w, b, c, seg) < 0) {
+            vpn_pkt_put(&w->pool, seg);
+            return;  // The client's queue is full: so is it for the rest
+        }
+        b->owned[b->num_owned++] = seg;
+    }
+}
+
+// Queue a packet for another worker and wake it up. The buffer itself is
+// passed on, not copied. Returns 1 if queued, 0 if the queue is full.
+static int handoff_packet(struct vpn_worker *to, struct vpn_pkt *pkt) {
+    int queued = 0;
+
+    pthread_mutex_lock(&to->handoff_lock);
+    if (to->handoff_tail - to->handoff_head < HANDOFF_SLOTS) {
+        to->handoff[to->handoff_tail % HANDOFF_SLOTS] = pkt;
+        to->handoff_tail++;
+        queued = 1;
+    }
+    pthread_mutex_unlock(&to->handoff_lock);
+
+    if (queued) {
+        uint64_t one = 1;
+        if (write(to->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("Failed to wake worker");
+        }
+    }
+    return queued;
+}
+
+// Route a plaintext TUN packet (*slot, from the read batch) by its inner
+// destination IP. A packet handed to another worker takes its buffer with
+// it, and *slot gets a fresh one.
+static void route_tun_packet(struct vpn_worker *w, struct tx_batch *b, struct vpn_pkt **slot) {
+    struct vpn_pkt *pkt = *slot;
+    unsigned char *ip = pkt->data + (tun_offload ? VPN_VNET_HDR_SIZE : 0);
+
+    // Only IPv4 is routed; everything else has no owner
+    if (pkt->len - (ip - pkt->data) < 20 || (ip[0] >> 4) != 4) {
+        vpn_stat_add(w->stats, VPN_STAT_DROP_NO_ROUTE, 1);
+        return;
+    }
+
+    uint32_t dst_ip;
+    memcpy(&dst_ip, ip + 16, sizeof(dst_ip));
+
+    // Fast path: the destination client is connected to this worker
+    int owner;
+    struct vpn_client *c = find_route(w, dst_ip, &owner);
+    if (c) {
+        if (vpn_trace(w->stats)) {
+            printf("[TUN→CLIENT] Worker %d: %d bytes to %s:%d\n", w->id, pkt->len,
+                   inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
+        }
+        send_tun_packet(w, b, c, pkt);
+        return;
+    }
+
+    // Slow path: the kernel put the packet on our queue, but the client's
+    // connection was accepted by another worker. Without a spare buffer to
+    // refill the batch with, the packet is dropped like on a full queue.
+    if (owner >= 0 && owner != w->id) {
+        struct vpn_pkt *spare = vpn_pkt_get(&w->pool);
+        if (!spare) {
+            vpn_stat_add(w->stats, VPN_STAT_DROP_QUEUE, 1);
+            return;
+        }
+        if (handoff_packet(workers[owner], pkt)) {
+            *slot = spare;
+        } else {
+            vpn_pkt_put(&w->pool, spare);
+            vpn_stat_add(w->stats, VPN_STAT_DROP_QUEUE, 1);
+        }
+        return;
+    }
+    // Otherwise no client owns this address (yet): drop
+    vpn_stat_add(w->stats, VPN_STAT_DROP_NO_ROUTE, 1);
+}
+
+// Deliver packets other workers handed to us
+static void handle_handoff(struct vpn_worker *w) {
+    uint64_t count;
+    if (read(w->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Failed to read worker eventfd");
+    }
+
+    while (1) {
+        // Take a batch off the queue under the lock, then send it without
+        // holding it
+        int n = 0;
+        pthread_mutex_lock(&w->handoff_lock);
+        while (n < VPN_BATCH_MAX && w->handoff_head != w->handoff_tail) {
+            w->handoff_rx[n++] = w->handoff[w->handoff_head % HANDOFF_SLOTS];
+            w->handoff_head++;
+        }
+        pthread_mutex_unlock(&w->handoff_lock);
+
+        if (n == 0) {
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct vpn_pkt *pkt = w->handoff_rx[i];
+            uint32_t dst_ip;
+            memcpy(&dst_ip, pkt->data + (tun_offload ? VPN_VNET_HDR_SIZE : 0) + 16, sizeof(dst_ip));
+            int owner;
+            struct vpn_client *c = find_route(w, dst_ip, &owner);
+            if (c) {
+                send_tun_packet(w, &w->tx, c, pkt);
+            } else {
+                vpn_stat_add(w->stats, VPN_STAT_DROP_NO_ROUTE, 1);  // Gone meanwhile
+            }
+        }
+        tx_batch_flush(w, &w->tx);
+
+        // Sent (or queued as bytes): give the buffers back to their workers
+        for (int i = 0; i < n; i++) {
+            vpn_pkt_put(&w->pool, w->handoff_rx[i]);
+        }
+    }
+}
+
+// Take on a newly accepted (non-blocking) connection
+static void add_tcp_client(struct vpn_worker *w, int fd, const struct sockaddr_in *addr) {
+    if (worker_full(w)) {
+        fprintf(stderr, "[SERVER] Too many clients, rejecting %s\n", inet_ntoa(addr->sin_addr));
+        close(fd);
+        return;
+    }
+
+    // Tunnel packets are latency sensitive - don't let Nagle hold them back
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct vpn_client *c = calloc(1, sizeof(*c));
+    if (c) {
+        c->tx_buf = malloc(CLIENT_TX_SIZE);
+    }
+    if (!c || !c->tx_buf || vpn_stream_init(&c->rx, VPN_STREAM_SIZE) < 0) {
+        if (c) {
+            vpn_stream_free(&c->rx);
+            free(c->tx_buf);
+            free(c);
+        }
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->addr = *addr;
+
+    if (use_uring) {
+        uring_arm_recv(w, c);
+    } else {
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl(client)");
+            close(fd);
+            vpn_stream_free(&c->rx);
+            free(c->tx_buf);
+            free(c);
+            return;
+        }
+    }
+    add_client(w, c);
+
+    printf("[SERVER] Worker %d: client connected from %s:%d (%d clients)\n",
+           w->id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), w->num_clients);
+}
+
+// Accept every pending connection (edge-triggered: drain until EAGAIN)
+static void handle_accept(struct vpn_worker *w) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(w->listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Failed to accept client");
+            }
+            return;
+        }
+        add_tcp_client(w, fd, &addr);
+    }
+}
+
+// Drain the TUN queue in batches and route each packet by its inner
+// destination IP
+static int handle_tun_readable(struct vpn_worker *w) {
+    unsigned char *bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+
+    while (1) {
+        // Handoffs swap buffers out of the batch and offloads move their
+        // data, so set them up each time
+        for (int i = 0; i < VPN_BATCH_MAX; i++) {
+            vpn_pkt_reset(w->tun_pkts[i]);
+            bufs[i] = w->tun_pkts[i]->data;
+        }
+
+        int count = vpn_read_batch(w->tun_fd, bufs, lens, VPN_BATCH_MAX,
+                                   tun_offload ? VPN_GSO_READ_MAX : VPN_PKT_MAX);
+        if (count < 0) {
+            perror("Failed to read from TUN device");
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            w->tun_pkts[i]->len = lens[i];
+            route_tun_packet(w, &w->tx, &w->tun_pkts[i]);
+        }
+        tx_batch_flush(w, &w->tx);
+        vpn_batch_record(&w->tun_stats, count);
+
+        if (count < VPN_BATCH_MAX) {
+            return 0;  // Hit EAGAIN: the queue is empty
+        }
+    }
+}
+
+// Check the source address of a packet from client c. Its first IPv4
+// packet fixes the tunnel IP replies from TUN are routed by; after that,
+// only that address and hosts in a subnet routed behind it (-R) may send.
+// Returns 0 to deliver the packet, or -1 to drop it: another client's
+// address, which would otherwise steal that client's return traffic.
+static int check_inner_ip(struct vpn_worker *w, struct vpn_client *c,
+                          const unsigned char *packet, int len) {
+    if (len < 20 || (packet[0] >> 4) != 4) {
+        return 0;  // Only IPv4 is routed
+    }
+
+    uint32_t src_ip;
+    memcpy(&src_ip, packet + 12, sizeof(src_ip));
+    if (src_ip == c->inner_ip) {
+        return 0;
+    }
+    uint32_t via = vpn_route_match(&subnets, ntohl(src_ip), NULL);
+    if (via != VPN_ROUTE_NONE) {
+        // Until its own address is known, a subnet isn't c's to send from
+        if (!c->inner_ip || via != ntohl(c->inner_ip)) {
+            vpn_stat_add(w->stats, VPN_STAT_DROP_SOURCE, 1);
+            return -1;
+        }
+        return 0;
+    }
+    if (c->inner_ip) {
+        vpn_stat_add(w->stats, VPN_STAT_DROP_SOURCE, 1);
+        return -1;
+    }
+
+    // A client reconnecting before its old connection is gone takes its
+    // address over; say so, as it moves replies to the new connection
+    if (vpn_route_get(&owners, ntohl(src_ip), 32) != VPN_ROUTE_NONE) {
+        struct in_addr a = {.s_addr = src_ip};
+        printf("[SERVER] Worker %d: %s:%d takes over tunnel IP %s\n", w->id,
+               inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), inet_ntoa(a));
+    }
+    set_client_inner_ip(w, c, src_ip);
+    return 0;
+}
+
+// Inject a batch of decrypted packets from client c into TUN. Writing from
+// this worker's queue also teaches tun to steer the flows' replies back to
+// this queue. Runs of TCP segments are coalesced for an offload TUN only if
+// coalesce is set: their buffers must be laid out as vpn_gro_coalesce() asks.
+static void deliver_to_tun(struct vpn_worker *w, struct vpn_client *c,
+                           struct vpn_aead_op *ops, int n, int coalesce) {
+    struct vpn_gro_pkt pkts[VPN_BATCH_MAX];
+    uint64_t bytes = 0;
+    int failed = 0;
+
+    for (int i = 0; i < n; i++) {
+        bytes += ops[i].len;
+        if (vpn_trace(w->stats)) {
+            printf("[CLIENT→TUN] Worker %d: %d bytes from %s:%d\n", w->id, ops[i].len,
+                   inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port));
+        }
+    }
+    vpn_stat_batch(w->stats, VPN_STAT_RX_PACKETS, n, bytes);
+
+    // Plain TUN, or frames that already carry a virtio-net header
+    if (!tun_offload || c->gso) {
+        int skip = c->gso ? VPN_VNET_HDR_SIZE : 0;
+        for (int i = 0; i < n; i++) {
+            if (check_inner_ip(w, c, ops[i].data + skip, ops[i].len - skip) < 0) {
+                continue;
+            }
+            if (skip) {
+                vpn_clamp_mss_vnet(ops[i].data, ops[i].len, tun_mtu_now);
+            } else {
+                vpn_clamp_mss(ops[i].data, ops[i].len, tun_mtu_now);
+            }
+            if (write(w->tun_fd, ops[i].data, ops[i].len) < 0 && errno != EAGAIN) {
+                failed = 1;
+            }
+        }
+    } else {
+        // Ordinary packets into an offload TUN: coalesce runs of TCP
+        // segments, and give each write its header
+        for (int i = 0; i < n; i++) {
+            vpn_clamp_mss(ops[i].data, ops[i].len, tun_mtu_now);
+            pkts[i].data = ops[i].data;
+            pkts[i].len = ops[i].len;
+        }
+        if (coalesce) {
+            n = vpn_gro_coalesce(pkts, n);
+        } else {
+            for (int i = 0; i < n; i++) {
+                memset(&pkts[i].hdr, 0, sizeof(pkts[i].hdr));
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (check_inner_ip(w, c, pkts[i].data, pkts[i].len) < 0) {
+                continue;
+            }
+            if (vpn_offload_write(w->tun_fd, &pkts[i].hdr, pkts[i].data, pkts[i].len) < 0 &&
+                errno != EAGAIN) {
+                failed = 1;
+            }
+        }
+    }
+    if (failed) {
+        perror("Failed to write to TUN device");
+    }
+}
+
+// The stream opens with the client's hello: answer it and derive the
+// session key. Returns -1 on error.
+static int start_tcp_session(struct vpn_client *c, const unsigned char *hello_bytes) {
+    struct vpn_hello hello, reply;
+
+    memcpy(&hello, hello_bytes, sizeof(hello));
+    if (vpn_hello_answer(&hello, &reply, psk, &c->aead) < 0) {
+        return -1;
+    }
+
+    // Super-packets go whole only if both ends use offloads
+    if (tun_offload && hello.gso) {
+        reply.gso = tun_gso_types;
+        c->gso = hello.gso;
+    }
+
+    // The first bytes on a fresh connection always fit in the socket buffer
+    if (write(c->fd, &reply, sizeof(reply)) != sizeof(reply)) {
+        return -1;
+    }
+    c->keyed = 1;
+
+    printf("[SERVER] Client %s:%d: session cipher %s%s\n",
+           inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), c->aead.impl,
+           c->gso ? ", super-packets whole" : "");
+    return 0;
+}
+
+// Verify and decrypt a batch of frames, inject them into TUN.
+// Returns -1 if one doesn't verify.
+static int open_client_frames(struct vpn_worker *w, struct vpn_client *c,
+                              struct vpn_aead_op *ops, int n) {
+    if (vpn_stats_open(w->stats, &c->aead, ops, n) != n) {
+        return -1;
+    }
+    deliver_to_tun(w, c, ops, n, 1);
+    return 0;
+}
+
+// Inject every complete frame in the client's receive ring into TUN.
+// Frames are decrypted in place, so nothing is copied on the way.
+// Returns -1 on a protocol error or a frame that fails to verify.
+static int process_client_frames(struct vpn_worker *w, struct vpn_client *c) {
+    struct vpn_aead_op ops[VPN_BATCH_MAX];
+    uint16_t hdrs[VPN_BATCH_MAX];
+    unsigned char *packet;
+    uint16_t packet_len;
+    int frames = 0, n_ops = 0;
+    int more;
+
+    if (!c->keyed) {
+        if (!vpn_stream_take(&c->rx, VPN_HELLO_SIZE, &packet)) {
+            return 0;  // Rest of the hello hasn't arrived yet
+        }
+        if (start_tcp_session(c, packet) < 0) {
+            return -1;
+        }
+    }
+
+    while ((more = vpn_stream_next_frame(&c->rx, VPN_PKT_MAX + VPN_TAG_SIZE,
+                                         &packet, &packet_len)) == 1) {
+        if (packet_len <= VPN_TAG_SIZE) {
+            more = -1;
+            break;
+        }
+        hdrs[n_ops] = htons(packet_len);
+        ops[n_ops] = (struct vpn_aead_op){
+            .data = packet, .len = packet_len - VPN_TAG_SIZE,
+            .aad = &hdrs[n_ops], .aad_len = sizeof(hdrs[n_ops]),
+        };
+        vpn_aead_nonce(ops[n_ops].nonce, VPN_DIR_TO_SERVER, ++c->rx_seq);
+        frames++;
+
+        if (++n_ops == VPN_BATCH_MAX) {
+            if (open_client_frames(w, c, ops, n_ops) < 0) {
+                more = -1;
+                break;
+            }
+            n_ops = 0;
+        }
+    }
+    if (more == 0 && n_ops > 0 && open_client_frames(w, c, ops, n_ops) < 0) {
+        more = -1;
+    }
+    vpn_batch_record(&w->tcp_stats, frames);
+
+    if (more < 0) {
+        fprintf(stderr, "[SERVER] Bad or forged frame from client\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Drain a client socket. Returns -1 if the client should be dropped.
+static int handle_client_readable(struct vpn_worker *w, struct vpn_client *c) {
+    while (1) {
+        ssize_t n = vpn_stream_fill(&c->rx, c->fd);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (n == 0) {
+            return -1;  // Orderly shutdown
+        }
+
+        if (process_client_frames(w, c) < 0) {
+            return -1;
+        }
+    }
+}
+
+// Datagrams find their session by id, not by source address, so a client
+// that roams to another address keeps its session
+static struct vpn_client *find_udp_session(struct vpn_worker *w, uint32_t session_id) {
+    uint32_t i = vpn_route_get(&w->by_session, session_id, 32);
+    return i == VPN_ROUTE_NONE ? NULL : w->clients[i];
+}
+
+static struct vpn_client *new_udp_session(struct vpn_worker *w, uint32_t session_id,
+                                          struct sockaddr_in *addr) {
+    if (worker_full(w)) {
+        return NULL;
+    }
+
+    struct vpn_client *c = calloc(1, sizeof(*c));
+    if (!c) {
+        return NULL;
+    }
+    c->fd = w->udp_fd;
+    c->udp = 1;
+    c->addr = *addr;
+    c->session_id = session_id;
+    add_client(w, c);
+
+    printf("[SERVER] Worker %d: UDP session %08x from %s:%d (%d clients)\n",
+           w->id, session_id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),
+           w->num_clients);
+    return c;
+}
+
+static void send_udp_control(struct vpn_worker *w, const void *dgram, size_t len,
+                             struct sockaddr_in *addr, const char *what) {
+    if (sendto(w->udp_fd, dgram, len, 0, (struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror(what);
+    }
+}
+
+// Answer a session's HELLO (again, if the first answer got lost), with the
+// ticket to resume it by
+static void send_udp_hello(struct vpn_worker *w, struct vpn_client *c, struct sockaddr_in *addr) {
+    unsigned char dgram[VPN_UDP_HDR_SIZE + VPN_UDP_HELLO_SIZE];
+
+    vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_HELLO, c->session_id, 0);
+    memcpy(dgram + VPN_UDP_HDR_SIZE, &c->hello_tx, VPN_HELLO_SIZE);
+    memcpy(dgram + VPN_UDP_HDR_SIZE + VPN_HELLO_SIZE, c->ticket, VPN_TICKET_SIZE);
+    send_udp_control(w, dgram, sizeof(dgram), addr, "Failed to answer hello");
+}
+
+// Confirm a resumed session: just a tag, under the resumed key
+static void send_udp_resumed(struct vpn_worker *w, struct vpn_client *c, struct sockaddr_in *addr) {
+    unsigned char dgram[VPN_UDP_HDR_SIZE + VPN_TAG_SIZE];
+
+    vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_RESUME, c->session_id, 0);
+    struct vpn_aead_op op = {
+        .data = dgram + VPN_UDP_HDR_SIZE, .len = 0,
+        .aad = dgram, .aad_len = VPN_UDP_HDR_SIZE,
+    };
+    vpn_aead_nonce(op.nonce, VPN_DIR_TO_CLIENT, 0);
+    vpn_stats_seal(w->stats, &c->aead, &op, 1);
+    send_udp_control(w, dgram, sizeof(dgram), addr, "Failed to answer resume");
+}
+
+// Answer a path MTU probe: a sealed PROBE carrying the size of the UDP
+// payload that got here
+static void send_udp_probe(struct vpn_worker *w, struct vpn_client *c, int size,
+                           struct sockaddr_in *addr) {
+    unsigned char dgram[VPN_UDP_HDR_SIZE + 2 + VPN_TAG_SIZE];
+
+    vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_PROBE, c->session_id, ++c->tx_seq);
+    dgram[VPN_UDP_HDR_SIZE] = size >> 8;
+    dgram[VPN_UDP_HDR_SIZE + 1] = size & 0xff;
+    struct vpn_aead_op op = {
+        .data = dgram + VPN_UDP_HDR_SIZE, .len = 2,
+        .aad = dgram, .aad_len = VPN_UDP_HDR_SIZE,
+    };
+    vpn_aead_nonce(op.nonce, VPN_DIR_TO_CLIENT, c->tx_seq);
+    vpn_stats_seal(w->stats, &c->aead, &op, 1);
+    send_udp_control(w, dgram, sizeof(dgram), addr, "Failed to answer probe");
+}
+
+// Tell a client we have no session session_id (any more); it resumes or
+// starts over. Not authenticated, so it can't end a live session.
+static void send_udp_retry(struct vpn_worker *w, uint32_t session_id, uint8_t reason,
+                           struct sockaddr_in *addr) {
+    unsigned char dgram[VPN_UDP_HDR_SIZE + 1];
+
+    vpn_udp_build_hdr((struct vpn_udp_hdr *)dgram, VPN_UDP_RETRY, session_id, 0);
+    dgram[VPN_UDP_HDR_SIZE] = reason;
+    send_udp_control(w, dgram, sizeof(dgram), addr, "Failed to send retry");
+}
+
+// A client starting a session, or repeating its HELLO. An unpadded one
+// is dropped before it costs a session: answering it would make us an
+// amplifier for forged source addresses.
+static void handle_udp_hello(struct vpn_worker *w, struct vpn_client *c, uint32_t session_id,
+                             const unsigned char *payload, int len, struct sockaddr_in *addr) {
+    if (len < VPN_UDP_HELLO_SIZE) {
+        return;
+    }
+
+    // The same HELLO again gets the same answer. A different one for a live
+    // session is ignored: HELLOs aren't authenticated, and must not be able
+    // to take over someone else's session.
+    if (c) {
+        if (memcmp(&c->hello_rx, payload, VPN_HELLO_SIZE) == 0) {
+            send_udp_hello(w, c, addr);
+        }
+        return;
+    }
+
+    c = new_udp_session(w, session_id, addr);
+    if (!c) {
+        return;
+    }
+    memcpy(&c->hello_rx, payload, VPN_HELLO_SIZE);
+    if (vpn_hello_answer(&c->hello_rx, &c->hello_tx, psk, &c->aead) < 0 ||
+        vpn_ticket_issue(&ticket_key, psk, &c->hello_rx, &c->hello_tx, c->ticket) < 0) {
+        remove_client(w, c);
+        return;
+    }
+    c->keyed = 1;
+    c->last_rx = time(NULL);
+
+    printf("[SERVER] UDP session %08x: cipher %s\n", session_id, c->aead.impl);
+    send_udp_hello(w, c, addr);
+}
+
+// A client resuming with a ticket; its DATA may follow right behind.
+// dgram is the whole datagram: header, struct vpn_resume, tag.
+static void handle_udp_resume(struct vpn_worker *w, struct vpn_client *c, uint32_t session_id,
+                              unsigned char *dgram, int n, struct sockaddr_in *addr) {
+    struct vpn_resume resume;
+    struct vpn_aead aead;
+
+    if (n != VPN_UDP_HDR_SIZE + VPN_RESUME_SIZE + VPN_TAG_SIZE) {
+        return;
+    }
+    memcpy(&resume, dgram + VPN_UDP_HDR_SIZE, sizeof(resume));
+
+    // A repeat (our answer got lost) is answered again; anything else for a
+    // live session is ignored, as for HELLOs
+    if (c) {
+        if (c->resumed && memcmp(c->resume_salt, resume.salt, VPN_SALT_SIZE) == 0) {
+            send_udp_resumed(w, c, addr);
+        }
+        return;
+    }
+
+    if (vpn_resume_answer(&ticket_key, &resume, &aead) < 0) {
+        send_udp_retry(w, session_id, VPN_RETRY_TICKET, addr);
+        return;
+    }
+    struct vpn_aead_op op = {
+        .data = dgram + VPN_UDP_HDR_SIZE + VPN_RESUME_SIZE, .len = 0,
+        .aad = dgram, .aad_len = VPN_UDP_HDR_SIZE + VPN_RESUME_SIZE,
+    };
+    vpn_aead_nonce(op.nonce, VPN_DIR_TO_SERVER, 0);
+    if (vpn_stats_open(w->stats, &aead, &op, 1) != 1 ||
+        !(c = new_udp_session(w, session_id, addr))) {
+        vpn_aead_wipe(&aead);
+        return;
+    }
+    c->aead = aead;
+    vpn_aead_wipe(&aead);
+    c->keyed = 1;
+    c->resumed = 1;
+    memcpy(c->resume_salt, resume.salt, VPN_SALT_SIZE);
+    c->last_rx = time(NULL);
+
+    printf("[SERVER] UDP session %08x: resumed, cipher %s\n", session_id, c->aead.impl);
+    send_udp_resumed(w, c, addr);
+}
+
+// Handle one received datagram: every datagram is one complete tunneled packet
+// Returns the client of an authentic DATA datagram, with its packet in
+// *op, or NULL if there is nothing to deliver
+static struct vpn_client *process_datagram(struct vpn_worker *w, unsigned char *buffer, int n,
+                                           struct sockaddr_in *addr, struct vpn_aead_op *op) {
+    uint32_t session_id;
+    uint64_t seq;
+    int type = vpn_udp_parse_hdr(buffer, n, &session_id, &seq);
+    if (type < 0) {
+        return NULL;  // Not ours
+    }
+
+    struct vpn_client *c = find_udp_session(w, session_id);
+    if (type == VPN_UDP_HELLO) {
+        handle_udp_hello(w, c, session_id, buffer + VPN_UDP_HDR_SIZE, n - VPN_UDP_HDR_SIZE, addr);
+        return NULL;
+    }
+    if (type == VPN_UDP_RESUME) {
+        handle_udp_resume(w, c, session_id, buffer, n, addr);
+        return NULL;
+    }
+    if (type == VPN_UDP_RETRY) {
+        return NULL;  // Only we send those
+    }
+    if (!c) {
+        // No session (we restarted, or forgot it): have the client resume
+        // instead of leaving its tunnel dead
+        send_udp_retry(w, session_id, VPN_RETRY_NO_SESSION, addr);
+        return NULL;
+    }
+
+    int packet_len = n - VPN_UDP_HDR_SIZE - VPN_TAG_SIZE;
+    if (packet_len < 0 || (type == VPN_UDP_DATA && packet_len == 0)) {
+        return NULL;
+    }
+    if (!vpn_replay_check(&c->replay, seq)) {
+        vpn_stat_add(w->stats, VPN_STAT_DROP_REPLAY, 1);
+        return NULL;  // Duplicate or too old
+    }
+
+    *op = (struct vpn_aead_op){
+        .data = buffer + VPN_UDP_HDR_SIZE, .len = packet_len,
+        .aad = buffer, .aad_len = VPN_UDP_HDR_SIZE,
+    };
+    vpn_aead_nonce(op->nonce, VPN_DIR_TO_SERVER, seq);
+    if (vpn_stats_open(w->stats, &c->aead, op, 1) != 1) {
+        return NULL;  // Forged or corrupted
+    }
+
+    // The packet is authentic: only now advance the window and follow
+    // the client to its new address if it moved
+    vpn_replay_update(&c->replay, seq);
+    c->last_rx = time(NULL);
+    if (c->addr.sin_addr.s_addr != addr->sin_addr.s_addr || c->addr.sin_port != addr->sin_port) {
+        printf("[SERVER] UDP session %08x moved to %s:%d\n",
+               session_id, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+        c->addr = *addr;
+    }
+
+    if (type == VPN_UDP_PROBE) {
+        send_udp_probe(w, c, n, addr);
+    }
+    return type == VPN_UDP_DATA ? c : NULL;
+}
+
+// Handle a batch of received datagrams (header + sealed packet each).
+// Each run of packets from one client is delivered together, so that an
+// offload TUN can coalesce them (if coalesce is set, see deliver_to_tun()).
+// HELLOs and RESUMEs never remove a session, so a run's client stays valid.
+static void process_datagrams(struct vpn_worker *w, unsigned char **bufs, const int *lens,
+                              struct sockaddr_in **addrs, int count, int coalesce) {
+    struct vpn_aead_op ops[VPN_BATCH_MAX];
+    struct vpn_client *run = NULL;
+    int num_ops = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct vpn_client *c = process_datagram(w, bufs[i], lens[i], addrs[i], &ops[num_ops]);
+        if (!c) {
+            continue;
+        }
+        if (c != run && num_ops > 0) {
+            deliver_to_tun(w, run, ops, num_ops, coalesce);
+            ops[0] = ops[num_ops];
+            num_ops = 0;
+        }
+        run = c;
+        num_ops++;
+    }
+    if (num_ops > 0) {
+        deliver_to_tun(w, run, ops, num_ops, coalesce);
+    }
+}
+
+// Drain the UDP socket, up to VPN_BATCH_MAX datagrams per recvmmsg()
+static void handle_udp_readable(struct vpn_worker *w) {
+    struct mmsghdr msgs[VPN_BATCH_MAX];
+    struct iovec iov[VPN_BATCH_MAX];
+    struct sockaddr_in addrs[VPN_BATCH_MAX];
+    unsigned char *bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+    struct sockaddr_in *addr_ptrs[VPN_BATCH_MAX];
+
+    while (1) {
+        memset(msgs, 0, sizeof(msgs));
+        // Each datagram's header lands in its buffer's headroom
+        for (int i = 0; i < VPN_BATCH_MAX; i++) {
+            iov[i].iov_base = w->udp_pkts[i]->data - VPN_UDP_HDR_SIZE;
+            iov[i].iov_len = VPN_UDP_HDR_SIZE + VPN_PKT_MAX + VPN_TAG_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+
+        int count = recvmmsg(w->udp_fd, msgs, VPN_BATCH_MAX, 0, NULL);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Failed to receive datagrams");
+            }
+            return;
+        }
+        vpn_batch_record(&w->udp_stats, count);
+
+        for (int i = 0; i < count; i++) {
+            bufs[i] = iov[i].iov_base;
+            lens[i] = msgs[i].msg_len;
+            addr_ptrs[i] = &addrs[i];
+        }
+        process_datagrams(w, bufs, lens, addr_ptrs, count, 1);
+
+        if (count < VPN_BATCH_MAX) {
+            return;  // Socket drained
+        }
+    }
+}
+
+// Drain the AF_XDP socket (-X). Datagrams are handled where the NIC or the
+// kernel put them, in UMEM frames; those come off the RX ring in any order,
+// so they aren't coalesced.
+static void handle_xsk_readable(struct vpn_worker *w) {
+    struct vpn_pkt *pkts[VPN_BATCH_MAX];
+    struct sockaddr_in addrs[VPN_BATCH_MAX];
+    unsigned char *bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+    struct sockaddr_in *addr_ptrs[VPN_BATCH_MAX];
+    int count;
+
+    do {
+        count = vpn_xsk_recv(&w->xsk, pkts, addrs, VPN_BATCH_MAX);
+        for (int i = 0; i < count; i++) {
+            bufs[i] = pkts[i]->data;
+            lens[i] = pkts[i]->len;
+            addr_ptrs[i] = &addrs[i];
+        }
+        if (count > 0) {
+            vpn_batch_record(&w->udp_stats, count);
+            process_datagrams(w, bufs, lens, addr_ptrs, count, 0);
+        }
+
+        // Straight back to the fill ring
+        for (int i = 0; i < count; i++) {
+            vpn_pkt_put(&w->xsk_pool, pkts[i]);
+        }
+        vpn_xsk_refill(&w->xsk);
+    } while (count == VPN_BATCH_MAX);
+}
+
+// UDP has no FIN: forget sessions that have been silent too long
+static void expire_udp_sessions(struct vpn_worker *w) {
+    time_t now = time(NULL);
+
+    for (int i = w->num_clients - 1; i >= 0; i--) {
+        struct vpn_client *c = w->clients[i];
+        if (c->udp && now - c->last_rx > VPN_UDP_SESSION_TIMEOUT) {
+            remove_client(w, c);
+        }
+    }
+}
+
+// -X: open an AF_XDP socket on the NIC queue with our id. Without one (more
+// workers than queues, or no socket) our datagrams keep coming through the
+// UDP socket.
+static void setup_worker_xsk(struct vpn_worker *w) {
+    if (w->id >= xdp.rx_queues || w->id >= VPN_XSK_MAX_QUEUES) {
+        return;
+    }
+    if (vpn_pool_init_slots(&w->xsk_pool, VPN_XSK_FRAMES, VPN_XSK_FRAME_SIZE) < 0 ||
+        vpn_xsk_open(&w->xsk, &xdp, w->id, &w->xsk_pool) < 0) {
+        fprintf(stderr, "[XDP] Worker %d: no AF_XDP socket on queue %d (%s), using the UDP socket\n",
+                w->id, w->id, strerror(errno));
+        vpn_pool_free(&w->xsk_pool);
+        return;
+    }
+    printf("[XDP] Worker %d: AF_XDP socket on queue %d, %s\n", w->id, w->id,
+           w->xsk.zerocopy ? "zero-copy" : "copy mode");
+}
+
+// Register the worker's fds with a fresh epoll set
+static int setup_worker(struct vpn_worker *w) {
+    // Edge-triggered mode only reports new data, so every fd must be
+    // non-blocking and drained until EAGAIN. io_uring waits for the TUN
+    // queue itself, and a read of a non-blocking file could just fail with
+    // EAGAIN instead, so in uring mode it stays blocking.
+    if ((!use_uring && set_nonblocking(w->tun_fd) < 0) || set_nonblocking(w->listen_fd) < 0 ||
+        set_nonblocking(w->udp_fd) < 0) {
+        perror("Failed to make sockets non-blocking");
+        return -1;
+    }
+
+    w->epoll_fd = epoll_create1(0);
+    w->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (w->epoll_fd < 0 || w->event_fd < 0) {
+        perror("Failed to create epoll/eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&w->handoff_lock, NULL);
+
+    if (vpn_pool_init(&w->pool, WORKER_POOL_SIZE) < 0) {
+        perror("Failed to set up packet buffers");
+        return -1;
+    }
+    for (int i = 0; i < VPN_BATCH_MAX; i++) {
+        w->tun_pkts[i] = vpn_pkt_get(&w->pool);
+        w->udp_pkts[i] = vpn_pkt_get(&w->pool);
+    }
+    if (xdp_ifname) {
+        setup_worker_xsk(w);
+    }
+    if (use_uring) {
+        return 0;  // The ring is set up by the worker thread itself
+    }
+
+    // The TUN, listen, UDP, event and AF_XDP fds are told apart by pointing at
+    // their slot in w; everything else is a struct vpn_client
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET };
+    ev.data.ptr = &w->tun_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->tun_fd, &ev);
+    ev.data.ptr = &w->listen_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev);
+    ev.data.ptr = &w->udp_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->udp_fd, &ev);
+    ev.data.ptr = &w->event_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev);
+    if (w->xsk.fd >= 0) {
+        ev.data.ptr = &w->xsk.fd;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->xsk.fd, &ev);
+    }
+    return 0;
+}
+
+static void print_worker_batch_stats(struct vpn_worker *w) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "worker %d TUN→CLIENT", w->id);
+    vpn_batch_print(name, &w->tun_stats);
+    snprintf(name, sizeof(name), "worker %d UDP→TUN", w->id);
+    vpn_batch_print(name, &w->udp_stats);
+    snprintf(name, sizeof(name), "worker %d TCP→TUN", w->id);
+    vpn_batch_print(name, &w->tcp_stats);
+}
+
+void vpn_epoll_loop(struct vpn_worker *w) {
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+
+    printf("[VPN] Worker %d: starting epoll event loop (up to %d clients)...\n",
+           w->id, MAX_CLIENTS);
+
+    while (1) {
+        // Wake up at least once a second to expire idle UDP sessions
+        int nready = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 1000);
+        if (nready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait() failed");
+            break;
+        }
+        uint64_t wakeup = vpn_stats_clock();
+        vpn_route_quiescent(w->route_reader);  // Nothing from the last wakeup is held
+
+        if (vpn_batch_report_requested(&w->report_seen)) {
+            print_worker_batch_stats(w);
+        }
+
+        for (int i = 0; i < nready; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &w->listen_fd) {
+                handle_accept(w);
+            } else if (ptr == &w->tun_fd) {
+                if (handle_tun_readable(w) < 0) goto out;
+            } else if (ptr == &w->udp_fd) {
+                handle_udp_readable(w);
+            } else if (ptr == &w->event_fd) {
+                handle_handoff(w);
+            } else if (ptr == &w->xsk.fd) {
+                handle_xsk_readable(w);
+            } else {
+                struct vpn_client *c = ptr;
+                uint32_t e = events[i].events;
+
+                if (c->fd < 0) {
+                    continue;  // Removed earlier in this batch
+                }
+                if ((e & EPOLLOUT) && flush_client_tx(w, c) < 0) {
+                    remove_client(w, c);
+                    continue;
+                }
+                if ((e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) &&
+                    handle_client_readable(w, c) < 0) {
+                    remove_client(w, c);
+                }
+            }
+        }
+
+        if (time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            expire_udp_sessions(w);
+        }
+        free_dead_clients(w);
+        if (nready > 0) {
+            vpn_stats_wakeup(w->stats, wakeup);
+        }
+    }
+
+out:
+    while (w->num_clients > 0) {
+        remove_client(w, w->clients[0]);
+    }
+    free_dead_clients(w);
+    print_worker_batch_stats(w);
+}
+
+// uring mode: queue a read of the next TUN packet into tun_pkts[i]. A
+// fixed buffer read if the slot still holds the buffer registered for it;
+// a plain one if a handoff gave it a spare, or nothing was registered.
+static void uring_arm_tun_read(struct vpn_worker *w, int i) {
+    struct io_uring_sqe *sqe = vpn_uring_sqe(&w->ring);
+    if (!sqe) {
+        return;
+    }
+    vpn_pkt_reset(w->tun_pkts[i]);
+    if (w->tun_pkts[i] == w->tun_fixed[i]) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = i;
+    } else {
+        sqe->opcode = IORING_OP_READ;
+    }
+    sqe->fd = w->tun_fd;
+    sqe->addr = (uintptr_t)w->tun_pkts[i]->data;
+    sqe->len = tun_offload ? VPN_GSO_READ_MAX : VPN_PKT_MAX;
+    sqe->off = -1;
+    sqe->user_data = ((uint64_t)i << URING_KIND_BITS) | URING_TUN;
+}
+
+// uring mode: (re)start a multishot request on one of the worker's own fds
+static void uring_arm_multishot(struct vpn_worker *w, int kind) {
+    struct io_uring_sqe *sqe = vpn_uring_sqe(&w->ring);
+    if (!sqe) {
+        return;
+    }
+    sqe->user_data = kind;
+    switch (kind) {
+    case URING_UDP:
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = w->udp_fd;
+        sqe->addr = (uintptr_t)&w->udp_msg;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = w->udp_ring.bgid;
+        break;
+    case URING_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = w->listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK;
+        break;
+    case URING_HANDOFF:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = w->event_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        break;
+    case URING_XDP:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = w->xsk.fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        break;
+    }
+}
+
+// The receive buffer udp_pkts[bid] as handed to the kernel
+static unsigned char *uring_udp_buf(struct vpn_worker *w, int bid) {
+    return w->udp_pkts[bid]->data - VPN_UDP_HDR_SIZE - URING_UDP_PREFIX;
+}
+
+// Register the TUN read batch's buffers, one per slot, for fixed buffer
+// reads. Only these are pinned (VPN_BATCH_MAX slots, about 2 MiB, counted
+// against RLIMIT_MEMLOCK): the rest of the pool keeps costing only the
+// pages it touches. Over the limit, the reads are plain ones.
+static int register_tun_buffers(struct vpn_worker *w) {
+    struct iovec iov[VPN_BATCH_MAX];
+
+    for (int i = 0; i < VPN_BATCH_MAX; i++) {
+        iov[i].iov_base = w->tun_pkts[i];
+        iov[i].iov_len = VPN_PKT_SLOT_SIZE;
+    }
+    if (vpn_uring_register_buffers(&w->ring, iov, VPN_BATCH_MAX) < 0) {
+        if (errno != ENOMEM && errno != EPERM) {
+            return -1;
+        }
+        fprintf(stderr, "Worker %d: cannot pin TUN buffers (ulimit -l), "
+                "reading without fixed buffers\n", w->id);
+        return 0;
+    }
+    memcpy(w->tun_fixed, w->tun_pkts, sizeof(w->tun_fixed));
+    return 0;
+}
+
+// Set up the worker's ring: the TUN read batch as fixed buffers, udp_pkts
+// as the multishot recvmsg's buffer ring, and the first round of requests
+static int setup_uring_worker(struct vpn_worker *w) {
+    // Requests in flight: one read per TUN slot, one recv (and maybe a
+    // POLLOUT) per client, plus a few multishots. The CQ is twice as big,
+    // and the kernel holds back completions rather than drop them.
+    if (vpn_uring_init(&w->ring, 1024) < 0) {
+        perror("Failed to set up io_uring (Linux 6.0+)");
+        return -1;
+    }
+
+    if (register_tun_buffers(w) < 0 ||
+        vpn_uring_bufring_init(&w->ring, &w->udp_ring, 0, VPN_BATCH_MAX) < 0) {
+        perror("Failed to register io_uring buffers");
+        return -1;
+    }
+    for (int i = 0; i < VPN_BATCH_MAX; i++) {
+        vpn_uring_bufring_add(&w->udp_ring, uring_udp_buf(w, i),
+                              URING_UDP_PREFIX + VPN_UDP_HDR_SIZE + VPN_PKT_MAX + VPN_TAG_SIZE, i);
+    }
+    vpn_uring_bufring_publish(&w->udp_ring);
+    w->udp_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+    for (int i = 0; i < VPN_BATCH_MAX; i++) {
+        uring_arm_tun_read(w, i);
+    }
+    uring_arm_multishot(w, URING_UDP);
+    uring_arm_multishot(w, URING_ACCEPT);
+    uring_arm_multishot(w, URING_HANDOFF);
+    if (w->xsk.fd >= 0) {
+        uring_arm_multishot(w, URING_XDP);
+    }
+    return 0;
+}
+
+// Per-wakeup work collected from the completions, handled in batches
+struct uring_reaped {
+    int tun[VPN_BATCH_MAX];                 // tun_pkts slots that got a packet
+    int num_tun;
+    int tun_rearm[VPN_BATCH_MAX];           // ... or that just need their read again
+    int num_tun_rearm;
+    int udp_bids[VPN_BATCH_MAX];            // udp_pkts holding a datagram
+    int num_udp;
+    int udp_rearm;                          // The multishot recvmsg stopped
+    int xsk;                                // The AF_XDP socket has frames
+};
+
+// Handle one completion. Returns -1 if the TUN device failed.
+static int uring_reap(struct vpn_worker *w, const struct io_uring_cqe *cqe,
+                      struct uring_reaped *r) {
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    int res = cqe->res;
+    struct vpn_client *c = URING_CLIENT(cqe->user_data);  // URING_RECV/URING_POLLOUT only
+
+    switch (URING_KIND(cqe->user_data)) {
+    case URING_TUN: {
+        int i = cqe->user_data >> URING_KIND_BITS;
+        if (res > 0) {
+            w->tun_pkts[i]->len = res;
+            r->tun[r->num_tun++] = i;
+        } else if (res == -EAGAIN || res == -EINTR || w->stopping) {
+            r->tun_rearm[r->num_tun_rearm++] = i;
+        } else {
+            errno = -res;
+            perror("Failed to read from TUN device");
+            return -1;
+        }
+        break;
+    }
+    case URING_UDP: {
+        int bid = vpn_uring_cqe_bid(cqe);
+        if (res >= 0 && bid >= 0) {
+            r->udp_bids[r->num_udp++] = bid;
+        } else if (bid >= 0) {
+            vpn_uring_bufring_add(&w->udp_ring, uring_udp_buf(w, bid),
+                                  URING_UDP_PREFIX + VPN_UDP_HDR_SIZE + VPN_PKT_MAX + VPN_TAG_SIZE,
+                                  bid);
+        }
+        // Stops on errors, and when every buffer is taken (ENOBUFS)
+        if (!more) {
+            r->udp_rearm = 1;
+        }
+        break;
+    }
+    case URING_ACCEPT:
+        if (res >= 0) {
+            struct sockaddr_in addr = {0};
+            socklen_t addr_len = sizeof(addr);
+            getpeername(res, (struct sockaddr *)&addr, &addr_len);
+            add_tcp_client(w, res, &addr);
+        } else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED) {
+            errno = -res;
+            perror("Failed to accept client");
+        }
+        if (!more && !w->stopping) {
+            uring_arm_multishot(w, URING_ACCEPT);
+        }
+        break;
+    case URING_HANDOFF:
+        handle_handoff(w);
+        if (!more && !w->stopping) {
+            uring_arm_multishot(w, URING_HANDOFF);
+        }
+        break;
+    case URING_XDP:
+        r->xsk = 1;
+        if (!more && !w->stopping) {
+            uring_arm_multishot(w, URING_XDP);
+        }
+        break;
+    case URING_RECV:
+        c->uring_refs--;
+        if (c->fd < 0) {
+            break;  // Removed while the receive was in flight
+        }
+        if (res == -EAGAIN || res == -EINTR) {
+            uring_arm_recv(w, c);
+            break;
+        }
+        if (res <= 0) {
+            remove_client(w, c);  // Orderly shutdown or error
+            break;
+        }
+        vpn_stream_commit(&c->rx, res);
+        if (process_client_frames(w, c) < 0) {
+            remove_client(w, c);
+        } else {
+            uring_arm_recv(w, c);
+        }
+        break;
+    case URING_POLLOUT:
+        c->uring_refs--;
+        c->pollout_armed = 0;
+        if (c->fd < 0) {
+            break;
+        }
+        if (flush_client_tx(w, c) < 0) {
+            remove_client(w, c);
+        } else {
+            update_client_events(w, c);  // Still more queued: wait again
+        }
+        break;
+    }
+    return 0;
+}
+
+// Handle the datagrams reaped in one wakeup, then hand their buffers back
+static void uring_udp_batch(struct vpn_worker *w, struct uring_reaped *r) {
+    unsigned char *bufs[VPN_BATCH_MAX];
+    int lens[VPN_BATCH_MAX];
+    struct sockaddr_in *addrs[VPN_BATCH_MAX];
+    int count = 0;
+
+    for (int i = 0; i < r->num_udp; i++) {
+        struct io_uring_recvmsg_out *out = (void *)uring_udp_buf(w, r->udp_bids[i]);
+        if ((out->flags & MSG_TRUNC) || out->namelen != sizeof(struct sockaddr_in)) {
+            continue;  // Not one of our datagrams
+        }
+        addrs[count] = (struct sockaddr_in *)(out + 1);
+        bufs[count] = (unsigned char *)out + URING_UDP_PREFIX;
+        lens[count] = out->payloadlen;
+        count++;
+    }
+    process_datagrams(w, bufs, lens, addrs, count, 1);
+    vpn_batch_record(&w->udp_stats, count);
+
+    for (int i = 0; i < r->num_udp; i++) {
+        vpn_uring_bufring_add(&w->udp_ring, uring_udp_buf(w, r->udp_bids[i]),
+                              URING_UDP_PREFIX + VPN_UDP_HDR_SIZE + VPN_PKT_MAX + VPN_TAG_SIZE,
+                              r->udp_bids[i]);
+    }
+    vpn_uring_bufring_publish(&w->udp_ring);
+}
+
+// The epoll worker with io_uring underneath. Each wakeup is one
+// io_uring_enter() that submits every request queued since the last one
+// and waits for completions; those are then handled in the same batches as
+// in epoll mode.
+void vpn_uring_loop(struct vpn_worker *w) {
+    time_t last_sweep = time(NULL);
+    struct uring_reaped r;
+
+    printf("[VPN] Worker %d: starting io_uring event loop (up to %d clients)...\n",
+           w->id, MAX_CLIENTS);
+    if (setup_uring_worker(w) < 0) {
+        goto out;
+    }
+
+    while (1) {
+        // Wake up at least once a second to expire idle UDP sessions
+        int ret = vpn_uring_submit_wait(&w->ring, 1, 1000);
+        if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+            errno = -ret;
+            perror("io_uring_enter() failed");
+            break;
+        }
+        uint64_t wakeup = vpn_stats_clock();
+        vpn_route_quiescent(w->route_reader);
+
+        if (vpn_batch_report_requested(&w->report_seen)) {
+            print_worker_batch_stats(w);
+        }
+
+        memset(&r, 0, sizeof(r));
+        struct io_uring_cqe *cqe;
+        int failed = 0;
+        while ((cqe = vpn_uring_peek(&w->ring)) != NULL) {
+            if (uring_reap(w, cqe, &r) < 0) {
+                failed = 1;
+            }
+            vpn_uring_seen(&w->ring);
+        }
+        if (failed) {
+            break;
+        }
+
+        // TUN packets: route the batch, send it, and read again
+        for (int i = 0; i < r.num_tun; i++) {
+            route_tun_packet(w, &w->tx, &w->tun_pkts[r.tun[i]]);
+        }
+        tx_batch_flush(w, &w->tx);
+        vpn_batch_record(&w->tun_stats, r.num_tun);
+        for (int i = 0; i < r.num_tun; i++) {
+            uring_arm_tun_read(w, r.tun[i]);
+        }
+        for (int i = 0; i < r.num_tun_rearm; i++) {
+            uring_arm_tun_read(w, r.tun_rearm[i]);
+        }
+
+        if (r.num_udp > 0) {
+            uring_udp_batch(w, &r);
+        } else if (r.udp_rearm) {
+            vpn_uring_bufring_publish(&w->udp_ring);  // Buffers of failed receives
+        }
+        if (r.udp_rearm) {
+            uring_arm_multishot(w, URING_UDP);
+        }
+        if (r.xsk) {
+            handle_xsk_readable(w);
+        }
+
+        if (time(NULL) != last_sweep) {
+            last_sweep = time(NULL);
+            expire_udp_sessions(w);
+        }
+        free_dead_clients(w);
+        if (ret == 0) {
+            vpn_stats_wakeup(w->stats, wakeup);
+        }
+    }
+
+out:
+    // Drop every client, and wait (briefly) for the requests that point at
+    // them to complete before they are freed
+    w->stopping = 1;
+    while (w->num_clients > 0) {
+        remove_client(w, w->clients[0]);
+    }
+    for (int tries = 0; w->num_dead > 0 && w->ring.fd >= 0 && tries < 10; tries++) {
+        vpn_uring_submit_wait(&w->ring, 1, 100);
+        struct io_uring_cqe *cqe;
+        while ((cqe = vpn_uring_peek(&w->ring)) != NULL) {
+            int kind = URING_KIND(cqe->user_data);
+            if (kind == URING_RECV || kind == URING_POLLOUT) {
+                URING_CLIENT(cqe->user_data)->uring_refs--;
+            }
+            vpn_uring_seen(&w->ring);
+        }
+        free_dead_clients(w);
+    }
+    vpn_uring_free(&w->ring);
+    vpn_uring_bufring_free(&w->udp_ring);
+    for (int i = 0; i < w->num_dead; i++) {
+        w->dead[i]->uring_refs = 0;  // The ring is gone, and its requests with it
+    }
+    free_dead_clients(w);
+    print_worker_batch_stats(w);
+}
+
+static void *worker_main(void *arg) {
+    struct vpn_worker *w = arg;
+
+    // One worker per core: keeps the queue's packets, the worker's clients
+    // and their buffers in one CPU's caches
+    if (num_workers > 1) {
+        int cpu = pin_thread_to_cpu(w->id);
+        if (cpu >= 0) {
+            printf("[VPN] Worker %d pinned to CPU %d\n", w->id, cpu);
+        }
+    }
+
+    // Every worker reads the shared owner and subnet tables
+    w->route_reader = vpn_route_reader_register();
+    if (w->route_reader < 0) {
+        fprintf(stderr, "[VPN] Worker %d: too many route table readers\n", w->id);
+        return NULL;
+    }
+
+    if (use_uring) {
+        vpn_uring_loop(w);
+    } else {
+        vpn_epoll_loop(w);
+    }
+    vpn_route_reader_offline(w->route_reader);
+    return NULL;
+}
+
+// Run num_workers epoll workers, one per TUN queue, and wait for them
+int run_epoll_workers(int *tun_fds, int count) {
+    char name[32];
+
+    num_workers = count;
+
+    // Worker N takes NIC queue N; datagrams on the other queues go up the
+    // stack to a UDP socket
+    if (xdp_ifname) {
+        if (vpn_xdp_attach(&xdp, xdp_ifname, htonl(INADDR_ANY), SERVER_PORT) < 0) {
+            return -1;
+        }
+        if (xdp.rx_queues > count) {
+            fprintf(stderr, "[XDP] %s has %d RX queues for %d workers: the rest take the stack"
+                    " (ethtool -L %s combined %d)\n", xdp_ifname, xdp.rx_queues, count,
+                    xdp_ifname, count);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct vpn_worker *w = calloc(1, sizeof(*w));
+        if (!w) {
+            perror("Failed to allocate worker");
+            return -1;
+        }
+        w->id = i;
+        w->tun_fd = tun_fds[i];
+        w->xsk.fd = -1;
+        snprintf(name, sizeof(name), "worker %d", i);
+        w->stats = vpn_stats_new(name);
+        if (vpn_route_init(&w->by_inner_ip) < 0 || vpn_route_init(&w->by_session) < 0) {
+            perror("Failed to set up client tables");
+            return -1;
+        }
+
+        // Each worker listens on the same port; SO_REUSEPORT makes the
+        // kernel spread incoming connections across the listeners
+        w->listen_fd = create_server_socket(SERVER_PORT, count > 1);
+        w->udp_fd = create_udp_socket(SERVER_PORT, count > 1);
+        if (w->listen_fd < 0 || w->udp_fd < 0 || setup_worker(w) < 0) {
+            return -1;
+        }
+        workers[i] = w;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers[i]->thread, NULL, worker_main, workers[i]) != 0) {
+            perror("Failed to start worker thread");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i]->thread, NULL);
+    }
+
+    // Only once every worker has stopped: their handoff queues may hold
+    // each other's buffers
+    for (int i = 0; i < count; i++) {
+        vpn_xsk_close(&workers[i]->xsk);
+        vpn_pool_free(&workers[i]->xsk_pool);
+        vpn_pool_free(&workers[i]->pool);
+        close(workers[i]->listen_fd);
+        close(workers[i]->udp_fd);
+        close(workers[i]->event_fd);
+        close(workers[i]->epoll_fd);
+        vpn_route_destroy(&workers[i]->by_inner_ip);
+        vpn_route_destroy(&workers[i]->by_session);
+        free(workers[i]);
+    }
+    if (xdp_ifname) {
+        vpn_xdp_detach(&xdp);
+    }
+    return 0;
+}
+
+// A VPN gateway has to forward between TUN and the uplink
+static void enable_ip_forwarding(void) {
+    int fd = open("/proc/sys/net/ipv4/ip_forward", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, "1\n", 2) != 2) {
+        perror("[SETUP] Failed to enable IP forwarding");
+    } else {
+        printf("[SETUP] IPv4 forwarding enabled\n");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// -R SUBNET/LEN=TUNNEL_IP: route a subnet to the client with that tunnel IP.
+// Returns 0, or -1 if arg doesn't parse.
+static int add_subnet_route(const char *arg) {
+    char net[INET_ADDRSTRLEN];
+    struct in_addr prefix, via;
+    int len, end = 0;
+
+    if (sscanf(arg, "%15[0-9.]/%d=%n", net, &len, &end) != 2 || end == 0 ||
+        len < 0 || len > 32 || inet_pton(AF_INET, net, &prefix) != 1 ||
+        inet_pton(AF_INET, arg + end, &via) != 1) {
+        return -1;
+    }
+    return vpn_route_set(&subnets, ntohl(prefix.s_addr), len, ntohl(via.s_addr));
+}
+
+void print_usage(const char *prog_name) {
+    printf("Usage: %s [-m select|epoll|uring] [-t threads] [-k keyfile] [-o] [-R subnet=ip]\n"
+           "          [-a addr/len] [-M mtu] [-X iface] [-s sec] [-S path] [-T n]\n", prog_name);
+    printf("  -m select  Serve one client with select() (default)\n");
+    printf("  -m epoll   Serve many clients with an edge-triggered epoll loop\n");
+    printf("  -m uring   Like epoll, with the I/O done through io_uring (Linux 6.0+)\n");
+    printf("  -t N       epoll/uring mode: N worker threads on a %d-queue max TUN device\n",
+           MAX_TUN_QUEUES);
+    printf("  -k FILE    Pre-shared key: 64 hex digits (e.g. openssl rand -hex 32 > vpn.key)\n");
+    printf("  -o         epoll/uring mode: TUN offloads (GSO super-packets, receive coalescing)\n");
+    printf("  -R NET/LEN=IP  epoll/uring mode: route NET/LEN to the client with tunnel IP IP\n");
+    printf("             (e.g. -R 192.168.50.0/24=10.8.0.2, repeatable)\n");
+    printf("  -a ADDR/LEN  Configure the TUN device (e.g. -a 10.8.0.1/24), bring it up and\n");
+    printf("             enable IP forwarding, instead of waiting for it to be done by hand\n");
+    printf("  -M MTU     With -a: the TUN device's MTU (default %d)\n",
+           VPN_PMTU_DEFAULT - VPN_UDP_OVERHEAD);
+    printf("  -X IFACE   epoll/uring mode: receive UDP through AF_XDP sockets on IFACE, one\n");
+    printf("             per worker and NIC queue (Linux 5.9+)\n");
+    printf("  -s SEC     Print a traffic summary every SEC seconds\n");
+    printf("  -S PATH    Dump all counters to each connection on unix socket PATH\n");
+    printf("  -T N       Trace: log one packet in N\n");
+}
+
+int main(int argc, char *argv[]) {
+    int tun_fd, server_fd, client_fd;
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    char tun_name[IFNAMSIZ] = "tun0";
+    int use_epoll = 0;
+    int num_threads = 1;
+    const char *key_file = NULL;
+    int stats_interval = 0;
+    const char *stats_socket = NULL;
+    int num_routes = 0;
+    const char *tun_addr = NULL;
+    int tun_mtu = 0;
+    int opt;
+
+    if (vpn_route_init(&owners) < 0 || vpn_route_init(&subnets) < 0) {
+        perror("Failed to set up route tables");
+        exit(1);
+    }
+
+    while ((opt = getopt(argc, argv, "m:t:k:oR:a:M:X:s:S:T:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "epoll") == 0) {
+                use_epoll = 1;
+            } else if (strcmp(optarg, "uring") == 0) {
+                use_epoll = 1;  // Same workers, other engine
+                use_uring = 1;
+            } else if (strcmp(optarg, "select") != 0) {
+                fprintf(stderr, "Unknown mode: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 't':
+            num_threads = atoi(optarg);
+            if (num_threads < 1 || num_threads > MAX_TUN_QUEUES) {
+                fprintf(stderr, "Thread count must be 1..%d\n", MAX_TUN_QUEUES);
+                exit(1);
+            }
+            break;
+        case 'k':
+            key_file = optarg;
+            break;
+        case 'o':
+            tun_offload = 1;
+            break;
+        case 'R':
+            if (add_subnet_route(optarg) < 0) {
+                fprintf(stderr, "Bad route: %s (want e.g. 192.168.50.0/24=10.8.0.2)\n", optarg);
+                exit(1);
+            }
+            num_routes++;
+            break;
+        case 'a':
+            tun_addr = optarg;
+            break;
+        case 'M':
+            tun_mtu = atoi(optarg);
+            if (tun_mtu < 68 || tun_mtu > 65535) {
+                fprintf(stderr, "MTU must be 68..65535\n");
+                exit(1);
+            }
+            break;
+        case 'X':
+            xdp_ifname = optarg;
+            break;
+        case 's':
+            stats_interval = atoi(optarg);
+            break;
+        case 'S':
+            stats_socket = optarg;
+            break;
+        case 'T':
+            vpn_trace_every = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+
+    if (num_threads > 1 && !use_epoll) {
+        fprintf(stderr, "-t requires -m epoll or -m uring\n");
+        exit(1);
+    }
+    if (tun_offload && !use_epoll) {
+        fprintf(stderr, "-o requires -m epoll or -m uring\n");
+        exit(1);
+    }
+    if (num_routes > 0 && !use_epoll) {
+        fprintf(stderr, "-R requires -m epoll or -m uring\n");
+        exit(1);
+    }
+    if (xdp_ifname && !use_epoll) {
+        fprintf(stderr, "-X requires -m epoll or -m uring\n");
+        exit(1);
+    }
+    if (tun_mtu && !tun_addr) {
+        fprintf(stderr, "-M requires -a\n");
+        exit(1);
+    }
+
+    printf("=== Simple VPN Server ===\n");
+    if (vpn_load_key(key_file, psk) < 0 || vpn_ticket_key_init(&ticket_key, psk) < 0 ||
+        vpn_stats_start(stats_interval, stats_socket) < 0) {
+        exit(1);
+    }
+    vpn_batch_install_report_signal();
+
+    // Step 1: Create TUN device (one queue per worker thread)
+    int tun_fds[MAX_TUN_QUEUES];
+    int *gso_types = tun_offload ? &tun_gso_types : NULL;
+    if (num_threads > 1) {
+        if (create_tun_queues(tun_name, num_threads, tun_fds, gso_types) < 0) {
+            fprintf(stderr, "Failed to create TUN device\n");
+            exit(1);
+        }
+    } else {
+        tun_fds[0] = create_tun_device(tun_name, gso_types);
+        if (tun_fds[0] < 0) {
+            fprintf(stderr, "Failed to create TUN device\n");
+            exit(1);
+        }
+    }
+    tun_fd = tun_fds[0];
+
+    if (tun_addr) {
+        if (!tun_mtu) {
+            tun_mtu = VPN_PMTU_DEFAULT - VPN_UDP_OVERHEAD;
+        }
+        if (configure_tun_device(tun_name, tun_addr, tun_mtu) < 0) {
+            exit(1);
+        }
+        enable_ip_forwarding();
+    } else {
+        printf("\n[SETUP] Please configure the TUN device in another terminal:\n");
+        printf("        sudo ip addr add 10.8.0.1/24 dev tun0\n");
+        printf("        sudo ip link set tun0 up\n");
+        printf("        sudo sysctl -w net.ipv4.ip_forward=1\n");
+        printf("\n[SETUP] Press Enter when ready (or start with -a 10.8.0.1/24)...");
+        getchar();
+    }
+    int mtu = get_tun_mtu(tun_name);
+    if (mtu > 0) {
+        tun_mtu_now = mtu;
+    }
+
+    // epoll/uring mode: every worker creates its own listen socket and
+    // serves the clients the kernel hands to it
+    if (use_epoll) {
+        int ret = run_epoll_workers(tun_fds, num_threads);
+
+        for (int i = 0; i < num_threads; i++) {
+            close(tun_fds[i]);
+        }
+        printf("\n[SERVER] Shutting down\n");
+        return ret < 0 ? 1 : 0;
+    }
+
+    // Step 2: Create server socket
+    server_fd = create_server_socket(SERVER_PORT, 0);
+    if (server_fd < 0) {
+        close(tun_fd);
+        exit(1);
+    }
+
+    // Step 3: Accept client connection
+    printf("[SERVER] Waiting for client connection...\n");
+    client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+    if (client_fd < 0) {
+        perror("Failed to accept client");
+        close(server_fd);
+        close(tun_fd);
+        exit(1);
+    }
+
+    printf("[SERVER] Client connected from %s:%d\n",
+           inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+    // Step 4: Agree on a session key, then run VPN event loop
+    struct vpn_aead aead;
+    if (tcp_handshake(client_fd, &aead) == 0) {
+        vpn_event_loop(tun_fd, client_fd, &aead);
+    }
+    vpn_aead_wipe(&aead);
 
     // Cleanup
     close(client_fd);
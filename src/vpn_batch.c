@@ -0,0 +1,114 @@
+/*
+ * Batched packet I/O shared by simple_vpn_server and simple_vpn_client
+ */
+
+#define _GNU_SOURCE  // IOV_MAX
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "vpn_batch.h"
+
+static volatile sig_atomic_t report_requests = 0;
+
+void vpn_batch_record(struct vpn_batch_stats *stats, int n) {
+    if (n <= 0) {
+        return;
+    }
+
+    int bucket = 0;
+    while ((1 << (bucket + 1)) <= n && bucket < VPN_BATCH_BUCKETS - 1) {
+        bucket++;
+    }
+
+    stats->batches++;
+    stats->packets += n;
+    stats->hist[bucket]++;
+    if ((uint64_t)n > stats->max) {
+        stats->max = n;
+    }
+}
+
+void vpn_batch_print(const char *name, const struct vpn_batch_stats *stats) {
+    printf("[BATCH] %s: %llu pkts in %llu batches (avg %.1f, max %llu) |",
+           name, (unsigned long long)stats->packets, (unsigned long long)stats->batches,
+           stats->batches ? (double)stats->packets / stats->batches : 0.0,
+           (unsigned long long)stats->max);
+    for (int i = 0; i < VPN_BATCH_BUCKETS; i++) {
+        int lo = 1 << i;
+        if (i == 0) {
+            printf(" 1:%llu", (unsigned long long)stats->hist[i]);
+        } else if (i == VPN_BATCH_BUCKETS - 1) {
+            printf(" %d+:%llu", lo, (unsigned long long)stats->hist[i]);
+        } else {
+            printf(" %d-%d:%llu", lo, (lo << 1) - 1, (unsigned long long)stats->hist[i]);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int vpn_read_batch(int fd, unsigned char **bufs, int *lens, int max, size_t buf_size) {
+    int count = 0;
+
+    while (count < max) {
+        ssize_t n = read(fd, bufs[count], buf_size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return count ? count : -1;
+        }
+        lens[count++] = n;
+    }
+    return count;
+}
+
+int vpn_writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        // Skip what was written; the first unfinished iovec is trimmed
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void report_signal_handler(int signum) {
+    (void)signum;
+    report_requests++;
+}
+
+void vpn_batch_install_report_signal(void) {
+    // No SA_RESTART needed: select()/epoll_wait() return EINTR either way,
+    // which is what makes the loop on the interrupted thread notice the
+    // request promptly (the others notice on their next wakeup)
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = report_signal_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+int vpn_batch_report_requested(unsigned int *seen) {
+    unsigned int now = report_requests;
+    if (now != *seen) {
+        *seen = now;
+        return 1;
+    }
+    return 0;
+}
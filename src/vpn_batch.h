@@ -0,0 +1,55 @@
+/*
+ * Batched packet I/O shared by simple_vpn_server and simple_vpn_client
+ *
+ * A wakeup from select()/epoll usually means several packets are waiting.
+ * Handling them one read()/write() pair at a time makes small-packet traffic
+ * (VoIP, DNS, TCP ACKs) pay two or three syscalls per packet. Instead, the
+ * event loops drain up to VPN_BATCH_MAX packets per wakeup and send them
+ * with one writev() (TCP) or sendmmsg() (UDP), and receive datagrams with
+ * recvmmsg().
+ *
+ * The TUN side can't be batched: tun takes exactly one packet per write().
+ */
+
+#ifndef VPN_BATCH_H
+#define VPN_BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define VPN_BATCH_MAX 32
+
+// Batch size histogram with power-of-two buckets: 1, 2-3, 4-7, ... 32+
+#define VPN_BATCH_BUCKETS 6
+
+struct vpn_batch_stats {
+    uint64_t batches;                   // Wakeups that moved at least one packet
+    uint64_t packets;
+    uint64_t max;                       // Largest batch seen
+    uint64_t hist[VPN_BATCH_BUCKETS];
+};
+
+// Account one batch of n packets (n == 0 is ignored)
+void vpn_batch_record(struct vpn_batch_stats *stats, int n);
+
+// Print "name: N batches, avg X pkts/batch, histogram ..."
+void vpn_batch_print(const char *name, const struct vpn_batch_stats *stats);
+
+// Read up to max packets from a non-blocking fd (e.g. TUN) into bufs,
+// storing each length in lens. Stops at EAGAIN. Returns the number of
+// packets read, or -1 if the very first read failed (errno is set).
+int vpn_read_batch(int fd, unsigned char **bufs, int *lens, int max, size_t buf_size);
+
+// writev() the whole iov array to a blocking fd, resuming after partial
+// writes. Returns 0, or -1 on error.
+int vpn_writev_all(int fd, struct iovec *iov, int iovcnt);
+
+// Ask loops for a batch report with SIGUSR1 (kill -USR1 <pid>)
+void vpn_batch_install_report_signal(void);
+
+// Returns 1 once per SIGUSR1 for each caller-owned *seen counter, so each
+// thread prints its own report
+int vpn_batch_report_requested(unsigned int *seen);
+
+#endif
@@ -0,0 +1,391 @@
+/*
+ * Load generator for the simple VPN benchmarks
+ *
+ * One end runs "vpn_bench serve" on its tunnel address; the other drives a
+ * workload through the tunnel at it and prints the result as one JSON
+ * object:
+ *   bulk - one TCP stream, as fast as it goes: Gbps
+ *   pps  - a flood of small UDP datagrams: Mpps sent and delivered
+ *   rr   - UDP request/response, one in flight: transactions per second and
+ *          p50/p99/p999 round-trip latency
+ * and "vpn_bench ping" waits (up to -d seconds) for the tunnel to come up.
+ *
+ * vpn_bench.sh sets up the namespaces and the VPN around it, and adds what
+ * the endpoints spent per packet.
+ *
+ * Compile: gcc -O2 -o vpn_bench vpn_bench.c -pthread
+ * Run: ./vpn_bench serve <addr>
+ *      ./vpn_bench [-d sec] [-l size] bulk|pps|rr|ping <server_addr>
+ */
+
+#define _GNU_SOURCE  // sendmmsg(), recvmmsg()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <time.h>
+
+#define BULK_PORT 9100          // TCP: everything read is thrown away
+#define FLOOD_PORT 9101         // UDP: datagrams are counted
+#define ECHO_PORT 9102          // UDP: datagrams go straight back
+#define COUNT_PORT 9103         // TCP: hands out (and resets) the flood count
+
+#define BULK_CHUNK (256 * 1024)
+#define FLOOD_BATCH 64
+#define RR_TIMEOUT_MS 1000      // A request unanswered this long is lost
+
+static _Atomic uint64_t flood_count;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int make_socket(int type, const char *addr, int port, int bind_it) {
+    struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port)};
+    int one = 1;
+
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address: %s\n", addr);
+        exit(1);
+    }
+    int fd = socket(AF_INET, type, 0);
+    if (fd < 0) {
+        perror("Failed to create socket");
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind_it ? bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+                : connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        fprintf(stderr, "Failed to %s %s:%d: %s\n", bind_it ? "bind" : "connect to",
+                addr, port, strerror(errno));
+        exit(1);
+    }
+    if (bind_it && type == SOCK_STREAM && listen(fd, 16) < 0) {
+        perror("Failed to listen");
+        exit(1);
+    }
+    return fd;
+}
+
+// =============================================================================
+// Server side
+// =============================================================================
+
+static void *bulk_sink(void *arg) {
+    int listen_fd = *(int *)arg;
+    char *buf = malloc(BULK_CHUNK);
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        // Closing once the sender is done tells it everything arrived
+        while (read(fd, buf, BULK_CHUNK) > 0) {
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+static void *flood_sink(void *arg) {
+    int fd = *(int *)arg;
+    static char bufs[FLOOD_BATCH][2048];
+    struct iovec iov[FLOOD_BATCH];
+    struct mmsghdr msgs[FLOOD_BATCH];
+
+    for (;;) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < FLOOD_BATCH; i++) {
+            iov[i] = (struct iovec){.iov_base = bufs[i], .iov_len = sizeof(bufs[i])};
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(fd, msgs, FLOOD_BATCH, MSG_WAITFORONE, NULL);
+        if (n > 0) {
+            atomic_fetch_add(&flood_count, n);
+        }
+    }
+    return NULL;
+}
+
+static void *echo(void *arg) {
+    int fd = *(int *)arg;
+    char buf[65536];
+    struct sockaddr_in from;
+
+    for (;;) {
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+        if (n >= 0) {
+            sendto(fd, buf, n, 0, (struct sockaddr *)&from, from_len);
+        }
+    }
+    return NULL;
+}
+
+static int serve(const char *addr) {
+    int fds[3] = {
+        make_socket(SOCK_STREAM, addr, BULK_PORT, 1),
+        make_socket(SOCK_DGRAM, addr, FLOOD_PORT, 1),
+        make_socket(SOCK_DGRAM, addr, ECHO_PORT, 1),
+    };
+    void *(*loops[3])(void *) = {bulk_sink, flood_sink, echo};
+    int count_fd = make_socket(SOCK_STREAM, addr, COUNT_PORT, 1);
+    int rcvbuf = 8 << 20;
+
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    for (int i = 0; i < 3; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, loops[i], &fds[i]) != 0) {
+            perror("Failed to start thread");
+            return 1;
+        }
+    }
+    printf("[BENCH] Serving on %s (ports %d-%d)\n", addr, BULK_PORT, COUNT_PORT);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(count_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        uint64_t count = atomic_exchange(&flood_count, 0);
+        if (write(fd, &count, sizeof(count)) < 0) {
+            perror("Failed to send count");
+        }
+        close(fd);
+    }
+}
+
+// =============================================================================
+// Workloads
+// =============================================================================
+
+static uint64_t take_flood_count(const char *addr) {
+    int fd = make_socket(SOCK_STREAM, addr, COUNT_PORT, 0);
+    uint64_t count = 0;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        fprintf(stderr, "Failed to read the flood count\n");
+        exit(1);
+    }
+    close(fd);
+    return count;
+}
+
+static void run_bulk(const char *addr, int seconds) {
+    int fd = make_socket(SOCK_STREAM, addr, BULK_PORT, 0);
+    char *buf = calloc(1, BULK_CHUNK);
+    uint64_t bytes = 0;
+
+    uint64_t start = now_ns(), end = start + seconds * 1000000000ull;
+    while (now_ns() < end) {
+        ssize_t n = write(fd, buf, BULK_CHUNK);
+        if (n < 0) {
+            perror("Failed to send");
+            exit(1);
+        }
+        bytes += n;
+    }
+    // Done once the sink has read everything and closed
+    shutdown(fd, SHUT_WR);
+    while (read(fd, buf, BULK_CHUNK) > 0) {
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    close(fd);
+
+    printf("{\"test\": \"bulk\", \"seconds\": %.3f, \"bytes\": %llu, \"gbps\": %.3f}\n",
+           elapsed, (unsigned long long)bytes, bytes * 8 / elapsed / 1e9);
+}
+
+static void run_pps(const char *addr, int seconds, int size) {
+    int fd = make_socket(SOCK_DGRAM, addr, FLOOD_PORT, 0);
+    char *buf = calloc(1, size);
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct mmsghdr msgs[FLOOD_BATCH];
+    uint64_t sent = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < FLOOD_BATCH; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    take_flood_count(addr);
+
+    uint64_t start = now_ns(), end = start + seconds * 1000000000ull;
+    while (now_ns() < end) {
+        int n = sendmmsg(fd, msgs, FLOOD_BATCH, 0);
+        if (n > 0) {
+            sent += n;
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // Let what is still in flight land before counting
+    usleep(200 * 1000);
+    uint64_t delivered = take_flood_count(addr);
+    close(fd);
+
+    printf("{\"test\": \"pps\", \"seconds\": %.3f, \"size\": %d, \"sent\": %llu, "
+           "\"delivered\": %llu, \"sent_mpps\": %.4f, \"mpps\": %.4f}\n",
+           elapsed, size, (unsigned long long)sent, (unsigned long long)delivered,
+           sent / elapsed / 1e6, delivered / elapsed / 1e6);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return sorted[i] / 1e3;
+}
+
+static void run_rr(const char *addr, int seconds, int size) {
+    int fd = make_socket(SOCK_DGRAM, addr, ECHO_PORT, 0);
+    char *req = calloc(1, size), *resp = malloc(size + 1);
+    struct timeval timeout = {.tv_sec = RR_TIMEOUT_MS / 1000,
+                              .tv_usec = RR_TIMEOUT_MS % 1000 * 1000};
+    size_t count = 0, cap = 1 << 16;
+    uint64_t *rtts = malloc(cap * sizeof(rtts[0]));
+    uint64_t lost = 0;
+    uint32_t id = 0;
+
+    // Without a timeout, the first lost datagram would block us for good
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror("Failed to set the receive timeout");
+        exit(1);
+    }
+
+    uint64_t start = now_ns(), end = start + seconds * 1000000000ull;
+    while (now_ns() < end) {
+        // Each request carries its number, so a late answer isn't taken
+        // for the next one's
+        id++;
+        memcpy(req, &id, size < 4 ? size : 4);
+        uint64_t sent_at = now_ns();
+        if (send(fd, req, size, 0) < 0) {
+            lost++;
+            continue;
+        }
+        for (;;) {
+            ssize_t n = recv(fd, resp, size + 1, 0);
+            if (n < 0) {
+                lost++;
+                break;
+            }
+            if (n == size && memcmp(resp, req, size) == 0) {
+                if (count == cap) {
+                    cap *= 2;
+                    rtts = realloc(rtts, cap * sizeof(rtts[0]));
+                }
+                rtts[count++] = now_ns() - sent_at;
+                break;
+            }
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    close(fd);
+
+    qsort(rtts, count, sizeof(rtts[0]), compare_u64);
+    printf("{\"test\": \"rr\", \"seconds\": %.3f, \"size\": %d, \"transactions\": %zu, "
+           "\"lost\": %llu, \"tps\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}\n",
+           elapsed, size, count, (unsigned long long)lost, count / elapsed,
+           percentile_us(rtts, count, 0.5), percentile_us(rtts, count, 0.99),
+           percentile_us(rtts, count, 0.999));
+}
+
+// Returns 0 once the echo server answers, 1 if it doesn't within seconds
+static int run_ping(const char *addr, int seconds) {
+    struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(ECHO_PORT)};
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = 100 * 1000};
+    char buf[16];
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    inet_pton(AF_INET, addr, &sa.sin_addr);
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror("Failed to set the receive timeout");
+        exit(1);
+    }
+    for (uint64_t end = now_ns() + seconds * 1000000000ull; now_ns() < end; ) {
+        // Unreachable, or unanswered, while the tunnel is still coming up
+        if (sendto(fd, "ping", 4, 0, (struct sockaddr *)&sa, sizeof(sa)) == 4 &&
+            recv(fd, buf, sizeof(buf), 0) == 4) {
+            close(fd);
+            return 0;
+        }
+        usleep(100 * 1000);
+    }
+    close(fd);
+    return 1;
+}
+
+void print_usage(const char *prog_name) {
+    printf("Usage: %s serve <addr>\n", prog_name);
+    printf("       %s [-d sec] [-l size] bulk|pps|rr|ping <server_addr>\n", prog_name);
+    printf("  -d SEC     How long to run the workload (default 5)\n");
+    printf("  -l SIZE    pps and rr: UDP payload size (default 64)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int seconds = 5;
+    int size = 64;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:l:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            seconds = atoi(optarg);
+            if (seconds < 1) {
+                fprintf(stderr, "Duration must be at least 1 second\n");
+                exit(1);
+            }
+            break;
+        case 'l':
+            size = atoi(optarg);
+            if (size < 1 || size > 65000) {
+                fprintf(stderr, "Size must be 1..65000\n");
+                exit(1);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    if (optind != argc - 2) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    const char *test = argv[optind], *addr = argv[optind + 1];
+
+    if (strcmp(test, "serve") == 0) {
+        return serve(addr);
+    } else if (strcmp(test, "bulk") == 0) {
+        run_bulk(addr, seconds);
+    } else if (strcmp(test, "pps") == 0) {
+        run_pps(addr, seconds, size);
+    } else if (strcmp(test, "rr") == 0) {
+        run_rr(addr, seconds, size);
+    } else if (strcmp(test, "ping") == 0) {
+        return run_ping(addr, seconds);
+    } else {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+#!/bin/bash
+#
+# Tunnel benchmark for simple_vpn_server / simple_vpn_client
+#
+# Sets up two network namespaces joined by a veth pair, runs the server in
+# one and the client in the other (both configuring their TUN device with
+# -a), and drives vpn_bench workloads through the tunnel:
+#   bulk - one TCP stream: Gbps
+#   pps  - small UDP datagrams: Mpps delivered
+#   rr   - UDP request/response: p50/p99/p999 latency
+#
+# Each result also gets the CPU the two endpoints spent per tunneled packet,
+# in cycles: their CPU time during the run at the nominal clock (from
+# /proc/cpuinfo, or BENCH_CPU_MHZ), over the packets through the client's
+# TUN device.
+#
+# Usage: sudo ./vpn_bench.sh [-m select|epoll|uring] [-c cipher] [-u] [-d sec]
+#          [-l size] [-t "bulk pps rr"] [-S "server args"] [-C "client args"] [-j file]
+#
+# The results are printed as one JSON object (to -j FILE as well), a summary
+# goes to stderr. Build the binaries first: make -f Makefile.vpn
+
+set -e
+
+BIN=${BIN:-$(cd "$(dirname "$0")" && pwd)}
+ENGINE=epoll
+CIPHER=auto
+TRANSPORT=tcp
+SECONDS_PER_TEST=5
+SIZE=64
+TESTS="bulk pps rr"
+SERVER_ARGS=""
+CLIENT_ARGS=""
+JSON_FILE=""
+
+NS_SRV=vpnb-srv
+NS_CLI=vpnb-cli
+OUTER_SRV=192.168.200.1
+OUTER_CLI=192.168.200.2
+INNER_SRV=10.9.0.1
+INNER_CLI=10.9.0.2
+
+usage() {
+    sed -n '/^# Usage/,/^#$/s/^# \{0,1\}//p' "$0"
+    exit "${1:-1}"
+}
+
+while getopts "m:c:ud:l:t:S:C:j:h" opt; do
+    case $opt in
+    m) ENGINE=$OPTARG ;;
+    c) CIPHER=$OPTARG ;;
+    u) TRANSPORT=udp ;;
+    d) SECONDS_PER_TEST=$OPTARG ;;
+    l) SIZE=$OPTARG ;;
+    t) TESTS=$OPTARG ;;
+    S) SERVER_ARGS=$OPTARG ;;
+    C) CLIENT_ARGS=$OPTARG ;;
+    j) JSON_FILE=$OPTARG ;;
+    h) usage 0 ;;
+    *) usage ;;
+    esac
+done
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "vpn_bench.sh: must run as root (network namespaces, TUN devices)" >&2
+    exit 1
+fi
+for prog in simple_vpn_server simple_vpn_client vpn_bench; do
+    if [ ! -x "$BIN/$prog" ]; then
+        echo "vpn_bench.sh: $BIN/$prog not found; run make -f Makefile.vpn" >&2
+        exit 1
+    fi
+done
+if [ "$TRANSPORT" = udp ] && [ "$ENGINE" = select ]; then
+    echo "vpn_bench.sh: the select engine is TCP only" >&2
+    exit 1
+fi
+
+LOG_DIR=$(mktemp -d /tmp/vpn_bench.XXXXXX)
+PIDS=""
+
+cleanup() {
+    for pid in $PIDS; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    ip netns del $NS_SRV 2>/dev/null || true
+    ip netns del $NS_CLI 2>/dev/null || true
+}
+trap cleanup EXIT
+
+# --- Namespaces -------------------------------------------------------------
+
+ip netns del $NS_SRV 2>/dev/null || true
+ip netns del $NS_CLI 2>/dev/null || true
+ip netns add $NS_SRV
+ip netns add $NS_CLI
+ip link add vpnb0 netns $NS_SRV type veth peer name vpnb1 netns $NS_CLI
+ip -n $NS_SRV addr add $OUTER_SRV/24 dev vpnb0
+ip -n $NS_CLI addr add $OUTER_CLI/24 dev vpnb1
+ip -n $NS_SRV link set vpnb0 up
+ip -n $NS_CLI link set vpnb1 up
+
+# --- Endpoints --------------------------------------------------------------
+
+# Wait (up to 10 s) for something in namespace $1 to listen on TCP port
+# $2; $3 is its log
+wait_for_listener() {
+    for _ in $(seq 100); do
+        ip netns exec "$1" ss -Hltn "sport = :$2" | grep -q . && return 0
+        sleep 0.1
+    done
+    echo "vpn_bench.sh: nothing listening on port $2 in $1:" >&2
+    cat "$3" >&2
+    exit 1
+}
+
+# Line-buffered logs, so the client's says which cipher it got
+LINEBUF=$(command -v stdbuf > /dev/null && echo "stdbuf -oL")
+
+ip netns exec $NS_SRV $LINEBUF "$BIN/simple_vpn_server" -m "$ENGINE" -a $INNER_SRV/24 $SERVER_ARGS \
+    > "$LOG_DIR/server.log" 2>&1 < /dev/null &
+SERVER_PID=$!
+PIDS="$PIDS $SERVER_PID"
+wait_for_listener $NS_SRV 5555 "$LOG_DIR/server.log"
+
+ip netns exec $NS_SRV "$BIN/vpn_bench" serve $INNER_SRV > "$LOG_DIR/bench.log" 2>&1 &
+PIDS="$PIDS $!"
+wait_for_listener $NS_SRV 9103 "$LOG_DIR/bench.log"
+
+CLIENT_FLAGS="-c $CIPHER -a $INNER_CLI/24"
+[ "$TRANSPORT" = udp ] && CLIENT_FLAGS="-u $CLIENT_FLAGS"
+ip netns exec $NS_CLI $LINEBUF "$BIN/simple_vpn_client" $CLIENT_FLAGS $CLIENT_ARGS $OUTER_SRV \
+    > "$LOG_DIR/client.log" 2>&1 < /dev/null &
+CLIENT_PID=$!
+PIDS="$PIDS $CLIENT_PID"
+
+if ! ip netns exec $NS_CLI "$BIN/vpn_bench" -d 10 ping $INNER_SRV; then
+    echo "vpn_bench.sh: the tunnel did not come up" >&2
+    cat "$LOG_DIR/server.log" "$LOG_DIR/client.log" >&2
+    exit 1
+fi
+
+# --- Workloads --------------------------------------------------------------
+
+CLK_TCK=$(getconf CLK_TCK)
+CPU_MHZ=${BENCH_CPU_MHZ:-$(awk -F': *' '/^cpu MHz/ {print $2; exit}' /proc/cpuinfo)}
+CPU_MHZ=${CPU_MHZ:-0}
+CIPHER_IMPL=$(sed -n 's/.*Session cipher: //p' "$LOG_DIR/client.log" | head -n 1)
+
+# CPU time of both endpoints so far, in clock ticks
+endpoint_ticks() {
+    awk '{ticks += $14 + $15} END {print ticks}' \
+        /proc/$SERVER_PID/stat /proc/$CLIENT_PID/stat
+}
+
+# Packets through the client's TUN device so far, both directions
+tun_packets() {
+    ip netns exec $NS_CLI sh -c \
+        'echo $(( $(cat /sys/class/net/tun0/statistics/tx_packets) + $(cat /sys/class/net/tun0/statistics/rx_packets) ))'
+}
+
+RESULTS=""
+for test in $TESTS; do
+    ticks_before=$(endpoint_ticks)
+    packets_before=$(tun_packets)
+    result=$(ip netns exec $NS_CLI "$BIN/vpn_bench" -d "$SECONDS_PER_TEST" -l "$SIZE" "$test" $INNER_SRV)
+    ticks=$(( $(endpoint_ticks) - ticks_before ))
+    packets=$(( $(tun_packets) - packets_before ))
+
+    cycles=$(awk -v t="$ticks" -v hz="$CLK_TCK" -v mhz="$CPU_MHZ" -v p="$packets" \
+        'BEGIN {printf "%.0f", (p > 0 ? t / hz * mhz * 1e6 / p : 0)}')
+    cpu=$(awk -v t="$ticks" -v hz="$CLK_TCK" 'BEGIN {printf "%.2f", t / hz}')
+    result="${result%\}}, \"packets\": $packets, \"cpu_seconds\": $cpu, \"cycles_per_packet\": $cycles}"
+    RESULTS="${RESULTS:+$RESULTS, }$result"
+
+    echo "[BENCH] $result" >&2
+done
+
+JSON="{\"engine\": \"$ENGINE\", \"transport\": \"$TRANSPORT\", \"cipher\": \"${CIPHER_IMPL:-$CIPHER}\", \
+\"server_args\": \"$SERVER_ARGS\", \"client_args\": \"$CLIENT_ARGS\", \"cpu_mhz\": $CPU_MHZ, \
+\"results\": [$RESULTS]}"
+echo "$JSON"
+if [ -n "$JSON_FILE" ]; then
+    echo "$JSON" > "$JSON_FILE"
+fi
+rm -rf "$LOG_DIR"
@@ -0,0 +1,662 @@
+/*
+ * Authenticated encryption shared by simple_vpn_server and simple_vpn_client
+ *
+ * Portable ChaCha20 (RFC 8439), Poly1305, HChaCha20 and the cipher
+ * dispatch; the SIMD kernels are in vpn_crypto_simd.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "vpn_crypto.h"
+
+static inline uint32_t load32_le(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32_le(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint64_t load64_le(const unsigned char *p) {
+    return (uint64_t)load32_le(p) | ((uint64_t)load32_le(p + 4) << 32);
+}
+
+static inline void store64_le(unsigned char *p, uint64_t v) {
+    store32_le(p, (uint32_t)v);
+    store32_le(p + 4, (uint32_t)(v >> 32));
+}
+
+// Compare tags without leaking how many leading bytes matched
+static int tags_equal(const unsigned char *a, const unsigned char *b) {
+    unsigned char diff = 0;
+    for (int i = 0; i < VPN_TAG_SIZE; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+// =============================================================================
+// ChaCha20
+// =============================================================================
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d)                    \
+    a += b; d ^= a; d = ROTL32(d, 16);              \
+    c += d; b ^= c; b = ROTL32(b, 12);              \
+    a += b; d ^= a; d = ROTL32(d, 8);               \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static void chacha20_rounds(uint32_t x[16]) {
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+}
+
+// constants | key | counter | nonce
+static void chacha20_setup(uint32_t state[16], const unsigned char key[VPN_KEY_SIZE],
+                           uint32_t counter, const unsigned char nonce[VPN_NONCE_SIZE]) {
+    state[0] = 0x61707865;  // "expand 32-byte k"
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        state[4 + i] = load32_le(key + 4 * i);
+    }
+    state[12] = counter;
+    for (int i = 0; i < 3; i++) {
+        state[13 + i] = load32_le(nonce + 4 * i);
+    }
+}
+
+static void chacha20_block(const uint32_t state[16], unsigned char out[64]) {
+    uint32_t x[16];
+
+    memcpy(x, state, sizeof(x));
+    chacha20_rounds(x);
+    for (int i = 0; i < 16; i++) {
+        store32_le(out + 4 * i, x[i] + state[i]);
+    }
+}
+
+// XOR the keystream into data, one 64-byte block at a time
+static void chacha20_xor(uint32_t state[16], unsigned char *data, size_t len) {
+    unsigned char block[64];
+
+    while (len > 0) {
+        size_t n = len < 64 ? len : 64;
+        chacha20_block(state, block);
+        for (size_t i = 0; i < n; i++) {
+            data[i] ^= block[i];
+        }
+        state[12]++;
+        data += n;
+        len -= n;
+    }
+}
+
+// The ChaCha20 core without the final addition: turns a key and a 16-byte
+// input into a new, independent key
+static void hchacha20(unsigned char out[VPN_KEY_SIZE], const unsigned char key[VPN_KEY_SIZE],
+                      const unsigned char in[16]) {
+    uint32_t x[16];
+
+    chacha20_setup(x, key, load32_le(in), in + 4);
+    chacha20_rounds(x);
+    for (int i = 0; i < 4; i++) {
+        store32_le(out + 4 * i, x[i]);
+        store32_le(out + 16 + 4 * i, x[12 + i]);
+    }
+}
+
+// =============================================================================
+// Poly1305 (radix 2^44, 64x64->128-bit multiplies)
+// =============================================================================
+
+struct poly1305 {
+    uint64_t r[3], s[2];    // s = r * 5 * 4, folds the modular reduction in
+    uint64_t h[3];
+    uint64_t pad[2];
+};
+
+#define MASK44 0xfffffffffffULL
+#define MASK42 0x3ffffffffffULL
+
+static void poly1305_init(struct poly1305 *p, const unsigned char key[32]) {
+    uint64_t t0 = load64_le(key);
+    uint64_t t1 = load64_le(key + 8);
+
+    // r is clamped as the spec requires
+    p->r[0] = t0 & 0xffc0fffffffULL;
+    p->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    p->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+    p->s[0] = p->r[1] * (5 << 2);
+    p->s[1] = p->r[2] * (5 << 2);
+    p->h[0] = p->h[1] = p->h[2] = 0;
+    p->pad[0] = load64_le(key + 16);
+    p->pad[1] = load64_le(key + 24);
+}
+
+// Absorb whole 16-byte blocks
+static void poly1305_blocks(struct poly1305 *p, const unsigned char *m, size_t len) {
+    const uint64_t hibit = 1ULL << 40;      // The 2^128 bit of each block
+    uint64_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2];
+    uint64_t s1 = p->s[0], s2 = p->s[1];
+    uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+
+    while (len >= 16) {
+        uint64_t t0 = load64_le(m);
+        uint64_t t1 = load64_le(m + 8);
+
+        h0 += t0 & MASK44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+        h2 += ((t1 >> 24) & MASK42) | hibit;
+
+        unsigned __int128 d0 = (unsigned __int128)h0 * r0 + (unsigned __int128)h1 * s2 +
+                               (unsigned __int128)h2 * s1;
+        unsigned __int128 d1 = (unsigned __int128)h0 * r1 + (unsigned __int128)h1 * r0 +
+                               (unsigned __int128)h2 * s2;
+        unsigned __int128 d2 = (unsigned __int128)h0 * r2 + (unsigned __int128)h1 * r1 +
+                               (unsigned __int128)h2 * r0;
+
+        uint64_t c = (uint64_t)(d0 >> 44);
+        h0 = (uint64_t)d0 & MASK44;
+        d1 += c;
+        c = (uint64_t)(d1 >> 44);
+        h1 = (uint64_t)d1 & MASK44;
+        d2 += c;
+        c = (uint64_t)(d2 >> 42);
+        h2 = (uint64_t)d2 & MASK42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= MASK44;
+        h1 += c;
+
+        m += 16;
+        len -= 16;
+    }
+
+    p->h[0] = h0;
+    p->h[1] = h1;
+    p->h[2] = h2;
+}
+
+// Absorb data zero-padded to a whole number of blocks, as the AEAD
+// construction does for the AAD and the ciphertext
+static void poly1305_padded(struct poly1305 *p, const unsigned char *m, size_t len) {
+    size_t full = len & ~(size_t)15;
+
+    poly1305_blocks(p, m, full);
+    if (len > full) {
+        unsigned char block[16] = {0};
+        memcpy(block, m + full, len - full);
+        poly1305_blocks(p, block, 16);
+    }
+}
+
+static void poly1305_finish(struct poly1305 *p, unsigned char tag[VPN_TAG_SIZE]) {
+    uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+    uint64_t c;
+
+    // Fully carry h
+    c = h1 >> 44; h1 &= MASK44; h2 += c;
+    c = h2 >> 42; h2 &= MASK42; h0 += c * 5;
+    c = h0 >> 44; h0 &= MASK44; h1 += c;
+    c = h1 >> 44; h1 &= MASK44; h2 += c;
+    c = h2 >> 42; h2 &= MASK42; h0 += c * 5;
+    c = h0 >> 44; h0 &= MASK44; h1 += c;
+
+    // g = h - (2^130 - 5); use it instead of h if it didn't go negative
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44; g0 &= MASK44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44; g1 &= MASK44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+
+    uint64_t mask = (g2 >> 63) - 1;     // All ones if h >= 2^130 - 5
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    // tag = (h + pad) mod 2^128
+    uint64_t t0 = p->pad[0], t1 = p->pad[1];
+    h0 += t0 & MASK44;
+    c = h0 >> 44; h0 &= MASK44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c;
+    c = h1 >> 44; h1 &= MASK44;
+    h2 += ((t1 >> 24) & MASK42) + c;
+    h2 &= MASK42;
+
+    store64_le(tag, h0 | (h1 << 44));
+    store64_le(tag + 8, (h1 >> 20) | (h2 << 24));
+}
+
+// =============================================================================
+// ChaCha20-Poly1305 (RFC 8439)
+// =============================================================================
+
+// Keystream for a run of blocks: the SIMD kernel takes the bulk, the
+// portable loop the rest
+static void chacha20_stream(const struct vpn_aead *a, uint32_t state[16],
+                            unsigned char *data, size_t len) {
+    if (a->chacha_simd) {
+        size_t done = a->chacha_simd(state, data, len);
+        data += done;
+        len -= done;
+    }
+    chacha20_xor(state, data, len);
+}
+
+// Block 0 of the keystream is the one-time Poly1305 key; packet data is
+// encrypted from block 1 on
+static void chacha_poly_start(const struct vpn_aead *a, const unsigned char nonce[VPN_NONCE_SIZE],
+                              uint32_t state[16], struct poly1305 *mac) {
+    unsigned char block[64];
+
+    chacha20_setup(state, a->u.chacha_key, 0, nonce);
+    chacha20_block(state, block);
+    poly1305_init(mac, block);
+    memset(block, 0, sizeof(block));
+    state[12] = 1;
+}
+
+static void chacha_poly_tag(struct poly1305 *mac, const unsigned char *aad, size_t aad_len,
+                            const unsigned char *ct, size_t len, unsigned char tag[VPN_TAG_SIZE]) {
+    unsigned char lengths[16];
+
+    poly1305_padded(mac, aad, aad_len);
+    poly1305_padded(mac, ct, len);
+    store64_le(lengths, aad_len);
+    store64_le(lengths + 8, len);
+    poly1305_blocks(mac, lengths, 16);
+    poly1305_finish(mac, tag);
+}
+
+static void chacha_poly_seal(const struct vpn_aead *a, struct vpn_aead_op *op) {
+    uint32_t state[16];
+    struct poly1305 mac;
+
+    chacha_poly_start(a, op->nonce, state, &mac);
+    chacha20_stream(a, state, op->data, op->len);
+    chacha_poly_tag(&mac, op->aad, op->aad_len, op->data, op->len, op->data + op->len);
+}
+
+// Verify first, decrypt only what verified
+static int chacha_poly_open(const struct vpn_aead *a, struct vpn_aead_op *op) {
+    uint32_t state[16];
+    struct poly1305 mac;
+    unsigned char tag[VPN_TAG_SIZE];
+
+    chacha_poly_start(a, op->nonce, state, &mac);
+    chacha_poly_tag(&mac, op->aad, op->aad_len, op->data, op->len, tag);
+    if (!tags_equal(tag, op->data + op->len)) {
+        return 0;
+    }
+    chacha20_stream(a, state, op->data, op->len);
+    return 1;
+}
+
+// =============================================================================
+// Dispatch
+// =============================================================================
+
+#if defined(__x86_64__)
+static int cpu_has_aes_gcm(void) {
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+           __builtin_cpu_supports("sse4.1");
+}
+#else
+static int cpu_has_aes_gcm(void) {
+    return 0;
+}
+#endif
+
+int vpn_cipher_supported(int cipher) {
+    switch (cipher) {
+    case VPN_CIPHER_AES_GCM:
+        return cpu_has_aes_gcm();
+    case VPN_CIPHER_CHACHA20_POLY1305:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+const char *vpn_cipher_name(int cipher) {
+    switch (cipher) {
+    case VPN_CIPHER_AES_GCM:
+        return "aes-256-gcm";
+    case VPN_CIPHER_CHACHA20_POLY1305:
+        return "chacha20-poly1305";
+    default:
+        return "auto";
+    }
+}
+
+int vpn_cipher_parse(const char *name) {
+    if (strcmp(name, "auto") == 0) return VPN_CIPHER_AUTO;
+    if (strcmp(name, "aes-gcm") == 0) return VPN_CIPHER_AES_GCM;
+    if (strcmp(name, "chacha20") == 0) return VPN_CIPHER_CHACHA20_POLY1305;
+    return -1;
+}
+
+int vpn_aead_init(struct vpn_aead *a, int cipher, const unsigned char key[VPN_KEY_SIZE]) {
+    memset(a, 0, sizeof(*a));
+    if (!vpn_cipher_supported(cipher)) {
+        return -1;
+    }
+    a->cipher = cipher;
+
+#if defined(__x86_64__)
+    if (cipher == VPN_CIPHER_AES_GCM) {
+        vpn_aesgcm_init_aesni(a, key);
+        a->impl = "aes-256-gcm (aes-ni/pclmul)";
+        return 0;
+    }
+#endif
+
+    memcpy(a->u.chacha_key, key, VPN_KEY_SIZE);
+    a->impl = "chacha20-poly1305 (generic)";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        a->chacha_simd = vpn_chacha20_avx2;
+        a->impl = "chacha20-poly1305 (avx2)";
+    }
+#elif defined(__aarch64__)
+    a->chacha_simd = vpn_chacha20_neon;     // NEON is part of every ARMv8 core
+    a->impl = "chacha20-poly1305 (neon)";
+#endif
+    return 0;
+}
+
+void vpn_aead_wipe(struct vpn_aead *a) {
+    // volatile, so the compiler can't drop the stores as dead
+    volatile unsigned char *p = (volatile unsigned char *)a;
+    for (size_t i = 0; i < sizeof(*a); i++) {
+        p[i] = 0;
+    }
+}
+
+void vpn_aead_nonce(unsigned char nonce[VPN_NONCE_SIZE], uint32_t dir, uint64_t counter) {
+    uint32_t d = htobe32(dir);
+    uint64_t c = htobe64(counter);
+    memcpy(nonce, &d, sizeof(d));
+    memcpy(nonce + 4, &c, sizeof(c));
+}
+
+void vpn_aead_seal_batch(const struct vpn_aead *a, struct vpn_aead_op *ops, int n) {
+    for (int i = 0; i < n; i++) {
+#if defined(__x86_64__)
+        if (a->cipher == VPN_CIPHER_AES_GCM) {
+            vpn_aesgcm_seal_aesni(a, ops[i].nonce, ops[i].aad, ops[i].aad_len,
+                                  ops[i].data, ops[i].len, ops[i].data + ops[i].len);
+            continue;
+        }
+#endif
+        chacha_poly_seal(a, &ops[i]);
+    }
+}
+
+int vpn_aead_open_batch(const struct vpn_aead *a, struct vpn_aead_op *ops, int n) {
+    int verified = 0;
+
+    for (int i = 0; i < n; i++) {
+#if defined(__x86_64__)
+        if (a->cipher == VPN_CIPHER_AES_GCM) {
+            ops[i].ok = vpn_aesgcm_open_aesni(a, ops[i].nonce, ops[i].aad, ops[i].aad_len,
+                                              ops[i].data, ops[i].len,
+                                              ops[i].data + ops[i].len) == 0;
+            verified += ops[i].ok;
+            continue;
+        }
+#endif
+        ops[i].ok = chacha_poly_open(a, &ops[i]);
+        verified += ops[i].ok;
+    }
+    return verified;
+}
+
+// =============================================================================
+// Keys
+// =============================================================================
+
+// Only for trying things out: anyone who can read this file has it
+static const unsigned char demo_key[VPN_KEY_SIZE] = "simple-vpn demo key, NOT SECURE";
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int vpn_load_key(const char *path, unsigned char key[VPN_KEY_SIZE]) {
+    if (!path) {
+        fprintf(stderr, "[CRYPTO] No key file given (-k): using the built-in demo key (NOT SECURE!)\n");
+        memcpy(key, demo_key, VPN_KEY_SIZE);
+        return 0;
+    }
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Failed to open key file");
+        return -1;
+    }
+
+    // 64 hex digits; whitespace (a trailing newline, line breaks) is ignored
+    int digits = 0;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (isspace(c)) continue;
+        int v = hex_value(c);
+        if (v < 0 || digits == 2 * VPN_KEY_SIZE) {
+            digits = -1;
+            break;
+        }
+        if (digits % 2 == 0) {
+            key[digits / 2] = v << 4;
+        } else {
+            key[digits / 2] |= v;
+        }
+        digits++;
+    }
+    fclose(f);
+
+    if (digits != 2 * VPN_KEY_SIZE) {
+        fprintf(stderr, "Key file %s must hold exactly %d hex digits\n", path, 2 * VPN_KEY_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+static void derive_session_key(unsigned char key[VPN_KEY_SIZE], const unsigned char psk[VPN_KEY_SIZE],
+                               const struct vpn_hello *client, const struct vpn_hello *server) {
+    unsigned char k1[VPN_KEY_SIZE];
+
+    hchacha20(k1, psk, client->salt);
+    hchacha20(key, k1, server->salt);
+    memset(k1, 0, sizeof(k1));
+}
+
+static int random_salt(unsigned char salt[VPN_SALT_SIZE]) {
+    return getrandom(salt, VPN_SALT_SIZE, 0) == VPN_SALT_SIZE ? 0 : -1;
+}
+
+int vpn_hello_init(struct vpn_hello *hello, int cipher) {
+    memset(hello, 0, sizeof(*hello));
+    if (cipher == VPN_CIPHER_AUTO) {
+        cipher = cpu_has_aes_gcm() ? VPN_CIPHER_AES_GCM : VPN_CIPHER_CHACHA20_POLY1305;
+    }
+    hello->cipher = cipher;
+    return random_salt(hello->salt);
+}
+
+int vpn_hello_answer(const struct vpn_hello *client, struct vpn_hello *reply,
+                     const unsigned char psk[VPN_KEY_SIZE], struct vpn_aead *a) {
+    unsigned char key[VPN_KEY_SIZE];
+
+    memset(reply, 0, sizeof(*reply));
+    reply->cipher = vpn_cipher_supported(client->cipher) ? client->cipher
+                                                          : VPN_CIPHER_CHACHA20_POLY1305;
+    if (random_salt(reply->salt) < 0) {
+        return -1;
+    }
+
+    derive_session_key(key, psk, client, reply);
+    int ret = vpn_aead_init(a, reply->cipher, key);
+    memset(key, 0, sizeof(key));
+    return ret;
+}
+
+int vpn_hello_complete(const struct vpn_hello *sent, const struct vpn_hello *reply,
+                       const unsigned char psk[VPN_KEY_SIZE], struct vpn_aead *a) {
+    unsigned char key[VPN_KEY_SIZE];
+
+    // The server either takes our cipher or falls back to ChaCha20-Poly1305
+    if (reply->cipher != sent->cipher && reply->cipher != VPN_CIPHER_CHACHA20_POLY1305) {
+        return -1;
+    }
+
+    derive_session_key(key, psk, sent, reply);
+    int ret = vpn_aead_init(a, reply->cipher, key);
+    memset(key, 0, sizeof(key));
+    return ret;
+}
+
+// Labels for keys derived from other keys, so no two uses share one
+static const unsigned char ticket_label[16] = {
+    's', 'i', 'm', 'p', 'l', 'e', '-', 'v', 'p', 'n', ' ', 't', 'i', 'c', 'k', 't',
+};
+static const unsigned char resume_label[16] = {
+    's', 'i', 'm', 'p', 'l', 'e', '-', 'v', 'p', 'n', ' ', 'r', 'e', 's', 'u', 'm',
+};
+
+// Sealed part of a ticket
+struct ticket_contents {
+    uint8_t cipher;
+    uint8_t reserved[7];
+    uint64_t issued;            // Big endian
+    unsigned char secret[VPN_KEY_SIZE];
+} __attribute__((packed));
+
+_Static_assert(8 + sizeof(struct ticket_contents) + VPN_TAG_SIZE == VPN_TICKET_SIZE,
+               "ticket size");
+
+static void derive_resumption_secret(unsigned char secret[VPN_KEY_SIZE],
+                                     const unsigned char psk[VPN_KEY_SIZE],
+                                     const struct vpn_hello *client,
+                                     const struct vpn_hello *server) {
+    unsigned char key[VPN_KEY_SIZE];
+
+    derive_session_key(key, psk, client, server);
+    hchacha20(secret, key, resume_label);
+    memset(key, 0, sizeof(key));
+}
+
+int vpn_ticket_key_init(struct vpn_aead *tk, const unsigned char psk[VPN_KEY_SIZE]) {
+    unsigned char key[VPN_KEY_SIZE];
+
+    hchacha20(key, psk, ticket_label);
+    int ret = vpn_aead_init(tk, VPN_CIPHER_CHACHA20_POLY1305, key);
+    memset(key, 0, sizeof(key));
+    return ret;
+}
+
+int vpn_ticket_issue(const struct vpn_aead *tk, const unsigned char psk[VPN_KEY_SIZE],
+                     const struct vpn_hello *client, const struct vpn_hello *reply,
+                     unsigned char blob[VPN_TICKET_SIZE]) {
+    struct ticket_contents tc;
+    uint64_t counter;
+
+    // Random nonce counters: tickets are sealed by every worker (and every
+    // run of the server) under the same key
+    if (getrandom(&counter, sizeof(counter), 0) != sizeof(counter)) {
+        return -1;
+    }
+    memset(&tc, 0, sizeof(tc));
+    tc.cipher = reply->cipher;
+    tc.issued = htobe64(time(NULL));
+    derive_resumption_secret(tc.secret, psk, client, reply);
+
+    memcpy(blob, &counter, sizeof(counter));
+    memcpy(blob + 8, &tc, sizeof(tc));
+    memset(&tc, 0, sizeof(tc));
+
+    struct vpn_aead_op op = {.data = blob + 8, .len = sizeof(tc), .aad = blob, .aad_len = 8};
+    vpn_aead_nonce(op.nonce, VPN_DIR_TICKET, counter);
+    vpn_aead_seal_batch(tk, &op, 1);
+    return 0;
+}
+
+void vpn_ticket_accept(struct vpn_ticket *t, const unsigned char psk[VPN_KEY_SIZE],
+                       const struct vpn_hello *sent, const struct vpn_hello *reply,
+                       const unsigned char blob[VPN_TICKET_SIZE]) {
+    t->cipher = reply->cipher;
+    derive_resumption_secret(t->secret, psk, sent, reply);
+    memcpy(t->blob, blob, VPN_TICKET_SIZE);
+}
+
+int vpn_resume_init(const struct vpn_ticket *t, struct vpn_resume *r, struct vpn_aead *a) {
+    unsigned char key[VPN_KEY_SIZE];
+
+    if (!t->cipher || random_salt(r->salt) < 0) {
+        return -1;
+    }
+    r->time = htobe64(time(NULL));
+    memcpy(r->ticket, t->blob, VPN_TICKET_SIZE);
+
+    hchacha20(key, t->secret, r->salt);
+    int ret = vpn_aead_init(a, t->cipher, key);
+    memset(key, 0, sizeof(key));
+    return ret;
+}
+
+int vpn_resume_answer(const struct vpn_aead *tk, const struct vpn_resume *r, struct vpn_aead *a) {
+    unsigned char blob[VPN_TICKET_SIZE];
+    struct ticket_contents tc;
+    uint64_t counter;
+    int64_t now = time(NULL);
+
+    int64_t sent = be64toh(r->time);
+    if (sent < now - VPN_RESUME_WINDOW || sent > now + VPN_RESUME_WINDOW) {
+        return -1;
+    }
+
+    // Open a copy: a ticket can resume any number of sessions
+    memcpy(blob, r->ticket, VPN_TICKET_SIZE);
+    memcpy(&counter, blob, sizeof(counter));
+    struct vpn_aead_op op = {.data = blob + 8, .len = sizeof(tc), .aad = blob, .aad_len = 8};
+    vpn_aead_nonce(op.nonce, VPN_DIR_TICKET, counter);
+    if (vpn_aead_open_batch(tk, &op, 1) != 1) {
+        return -1;
+    }
+    memcpy(&tc, blob + 8, sizeof(tc));
+    memset(blob, 0, sizeof(blob));
+
+    int64_t issued = be64toh(tc.issued);
+    int ret = -1;
+    if (issued <= now + VPN_RESUME_WINDOW && now - issued < VPN_TICKET_LIFETIME) {
+        unsigned char key[VPN_KEY_SIZE];
+        hchacha20(key, tc.secret, r->salt);
+        ret = vpn_aead_init(a, tc.cipher, key);
+        memset(key, 0, sizeof(key));
+    }
+    memset(&tc, 0, sizeof(tc));
+    return ret;
+}
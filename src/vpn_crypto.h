@@ -0,0 +1,205 @@
+/*
+ * Authenticated encryption shared by simple_vpn_server and simple_vpn_client
+ *
+ * Every tunneled packet is sealed with an AEAD cipher: encrypted, and
+ * followed by a 16-byte tag that proves it came from a peer holding the key
+ * and was not modified on the way. Two ciphers are available:
+ *
+ *   aes-256-gcm        AES-NI + PCLMULQDQ (x86 only; fastest where present)
+ *   chacha20-poly1305  AVX2 (x86), NEON (ARM) or portable C
+ *
+ * The implementation is picked at runtime from the CPU's features, so one
+ * binary runs at full speed on any gateway. ChaCha20-Poly1305 is always
+ * available and is the fallback when the peers can't agree on AES-GCM.
+ *
+ * Keys: both ends share a 32-byte pre-shared key (-k, a file of 64 hex
+ * digits). It is never used to encrypt packets directly. Instead each TCP
+ * connection or UDP session starts with a hello exchange: the client sends
+ * the cipher it wants and a random salt, the server answers with the cipher
+ * it picked and its own salt, and both derive the session key
+ *
+ *   key = HChaCha20(HChaCha20(psk, client_salt), server_salt)
+ *
+ * Because the server's salt is fresh, a recorded session replayed later
+ * ends up with a different key and none of its packets verify.
+ *
+ * Nonces are never sent: they are the direction and a 64-bit counter.
+ * For TCP the counter is the frame number on the stream; for UDP it is the
+ * header's sequence number.
+ *
+ * Resumption (UDP): a full hello exchange also gives both ends a resumption
+ * secret, HChaCha20(session_key, label). The server hands the client a
+ * ticket - the secret, the cipher and the issue time, sealed under a ticket
+ * key that only the server uses (derived from the psk, so tickets outlive
+ * a server restart). A client that has lost its session (the server
+ * restarted, or it moved to a network where the reply can't find it) sends
+ * the ticket back with a fresh salt and starts sending packets at once,
+ * sealed with
+ *
+ *   key = HChaCha20(secret, resume_salt)
+ *
+ * No round trip is spent on a handshake (0-RTT). The price is the usual one
+ * for 0-RTT: the server has no fresh salt in that key, so it only takes a
+ * resume whose client time is within VPN_RESUME_WINDOW of its own clock, and
+ * the replay window guards the session from there on.
+ */
+
+#ifndef VPN_CRYPTO_H
+#define VPN_CRYPTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define VPN_KEY_SIZE 32
+#define VPN_SALT_SIZE 16
+#define VPN_NONCE_SIZE 12
+#define VPN_TAG_SIZE 16         // Buffers need this much room after the packet
+
+// Ciphers (also the values sent in a hello)
+#define VPN_CIPHER_AUTO              0   // Best one this CPU runs in hardware
+#define VPN_CIPHER_AES_GCM           1
+#define VPN_CIPHER_CHACHA20_POLY1305 2
+
+// Nonce direction, so both ends can count from 0 under the same key
+#define VPN_DIR_TO_SERVER 0
+#define VPN_DIR_TO_CLIENT 1
+#define VPN_DIR_TICKET    2     // Ticket sealing, under the ticket key
+
+// The first message in each direction of a connection or session
+struct vpn_hello {
+    uint8_t cipher;
+    uint8_t gso;                // TCP: super-packet types the sender takes whole (vpn_offload.h)
+    uint8_t reserved[2];
+    unsigned char salt[VPN_SALT_SIZE];
+} __attribute__((packed));
+
+#define VPN_HELLO_SIZE ((int)sizeof(struct vpn_hello))
+
+// A ticket: counter (the nonce), sealed contents (cipher, issue time,
+// resumption secret) and tag. Opaque to the client.
+#define VPN_TICKET_SIZE (8 + 16 + VPN_KEY_SIZE + VPN_TAG_SIZE)
+#define VPN_TICKET_LIFETIME (24 * 3600)     // Seconds a ticket can resume sessions
+#define VPN_RESUME_WINDOW 30                // Max clock difference for a resume
+
+// Client: what it needs to resume
+struct vpn_ticket {
+    int cipher;                 // 0: no ticket
+    unsigned char secret[VPN_KEY_SIZE];
+    unsigned char blob[VPN_TICKET_SIZE];
+};
+
+// The first message of a resumed session
+struct vpn_resume {
+    unsigned char salt[VPN_SALT_SIZE];
+    uint64_t time;              // Client's clock, seconds since the epoch (big endian)
+    unsigned char ticket[VPN_TICKET_SIZE];
+} __attribute__((packed));
+
+#define VPN_RESUME_SIZE ((int)sizeof(struct vpn_resume))
+
+// A session key, expanded for the chosen implementation
+struct vpn_aead {
+    int cipher;
+    const char *impl;           // e.g. "chacha20-poly1305 (avx2)"
+    size_t (*chacha_simd)(uint32_t state[16], unsigned char *data, size_t len);
+    union {
+        unsigned char chacha_key[VPN_KEY_SIZE];
+        struct {
+            unsigned char round_keys[15][16];
+            unsigned char h_powers[8][16];  // H^1..H^8, for 8 blocks per GHASH reduction
+        } gcm;
+    } u;
+};
+
+// One packet of a batch, sealed or opened in place
+struct vpn_aead_op {
+    unsigned char *data;        // Packet; the tag lives at data + len
+    int len;                    // Packet length, without the tag
+    const void *aad;            // Authenticated but not encrypted (the header)
+    int aad_len;
+    unsigned char nonce[VPN_NONCE_SIZE];
+    int ok;                     // open: set to 1 if the tag verified
+};
+
+// Returns 1 if this CPU can run cipher, 0 otherwise
+int vpn_cipher_supported(int cipher);
+
+const char *vpn_cipher_name(int cipher);
+
+// Parse "aes-gcm" / "chacha20" / "auto". Returns the cipher, or -1.
+int vpn_cipher_parse(const char *name);
+
+// Set up a for cipher (not AUTO). Returns 0, or -1 if it's not supported.
+int vpn_aead_init(struct vpn_aead *a, int cipher, const unsigned char key[VPN_KEY_SIZE]);
+
+void vpn_aead_wipe(struct vpn_aead *a);
+
+// Nonce = direction (4 bytes) || counter (8 bytes), big endian
+void vpn_aead_nonce(unsigned char nonce[VPN_NONCE_SIZE], uint32_t dir, uint64_t counter);
+
+// Encrypt each op's packet and write its tag
+void vpn_aead_seal_batch(const struct vpn_aead *a, struct vpn_aead_op *ops, int n);
+
+// Verify and decrypt each op's packet. Returns how many verified; ops that
+// failed have ok = 0 and their data must be dropped.
+int vpn_aead_open_batch(const struct vpn_aead *a, struct vpn_aead_op *ops, int n);
+
+// Read the pre-shared key from a file of 64 hex digits. With path NULL the
+// built-in demo key is used (NOT SECURE!). Returns 0, or -1 on error.
+int vpn_load_key(const char *path, unsigned char key[VPN_KEY_SIZE]);
+
+// Client: fill in the hello to send. cipher may be VPN_CIPHER_AUTO.
+// Returns 0, or -1 if no random salt could be drawn.
+int vpn_hello_init(struct vpn_hello *hello, int cipher);
+
+// Server: answer a client's hello and set up the session key. Picks the
+// client's cipher if this CPU supports it, ChaCha20-Poly1305 otherwise.
+// Returns 0, or -1 on error.
+int vpn_hello_answer(const struct vpn_hello *client, struct vpn_hello *reply,
+                     const unsigned char psk[VPN_KEY_SIZE], struct vpn_aead *a);
+
+// Client: set up the session key from the server's answer. Returns 0, or
+// -1 if the server picked a cipher this CPU can't run.
+int vpn_hello_complete(const struct vpn_hello *sent, const struct vpn_hello *reply,
+                       const unsigned char psk[VPN_KEY_SIZE], struct vpn_aead *a);
+
+// Server: set up tk, the key tickets are sealed with. Returns 0, or -1 on
+// error.
+int vpn_ticket_key_init(struct vpn_aead *tk, const unsigned char psk[VPN_KEY_SIZE]);
+
+// Server: make the ticket for the session set up by this hello exchange.
+// Returns 0, or -1 on error.
+int vpn_ticket_issue(const struct vpn_aead *tk, const unsigned char psk[VPN_KEY_SIZE],
+                     const struct vpn_hello *client, const struct vpn_hello *reply,
+                     unsigned char blob[VPN_TICKET_SIZE]);
+
+// Client: keep the ticket the server sent with its answer to our hello
+void vpn_ticket_accept(struct vpn_ticket *t, const unsigned char psk[VPN_KEY_SIZE],
+                       const struct vpn_hello *sent, const struct vpn_hello *reply,
+                       const unsigned char blob[VPN_TICKET_SIZE]);
+
+// Client: fill in a resume with a fresh salt and set up the new session's
+// key. Returns 0, or -1 on error.
+int vpn_resume_init(const struct vpn_ticket *t, struct vpn_resume *r, struct vpn_aead *a);
+
+// Server: set up the key of a session resumed with r. Returns 0, or -1 if
+// the ticket is forged or expired, or r is too old.
+int vpn_resume_answer(const struct vpn_aead *tk, const struct vpn_resume *r, struct vpn_aead *a);
+
+// SIMD kernels (vpn_crypto_simd.c), picked by vpn_aead_init(). The ChaCha20
+// kernels XOR keystream into data, advancing the block counter in state,
+// and return how many bytes they did; the portable code does the rest.
+#if defined(__x86_64__)
+size_t vpn_chacha20_avx2(uint32_t state[16], unsigned char *data, size_t len);
+void vpn_aesgcm_init_aesni(struct vpn_aead *a, const unsigned char key[VPN_KEY_SIZE]);
+void vpn_aesgcm_seal_aesni(const struct vpn_aead *a, const unsigned char nonce[VPN_NONCE_SIZE],
+                           const unsigned char *aad, size_t aad_len,
+                           unsigned char *data, size_t len, unsigned char tag[VPN_TAG_SIZE]);
+int vpn_aesgcm_open_aesni(const struct vpn_aead *a, const unsigned char nonce[VPN_NONCE_SIZE],
+                          const unsigned char *aad, size_t aad_len,
+                          unsigned char *data, size_t len, const unsigned char tag[VPN_TAG_SIZE]);
+#elif defined(__aarch64__)
+size_t vpn_chacha20_neon(uint32_t state[16], unsigned char *data, size_t len);
+#endif
+
+#endif
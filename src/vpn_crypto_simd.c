@@ -0,0 +1,491 @@
+/*
+ * SIMD kernels for vpn_crypto.c
+ *
+ * Each kernel is compiled for its instruction set with a target pragma, so
+ * the file builds without -mavx2/-maes and the binary still runs on CPUs
+ * that lack them: vpn_aead_init() only calls a kernel after checking the
+ * CPU supports it.
+ *
+ * ChaCha20 (AVX2 / NEON): the state is held "vertically", one vector per
+ * state word with one block per lane, so 8 (AVX2) or 4 (NEON) blocks go
+ * through the rounds at once. The lanes are then transposed back into
+ * consecutive 64-byte blocks.
+ *
+ * AES-256-GCM (AES-NI + PCLMULQDQ): 8 counter blocks are in flight through
+ * the AES rounds to hide aesenc latency, and GHASH multiplies 8 ciphertext
+ * blocks by H^8..H^1 and does a single reduction for all of them.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "vpn_crypto.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+// =============================================================================
+// ChaCha20, 8 blocks per AVX2 pass
+// =============================================================================
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#define ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+// 16- and 8-bit rotations are byte moves, one shuffle instead of two shifts
+#define QR_AVX2(a, b, c, d)                                                 \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a);                 \
+    d = _mm256_shuffle_epi8(d, rot16);                                      \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);                 \
+    b = ROTL_AVX2(b, 12);                                                   \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a);                 \
+    d = _mm256_shuffle_epi8(d, rot8);                                       \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);                 \
+    b = ROTL_AVX2(b, 7);
+
+// v[i] holds word i of 8 blocks; afterwards v[b] holds 8 words of block b
+static inline void transpose8_avx2(__m256i v[8]) {
+    __m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+size_t vpn_chacha20_avx2(uint32_t state[16], unsigned char *data, size_t len) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    size_t done = 0;
+
+    // Below 4 blocks most of an 8-block pass would be thrown away; the
+    // portable code finishes those
+    while (len - done >= 256) {
+        __m256i x[16], in[16];
+
+        for (int i = 0; i < 16; i++) {
+            in[i] = _mm256_set1_epi32(state[i]);
+        }
+        in[12] = _mm256_add_epi32(in[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        memcpy(x, in, sizeof(x));
+
+        for (int i = 0; i < 10; i++) {
+            QR_AVX2(x[0], x[4], x[8], x[12]);
+            QR_AVX2(x[1], x[5], x[9], x[13]);
+            QR_AVX2(x[2], x[6], x[10], x[14]);
+            QR_AVX2(x[3], x[7], x[11], x[15]);
+            QR_AVX2(x[0], x[5], x[10], x[15]);
+            QR_AVX2(x[1], x[6], x[11], x[12]);
+            QR_AVX2(x[2], x[7], x[8], x[13]);
+            QR_AVX2(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i++) {
+            x[i] = _mm256_add_epi32(x[i], in[i]);
+        }
+
+        // Block b is x[b] (words 0-7) followed by x[8 + b] (words 8-15)
+        transpose8_avx2(x);
+        transpose8_avx2(x + 8);
+
+        size_t n = len - done < 512 ? len - done : 512;
+        unsigned char *p = data + done;
+        if (n == 512) {
+            for (int b = 0; b < 8; b++) {
+                __m256i lo = _mm256_loadu_si256((const __m256i *)(p + 64 * b));
+                __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 64 * b + 32));
+                _mm256_storeu_si256((__m256i *)(p + 64 * b), _mm256_xor_si256(lo, x[b]));
+                _mm256_storeu_si256((__m256i *)(p + 64 * b + 32), _mm256_xor_si256(hi, x[8 + b]));
+            }
+        } else {
+            // Last, partial pass: XOR only the keystream that is needed
+            unsigned char ks[512];
+            for (int b = 0; b < 8; b++) {
+                _mm256_storeu_si256((__m256i *)(ks + 64 * b), x[b]);
+                _mm256_storeu_si256((__m256i *)(ks + 64 * b + 32), x[8 + b]);
+            }
+            for (size_t i = 0; i < n; i++) {
+                p[i] ^= ks[i];
+            }
+        }
+
+        state[12] += (n + 63) / 64;
+        done += n;
+    }
+    return done;
+}
+
+#pragma GCC pop_options
+
+// =============================================================================
+// AES-256-GCM with AES-NI and PCLMULQDQ
+// =============================================================================
+
+#pragma GCC push_options
+#pragma GCC target("aes,pclmul,sse4.1")
+
+#define GCM_PAR 8   // Blocks in flight
+
+// GHASH works on bit-reflected values; reversing the bytes of each block
+// lets PCLMULQDQ multiply them directly (Intel's CLMUL white paper)
+static inline __m128i bswap128(__m128i v) {
+    return _mm_shuffle_epi8(v, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+// Accumulate the 256-bit carry-less product a * b as lo, mid and hi parts
+static inline void clmul_acc(__m128i a, __m128i b, __m128i *lo, __m128i *mid, __m128i *hi) {
+    *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+    *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+    *mid = _mm_xor_si128(*mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                                             _mm_clmulepi64_si128(a, b, 0x01)));
+}
+
+// Fold an accumulated product back to 128 bits modulo the GCM polynomial.
+// Reduction is linear, so the sum of several products needs only one.
+static inline __m128i ghash_reduce(__m128i lo, __m128i mid, __m128i hi) {
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    // Shift the 256-bit product left by one (bit reflection)
+    __m128i c_lo = _mm_srli_epi32(lo, 31);
+    __m128i c_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i carry = _mm_srli_si128(c_lo, 12);
+    c_hi = _mm_slli_si128(c_hi, 4);
+    c_lo = _mm_slli_si128(c_lo, 4);
+    lo = _mm_or_si128(lo, c_lo);
+    hi = _mm_or_si128(hi, c_hi);
+    hi = _mm_or_si128(hi, carry);
+
+    // Reduce modulo x^128 + x^7 + x^2 + x + 1
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                              _mm_slli_epi32(lo, 25));
+    __m128i a_hi = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    __m128i b = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                              _mm_srli_epi32(lo, 7));
+    b = _mm_xor_si128(b, a_hi);
+    lo = _mm_xor_si128(lo, b);
+    return _mm_xor_si128(hi, lo);
+}
+
+static inline __m128i gf_mul(__m128i a, __m128i b) {
+    __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+    clmul_acc(a, b, &lo, &mid, &hi);
+    return ghash_reduce(lo, mid, hi);
+}
+
+// x = (x ^ c[0]) * H^8 ^ c[1] * H^7 ^ ... ^ c[7] * H, one reduction
+static inline __m128i ghash8(const struct vpn_aead *a, __m128i x, const __m128i c[GCM_PAR]) {
+    __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+
+    for (int i = 0; i < GCM_PAR; i++) {
+        __m128i block = bswap128(c[i]);
+        if (i == 0) {
+            block = _mm_xor_si128(block, x);
+        }
+        __m128i h = _mm_loadu_si128((const __m128i *)a->u.gcm.h_powers[GCM_PAR - 1 - i]);
+        clmul_acc(block, h, &lo, &mid, &hi);
+    }
+    return ghash_reduce(lo, mid, hi);
+}
+
+static inline __m128i ghash1(const struct vpn_aead *a, __m128i x, __m128i c) {
+    __m128i h = _mm_loadu_si128((const __m128i *)a->u.gcm.h_powers[0]);
+    return gf_mul(_mm_xor_si128(x, bswap128(c)), h);
+}
+
+static inline __m128i aes_encrypt(const struct vpn_aead *a, __m128i block) {
+    const __m128i *rk = (const __m128i *)a->u.gcm.round_keys;
+
+    block = _mm_xor_si128(block, _mm_loadu_si128(&rk[0]));
+    for (int r = 1; r < 14; r++) {
+        block = _mm_aesenc_si128(block, _mm_loadu_si128(&rk[r]));
+    }
+    return _mm_aesenclast_si128(block, _mm_loadu_si128(&rk[14]));
+}
+
+// Round key 2i from round keys 2i-2 and the key-generation assist of 2i-1
+static inline __m128i aes256_expand_even(__m128i prev, __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 4));
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 8));
+    return _mm_xor_si128(prev, assist);
+}
+
+// Round key 2i+1 from round keys 2i-1 and 2i
+static inline __m128i aes256_expand_odd(__m128i prev, __m128i even) {
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(even, 0x00), 0xaa);
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 4));
+    prev = _mm_xor_si128(prev, _mm_slli_si128(prev, 8));
+    return _mm_xor_si128(prev, assist);
+}
+
+// The round constant must be an immediate, hence a macro
+#define AES256_EXPAND(rk, i, rcon)                                                   \
+    rk[i] = aes256_expand_even(rk[i - 2], _mm_aeskeygenassist_si128(rk[i - 1], rcon));  \
+    rk[i + 1] = aes256_expand_odd(rk[i - 1], rk[i]);
+
+void vpn_aesgcm_init_aesni(struct vpn_aead *a, const unsigned char key[VPN_KEY_SIZE]) {
+    __m128i rk[15];
+
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+    AES256_EXPAND(rk, 2, 0x01);
+    AES256_EXPAND(rk, 4, 0x02);
+    AES256_EXPAND(rk, 6, 0x04);
+    AES256_EXPAND(rk, 8, 0x08);
+    AES256_EXPAND(rk, 10, 0x10);
+    AES256_EXPAND(rk, 12, 0x20);
+    rk[14] = aes256_expand_even(rk[12], _mm_aeskeygenassist_si128(rk[13], 0x40));
+    for (int i = 0; i < 15; i++) {
+        _mm_storeu_si128((__m128i *)a->u.gcm.round_keys[i], rk[i]);
+    }
+
+    // H = AES_K(0), and its powers up to H^8 for ghash8()
+    __m128i h = bswap128(aes_encrypt(a, _mm_setzero_si128()));
+    __m128i hp = h;
+    for (int i = 0; i < GCM_PAR; i++) {
+        _mm_storeu_si128((__m128i *)a->u.gcm.h_powers[i], hp);
+        hp = gf_mul(hp, h);
+    }
+}
+
+// Counter block n: nonce || n (32-bit big endian)
+static inline __m128i gcm_counter(__m128i j0, uint32_t n) {
+    return _mm_insert_epi32(j0, (int)__builtin_bswap32(n), 3);
+}
+
+static inline __m128i load_partial(const unsigned char *p, size_t len) {
+    unsigned char block[16] = {0};
+    memcpy(block, p, len);
+    return _mm_loadu_si128((const __m128i *)block);
+}
+
+// GHASH of the AAD (zero-padded), the usual starting point of both directions
+static __m128i gcm_hash_aad(const struct vpn_aead *a, const unsigned char *aad, size_t aad_len) {
+    __m128i x = _mm_setzero_si128();
+
+    for (size_t off = 0; off < aad_len; off += 16) {
+        size_t n = aad_len - off < 16 ? aad_len - off : 16;
+        x = ghash1(a, x, load_partial(aad + off, n));
+    }
+    return x;
+}
+
+// CTR-encrypt or -decrypt data in place and GHASH the ciphertext side:
+// the output when encrypting, the input when decrypting
+static __m128i gcm_crypt(const struct vpn_aead *a, __m128i j0, __m128i x,
+                         unsigned char *data, size_t len, int encrypt) {
+    const __m128i *rk = (const __m128i *)a->u.gcm.round_keys;
+    uint32_t ctr = 2;   // Counter 1 is for the tag
+    size_t off = 0;
+
+    for (; len - off >= 16 * GCM_PAR; off += 16 * GCM_PAR, ctr += GCM_PAR) {
+        __m128i ks[GCM_PAR], c[GCM_PAR];
+        __m128i k = _mm_loadu_si128(&rk[0]);
+
+        for (int i = 0; i < GCM_PAR; i++) {
+            ks[i] = _mm_xor_si128(gcm_counter(j0, ctr + i), k);
+        }
+        for (int r = 1; r < 14; r++) {
+            k = _mm_loadu_si128(&rk[r]);
+            for (int i = 0; i < GCM_PAR; i++) {
+                ks[i] = _mm_aesenc_si128(ks[i], k);
+            }
+        }
+        k = _mm_loadu_si128(&rk[14]);
+        for (int i = 0; i < GCM_PAR; i++) {
+            ks[i] = _mm_aesenclast_si128(ks[i], k);
+        }
+
+        for (int i = 0; i < GCM_PAR; i++) {
+            __m128i in = _mm_loadu_si128((const __m128i *)(data + off + 16 * i));
+            __m128i out = _mm_xor_si128(in, ks[i]);
+            _mm_storeu_si128((__m128i *)(data + off + 16 * i), out);
+            c[i] = encrypt ? out : in;
+        }
+        x = ghash8(a, x, c);
+    }
+
+    for (; off < len; off += 16, ctr++) {
+        size_t n = len - off < 16 ? len - off : 16;
+        __m128i ks = aes_encrypt(a, gcm_counter(j0, ctr));
+
+        if (n == 16) {
+            __m128i in = _mm_loadu_si128((const __m128i *)(data + off));
+            __m128i out = _mm_xor_si128(in, ks);
+            _mm_storeu_si128((__m128i *)(data + off), out);
+            x = ghash1(a, x, encrypt ? out : in);
+        } else {
+            // Tail: GHASH sees the ciphertext zero-padded to a full block
+            unsigned char block[16];
+            __m128i in = load_partial(data + off, n);
+            _mm_storeu_si128((__m128i *)block, _mm_xor_si128(in, ks));
+            memcpy(data + off, block, n);
+            x = ghash1(a, x, encrypt ? load_partial(block, n) : in);
+        }
+    }
+    return x;
+}
+
+// Tag = E(J0) ^ GHASH(..., bit lengths of AAD and ciphertext)
+static __m128i gcm_tag(const struct vpn_aead *a, __m128i j0, __m128i x,
+                       size_t aad_len, size_t len) {
+    __m128i lengths = _mm_set_epi64x((long long)aad_len * 8, (long long)len * 8);
+    __m128i h = _mm_loadu_si128((const __m128i *)a->u.gcm.h_powers[0]);
+
+    x = gf_mul(_mm_xor_si128(x, lengths), h);
+    return _mm_xor_si128(bswap128(x), aes_encrypt(a, gcm_counter(j0, 1)));
+}
+
+static inline __m128i gcm_j0(const unsigned char nonce[VPN_NONCE_SIZE]) {
+    unsigned char block[16] = {0};
+    memcpy(block, nonce, VPN_NONCE_SIZE);
+    return _mm_loadu_si128((const __m128i *)block);
+}
+
+void vpn_aesgcm_seal_aesni(const struct vpn_aead *a, const unsigned char nonce[VPN_NONCE_SIZE],
+                           const unsigned char *aad, size_t aad_len,
+                           unsigned char *data, size_t len, unsigned char tag[VPN_TAG_SIZE]) {
+    __m128i j0 = gcm_j0(nonce);
+    __m128i x = gcm_hash_aad(a, aad, aad_len);
+
+    x = gcm_crypt(a, j0, x, data, len, 1);
+    _mm_storeu_si128((__m128i *)tag, gcm_tag(a, j0, x, aad_len, len));
+}
+
+// Decrypts in the same pass as it authenticates: on failure the caller
+// must drop the (garbage) data
+int vpn_aesgcm_open_aesni(const struct vpn_aead *a, const unsigned char nonce[VPN_NONCE_SIZE],
+                          const unsigned char *aad, size_t aad_len,
+                          unsigned char *data, size_t len, const unsigned char tag[VPN_TAG_SIZE]) {
+    __m128i j0 = gcm_j0(nonce);
+    __m128i x = gcm_hash_aad(a, aad, aad_len);
+
+    x = gcm_crypt(a, j0, x, data, len, 0);
+    __m128i expect = gcm_tag(a, j0, x, aad_len, len);
+    __m128i got = _mm_loadu_si128((const __m128i *)tag);
+
+    // All 16 bytes are compared, whatever the first mismatch
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(expect, got)) == 0xffff ? 0 : -1;
+}
+
+#pragma GCC pop_options
+
+#endif  // __x86_64__
+
+#if defined(__aarch64__)
+
+#include <arm_neon.h>
+
+// =============================================================================
+// ChaCha20, 4 blocks per NEON pass
+// =============================================================================
+
+#define ROTL_NEON(v, n) vsriq_n_u32(vshlq_n_u32(v, n), v, 32 - (n))
+#define ROTL16_NEON(v) vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(v)))
+
+#define QR_NEON(a, b, c, d)                                                 \
+    a = vaddq_u32(a, b); d = veorq_u32(d, a); d = ROTL16_NEON(d);           \
+    c = vaddq_u32(c, d); b = veorq_u32(b, c); b = ROTL_NEON(b, 12);         \
+    a = vaddq_u32(a, b); d = veorq_u32(d, a); d = ROTL_NEON(d, 8);          \
+    c = vaddq_u32(c, d); b = veorq_u32(b, c); b = ROTL_NEON(b, 7);
+
+// v[i] holds word i of 4 blocks; afterwards v[b] holds 4 words of block b
+static inline void transpose4_neon(uint32x4_t v[4]) {
+    uint32x4x2_t t01 = vtrnq_u32(v[0], v[1]);
+    uint32x4x2_t t23 = vtrnq_u32(v[2], v[3]);
+
+    v[0] = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+    v[1] = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+    v[2] = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+    v[3] = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+}
+
+size_t vpn_chacha20_neon(uint32_t state[16], unsigned char *data, size_t len) {
+    const uint32_t lane[4] = {0, 1, 2, 3};
+    size_t done = 0;
+
+    // Below 2 blocks the portable code is as fast
+    while (len - done >= 128) {
+        uint32x4_t x[16], in[16];
+
+        for (int i = 0; i < 16; i++) {
+            in[i] = vdupq_n_u32(state[i]);
+        }
+        in[12] = vaddq_u32(in[12], vld1q_u32(lane));
+        memcpy(x, in, sizeof(x));
+
+        for (int i = 0; i < 10; i++) {
+            QR_NEON(x[0], x[4], x[8], x[12]);
+            QR_NEON(x[1], x[5], x[9], x[13]);
+            QR_NEON(x[2], x[6], x[10], x[14]);
+            QR_NEON(x[3], x[7], x[11], x[15]);
+            QR_NEON(x[0], x[5], x[10], x[15]);
+            QR_NEON(x[1], x[6], x[11], x[12]);
+            QR_NEON(x[2], x[7], x[8], x[13]);
+            QR_NEON(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i++) {
+            x[i] = vaddq_u32(x[i], in[i]);
+        }
+
+        // Block b is x[b], x[4 + b], x[8 + b], x[12 + b]
+        for (int g = 0; g < 16; g += 4) {
+            transpose4_neon(x + g);
+        }
+
+        size_t n = len - done < 256 ? len - done : 256;
+        unsigned char *p = data + done;
+        if (n == 256) {
+            for (int b = 0; b < 4; b++) {
+                for (int g = 0; g < 4; g++) {
+                    unsigned char *q = p + 64 * b + 16 * g;
+                    vst1q_u8(q, veorq_u8(vld1q_u8(q), vreinterpretq_u8_u32(x[4 * g + b])));
+                }
+            }
+        } else {
+            // Last, partial pass: XOR only the keystream that is needed
+            unsigned char ks[256];
+            for (int b = 0; b < 4; b++) {
+                for (int g = 0; g < 4; g++) {
+                    vst1q_u8(ks + 64 * b + 16 * g, vreinterpretq_u8_u32(x[4 * g + b]));
+                }
+            }
+            for (size_t i = 0; i < n; i++) {
+                p[i] ^= ks[i];
+            }
+        }
+
+        state[12] += (n + 63) / 64;
+        done += n;
+    }
+    return done;
+}
+
+#endif  // __aarch64__
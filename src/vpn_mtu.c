@@ -0,0 +1,182 @@
+/*
+ * Path MTU discovery and MSS clamping shared by simple_vpn_server and
+ * simple_vpn_client
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/virtio_net.h>
+
+#include "vpn_mtu.h"
+
+// Probe halfway between what is known to work and what is known not to, or
+// end the search once the two are VPN_PMTU_STEP apart. If nothing got
+// through at all, the server is down or doesn't answer probes: keep the
+// last result instead of shrinking to VPN_PMTU_MIN.
+static void pmtu_choose(struct vpn_pmtu *p, time_t now) {
+    int lo = p->lo ? p->lo : VPN_PMTU_MIN;
+
+    p->tries = 0;
+    p->next = now;
+    if (p->hi - lo <= VPN_PMTU_STEP) {
+        if (p->lo) {
+            p->mtu = p->lo;
+        }
+        p->probe = 0;
+        p->next = now + VPN_PMTU_RESEARCH_SEC;
+        return;
+    }
+    p->probe = (lo + p->hi) / 2;
+}
+
+void vpn_pmtu_init(struct vpn_pmtu *p, int max, time_t now) {
+    memset(p, 0, sizeof(*p));
+    p->max = max > VPN_PMTU_MIN ? max : VPN_PMTU_DEFAULT;
+    p->next = now;
+}
+
+int vpn_pmtu_next_probe(struct vpn_pmtu *p, time_t now) {
+    if (now < p->next) {
+        return 0;
+    }
+    if (!p->probe) {
+        // New search, largest first
+        p->lo = 0;
+        p->hi = p->max + 1;
+        p->probe = p->max;
+        p->tries = 0;
+    } else if (p->tries >= VPN_PMTU_TRIES) {
+        p->hi = p->probe;
+        pmtu_choose(p, now);
+        if (!p->probe) {
+            return 0;
+        }
+    }
+    p->tries++;
+    p->next = now + VPN_PMTU_PROBE_SEC;
+    return p->probe;
+}
+
+void vpn_pmtu_acked(struct vpn_pmtu *p, int size, time_t now) {
+    // Late answers to an earlier try still count, as long as they narrow
+    // the search
+    if (!p->probe || size <= p->lo || size >= p->hi) {
+        return;
+    }
+    p->lo = size;
+    if (size >= p->probe) {
+        pmtu_choose(p, now);
+    }
+}
+
+int vpn_pmtu_timeout(const struct vpn_pmtu *p, time_t now) {
+    return p->next > now ? (int)(p->next - now) : 0;
+}
+
+int vpn_pmtu_socket(int fd) {
+    int val = IP_PMTUDISC_PROBE;
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+    if (getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0 || mtu <= 0) {
+        return VPN_PMTU_DEFAULT;
+    }
+    return mtu < 65535 ? mtu : 65535;  // Loopback's is 65536; IPv4 datagrams end before that
+}
+
+// One's complement checksum update for a 16-bit value changing from old to
+// new (RFC 1624, eqn. 3). At an odd offset, the value straddles two 16-bit
+// words of the sum, which comes out the same as adding it byte swapped.
+static void csum_replace16(unsigned char *csum_field, uint16_t old, uint16_t new, int odd) {
+    uint16_t csum;
+    memcpy(&csum, csum_field, sizeof(csum));
+
+    if (odd) {
+        old = (uint16_t)(old << 8 | old >> 8);
+        new = (uint16_t)(new << 8 | new >> 8);
+    }
+    uint32_t sum = (uint16_t)~ntohs(csum) + (uint16_t)~old + new;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    csum = htons((uint16_t)~sum);
+    memcpy(csum_field, &csum, sizeof(csum));
+}
+
+// With csum_partial, the TCP checksum field holds just the pseudo-header
+// sum, and the kernel sums the options in when it completes it
+static void clamp_mss(unsigned char *pkt, int len, int mtu, int csum_partial) {
+    int l4, ip_hdrs;
+
+    if (len < 1) {
+        return;
+    }
+    if (pkt[0] >> 4 == 4) {
+        l4 = (pkt[0] & 0x0f) * 4;
+        // TCP, and the first (or only) fragment
+        if (len < 20 || l4 < 20 || pkt[9] != IPPROTO_TCP || (pkt[6] & 0x1f) || pkt[7]) {
+            return;
+        }
+        ip_hdrs = 20 + 20;
+    } else if (pkt[0] >> 4 == 6) {
+        l4 = 40;
+        if (len < 40 || pkt[6] != IPPROTO_TCP) {
+            return;  // Not TCP, or behind extension headers
+        }
+        ip_hdrs = 40 + 20;
+    } else {
+        return;
+    }
+
+    if (len < l4 + 20 || !(pkt[l4 + 13] & 0x02)) {
+        return;  // Not a SYN
+    }
+    int tcp_len = (pkt[l4 + 12] >> 4) * 4;
+    if (tcp_len < 20 || l4 + tcp_len > len) {
+        return;
+    }
+
+    uint16_t max_mss = mtu - ip_hdrs;
+    unsigned char *opt = pkt + l4 + 20, *end = pkt + l4 + tcp_len;
+    while (opt < end) {
+        if (opt[0] == 0) {
+            break;          // End of options
+        }
+        if (opt[0] == 1) {
+            opt++;          // NOP
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) {
+            return;         // Malformed
+        }
+        if (opt[0] == 2 && opt[1] == 4) {
+            uint16_t mss = opt[2] << 8 | opt[3];
+            if (mss > max_mss) {
+                opt[2] = max_mss >> 8;
+                opt[3] = max_mss & 0xff;
+                if (!csum_partial) {
+                    csum_replace16(pkt + l4 + 16, mss, max_mss, (opt + 2 - (pkt + l4)) & 1);
+                }
+            }
+            return;
+        }
+        opt += opt[1];
+    }
+}
+
+void vpn_clamp_mss(unsigned char *pkt, int len, int mtu) {
+    clamp_mss(pkt, len, mtu, 0);
+}
+
+void vpn_clamp_mss_vnet(unsigned char *frame, int len, int mtu) {
+    struct virtio_net_hdr vh;
+
+    if (len < VPN_VNET_HDR_SIZE) {
+        return;
+    }
+    memcpy(&vh, frame, sizeof(vh));
+    clamp_mss(frame + VPN_VNET_HDR_SIZE, len - VPN_VNET_HDR_SIZE, mtu,
+              vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM);
+}
@@ -0,0 +1,87 @@
+/*
+ * Path MTU discovery and MSS clamping shared by simple_vpn_server and
+ * simple_vpn_client
+ *
+ * Every tunneled packet grows by the outer IP and UDP headers, our header
+ * and the tag (VPN_UDP_OVERHEAD bytes). If the TUN MTU lets the result
+ * outgrow the path, the outer datagram is fragmented - or, on paths that
+ * drop fragments or the ICMP errors PMTU discovery relies on, lost.
+ *
+ * Over UDP the client finds the path MTU itself, by packetization layer
+ * probing (RFC 8899): the UDP socket sets DF without trusting the kernel's
+ * estimate (IP_PMTUDISC_PROBE), and the client sends PROBE datagrams padded
+ * to a candidate size. The server answers each one that arrives with the
+ * size it got, so the search needs no ICMP at all:
+ *
+ * - The first probe is the largest datagram the local route takes; most
+ *   paths carry it, so one round trip settles the search.
+ * - Otherwise it is a binary search between VPN_PMTU_MIN and that size. A
+ *   size counts as too big once VPN_PMTU_TRIES probes of it go unanswered.
+ * - Every VPN_PMTU_RESEARCH_SEC the search runs again, so the MTU follows
+ *   the path when it changes.
+ *
+ * The client sets its TUN MTU to the path MTU minus VPN_UDP_OVERHEAD, so no
+ * inner packet needs fragmenting. Each endpoint also clamps the MSS of the
+ * TCP SYNs it writes to its TUN device to what that device's MTU carries:
+ * hosts behind the far end, which never hear about our MTU, then keep
+ * their TCP segments within it in both directions.
+ */
+
+#ifndef VPN_MTU_H
+#define VPN_MTU_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "vpn_crypto.h"
+#include "vpn_tun.h"
+#include "vpn_udp.h"
+
+// Outer IPv4 and UDP headers, our header and the tag
+#define VPN_UDP_OVERHEAD (20 + 8 + VPN_UDP_HDR_SIZE + VPN_TAG_SIZE)
+
+#define VPN_PMTU_MIN 576                // Every IPv4 path carries this
+#define VPN_PMTU_DEFAULT 1500           // When the route's MTU is unknown
+#define VPN_PMTU_STEP 8                 // The search stops this close
+#define VPN_PMTU_TRIES 3                // Unanswered probes before a size counts as too big
+#define VPN_PMTU_PROBE_SEC 1            // Between tries
+#define VPN_PMTU_RESEARCH_SEC 600       // Between searches
+
+// Search state: sizes are whole outer IPv4 datagrams
+struct vpn_pmtu {
+    int max;                    // Largest the local route takes
+    int lo;                     // Largest known to get through (0: none yet)
+    int hi;                     // Smallest known not to, or max + 1
+    int probe;                  // Size being probed, 0 between searches
+    int tries;                  // Probes of it sent
+    time_t next;                // When to send the next probe, or search again
+    int mtu;                    // Path MTU found by the last search (0: none yet)
+};
+
+// Start a search. max is the route's MTU (0: unknown).
+void vpn_pmtu_init(struct vpn_pmtu *p, int max, time_t now);
+
+// The size of the probe to send now, or 0 if none is due. A search that
+// ends here, or in vpn_pmtu_acked(), leaves its result in p->mtu, unless no
+// probe at all got through.
+int vpn_pmtu_next_probe(struct vpn_pmtu *p, time_t now);
+
+// A probe of size got through
+void vpn_pmtu_acked(struct vpn_pmtu *p, int size, time_t now);
+
+// Seconds until vpn_pmtu_next_probe() has something to do
+int vpn_pmtu_timeout(const struct vpn_pmtu *p, time_t now);
+
+// Set DF on a UDP socket's datagrams, ignoring the kernel's path MTU
+// estimate. Returns the MTU of the socket's route (at most 65535), or
+// VPN_PMTU_DEFAULT if it is not connected.
+int vpn_pmtu_socket(int fd);
+
+// If pkt (an IPv4 or IPv6 packet) is a TCP SYN whose MSS option is more
+// than a packet of mtu bytes carries, lower it and fix the checksum
+void vpn_clamp_mss(unsigned char *pkt, int len, int mtu);
+
+// The same for a packet behind a virtio-net header (vpn_offload.h)
+void vpn_clamp_mss_vnet(unsigned char *frame, int len, int mtu);
+
+#endif
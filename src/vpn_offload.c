@@ -0,0 +1,432 @@
+/*
+ * TUN offloads shared by simple_vpn_server and simple_vpn_client
+ */
+
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "vpn_offload.h"
+#include "vpn_pool.h"
+
+// A whole TUN read must fit in a pool buffer, with room for the tag
+_Static_assert(sizeof(struct vpn_pkt) + VPN_PKT_HEADROOM + VPN_GSO_READ_MAX + VPN_TAG_SIZE
+               <= VPN_PKT_SLOT_SIZE, "VPN_PKT_SLOT_SIZE too small for offload reads");
+
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_CWR 0x80
+
+#define IP_MAX_LEN 65535
+
+// Where the headers of an IP packet end
+struct l4_info {
+    int v6;
+    int ip_hlen;
+    int hdr_len;    // IP + TCP/UDP headers
+    int proto;
+};
+
+static int parse_headers(const unsigned char *pkt, int len, struct l4_info *l) {
+    int l4_hlen;
+
+    if (len < 20) {
+        return -1;
+    }
+    if ((pkt[0] >> 4) == 4) {
+        l->v6 = 0;
+        l->ip_hlen = (pkt[0] & 0x0f) * 4;
+        l->proto = pkt[9];
+        if (l->ip_hlen < 20) {
+            return -1;
+        }
+    } else if ((pkt[0] >> 4) == 6 && len >= 40) {
+        // Extension headers are not followed: such packets are left alone
+        l->v6 = 1;
+        l->ip_hlen = 40;
+        l->proto = pkt[6];
+    } else {
+        return -1;
+    }
+
+    if (l->proto == IPPROTO_TCP) {
+        if (len < l->ip_hlen + 20) {
+            return -1;
+        }
+        l4_hlen = (pkt[l->ip_hlen + 12] >> 4) * 4;
+        if (l4_hlen < 20) {
+            return -1;
+        }
+    } else if (l->proto == IPPROTO_UDP) {
+        l4_hlen = 8;
+    } else {
+        return -1;
+    }
+
+    l->hdr_len = l->ip_hlen + l4_hlen;
+    return l->hdr_len <= len ? 0 : -1;
+}
+
+// Internet checksum, summed in native byte order 32 bits at a time. The
+// folded result is the checksum's native-order representation, so storing
+// it with memcpy() gives the right bytes on either endianness. p must start
+// at an even offset of the packet.
+static uint64_t csum_add(uint64_t sum, const unsigned char *p, int len) {
+    while (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        sum += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        sum += w;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        uint16_t w = 0;
+        memcpy(&w, p, 1);  // The odd byte is the high half of a network order word
+        sum += w;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint64_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+// TCP/UDP pseudo-header: addresses, protocol and L4 length
+static uint64_t pseudo_sum(const unsigned char *ip, const struct l4_info *l, int l4_len) {
+    uint64_t sum = l->v6 ? csum_add(0, ip + 8, 32) : csum_add(0, ip + 12, 8);
+    return sum + htons(l->proto) + htons(l4_len);
+}
+
+static void store_csum(unsigned char *field, uint16_t csum) {
+    memcpy(field, &csum, sizeof(csum));
+}
+
+static void ip4_set_len(unsigned char *ip, int ip_hlen, int len) {
+    uint16_t tot_len = htons(len);
+    memcpy(ip + 2, &tot_len, 2);
+    store_csum(ip + 10, 0);
+    store_csum(ip + 10, ~csum_fold(csum_add(0, ip, ip_hlen)));
+}
+
+static void ip_set_len(unsigned char *ip, const struct l4_info *l, int len) {
+    if (l->v6) {
+        uint16_t payload_len = htons(len - 40);
+        memcpy(ip + 4, &payload_len, 2);
+    } else {
+        ip4_set_len(ip, l->ip_hlen, len);
+    }
+}
+
+static int gso_type_of(const struct virtio_net_hdr *vh) {
+    return vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+}
+
+int vpn_offload_whole(const unsigned char *data, int len, int peer_types) {
+    struct virtio_net_hdr vh;
+
+    if (len < VPN_VNET_HDR_SIZE) {
+        return 0;
+    }
+    memcpy(&vh, data, sizeof(vh));
+
+    switch (gso_type_of(&vh)) {
+    case VIRTIO_NET_HDR_GSO_NONE:
+        return 1;
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+        return (peer_types & VPN_GSO_TCPV4) && len <= VPN_PKT_MAX;
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        return (peer_types & VPN_GSO_TCPV6) && len <= VPN_PKT_MAX;
+    case VIRTIO_NET_HDR_GSO_UDP_L4:
+        return (peer_types & VPN_GSO_UDP) && len <= VPN_PKT_MAX;
+    default:
+        return 0;
+    }
+}
+
+int vpn_offload_to_plain(unsigned char **data, int *len) {
+    struct virtio_net_hdr vh;
+
+    if (*len < VPN_VNET_HDR_SIZE) {
+        return -1;
+    }
+    memcpy(&vh, *data, sizeof(vh));
+    if (gso_type_of(&vh) != VIRTIO_NET_HDR_GSO_NONE) {
+        return 0;
+    }
+
+    unsigned char *pkt = *data + VPN_VNET_HDR_SIZE;
+    int pkt_len = *len - VPN_VNET_HDR_SIZE;
+
+    // The kernel only summed the pseudo-header into the checksum field:
+    // add everything from csum_start on, like a NIC would
+    if (vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        int start = le16toh(vh.csum_start);
+        int field = start + le16toh(vh.csum_offset);
+        if ((start & 1) || field + 2 > pkt_len) {
+            return -1;
+        }
+        uint16_t csum = ~csum_fold(csum_add(0, pkt + start, pkt_len - start));
+        store_csum(pkt + field, csum ? csum : 0xffff);
+    }
+
+    *data = pkt;
+    *len = pkt_len;
+    return 1;
+}
+
+int vpn_gso_begin(struct vpn_gso_iter *it, const unsigned char *data, int len) {
+    struct virtio_net_hdr vh;
+    struct l4_info l;
+
+    if (len < VPN_VNET_HDR_SIZE) {
+        return -1;
+    }
+    memcpy(&vh, data, sizeof(vh));
+    data += VPN_VNET_HDR_SIZE;
+    len -= VPN_VNET_HDR_SIZE;
+
+    if (parse_headers(data, len, &l) < 0) {
+        return -1;
+    }
+    switch (gso_type_of(&vh)) {
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+        if (l.v6 || l.proto != IPPROTO_TCP) return -1;
+        break;
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        if (!l.v6 || l.proto != IPPROTO_TCP) return -1;
+        break;
+    case VIRTIO_NET_HDR_GSO_UDP_L4:
+        if (l.proto != IPPROTO_UDP) return -1;
+        break;
+    default:
+        return -1;
+    }
+
+    memset(it, 0, sizeof(*it));
+    it->pkt = data;
+    it->ip_hlen = l.ip_hlen;
+    it->hdr_len = l.hdr_len;
+    it->proto = l.proto;
+    it->v6 = l.v6;
+    it->mss = le16toh(vh.gso_size);
+    it->payload = len - l.hdr_len;
+    if (it->mss == 0 || it->payload <= 0 || l.hdr_len + it->mss > IP_MAX_LEN) {
+        return -1;
+    }
+
+    if (l.proto == IPPROTO_TCP) {
+        uint32_t seq;
+        memcpy(&seq, data + l.ip_hlen + 4, 4);
+        it->seq = ntohl(seq);
+    }
+    if (!l.v6) {
+        uint16_t id;
+        memcpy(&id, data + 4, 2);
+        it->id = ntohs(id);
+    }
+    return 0;
+}
+
+int vpn_gso_next(struct vpn_gso_iter *it, unsigned char *out) {
+    if (it->off >= it->payload) {
+        return 0;
+    }
+
+    int chunk = it->payload - it->off < it->mss ? it->payload - it->off : it->mss;
+    int last = it->off + chunk == it->payload;
+    int len = it->hdr_len + chunk;
+    int l4_len = len - it->ip_hlen;
+    struct l4_info l = { .v6 = it->v6, .ip_hlen = it->ip_hlen, .hdr_len = it->hdr_len,
+                         .proto = it->proto };
+    unsigned char *l4 = out + it->ip_hlen;
+
+    memcpy(out, it->pkt, it->hdr_len);
+    memcpy(out + it->hdr_len, it->pkt + it->hdr_len + it->off, chunk);
+
+    // IP: length, and a fresh id per segment like the kernel would use
+    if (!it->v6) {
+        uint16_t id = htons(it->id + it->index);
+        memcpy(out + 4, &id, 2);
+    }
+    ip_set_len(out, &l, len);
+
+    if (it->proto == IPPROTO_TCP) {
+        uint32_t seq = htonl(it->seq + it->off);
+        memcpy(l4 + 4, &seq, 4);
+        if (!last) {
+            l4[13] &= ~(TCP_FIN | TCP_PSH);  // Those belong to the end of the burst
+        }
+        if (it->index > 0) {
+            l4[13] &= ~TCP_CWR;              // And this to its start
+        }
+        store_csum(l4 + 16, 0);
+        store_csum(l4 + 16, ~csum_fold(pseudo_sum(out, &l, l4_len) + csum_add(0, l4, l4_len)));
+    } else {
+        uint16_t udp_len = htons(l4_len);
+        memcpy(l4 + 4, &udp_len, 2);
+        store_csum(l4 + 6, 0);
+        uint16_t csum = ~csum_fold(pseudo_sum(out, &l, l4_len) + csum_add(0, l4, l4_len));
+        store_csum(l4 + 6, csum ? csum : 0xffff);  // 0 means "no checksum" in UDP
+    }
+
+    it->off += chunk;
+    it->index++;
+    return len;
+}
+
+// A packet that may start or extend a run: a TCP segment with data, only
+// ACK (and PSH) set, and an IP header without options or fragmentation
+static int gro_candidate(const unsigned char *pkt, int len, struct l4_info *l) {
+    if (parse_headers(pkt, len, l) < 0 || l->proto != IPPROTO_TCP || l->hdr_len >= len) {
+        return 0;
+    }
+
+    uint16_t ip_len;
+    if (l->v6) {
+        memcpy(&ip_len, pkt + 4, 2);
+        if (ntohs(ip_len) + 40 != len) return 0;
+    } else {
+        uint16_t frag;
+        memcpy(&ip_len, pkt + 2, 2);
+        memcpy(&frag, pkt + 6, 2);
+        if (l->ip_hlen != 20 || ntohs(ip_len) != len || (ntohs(frag) & 0x3fff)) return 0;
+    }
+
+    unsigned char flags = pkt[l->ip_hlen + 13];
+    return (flags & ~TCP_PSH) == TCP_ACK;
+}
+
+// State of the run that ends at the last packet kept so far
+struct gro_run {
+    struct l4_info l;
+    int open;           // Can take more segments
+    int segs;
+    int mss;            // Payload of the first segment
+    uint32_t next_seq;
+};
+
+// Returns 1 if p continues the run whose first packet is h: same flow and
+// IP/TCP header fields, next in sequence, and no bigger than the first
+static int gro_continues(const struct gro_run *run, const struct vpn_gro_pkt *h,
+                         const unsigned char *p, int len, const struct l4_info *l) {
+    const unsigned char *hp = h->data;
+    int ip = l->ip_hlen;
+    int payload = len - l->hdr_len;
+
+    if (l->v6 != run->l.v6 || l->hdr_len != run->l.hdr_len ||
+        payload > run->mss || h->len + payload > IP_MAX_LEN) {
+        return 0;
+    }
+    if (l->v6) {
+        // Version/class/flow label, next header + hop limit, addresses
+        if (memcmp(hp, p, 4) != 0 || memcmp(hp + 6, p + 6, 34) != 0) return 0;
+    } else {
+        // TOS, DF, TTL + protocol, addresses
+        if (hp[1] != p[1] || hp[6] != p[6] || memcmp(hp + 8, p + 8, 2) != 0 ||
+            memcmp(hp + 12, p + 12, 8) != 0) return 0;
+    }
+
+    // Ports, ACK number, data offset, window, options
+    uint32_t seq;
+    memcpy(&seq, p + ip + 4, 4);
+    return ntohl(seq) == run->next_seq &&
+           memcmp(hp + ip, p + ip, 4) == 0 &&
+           memcmp(hp + ip + 8, p + ip + 8, 5) == 0 &&
+           memcmp(hp + ip + 14, p + ip + 14, 2) == 0 &&
+           memcmp(hp + ip + 20, p + ip + 20, l->hdr_len - ip - 20) == 0;
+}
+
+// Turn a run of more than one segment into a super-packet: fix the IP
+// length, leave a partial checksum and describe it in the header
+static void gro_finish(const struct gro_run *run, struct vpn_gro_pkt *h) {
+    const struct l4_info *l = &run->l;
+    unsigned char *tcp = h->data + l->ip_hlen;
+
+    if (run->segs < 2) {
+        return;
+    }
+
+    ip_set_len(h->data, l, h->len);
+    store_csum(tcp + 16, csum_fold(pseudo_sum(h->data, l, h->len - l->ip_hlen)));
+
+    h->hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    h->hdr.gso_type = l->v6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+    h->hdr.hdr_len = htole16(l->hdr_len);
+    h->hdr.gso_size = htole16(run->mss);
+    h->hdr.csum_start = htole16(l->ip_hlen);
+    h->hdr.csum_offset = htole16(16);
+}
+
+int vpn_gro_coalesce(struct vpn_gro_pkt *pkts, int n) {
+    struct gro_run run = {0};
+    int out = 0;
+
+    for (int i = 0; i < n; i++) {
+        unsigned char *p = pkts[i].data;
+        int len = pkts[i].len;
+        struct l4_info l;
+        int candidate = gro_candidate(p, len, &l);
+
+        if (candidate && run.open && gro_continues(&run, &pkts[out - 1], p, len, &l)) {
+            struct vpn_gro_pkt *h = &pkts[out - 1];
+            int payload = len - l.hdr_len;
+            unsigned char flags = p[l.ip_hlen + 13];
+
+            memmove(h->data + h->len, p + l.hdr_len, payload);
+            h->len += payload;
+            run.segs++;
+            run.next_seq += payload;
+
+            // A short segment or a push ends the burst, as it does in the kernel
+            if (payload < run.mss || (flags & TCP_PSH)) {
+                h->data[l.ip_hlen + 13] |= flags;
+                run.open = 0;
+            }
+            continue;
+        }
+
+        if (out > 0) {
+            gro_finish(&run, &pkts[out - 1]);
+        }
+        pkts[out] = pkts[i];
+        memset(&pkts[out].hdr, 0, sizeof(pkts[out].hdr));
+        out++;
+
+        memset(&run, 0, sizeof(run));
+        run.segs = 1;
+        if (candidate) {
+            uint32_t seq;
+            memcpy(&seq, p + l.ip_hlen + 4, 4);
+            run.l = l;
+            run.mss = len - l.hdr_len;
+            run.next_seq = ntohl(seq) + run.mss;
+            run.open = !(p[l.ip_hlen + 13] & TCP_PSH);
+        }
+    }
+    if (out > 0) {
+        gro_finish(&run, &pkts[out - 1]);
+    }
+    return out;
+}
+
+int vpn_offload_write(int tun_fd, const struct virtio_net_hdr *hdr,
+                      const unsigned char *pkt, int len) {
+    struct iovec iov[2] = {
+        { .iov_base = (void *)hdr, .iov_len = VPN_VNET_HDR_SIZE },
+        { .iov_base = (void *)pkt, .iov_len = len },
+    };
+    return writev(tun_fd, iov, 2) < 0 ? -1 : 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * TUN offloads shared by simple_vpn_server and simple_vpn_client
+ *
+ * Without offloads the kernel cuts every TCP stream into MTU-sized packets
+ * before they reach the TUN device, and each of them costs a read, a seal
+ * and a send on the way out, and an open and a write on the way in. With -o
+ * the TUN device is opened with IFF_VNET_HDR and TSO/USO (see vpn_tun.h):
+ * a read then returns a whole burst of one flow as a single super-packet of
+ * up to 64 KiB, prefixed with a virtio-net header that says how to cut it
+ * up, and a write takes the same.
+ *
+ * Super-packets cross the tunnel in one of two ways:
+ *
+ * - TCP transport, both ends with -o: whole. Each frame's payload is the
+ *   virtio-net header plus the packet, and the far kernel takes it as is
+ *   (it only segments if it forwards the packet out of a real NIC).
+ * - UDP transport, or a peer without -o: cut into ordinary packets at the
+ *   transport boundary (vpn_gso_next()), as the kernel would have done. An
+ *   offloading receiver glues runs of consecutive TCP segments of a flow
+ *   back together (vpn_gro_coalesce()) before writing them to its TUN.
+ *
+ * Packets read from an offload TUN may also only have a partial checksum
+ * (VIRTIO_NET_HDR_F_NEEDS_CSUM); vpn_offload_to_plain() completes it when
+ * the packet leaves as an ordinary one.
+ *
+ * The virtio-net header is little endian on the wire and on the TUN.
+ */
+
+#ifndef VPN_OFFLOAD_H
+#define VPN_OFFLOAD_H
+
+#include <stdint.h>
+#include <linux/virtio_net.h>
+
+#include "vpn_tun.h"
+
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5     // USO, Linux 6.2+ (older headers lack it)
+#endif
+
+// Largest TUN read with offloads on: header + the largest IP packet
+#define VPN_GSO_READ_MAX (VPN_VNET_HDR_SIZE + 65535)
+
+// Cuts one super-packet into ordinary packets
+struct vpn_gso_iter {
+    const unsigned char *pkt;   // IP packet (after the virtio-net header)
+    int ip_hlen;
+    int hdr_len;                // IP + TCP/UDP headers, repeated in every segment
+    int proto;                  // IPPROTO_TCP or IPPROTO_UDP
+    int v6;
+    int mss;                    // Payload bytes per segment
+    int payload;                // Payload bytes in the super-packet
+    int off;                    // Payload bytes cut so far
+    int index;                  // Segments cut so far
+    uint32_t seq;               // TCP: first sequence number
+    uint16_t id;                // IPv4: first IP id
+};
+
+// One decrypted packet on its way to an offload TUN
+struct vpn_gro_pkt {
+    unsigned char *data;        // IP packet; coalesced segments are appended here
+    int len;
+    struct virtio_net_hdr hdr;  // Set by vpn_gro_coalesce()
+};
+
+// Returns 1 if a packet read from TUN (header + packet) can be tunneled whole
+// to a peer that takes the super-packet types in peer_types (VPN_GSO_*):
+// it is not a super-packet, or one of a type the peer takes and small
+// enough for a TCP frame.
+int vpn_offload_whole(const unsigned char *data, int len, int peer_types);
+
+// Turn a packet read from TUN into an ordinary one in place: complete a
+// partial checksum and step *data/*len past the header. Returns 1, 0 if it
+// is a super-packet (cut it with vpn_gso_begin() instead), or -1 if the
+// header is malformed.
+int vpn_offload_to_plain(unsigned char **data, int *len);
+
+// Start cutting a super-packet read from TUN (header + packet). data must
+// stay untouched until the last vpn_gso_next(). Returns 0, or -1 if it is
+// malformed or of a type we can't cut.
+int vpn_gso_begin(struct vpn_gso_iter *it, const unsigned char *data, int len);
+
+// Write the next segment to out (room for hdr_len + mss bytes) as an
+// ordinary packet with complete checksums. Returns its length, or 0 once
+// every segment has been cut.
+int vpn_gso_next(struct vpn_gso_iter *it, unsigned char *out);
+
+// Coalesce runs of consecutive, in-order TCP segments of one flow into
+// super-packets, in place: a segment's payload is moved into the first
+// segment's buffer, and the packets array is compacted. A run's buffer must
+// have room for 65535 bytes, or sit in memory before the run's other
+// packets (frames in a receive ring). Every packet's hdr is set, to
+// zeros for a packet that stays as it was. Returns the new count.
+int vpn_gro_coalesce(struct vpn_gro_pkt *pkts, int n);
+
+// Write a packet to an offload TUN, behind its virtio-net header.
+// Returns 0, or -1 on error (errno set).
+int vpn_offload_write(int tun_fd, const struct virtio_net_hdr *hdr,
+                      const unsigned char *pkt, int len);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Packet buffer pool shared by simple_vpn_server and simple_vpn_client
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "vpn_pool.h"
+
+_Static_assert(sizeof(struct vpn_pkt) + VPN_PKT_HEADROOM + VPN_PKT_MAX + VPN_TAG_SIZE
+               <= VPN_PKT_SLOT_SIZE, "VPN_PKT_SLOT_SIZE too small");
+
+int vpn_pool_init(struct vpn_pool *pool, int count) {
+    return vpn_pool_init_slots(pool, count, VPN_PKT_SLOT_SIZE);
+}
+
+int vpn_pool_init_slots(struct vpn_pool *pool, int count, size_t slot_size) {
+    memset(pool, 0, sizeof(*pool));
+
+    unsigned char *arena = mmap(NULL, (size_t)count * slot_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+        return -1;
+    }
+
+    pool->arena = arena;
+    pool->count = count;
+    pool->slot_size = slot_size;
+    atomic_init(&pool->returned, NULL);
+
+    // Build the free list back to front, so buffers are handed out in
+    // address order
+    for (int i = count - 1; i >= 0; i--) {
+        struct vpn_pkt *pkt = (struct vpn_pkt *)(arena + (size_t)i * slot_size);
+        pkt->pool = pool;
+        pkt->next = pool->free;
+        pool->free = pkt;
+    }
+    pool->num_free = count;
+    return 0;
+}
+
+void vpn_pool_free(struct vpn_pool *pool) {
+    if (pool->arena) {
+        munmap(pool->arena, (size_t)pool->count * pool->slot_size);
+        pool->arena = NULL;
+    }
+}
+
+struct vpn_pkt *vpn_pkt_get(struct vpn_pool *pool) {
+    if (!pool->free) {
+        // Take everything other threads gave back in one swap. Only the
+        // owner ever removes from the stack, so there is no ABA problem.
+        struct vpn_pkt *list = atomic_exchange_explicit(&pool->returned, NULL,
+                                                        memory_order_acquire);
+        pool->free = list;
+        for (; list; list = list->next) {
+            pool->num_free++;
+        }
+        if (!pool->free) {
+            return NULL;
+        }
+    }
+
+    struct vpn_pkt *pkt = pool->free;
+    pool->free = pkt->next;
+    pool->num_free--;
+
+    pkt->next = NULL;
+    vpn_pkt_reset(pkt);
+    return pkt;
+}
+
+void vpn_pkt_put(struct vpn_pool *mine, struct vpn_pkt *pkt) {
+    struct vpn_pool *pool = pkt->pool;
+
+    if (pool == mine) {
+        pkt->next = pool->free;
+        pool->free = pkt;
+        pool->num_free++;
+        return;
+    }
+
+    // Push onto the owner's return stack
+    struct vpn_pkt *head = atomic_load_explicit(&pool->returned, memory_order_relaxed);
+    do {
+        pkt->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->returned, &head, pkt,
+                                                    memory_order_release, memory_order_relaxed));
+}
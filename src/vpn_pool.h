@@ -0,0 +1,94 @@
+/*
+ * Packet buffer pool shared by simple_vpn_server and simple_vpn_client
+ *
+ * Every packet lives in a fixed-size buffer taken from a pool, instead of
+ * in a stack array of one loop. A buffer can then be queued, batched or
+ * handed to another worker as a pointer: nothing is malloc()ed or copied
+ * per packet.
+ *
+ * Buffer layout (one slot of the pool's arena):
+ *
+ *   +------------+------------+----------------------------+-----+
+ *   | vpn_pkt    |  headroom  |  packet (up to VPN_PKT_MAX) | tag |
+ *   +------------+------------+----------------------------+-----+
+ *   0            64           data                          data + len
+ *
+ * - The headroom lets a sender write the UDP header or TCP length prefix
+ *   right in front of the packet, so header + sealed packet + tag is one
+ *   contiguous run: one iovec per datagram or frame. A receiver can
+ *   recvmmsg() a datagram's header into it the same way.
+ * - VPN_PKT_MAX is the largest packet a TCP frame can carry (its length
+ *   field is 16 bits, tag included), big enough for GSO super-packets.
+ * - The descriptor and packet start on cache lines of their own.
+ *
+ * The arena is one MAP_NORESERVE mapping: memory is only used for the pages
+ * packets actually touch, so a 68 KiB slot carrying a 1500-byte packet costs
+ * one page.
+ *
+ * A pool can have smaller slots, e.g. the 4 KiB frames of an AF_XDP UMEM
+ * (vpn_xdp.h): the same descriptor at the start, and whatever fits after.
+ *
+ * Each thread owns its pool and takes buffers from it without locks. A
+ * buffer handed to another thread is given back with vpn_pkt_put() there:
+ * it goes on its own pool's return stack (lock-free), and the owner picks
+ * the whole stack up the next time its free list runs dry.
+ */
+
+#ifndef VPN_POOL_H
+#define VPN_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "vpn_crypto.h"
+
+#define VPN_PKT_HEADROOM 64
+#define VPN_PKT_MAX (UINT16_MAX - VPN_TAG_SIZE)
+#define VPN_PKT_SLOT_SIZE (68 * 1024)       // Descriptor..tag, rounded up to whole pages
+
+struct vpn_pool;
+
+// Descriptor at the start of each buffer
+struct vpn_pkt {
+    struct vpn_pkt *next;                   // Free list link
+    struct vpn_pool *pool;                  // Pool the buffer belongs to
+    unsigned char *data;                    // Packet start, VPN_PKT_HEADROOM into the buffer
+    int len;
+} __attribute__((aligned(64)));
+
+struct vpn_pool {
+    unsigned char *arena;
+    int count;
+    size_t slot_size;                       // VPN_PKT_SLOT_SIZE, unless made smaller
+    struct vpn_pkt *free;                   // Owner thread only
+    int num_free;
+    _Atomic(struct vpn_pkt *) returned;     // Given back by other threads
+};
+
+// Map count buffers. Returns 0, or -1 on error.
+int vpn_pool_init(struct vpn_pool *pool, int count);
+
+// The same with slots of slot_size bytes (a multiple of the page size, or
+// a power of two below it), for buffers that only ever hold small packets
+int vpn_pool_init_slots(struct vpn_pool *pool, int count, size_t slot_size);
+
+// Unmap the arena. Every buffer must be back in the pool (or abandoned).
+void vpn_pool_free(struct vpn_pool *pool);
+
+// Take a buffer, with data reset to the default headroom. Owner thread
+// only. Returns NULL if every buffer is in use.
+struct vpn_pkt *vpn_pkt_get(struct vpn_pool *pool);
+
+// Point data back at the default headroom, e.g. before reusing a buffer
+// whose data was moved
+static inline void vpn_pkt_reset(struct vpn_pkt *pkt) {
+    pkt->data = (unsigned char *)(pkt + 1) + VPN_PKT_HEADROOM;
+    pkt->len = 0;
+}
+
+// Give pkt back. mine is the calling thread's own pool: a buffer from
+// another pool goes on that pool's return stack instead.
+void vpn_pkt_put(struct vpn_pool *mine, struct vpn_pkt *pkt);
+
+#endif
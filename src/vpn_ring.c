@@ -0,0 +1,97 @@
+/*
+ * Single-producer single-consumer rings for simple_vpn_client's pipelined mode
+ */
+
+#define _GNU_SOURCE  // syscall()
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "vpn_ring.h"
+
+#define WAITER_SPINS 4000       // Checks before sleeping: a few microseconds
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+int vpn_ring_init(struct vpn_ring *r, unsigned int size) {
+    unsigned int slots = 1;
+
+    memset(r, 0, sizeof(*r));
+    while (slots < size) {
+        slots *= 2;
+    }
+    r->slots = calloc(slots, sizeof(r->slots[0]));
+    if (!r->slots) {
+        return -1;
+    }
+    r->mask = slots - 1;
+    return 0;
+}
+
+void vpn_ring_free(struct vpn_ring *r) {
+    free(r->slots);
+    r->slots = NULL;
+}
+
+void vpn_ring_reset(struct vpn_ring *r) {
+    atomic_store(&r->head, 0);
+    atomic_store(&r->tail, 0);
+    r->head_cache = 0;
+    r->tail_cache = 0;
+}
+
+static int futex(_Atomic uint32_t *word, int op, uint32_t val, const struct timespec *timeout) {
+    return syscall(SYS_futex, (uint32_t *)word, op, val, timeout, NULL, 0);
+}
+
+// With one CPU, spinning only keeps the thread we wait for off it
+static int waiter_spins(void) {
+    static atomic_int spins = -1;
+    int n = atomic_load_explicit(&spins, memory_order_relaxed);
+
+    if (n < 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WAITER_SPINS : 0;
+        atomic_store_explicit(&spins, n, memory_order_relaxed);
+    }
+    return n;
+}
+
+int vpn_waiter_wait(struct vpn_waiter *w, uint32_t seen, int timeout_ms) {
+    int spins = waiter_spins();
+
+    for (int i = 0; i < spins; i++) {
+        if (atomic_load_explicit(&w->seq, memory_order_acquire) != seen) {
+            return 1;
+        }
+        cpu_relax();
+    }
+
+    struct timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    atomic_store(&w->sleeping, 1);
+    int ret = 0;
+    if (atomic_load(&w->seq) == seen) {
+        // Returns at once (EAGAIN) if seq moved on since the check
+        ret = futex(&w->seq, FUTEX_WAIT_PRIVATE, seen, timeout_ms >= 0 ? &ts : NULL);
+    }
+    atomic_store(&w->sleeping, 0);
+
+    if (ret < 0 && errno == ETIMEDOUT) {
+        return atomic_load(&w->seq) != seen;
+    }
+    return 1;
+}
+
+void vpn_waiter_wake(struct vpn_waiter *w) {
+    futex(&w->seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
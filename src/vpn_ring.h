@@ -0,0 +1,110 @@
+/*
+ * Single-producer single-consumer rings for simple_vpn_client's pipelined mode
+ *
+ * In pipelined mode (-P) every stage of the tunnel - TUN reader, crypto,
+ * socket sender, and the same in reverse - runs on its own thread, and
+ * batches of packets move between neighbouring stages through rings:
+ *
+ * - A struct vpn_ring has exactly one producer and one consumer thread, so
+ *   a push or pop is a plain load and store on each side, with no locked
+ *   instruction. The producer owns tail and the consumer head, each on its
+ *   own cache line, and each side keeps a cached copy of the other's index:
+ *   the shared line is only read when the copy says the ring is full (or
+ *   empty).
+ * - A stage with nothing to do waits on its struct vpn_waiter. It spins for
+ *   a few microseconds first (a busy pipeline refills it before that; not
+ *   on a single CPU), then sleeps on a futex. A producer calls
+ *   vpn_waiter_notify() after pushing, which only makes a syscall when the
+ *   consumer is asleep.
+ *
+ * One waiter can serve several rings: a stage that consumes from more than
+ * one checks them all between waits.
+ */
+
+#ifndef VPN_RING_H
+#define VPN_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+struct vpn_ring {
+    // Producer side
+    _Atomic unsigned int tail __attribute__((aligned(64)));    // Next slot to fill
+    unsigned int head_cache;                // Last head the producer saw
+
+    // Consumer side
+    _Atomic unsigned int head __attribute__((aligned(64)));    // Next slot to take
+    unsigned int tail_cache;                // Last tail the consumer saw
+
+    unsigned int mask __attribute__((aligned(64)));            // Slot count - 1
+    void **slots;
+};
+
+// Up to size entries (rounded up to a power of two). Returns 0, or -1 if
+// out of memory.
+int vpn_ring_init(struct vpn_ring *r, unsigned int size);
+
+void vpn_ring_free(struct vpn_ring *r);
+
+// Empty the ring. Neither side may be using it.
+void vpn_ring_reset(struct vpn_ring *r);
+
+// Producer only. Returns 1, or 0 if the ring is full.
+static inline int vpn_ring_push(struct vpn_ring *r, void *p) {
+    unsigned int t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if (t - r->head_cache > r->mask) {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (t - r->head_cache > r->mask) {
+            return 0;
+        }
+    }
+    r->slots[t & r->mask] = p;
+    atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+    return 1;
+}
+
+// Consumer only. Returns the oldest entry, or NULL if the ring is empty.
+static inline void *vpn_ring_pop(struct vpn_ring *r) {
+    unsigned int h = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (h == r->tail_cache) {
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (h == r->tail_cache) {
+            return NULL;
+        }
+    }
+    void *p = r->slots[h & r->mask];
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+    return p;
+}
+
+// Where one consumer thread sleeps while its rings are empty
+struct vpn_waiter {
+    _Atomic uint32_t seq;                   // Bumped by every notify (the futex word)
+    _Atomic int sleeping;
+} __attribute__((aligned(64)));
+
+// Take a snapshot before checking the rings: a notify after it makes
+// vpn_waiter_wait() return at once, so none can be missed
+static inline uint32_t vpn_waiter_prepare(struct vpn_waiter *w) {
+    return atomic_load(&w->seq);
+}
+
+// Wait for a notify since seen was taken, at most timeout_ms (-1: no
+// limit). Returns 1 if notified, 0 on timeout.
+int vpn_waiter_wait(struct vpn_waiter *w, uint32_t seen, int timeout_ms);
+
+void vpn_waiter_wake(struct vpn_waiter *w);
+
+// Call after pushing to one of w's rings
+static inline void vpn_waiter_notify(struct vpn_waiter *w) {
+    // Both sequentially consistent: either the sleeper sees the new seq
+    // before it sleeps, or we see it sleeping and wake it
+    atomic_fetch_add(&w->seq, 1);
+    if (atomic_load(&w->sleeping)) {
+        vpn_waiter_wake(w);
+    }
+}
+
+#endif
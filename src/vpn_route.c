@@ -0,0 +1,246 @@
+/*
+ * Session and route tables for simple_vpn_server
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vpn_route.h"
+
+#define HASH_MIN_SLOTS 16
+#define TOMBSTONE ((uint64_t)UINT32_MAX << 32)
+
+// Reclamation state, shared by every table. A reader's seen is the epoch
+// at its last quiescent state (0: offline); a hash retired at epoch e can
+// go once every online reader has seen e.
+static _Atomic uint64_t epoch = 1;
+static struct {
+    _Atomic uint64_t seen;
+    int taken;
+} readers[VPN_ROUTE_MAX_READERS];
+
+struct retired {
+    struct retired *next;
+    uint64_t epoch;
+    struct vpn_route_hash *hash;
+};
+
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct retired *retired_list;
+
+int vpn_route_reader_register(void) {
+    int id = -1;
+
+    pthread_mutex_lock(&rcu_lock);
+    for (int i = 0; i < VPN_ROUTE_MAX_READERS; i++) {
+        if (!readers[i].taken) {
+            readers[i].taken = 1;
+            atomic_store(&readers[i].seen, atomic_load(&epoch));
+            id = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rcu_lock);
+    return id;
+}
+
+void vpn_route_quiescent(int reader) {
+    if (reader >= 0) {
+        uint64_t now = atomic_load_explicit(&epoch, memory_order_acquire);
+        atomic_store_explicit(&readers[reader].seen, now, memory_order_release);
+    }
+}
+
+void vpn_route_reader_offline(int reader) {
+    if (reader < 0) {
+        return;
+    }
+    pthread_mutex_lock(&rcu_lock);
+    atomic_store(&readers[reader].seen, 0);
+    readers[reader].taken = 0;
+    pthread_mutex_unlock(&rcu_lock);
+}
+
+// Free the retired hashes no reader can still be probing
+static void reclaim(void) {
+    pthread_mutex_lock(&rcu_lock);
+
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < VPN_ROUTE_MAX_READERS; i++) {
+        uint64_t seen = atomic_load_explicit(&readers[i].seen, memory_order_acquire);
+        if (seen != 0 && seen < oldest) {
+            oldest = seen;
+        }
+    }
+
+    struct retired **link = &retired_list;
+    while (*link) {
+        struct retired *r = *link;
+        if (r->epoch <= oldest) {
+            *link = r->next;
+            free(r->hash);
+            free(r);
+        } else {
+            link = &r->next;
+        }
+    }
+    pthread_mutex_unlock(&rcu_lock);
+}
+
+// Free h once the readers are done with it. It must be unpublished already.
+static void retire(struct vpn_route_hash *h) {
+    struct retired *r = malloc(sizeof(*r));
+    if (!r) {
+        return;  // Nowhere to keep it: better a leak than a use after free
+    }
+
+    // Readers that see the new epoch see the hash unpublished, too
+    pthread_mutex_lock(&rcu_lock);
+    r->hash = h;
+    r->epoch = atomic_fetch_add(&epoch, 1) + 1;
+    r->next = retired_list;
+    retired_list = r;
+    pthread_mutex_unlock(&rcu_lock);
+}
+
+static struct vpn_route_hash *hash_alloc(unsigned int slots) {
+    struct vpn_route_hash *h = calloc(1, sizeof(*h) + slots * sizeof(h->slots[0]));
+    if (!h) {
+        return NULL;
+    }
+    h->mask = slots - 1;
+    h->shift = 32 - __builtin_ctz(slots);
+    return h;
+}
+
+// Writer only: put a new key into h, which has room for it
+static void hash_insert(struct vpn_route_hash *h, uint64_t entry) {
+    unsigned int i = vpn_route_slot(h, (uint32_t)entry);
+    while (atomic_load_explicit(&h->slots[i], memory_order_relaxed) != 0) {
+        i = (i + 1) & h->mask;
+    }
+    atomic_store_explicit(&h->slots[i], entry, memory_order_release);
+}
+
+// Writer only: rebuild the /len hash with room for one more entry than it
+// has (and no tombstones), and publish it
+static int hash_grow(struct vpn_route_table *t, int len) {
+    struct vpn_route_hash *old = atomic_load_explicit(&t->hash[len], memory_order_relaxed);
+    unsigned int slots = HASH_MIN_SLOTS;
+
+    // At most half full after the rebuild
+    while (slots < (t->used[len] + 1) * 2) {
+        slots *= 2;
+    }
+
+    struct vpn_route_hash *h = hash_alloc(slots);
+    if (!h) {
+        return -1;
+    }
+    if (old) {
+        for (unsigned int i = 0; i <= old->mask; i++) {
+            uint64_t entry = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+            if (entry != 0 && (entry & TOMBSTONE) != TOMBSTONE) {
+                hash_insert(h, entry);
+            }
+        }
+    }
+
+    atomic_store_explicit(&t->hash[len], h, memory_order_release);
+    t->tombs[len] = 0;
+    if (old) {
+        retire(old);
+    }
+    return 0;
+}
+
+int vpn_route_init(struct vpn_route_table *t) {
+    memset(t, 0, sizeof(*t));
+    return pthread_mutex_init(&t->lock, NULL) == 0 ? 0 : -1;
+}
+
+void vpn_route_destroy(struct vpn_route_table *t) {
+    for (int len = 0; len <= 32; len++) {
+        free(atomic_load(&t->hash[len]));
+    }
+    pthread_mutex_destroy(&t->lock);
+    memset(t, 0, sizeof(*t));
+    reclaim();
+}
+
+int vpn_route_set(struct vpn_route_table *t, uint32_t prefix, int len, uint32_t value) {
+    if (len < 0 || len > 32 || value >= VPN_ROUTE_NONE - 1) {
+        return -1;
+    }
+    uint32_t key = prefix & vpn_route_mask(len);
+    uint64_t entry = (uint64_t)(value + 1) << 32 | key;
+    int ret = 0;
+
+    pthread_mutex_lock(&t->lock);
+    struct vpn_route_hash *h = atomic_load_explicit(&t->hash[len], memory_order_relaxed);
+
+    // Already there: replace the value in place
+    if (h) {
+        for (unsigned int i = vpn_route_slot(h, key); ; i = (i + 1) & h->mask) {
+            uint64_t slot = atomic_load_explicit(&h->slots[i], memory_order_relaxed);
+            if (slot == 0) {
+                break;
+            }
+            if ((uint32_t)slot == key && (slot & TOMBSTONE) != TOMBSTONE) {
+                atomic_store_explicit(&h->slots[i], entry, memory_order_release);
+                goto out;
+            }
+        }
+    }
+
+    // New: keep live entries and tombstones under 3/4 of the slots, so
+    // every probe run ends at an empty slot
+    if (!h || (t->used[len] + t->tombs[len] + 1) * 4 > (h->mask + 1) * 3) {
+        if (hash_grow(t, len) < 0) {
+            ret = -1;
+            goto out;
+        }
+        h = atomic_load_explicit(&t->hash[len], memory_order_relaxed);
+    }
+    hash_insert(h, entry);
+    t->used[len]++;
+    atomic_fetch_or_explicit(&t->lens, 1ull << len, memory_order_release);
+
+out:
+    pthread_mutex_unlock(&t->lock);
+    reclaim();
+    return ret;
+}
+
+int vpn_route_del(struct vpn_route_table *t, uint32_t prefix, int len, uint32_t value) {
+    if (len < 0 || len > 32) {
+        return 0;
+    }
+    uint32_t key = prefix & vpn_route_mask(len);
+    int removed = 0;
+
+    pthread_mutex_lock(&t->lock);
+    struct vpn_route_hash *h = atomic_load_explicit(&t->hash[len], memory_order_relaxed);
+    for (unsigned int i = h ? vpn_route_slot(h, key) : 0; h; i = (i + 1) & h->mask) {
+        uint64_t slot = atomic_load_explicit(&h->slots[i], memory_order_relaxed);
+        if (slot == 0) {
+            break;
+        }
+        if ((uint32_t)slot != key || (slot & TOMBSTONE) == TOMBSTONE) {
+            continue;
+        }
+        if (value == VPN_ROUTE_NONE || (uint32_t)(slot >> 32) - 1 == value) {
+            // The slot stays taken, so probe runs through it stay intact
+            atomic_store_explicit(&h->slots[i], TOMBSTONE | key, memory_order_release);
+            t->used[len]--;
+            t->tombs[len]++;
+            removed = 1;
+            if (t->used[len] == 0) {
+                atomic_fetch_and_explicit(&t->lens, ~(1ull << len), memory_order_release);
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return removed;
+}
@@ -0,0 +1,126 @@
+/*
+ * Session and route tables for simple_vpn_server
+ *
+ * With thousands of clients, a linear scan (or a map behind a mutex) per
+ * TUN packet sinks throughput. A struct vpn_route_table maps a 32-bit key
+ * (a tunnel IP, a routed subnet or a UDP session id) to a 32-bit value (a
+ * worker, a client index, a next hop):
+ *
+ * - One open-addressing hash per prefix length in use, with linear probing.
+ *   A slot is one 64-bit word (key and value), so a probe walks adjacent
+ *   words in the same cache lines, and a reader can never see half an
+ *   entry.
+ * - vpn_route_match() does longest-prefix match: the table keeps a bitmap of
+ *   the prefix lengths that have entries, and probes them longest first. A
+ *   table of host keys (/32 only) costs one hash probe.
+ * - Lookups take no lock: writers (one at a time, under the table's mutex)
+ *   update slots with single atomic stores, and a hash that has to grow is
+ *   rebuilt on the side and published with one pointer store.
+ *
+ * The old hash of a resize can't be freed while a reader may still be
+ * probing it. Reclamation is RCU-style, with quiescent states: every thread
+ * that reads tables registers as a reader and calls vpn_route_quiescent()
+ * between wakeups, where it holds no slot pointers. A retired hash is freed
+ * once every online reader has passed a quiescent state since.
+ *
+ * Keys of prefixes are in host byte order (ntohl() of an address).
+ */
+
+#ifndef VPN_ROUTE_H
+#define VPN_ROUTE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define VPN_ROUTE_NONE UINT32_MAX       // No entry; not a valid value
+#define VPN_ROUTE_MAX_READERS 64
+
+// One hash: the slots of one prefix length
+struct vpn_route_hash {
+    unsigned int mask;                  // Slot count - 1 (a power of two minus one)
+    unsigned int shift;                 // 32 - log2(slot count)
+    _Atomic uint64_t slots[];           // (value + 1) << 32 | key; 0: empty
+};
+
+struct vpn_route_table {
+    _Atomic(struct vpn_route_hash *) hash[33];  // By prefix length, NULL until used
+    _Atomic uint64_t lens;                      // Bit n: there are /n entries
+
+    // Writer side
+    pthread_mutex_t lock;
+    unsigned int used[33];                      // Live entries per length
+    unsigned int tombs[33];                     // Deleted slots per length
+};
+
+// Returns 0, or -1 on error
+int vpn_route_init(struct vpn_route_table *t);
+
+// Free everything. No reader may use the table any more.
+void vpn_route_destroy(struct vpn_route_table *t);
+
+// Add or replace prefix/len → value. Returns 0, or -1 if out of memory.
+int vpn_route_set(struct vpn_route_table *t, uint32_t prefix, int len, uint32_t value);
+
+// Remove prefix/len, only if it maps to value (VPN_ROUTE_NONE: whatever it
+// maps to). Returns 1 if it was removed.
+int vpn_route_del(struct vpn_route_table *t, uint32_t prefix, int len, uint32_t value);
+
+static inline uint32_t vpn_route_mask(int len) {
+    return len == 0 ? 0 : UINT32_MAX << (32 - len);
+}
+
+static inline unsigned int vpn_route_slot(const struct vpn_route_hash *h, uint32_t key) {
+    return (uint32_t)(key * 2654435769u) >> h->shift;   // Fibonacci hashing
+}
+
+// The value of exactly prefix/len, or VPN_ROUTE_NONE
+static inline uint32_t vpn_route_get(const struct vpn_route_table *t, uint32_t prefix, int len) {
+    const struct vpn_route_hash *h = atomic_load_explicit(&t->hash[len], memory_order_acquire);
+    if (!h) {
+        return VPN_ROUTE_NONE;
+    }
+
+    uint32_t key = prefix & vpn_route_mask(len);
+    for (unsigned int i = vpn_route_slot(h, key); ; i = (i + 1) & h->mask) {
+        uint64_t slot = atomic_load_explicit(&h->slots[i], memory_order_acquire);
+        uint32_t stored = slot >> 32;
+        if (stored == 0) {
+            return VPN_ROUTE_NONE;              // Empty: end of the probe run
+        }
+        if ((uint32_t)slot == key && stored != UINT32_MAX) {
+            return stored - 1;
+        }
+    }
+}
+
+// Longest-prefix match of addr, or VPN_ROUTE_NONE. *len_out (if not NULL)
+// gets the length of the prefix that matched.
+static inline uint32_t vpn_route_match(const struct vpn_route_table *t, uint32_t addr,
+                                       int *len_out) {
+    uint64_t lens = atomic_load_explicit(&t->lens, memory_order_acquire);
+    while (lens) {
+        int len = 63 - __builtin_clzll(lens);
+        uint32_t value = vpn_route_get(t, addr, len);
+        if (value != VPN_ROUTE_NONE) {
+            if (len_out) {
+                *len_out = len;
+            }
+            return value;
+        }
+        lens &= ~(1ull << len);
+    }
+    return VPN_ROUTE_NONE;
+}
+
+// Register the calling thread as a table reader. Returns its reader id, or
+// -1 if there are VPN_ROUTE_MAX_READERS already.
+int vpn_route_reader_register(void);
+
+// The reader holds no pointer into any table right now
+void vpn_route_quiescent(int reader);
+
+// The reader stops reading tables (e.g. its thread exits)
+void vpn_route_reader_offline(int reader);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Data path statistics shared by simple_vpn_server and simple_vpn_client
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vpn_stats.h"
+
+int vpn_trace_every = 0;
+
+static struct vpn_stats slots[VPN_STATS_MAX];
+static atomic_int num_slots;
+
+static const char *stat_names[VPN_STAT_COUNT] = {
+    [VPN_STAT_TX_PACKETS] = "tx_packets",
+    [VPN_STAT_TX_BYTES] = "tx_bytes",
+    [VPN_STAT_TX_BATCHES] = "tx_batches",
+    [VPN_STAT_RX_PACKETS] = "rx_packets",
+    [VPN_STAT_RX_BYTES] = "rx_bytes",
+    [VPN_STAT_RX_BATCHES] = "rx_batches",
+    [VPN_STAT_DROP_NO_ROUTE] = "drop_no_route",
+    [VPN_STAT_DROP_QUEUE] = "drop_queue",
+    [VPN_STAT_DROP_AUTH] = "drop_auth",
+    [VPN_STAT_DROP_REPLAY] = "drop_replay",
+    [VPN_STAT_DROP_SOURCE] = "drop_source",
+    [VPN_STAT_CRYPTO_NS] = "crypto_ns",
+};
+
+static int report_interval;
+static int listen_fd = -1;
+
+struct vpn_stats *vpn_stats_new(const char *name) {
+    int i = atomic_fetch_add(&num_slots, 1);
+    if (i >= VPN_STATS_MAX) {
+        return NULL;
+    }
+
+    struct vpn_stats *s = &slots[i];
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    return s;
+}
+
+void vpn_stats_wakeup(struct vpn_stats *s, uint64_t start) {
+    if (!s) {
+        return;
+    }
+
+    uint64_t us = (vpn_stats_clock() - start) / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < VPN_LAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    uint64_t v = atomic_load_explicit(&s->latency[bucket], memory_order_relaxed);
+    atomic_store_explicit(&s->latency[bucket], v + 1, memory_order_relaxed);
+}
+
+static int slots_in_use(void) {
+    int n = atomic_load(&num_slots);
+    return n < VPN_STATS_MAX ? n : VPN_STATS_MAX;
+}
+
+static void sum_counters(uint64_t *total) {
+    memset(total, 0, VPN_STAT_COUNT * sizeof(*total));
+    int n = slots_in_use();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < VPN_STAT_COUNT; j++) {
+            total[j] += atomic_load_explicit(&slots[i].counters[j], memory_order_relaxed);
+        }
+    }
+}
+
+// Print the rates since the last summary, taken sec seconds ago
+static void print_summary(uint64_t *last, double sec) {
+    uint64_t now[VPN_STAT_COUNT], d[VPN_STAT_COUNT];
+
+    sum_counters(now);
+    for (int j = 0; j < VPN_STAT_COUNT; j++) {
+        d[j] = now[j] - last[j];
+        last[j] = now[j];
+    }
+
+    uint64_t drops = d[VPN_STAT_DROP_NO_ROUTE] + d[VPN_STAT_DROP_QUEUE] +
+                     d[VPN_STAT_DROP_AUTH] + d[VPN_STAT_DROP_REPLAY] +
+                     d[VPN_STAT_DROP_SOURCE];
+    printf("stats: tx %.0f pps %.1f Mbit/s, rx %.0f pps %.1f Mbit/s, "
+           "%llu drops (route %llu, queue %llu, auth %llu, replay %llu, source %llu), crypto %.1f%%\n",
+           d[VPN_STAT_TX_PACKETS] / sec, d[VPN_STAT_TX_BYTES] * 8 / sec / 1e6,
+           d[VPN_STAT_RX_PACKETS] / sec, d[VPN_STAT_RX_BYTES] * 8 / sec / 1e6,
+           (unsigned long long)drops, (unsigned long long)d[VPN_STAT_DROP_NO_ROUTE],
+           (unsigned long long)d[VPN_STAT_DROP_QUEUE], (unsigned long long)d[VPN_STAT_DROP_AUTH],
+           (unsigned long long)d[VPN_STAT_DROP_REPLAY], (unsigned long long)d[VPN_STAT_DROP_SOURCE],
+           d[VPN_STAT_CRYPTO_NS] / (sec * 1e9) * 100);
+    fflush(stdout);
+}
+
+// One "<thread>.<counter> <value>" line per counter, then the wakeup
+// histogram as "<thread>.wakeup_us_<bucket> <count>"
+static void dump_stats(int fd) {
+    FILE *f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        return;
+    }
+
+    int n = slots_in_use();
+    for (int i = 0; i < n; i++) {
+        struct vpn_stats *s = &slots[i];
+        for (int j = 0; j < VPN_STAT_COUNT; j++) {
+            fprintf(f, "%s.%s %llu\n", s->name, stat_names[j],
+                    (unsigned long long)atomic_load_explicit(&s->counters[j],
+                                                             memory_order_relaxed));
+        }
+        for (int b = 0; b < VPN_LAT_BUCKETS; b++) {
+            fprintf(f, "%s.wakeup_us_%s%u %llu\n", s->name, b == 0 ? "lt" : "",
+                    b == 0 ? 1u : 1u << (b - 1),
+                    (unsigned long long)atomic_load_explicit(&s->latency[b],
+                                                             memory_order_relaxed));
+        }
+    }
+    fclose(f);
+}
+
+static void *reporter_thread(void *arg) {
+    (void)arg;
+    uint64_t last[VPN_STAT_COUNT];
+    uint64_t interval_ns = (uint64_t)report_interval * 1000000000;
+    uint64_t last_time = vpn_stats_clock();
+
+    // Summaries are due every interval, however many dumps come in between
+    sum_counters(last);
+    for (;;) {
+        int timeout = -1;
+        if (report_interval > 0) {
+            uint64_t elapsed = vpn_stats_clock() - last_time;
+            timeout = elapsed >= interval_ns ? 0 : (int)((interval_ns - elapsed + 999999) / 1000000);
+        }
+
+        struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+        int ret = poll(&pfd, listen_fd >= 0 ? 1 : 0, timeout);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("stats poll");
+            return NULL;
+        }
+
+        // Divide by the time that really passed, not the nominal interval
+        uint64_t now = vpn_stats_clock();
+        if (report_interval > 0 && now - last_time >= interval_ns) {
+            print_summary(last, (now - last_time) / 1e9);
+            last_time = now;
+        }
+
+        if (ret > 0) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                dump_stats(fd);
+            }
+        }
+    }
+}
+
+int vpn_stats_start(int interval_sec, const char *socket_path) {
+    if (interval_sec <= 0 && !socket_path) {
+        return 0;
+    }
+    report_interval = interval_sec > 0 ? interval_sec : 0;
+
+    if (socket_path) {
+        struct sockaddr_un addr;
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Stats socket path too long: %s\n", socket_path);
+            return -1;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, socket_path);
+
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            perror("stats socket");
+            return -1;
+        }
+        unlink(socket_path);  // Left over from a previous run
+        if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(listen_fd, 4) < 0) {
+            perror("stats socket bind");
+            close(listen_fd);
+            listen_fd = -1;
+            return -1;
+        }
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, reporter_thread, NULL) != 0) {
+        fprintf(stderr, "Failed to start stats thread\n");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
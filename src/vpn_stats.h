@@ -0,0 +1,124 @@
+/*
+ * Data path statistics shared by simple_vpn_server and simple_vpn_client
+ *
+ * Logging every packet with printf() puts a terminal or journald write on
+ * the data path. Instead, every event loop thread counts what it does in a
+ * struct vpn_stats of its own: packets and bytes each way, drops by reason,
+ * time spent in crypto and how long each wakeup took to handle.
+ *
+ * - Only the owner thread writes its counters, with relaxed atomic stores:
+ *   no lock and no locked instruction on the data path.
+ * - The reporter thread (vpn_stats_start()) reads every thread's counters
+ *   with relaxed loads and sums them. It prints a summary every -s seconds
+ *   and answers each connection to the -S unix socket with a full dump:
+ *
+ *     sudo socat - UNIX-CONNECT:/run/vpn.stats
+ *
+ * - Per-packet log lines only appear in trace mode (-T N), for one packet
+ *   in N.
+ */
+
+#ifndef VPN_STATS_H
+#define VPN_STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "vpn_crypto.h"
+
+enum vpn_stat {
+    VPN_STAT_TX_PACKETS,        // TUN → peer: sealed and handed to the socket
+    VPN_STAT_TX_BYTES,
+    VPN_STAT_TX_BATCHES,
+    VPN_STAT_RX_PACKETS,        // Peer → TUN: verified and injected
+    VPN_STAT_RX_BYTES,
+    VPN_STAT_RX_BATCHES,
+    VPN_STAT_DROP_NO_ROUTE,     // No client for the destination
+    VPN_STAT_DROP_QUEUE,        // Out of buffers, or a full socket/queue
+    VPN_STAT_DROP_AUTH,         // Failed to verify
+    VPN_STAT_DROP_REPLAY,       // Duplicate or too old datagram
+    VPN_STAT_DROP_SOURCE,       // Inner source address not the client's own
+    VPN_STAT_CRYPTO_NS,         // Time in seal/open
+    VPN_STAT_COUNT
+};
+
+// Wakeup handling time histogram with power-of-two buckets in microseconds:
+// <1, 1, 2-3, 4-7, ... 16384+
+#define VPN_LAT_BUCKETS 16
+
+#define VPN_STATS_MAX 128           // Threads that can have stats
+
+struct vpn_stats {
+    char name[32];
+    _Atomic uint64_t counters[VPN_STAT_COUNT];
+    _Atomic uint64_t latency[VPN_LAT_BUCKETS];
+    unsigned int trace_count;       // Owner only
+} __attribute__((aligned(64)));
+
+// -T: log one packet in vpn_trace_every (0: none)
+extern int vpn_trace_every;
+
+// Take the stats slot for the calling loop, named e.g. "worker 0". Slots
+// are never freed, so the reporter can always read them. Returns NULL if
+// every slot is taken (the vpn_stat_*() calls accept NULL).
+struct vpn_stats *vpn_stats_new(const char *name);
+
+// Count n more of counter i. Owner thread only.
+static inline void vpn_stat_add(struct vpn_stats *s, enum vpn_stat i, uint64_t n) {
+    if (s) {
+        uint64_t v = atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+        atomic_store_explicit(&s->counters[i], v + n, memory_order_relaxed);
+    }
+}
+
+// Count a batch of n packets / bytes going one way (tx: VPN_STAT_TX_PACKETS,
+// rx: VPN_STAT_RX_PACKETS). An empty batch is not counted.
+static inline void vpn_stat_batch(struct vpn_stats *s, enum vpn_stat packets, int n,
+                                  uint64_t bytes) {
+    if (n > 0) {
+        vpn_stat_add(s, packets, n);
+        vpn_stat_add(s, packets + 1, bytes);
+        vpn_stat_add(s, packets + 2, 1);
+    }
+}
+
+static inline uint64_t vpn_stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Account the time since start (a vpn_stats_clock() value) for one wakeup
+void vpn_stats_wakeup(struct vpn_stats *s, uint64_t start);
+
+// vpn_aead_seal_batch() / vpn_aead_open_batch(), timed
+static inline void vpn_stats_seal(struct vpn_stats *s, const struct vpn_aead *aead,
+                                  struct vpn_aead_op *ops, int n) {
+    uint64_t start = vpn_stats_clock();
+    vpn_aead_seal_batch(aead, ops, n);
+    vpn_stat_add(s, VPN_STAT_CRYPTO_NS, vpn_stats_clock() - start);
+}
+
+static inline int vpn_stats_open(struct vpn_stats *s, const struct vpn_aead *aead,
+                                 struct vpn_aead_op *ops, int n) {
+    uint64_t start = vpn_stats_clock();
+    int ok = vpn_aead_open_batch(aead, ops, n);
+    vpn_stat_add(s, VPN_STAT_CRYPTO_NS, vpn_stats_clock() - start);
+    if (ok < n) {
+        vpn_stat_add(s, VPN_STAT_DROP_AUTH, n - ok);
+    }
+    return ok;
+}
+
+// Returns 1 if this packet should be logged: one in vpn_trace_every
+static inline int vpn_trace(struct vpn_stats *s) {
+    return vpn_trace_every > 0 && s && ++s->trace_count % vpn_trace_every == 0;
+}
+
+// Start the reporter thread: a summary of the last interval_sec seconds
+// every interval_sec (0: none), and a dump for every connection to the unix
+// socket at socket_path (NULL: none). Returns 0, or -1 on error.
+int vpn_stats_start(int interval_sec, const char *socket_path);
+
+#endif
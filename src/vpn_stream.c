@@ -0,0 +1,125 @@
+/*
+ * Stream reassembly for the length-prefixed TCP framing
+ */
+
+#define _GNU_SOURCE  // memfd_create()
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "vpn_stream.h"
+
+int vpn_stream_init(struct vpn_stream *s, size_t size) {
+    memset(s, 0, sizeof(*s));
+
+    // Anonymous file holding the ring's memory
+    int fd = memfd_create("vpn_stream", MFD_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Reserve 2 * size of address space, then map the same file into both
+    // halves. Writing past the end of the first half lands at the start.
+    unsigned char *base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, 2 * size);
+        close(fd);
+        return -1;
+    }
+
+    // The mappings keep the memory alive
+    close(fd);
+
+    s->base = base;
+    s->size = size;
+    return 0;
+}
+
+void vpn_stream_free(struct vpn_stream *s) {
+    if (s->base) {
+        munmap(s->base, 2 * s->size);
+        s->base = NULL;
+    }
+}
+
+ssize_t vpn_stream_fill(struct vpn_stream *s, int fd) {
+    size_t used = s->tail - s->head;
+    size_t space = s->size - used;
+
+    if (space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // Thanks to the mirror mapping, the free space is one contiguous run
+    ssize_t n = read(fd, s->base + (s->tail % s->size), space);
+    if (n > 0) {
+        s->tail += n;
+    }
+    return n;
+}
+
+size_t vpn_stream_space(struct vpn_stream *s, unsigned char **dst) {
+    *dst = s->base + (s->tail % s->size);
+    return s->size - (s->tail - s->head);
+}
+
+int vpn_stream_next_frame(struct vpn_stream *s, size_t max_len,
+                          unsigned char **payload, uint16_t *len) {
+    size_t used = s->tail - s->head;
+    unsigned char *p = s->base + (s->head % s->size);
+    uint16_t frame_len;
+
+    if (used < VPN_FRAME_HDR_SIZE) {
+        return 0;
+    }
+    memcpy(&frame_len, p, VPN_FRAME_HDR_SIZE);
+    frame_len = ntohs(frame_len);
+
+    if (frame_len == 0 || frame_len > max_len) {
+        return -1;
+    }
+    if (used < VPN_FRAME_HDR_SIZE + (size_t)frame_len) {
+        return 0;  // Rest of the frame hasn't arrived yet
+    }
+
+    *payload = p + VPN_FRAME_HDR_SIZE;
+    *len = frame_len;
+    s->head += VPN_FRAME_HDR_SIZE + frame_len;
+    return 1;
+}
+
+int vpn_stream_take(struct vpn_stream *s, size_t len, unsigned char **data) {
+    if (s->tail - s->head < len) {
+        return 0;
+    }
+    *data = s->base + (s->head % s->size);
+    s->head += len;
+    return 1;
+}
+
+int vpn_read_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = read(fd, (unsigned char *)buf + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
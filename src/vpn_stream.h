@@ -0,0 +1,71 @@
+/*
+ * Stream reassembly for the length-prefixed TCP framing
+ *
+ * TCP delivers bytes, not frames: one read() can return half a length
+ * prefix, or three frames and the start of a fourth. The receiver must
+ * therefore buffer what it got and cut frames out of it. vpn_stream does
+ * that without copying:
+ *
+ * - The buffer is a ring whose memory is mapped twice, back to back, so
+ *   base[i] and base[i + size] are the same byte. Any run of up to size
+ *   bytes starting anywhere in the ring is therefore contiguous in memory,
+ *   even when it wraps around the end.
+ * - vpn_stream_fill() reads as much as fits with one read().
+ * - vpn_stream_next_frame() returns a pointer to the next complete frame's
+ *   payload inside the ring, which can be decrypted in place and written
+ *   straight to TUN.
+ *
+ * A frame pointer stays valid until the next vpn_stream_fill().
+ */
+
+#ifndef VPN_STREAM_H
+#define VPN_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define VPN_STREAM_SIZE (128 * 1024)    // Must be a multiple of the page size, and hold a full frame
+#define VPN_FRAME_HDR_SIZE 2            // uint16_t length prefix, network order
+
+struct vpn_stream {
+    unsigned char *base;    // 2 * size bytes of address space, one size of memory
+    size_t size;
+    uint64_t head;          // Bytes consumed so far
+    uint64_t tail;          // Bytes received so far
+};
+
+// Set up the double-mapped ring. Returns 0, or -1 on error.
+int vpn_stream_init(struct vpn_stream *s, size_t size);
+
+void vpn_stream_free(struct vpn_stream *s);
+
+// One read() into all the free space. Returns the byte count, 0 on EOF,
+// or -1 on error (errno set; EAGAIN for a drained non-blocking socket).
+// Returns -1 with errno = ENOBUFS if the ring is full.
+ssize_t vpn_stream_fill(struct vpn_stream *s, int fd);
+
+// For reads issued elsewhere (io_uring): the free space, as one contiguous
+// run at *dst. Returns its size, 0 if the ring is full.
+size_t vpn_stream_space(struct vpn_stream *s, unsigned char **dst);
+
+// Account for n bytes that were read into the free space
+static inline void vpn_stream_commit(struct vpn_stream *s, size_t n) {
+    s->tail += n;
+}
+
+// Take the next complete frame. Returns 1 and sets *payload/*len, 0 if the
+// rest of the frame hasn't arrived yet, or -1 if the length prefix is 0 or
+// larger than max_len (the stream is corrupt and must be dropped).
+int vpn_stream_next_frame(struct vpn_stream *s, size_t max_len,
+                          unsigned char **payload, uint16_t *len);
+
+// Take the next len raw (unframed) bytes, e.g. the hello that opens the
+// stream. Returns 1 and sets *data, or 0 if they haven't all arrived yet.
+int vpn_stream_take(struct vpn_stream *s, size_t len, unsigned char **data);
+
+// Read exactly len bytes from a blocking socket, for the handshake before
+// the event loop starts. Returns 0, or -1 on error or EOF.
+int vpn_read_full(int fd, void *buf, size_t len);
+
+#endif
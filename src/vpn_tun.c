@@ -0,0 +1,324 @@
+/*
+ * TUN device helpers shared by simple_vpn_server and simple_vpn_client
+ *
+ * A TUN device normally has one packet queue, so one fd and one core handle
+ * every packet. With IFF_MULTI_QUEUE, every open() + TUNSETIFF on the same
+ * name attaches another queue to the same interface. The kernel picks a
+ * queue per flow (drivers/net/tun.c:tun_select_queue()) and remembers which
+ * queue last *wrote* a flow, so a reply is read from the same queue that
+ * injected the request.
+ *
+ * configure_tun_device() sets the device's address, MTU and link state over
+ * rtnetlink, so the programs can come up without anyone typing ip commands.
+ * set_tun_mtu() changes just the MTU, as the client's path MTU search does
+ * while running (vpn_mtu.h).
+ */
+
+#define _GNU_SOURCE  // CPU_SET, pthread_setaffinity_np()
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "vpn_tun.h"
+
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20     // Linux 6.2+ (older headers lack them)
+#define TUN_F_USO6 0x40
+#endif
+
+// Turn on checksum and segmentation offloads: the kernel may then hand us
+// (and take from us) partially checksummed packets and super-packets.
+// Returns the VPN_GSO_* types enabled, or -1 if the kernel refuses.
+static int enable_offloads(int tun_fd) {
+    unsigned int tso = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+    int le = 1;
+
+    // The header's byte order is fixed, so peers of either endianness agree
+    if (ioctl(tun_fd, TUNSETVNETLE, &le) < 0) {
+        return -1;
+    }
+
+    // USO4 and USO6 only come as a pair; older kernels reject both
+    if (ioctl(tun_fd, TUNSETOFFLOAD, tso | TUN_F_USO4 | TUN_F_USO6) == 0) {
+        return VPN_GSO_TCPV4 | VPN_GSO_TCPV6 | VPN_GSO_UDP;
+    }
+    if (ioctl(tun_fd, TUNSETOFFLOAD, tso) == 0) {
+        return VPN_GSO_TCPV4 | VPN_GSO_TCPV6;
+    }
+    return -1;
+}
+
+// Open one queue of the TUN device called dev_name (created if missing)
+static int open_tun_queue(char *dev_name, short extra_flags, int *gso_types) {
+    struct ifreq ifr;
+    int tun_fd;
+
+    // Open the TUN device
+    tun_fd = open(TUN_DEVICE, O_RDWR);
+    if (tun_fd < 0) {
+        perror("Failed to open /dev/net/tun");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+
+    // IFF_TUN: TUN device (Layer 3, IP packets)
+    // IFF_NO_PI: No packet information (just raw IP packets)
+    // IFF_VNET_HDR: a virtio-net header in front of each packet (offloads)
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | extra_flags | (gso_types ? IFF_VNET_HDR : 0);
+    strncpy(ifr.ifr_name, dev_name, IFNAMSIZ - 1);
+
+    // Create the TUN interface, or attach another queue to it
+    if (ioctl(tun_fd, TUNSETIFF, (void *)&ifr) < 0) {
+        perror("Failed to configure TUN device");
+        close(tun_fd);
+        return -1;
+    }
+
+    if (gso_types) {
+        *gso_types = enable_offloads(tun_fd);
+        if (*gso_types < 0) {
+            perror("Failed to enable TUN offloads");
+            close(tun_fd);
+            return -1;
+        }
+    }
+
+    strncpy(dev_name, ifr.ifr_name, IFNAMSIZ);
+    return tun_fd;
+}
+
+static void print_offloads(const int *gso_types) {
+    if (gso_types) {
+        printf("[TUN] Offloads on: %s%s%s\n",
+               (*gso_types & VPN_GSO_TCPV4) ? "tso4 " : "",
+               (*gso_types & VPN_GSO_TCPV6) ? "tso6 " : "",
+               (*gso_types & VPN_GSO_UDP) ? "uso" : "");
+    }
+}
+
+int create_tun_device(char *dev_name, int *gso_types) {
+    int tun_fd = open_tun_queue(dev_name, 0, gso_types);
+    if (tun_fd < 0) {
+        return -1;
+    }
+
+    printf("[TUN] Created TUN device: %s\n", dev_name);
+    print_offloads(gso_types);
+    return tun_fd;
+}
+
+int create_tun_queues(char *dev_name, int num_queues, int *fds, int *gso_types) {
+    if (num_queues < 1 || num_queues > MAX_TUN_QUEUES) {
+        fprintf(stderr, "[TUN] Queue count must be 1..%d\n", MAX_TUN_QUEUES);
+        return -1;
+    }
+
+    for (int i = 0; i < num_queues; i++) {
+        // The first queue creates the device; the rest attach to it by name
+        fds[i] = open_tun_queue(dev_name, IFF_MULTI_QUEUE, gso_types);
+        if (fds[i] < 0) {
+            while (i-- > 0) {
+                close(fds[i]);
+            }
+            return -1;
+        }
+    }
+
+    printf("[TUN] Created TUN device: %s (%d queues)\n", dev_name, num_queues);
+    print_offloads(gso_types);
+    return 0;
+}
+
+// A netlink request with room for a few attributes
+struct nl_request {
+    struct nlmsghdr nh;
+    union {
+        struct ifaddrmsg ifa;
+        struct ifinfomsg ifi;
+    };
+    unsigned char attrs[64];
+};
+
+static void nl_add_attr(struct nl_request *req, int type, const void *data, int len) {
+    struct rtattr *rta = (struct rtattr *)((char *)req + NLMSG_ALIGN(req->nh.nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    req->nh.nlmsg_len = NLMSG_ALIGN(req->nh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+// Send req and wait for the kernel's answer. Returns 0, or -1 with errno set.
+static int nl_talk(int fd, struct nl_request *req) {
+    static unsigned int seq;
+    union {
+        struct nlmsghdr nh;
+        unsigned char buf[512];
+    } ack;
+
+    req->nh.nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    req->nh.nlmsg_seq = ++seq;
+    if (send(fd, req, req->nh.nlmsg_len, 0) < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        int n = recv(fd, &ack, sizeof(ack), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (struct nlmsghdr *nh = &ack.nh; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_seq != req->nh.nlmsg_seq || nh->nlmsg_type != NLMSG_ERROR) {
+                continue;
+            }
+            const struct nlmsgerr *err = NLMSG_DATA(nh);
+            if (err->error) {
+                errno = -err->error;
+                return -1;
+            }
+            return 0;
+        }
+    }
+}
+
+int configure_tun_device(const char *dev_name, const char *cidr, int mtu) {
+    char addr_str[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    int prefix_len, end = 0;
+
+    if (sscanf(cidr, "%15[0-9.]/%d%n", addr_str, &prefix_len, &end) != 2 ||
+        cidr[end] != '\0' || prefix_len < 1 || prefix_len > 32 ||
+        inet_pton(AF_INET, addr_str, &addr) != 1) {
+        fprintf(stderr, "[TUN] Bad address %s (want e.g. 10.8.0.1/24)\n", cidr);
+        return -1;
+    }
+
+    struct ifreq ifr;
+    int ctl_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev_name, IFNAMSIZ - 1);
+    if (ctl_fd < 0 || ioctl(ctl_fd, SIOCGIFINDEX, &ifr) < 0) {
+        perror("[TUN] Failed to look up the device");
+        if (ctl_fd >= 0) close(ctl_fd);
+        return -1;
+    }
+    close(ctl_fd);
+
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        perror("[TUN] Failed to open rtnetlink");
+        return -1;
+    }
+
+    // ip addr replace ADDR/LEN dev DEV: local and peer address are the same,
+    // and the kernel adds the route to the subnet
+    struct nl_request req;
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+    req.nh.nlmsg_type = RTM_NEWADDR;
+    req.nh.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+    req.ifa.ifa_family = AF_INET;
+    req.ifa.ifa_prefixlen = prefix_len;
+    req.ifa.ifa_index = ifr.ifr_ifindex;
+    nl_add_attr(&req, IFA_LOCAL, &addr, sizeof(addr));
+    nl_add_attr(&req, IFA_ADDRESS, &addr, sizeof(addr));
+    if (nl_talk(fd, &req) < 0) {
+        perror("[TUN] Failed to set the address");
+        close(fd);
+        return -1;
+    }
+
+    // ip link set DEV [mtu MTU] up
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_type = RTM_NEWLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifr.ifr_ifindex;
+    req.ifi.ifi_flags = IFF_UP;
+    req.ifi.ifi_change = IFF_UP;
+    if (mtu > 0) {
+        unsigned int value = mtu;
+        nl_add_attr(&req, IFLA_MTU, &value, sizeof(value));
+    }
+    if (nl_talk(fd, &req) < 0) {
+        perror("[TUN] Failed to bring the device up");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (mtu > 0) {
+        printf("[TUN] %s: %s, mtu %d, up\n", dev_name, cidr, mtu);
+    } else {
+        printf("[TUN] %s: %s, up\n", dev_name, cidr);
+    }
+    return 0;
+}
+
+// SIOCGIFMTU or SIOCSIFMTU on the device called dev_name; any socket does
+static int tun_mtu_ioctl(const char *dev_name, unsigned long req, int *mtu) {
+    struct ifreq ifr;
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev_name, IFNAMSIZ - 1);
+    ifr.ifr_mtu = *mtu;
+    int ret = ioctl(fd, req, &ifr);
+    close(fd);
+    *mtu = ifr.ifr_mtu;
+    return ret;
+}
+
+int get_tun_mtu(const char *dev_name) {
+    int mtu = 0;
+    return tun_mtu_ioctl(dev_name, SIOCGIFMTU, &mtu) < 0 ? -1 : mtu;
+}
+
+int set_tun_mtu(const char *dev_name, int mtu) {
+    return tun_mtu_ioctl(dev_name, SIOCSIFMTU, &mtu);
+}
+
+int pin_thread_to_cpu(int index) {
+    cpu_set_t allowed, one;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return -1;
+    }
+
+    int count = CPU_COUNT(&allowed);
+    if (count == 0) {
+        return -1;
+    }
+
+    // Walk to the (index % count)-th allowed CPU
+    int want = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (want-- > 0) continue;
+
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(one), &one) != 0) {
+            return -1;
+        }
+        return cpu;
+    }
+    return -1;
+}
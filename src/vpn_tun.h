@@ -0,0 +1,50 @@
+/*
+ * TUN device helpers shared by simple_vpn_server and simple_vpn_client
+ */
+
+#ifndef VPN_TUN_H
+#define VPN_TUN_H
+
+#define TUN_DEVICE "/dev/net/tun"
+#define MAX_TUN_QUEUES 64
+
+// With offloads on, every packet read or written is preceded by a
+// struct virtio_net_hdr (see vpn_offload.h)
+#define VPN_VNET_HDR_SIZE 10
+
+// Super-packet types the device hands us (and a peer takes whole)
+#define VPN_GSO_TCPV4 0x01
+#define VPN_GSO_TCPV6 0x02
+#define VPN_GSO_UDP   0x04      // USO, IPv4 and IPv6 (Linux 6.2+)
+
+// Create a single-queue TUN device. dev_name is updated with the name the
+// kernel picked. With gso_types non-NULL, the device is opened with
+// IFF_VNET_HDR and TSO/USO offloads, and *gso_types is set to the
+// super-packet types the kernel agreed to. Returns the TUN fd, or -1 on
+// error.
+int create_tun_device(char *dev_name, int *gso_types);
+
+// Create a multi-queue TUN device (IFF_MULTI_QUEUE) and open num_queues
+// fds on it. Each fd is an independent packet queue: the kernel spreads
+// flows across them, so each can be served by its own thread. gso_types
+// works as for create_tun_device().
+// Returns 0 on success, -1 on error (no fds are left open).
+int create_tun_queues(char *dev_name, int num_queues, int *fds, int *gso_types);
+
+// Give the TUN device called dev_name the address in cidr (e.g.
+// "10.8.0.1/24"), set its MTU (unless mtu is 0) and bring it up, all over
+// rtnetlink: what "ip addr add" and "ip link set up" do. Returns 0, or -1 on
+// error (a message has been printed).
+int configure_tun_device(const char *dev_name, const char *cidr, int mtu);
+
+// Get or set the MTU of the device called dev_name (SIOCGIFMTU/SIOCSIFMTU).
+// get_tun_mtu() returns the MTU, or -1 on error; set_tun_mtu() returns 0, or
+// -1 on error.
+int get_tun_mtu(const char *dev_name);
+int set_tun_mtu(const char *dev_name, int mtu);
+
+// Pin the calling thread to the index-th CPU it is allowed to run on
+// (wrapping around). Returns the CPU number, or -1 on error.
+int pin_thread_to_cpu(int index);
+
+#endif
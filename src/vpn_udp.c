@@ -0,0 +1,85 @@
+/*
+ * UDP datagram transport shared by simple_vpn_server and simple_vpn_client
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/random.h>
+
+#include "vpn_udp.h"
+
+void vpn_udp_build_hdr(struct vpn_udp_hdr *hdr, uint8_t type, uint32_t session_id, uint64_t seq) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = type;
+    hdr->session_id = htonl(session_id);
+    hdr->seq = htobe64(seq);
+}
+
+int vpn_udp_parse_hdr(const unsigned char *buf, int len, uint32_t *session_id, uint64_t *seq) {
+    struct vpn_udp_hdr hdr;
+
+    if (len < VPN_UDP_HDR_SIZE) {
+        return -1;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    if (hdr.type < VPN_UDP_DATA || hdr.type > VPN_UDP_TYPE_MAX) {
+        return -1;
+    }
+
+    *session_id = ntohl(hdr.session_id);
+    *seq = be64toh(hdr.seq);
+    return *session_id ? hdr.type : -1;
+}
+
+int vpn_replay_check(const struct vpn_replay_window *win, uint64_t seq) {
+    // Sequence numbers start at 1, so a fresh (all-zero) window accepts
+    // everything from 1 up
+    if (seq == 0) {
+        return 0;
+    }
+    if (seq > win->top) {
+        return 1;  // Ahead of the window: always new
+    }
+    if (win->top - seq >= REPLAY_WINDOW_SIZE) {
+        return 0;  // Fell off the back of the window
+    }
+
+    uint64_t word = (seq / 64) % REPLAY_WORDS;
+    uint64_t bit = seq % 64;
+    return !(win->bitmap[word] & (1ULL << bit));
+}
+
+void vpn_replay_update(struct vpn_replay_window *win, uint64_t seq) {
+    if (seq > win->top) {
+        // Slide the window: clear every word between the old top's word
+        // and the new one (all of them if we jumped a whole window)
+        uint64_t cur = win->top / 64;
+        uint64_t new = seq / 64;
+        uint64_t diff = new - cur;
+        if (diff > REPLAY_WORDS) {
+            diff = REPLAY_WORDS;
+        }
+        for (uint64_t i = 1; i <= diff; i++) {
+            win->bitmap[(cur + i) % REPLAY_WORDS] = 0;
+        }
+        win->top = seq;
+    }
+
+    win->bitmap[(seq / 64) % REPLAY_WORDS] |= 1ULL << (seq % 64);
+}
+
+uint32_t vpn_udp_new_session_id(void) {
+    uint32_t id = 0;
+
+    while (id == 0) {
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+            // No entropy source: fall back to something unlikely to collide
+            id = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+        }
+    }
+    return id;
+}
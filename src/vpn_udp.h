@@ -0,0 +1,125 @@
+/*
+ * UDP datagram transport shared by simple_vpn_server and simple_vpn_client
+ *
+ * Tunneling IP over a TCP stream means an inner TCP flow is stacked on an
+ * outer one: a single lost segment stalls every tunneled flow until the outer
+ * TCP retransmits it (head-of-line blocking), and both layers back off at
+ * once (TCP-over-TCP meltdown). Over UDP every tunneled packet is its own
+ * datagram, so a loss only costs that packet and the inner flow recovers on
+ * its own.
+ *
+ * Datagram layout:
+ *
+ *   0       1               4               8                       16
+ *   +-------+---------------+---------------+-----------------------+---------
+ *   | type  |   reserved    |  session id   |   sequence number     | payload
+ *   +-------+---------------+---------------+-----------------------+---------
+ *
+ * The session id names the tunnel independently of the outer address, so a
+ * client that changes IP/port (NAT rebinding, roaming) keeps its session.
+ * The sequence number increases by one per datagram and direction; the
+ * receiver keeps a sliding window of seen numbers to drop replays.
+ *
+ * A session starts with a HELLO from the client, which the server answers
+ * with a HELLO of its own (payload: struct vpn_hello, see vpn_crypto.h).
+ * HELLOs aren't authenticated, so anyone can send one from a forged source
+ * address: the client's is padded with zeros to the size of the answer
+ * (VPN_UDP_HELLO_SIZE), and a shorter one is ignored, so that the server
+ * never sends more to a forged address than it got.
+ * After that, DATA and KEEPALIVE payloads are sealed with the session key:
+ * the encrypted packet (empty for a keepalive) and a 16-byte tag, with the
+ * header as associated data and the sequence number as the nonce counter.
+ * Nothing about a session - its address, its replay window - changes until
+ * a datagram's tag has verified.
+ *
+ * The server's HELLO also carries a session ticket (vpn_crypto.h). When the
+ * server has no session for a DATA or KEEPALIVE - it restarted, or it
+ * expired the session - it says so with a RETRY. A client holding a ticket
+ * then starts a new session with RESUME (payload: struct vpn_resume and a
+ * tag over the whole datagram, sealed with the resumed key and sequence
+ * number 0) and keeps sending DATA right behind it, without waiting for
+ * the answer:
+ *
+ *   client                       server
+ *   DATA ----------------------> (unknown session)
+ *        <---------------------- RETRY
+ *   RESUME, DATA, DATA... -----> session back, packets delivered
+ *        <---------------------- RESUME (a tag: resumed), DATA...
+ *
+ * The client repeats its RESUME until answered, like a HELLO. A refused
+ * ticket gets a RETRY that says so, and the client falls back to HELLO.
+ *
+ * A PROBE is a sealed KEEPALIVE padded to a size the client wants to know
+ * the path carries (vpn_mtu.h). The server answers every one it gets with a
+ * sealed PROBE whose payload is the UDP payload size it received, as a
+ * 16-bit big-endian number.
+ */
+
+#ifndef VPN_UDP_H
+#define VPN_UDP_H
+
+#include <stdint.h>
+
+#include "vpn_crypto.h"
+
+#define VPN_UDP_HDR_SIZE 16
+
+// HELLO payload, both ways: struct vpn_hello, then the server's ticket or
+// the client's padding
+#define VPN_UDP_HELLO_SIZE (VPN_HELLO_SIZE + VPN_TICKET_SIZE)
+
+// Datagram types
+#define VPN_UDP_DATA      1   // Payload is one tunneled IP packet
+#define VPN_UDP_KEEPALIVE 2   // No packet; keeps NAT mappings and the session alive
+#define VPN_UDP_HELLO     3   // Session setup, see vpn_crypto.h
+#define VPN_UDP_RESUME    4   // Session setup from a ticket
+#define VPN_UDP_RETRY     5   // Server: no such session; payload is the reason
+#define VPN_UDP_PROBE     6   // Path MTU probe: padding, or (server) the size that got through
+#define VPN_UDP_TYPE_MAX  6
+
+// RETRY reasons
+#define VPN_RETRY_NO_SESSION 0  // Resume (or say HELLO again)
+#define VPN_RETRY_TICKET     1  // The ticket was refused: say HELLO
+
+#define VPN_UDP_KEEPALIVE_SEC 15   // Client sends a keepalive after this much silence
+#define VPN_UDP_SESSION_TIMEOUT 120 // Server forgets sessions silent for this long
+#define VPN_UDP_HELLO_RETRY_SEC 1   // Client resends its HELLO until answered
+
+struct vpn_udp_hdr {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t session_id;    // Network byte order
+    uint64_t seq;           // Network byte order
+} __attribute__((packed));
+
+// Replay window: the highest sequence number seen plus a bitmap of the
+// REPLAY_WINDOW_SIZE numbers below it. The bitmap is a ring of 64-bit words
+// (the RFC 6479 layout), so sliding forward only clears whole words instead
+// of shifting the whole bitmap.
+#define REPLAY_WORDS 32
+#define REPLAY_WINDOW_SIZE ((REPLAY_WORDS - 1) * 64)
+
+struct vpn_replay_window {
+    uint64_t top;                   // Highest accepted sequence number
+    uint64_t bitmap[REPLAY_WORDS];
+};
+
+// Fill in a header. seq is host order.
+void vpn_udp_build_hdr(struct vpn_udp_hdr *hdr, uint8_t type, uint32_t session_id, uint64_t seq);
+
+// Validate a received datagram's header. Returns the datagram type, or -1
+// if it is too short or of unknown type. session_id/seq are host order.
+int vpn_udp_parse_hdr(const unsigned char *buf, int len, uint32_t *session_id, uint64_t *seq);
+
+// Returns 1 if seq is new (inside the window and not seen, or ahead of it),
+// 0 if it is a replay or too old. Does not modify the window.
+int vpn_replay_check(const struct vpn_replay_window *win, uint64_t seq);
+
+// Record seq as seen. Call only after vpn_replay_check() accepted it and the
+// packet was otherwise valid, so forged packets can't advance the window.
+void vpn_replay_update(struct vpn_replay_window *win, uint64_t seq);
+
+// Random non-zero session id
+uint32_t vpn_udp_new_session_id(void);
+
+#endif
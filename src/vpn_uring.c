@@ -0,0 +1,179 @@
+/*
+ * Minimal io_uring wrapper for simple_vpn_server's -m uring engine
+ */
+
+#define _GNU_SOURCE  // syscall()
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "vpn_uring.h"
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags, void *arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+int vpn_uring_init(struct vpn_uring *u, unsigned int entries) {
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    // Only the thread that set up the ring uses it: let the kernel run
+    // completion work when we wait, instead of interrupting us for it.
+    // Older kernels (before 6.1) don't know the flags.
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        errno = ENOSYS;  // Wait timeouts need Linux 5.11
+        return -1;
+    }
+    u->fd = fd;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->sq_ring == MAP_FAILED) u->sq_ring = NULL;
+        if (u->cq_ring == MAP_FAILED) u->cq_ring = NULL;
+        if (u->sqes == MAP_FAILED) u->sqes = NULL;
+        vpn_uring_free(u);
+        return -1;
+    }
+
+    unsigned char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_entries = p.sq_entries;
+    u->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+    u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    u->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+    u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sqe_tail = *u->sq_tail;
+
+    // SQ slot i always holds SQE i, so the index array is set up once
+    for (unsigned int i = 0; i < p.sq_entries; i++) {
+        u->sq_array[i] = i;
+    }
+    return 0;
+}
+
+void vpn_uring_free(struct vpn_uring *u) {
+    if (u->sqes) {
+        munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (u->sq_ring) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->cq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+struct io_uring_sqe *vpn_uring_sqe(struct vpn_uring *u) {
+    while (u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        int ret = vpn_uring_submit_wait(u, 0, -1);
+        if (ret < 0 && ret != -EINTR && ret != -EBUSY) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqe_tail++;
+    return sqe;
+}
+
+int vpn_uring_submit_wait(struct vpn_uring *u, unsigned int wait_nr, int timeout_ms) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {0};
+    unsigned int flags = 0;
+    void *argp = NULL;
+    size_t arg_size = 0;
+
+    // Publish the SQEs queued since the last call
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    unsigned int to_submit = u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (wait_nr > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            arg_size = sizeof(arg);
+        }
+    }
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+
+    if (uring_enter(u->fd, to_submit, wait_nr, flags, argp, arg_size) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+int vpn_uring_register_buffers(struct vpn_uring *u, const struct iovec *iov, unsigned int n) {
+    return syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, n) < 0 ? -1 : 0;
+}
+
+int vpn_uring_bufring_init(struct vpn_uring *u, struct vpn_uring_bufring *r,
+                           unsigned short bgid, unsigned int entries) {
+    size_t size = entries * sizeof(struct io_uring_buf);
+
+    memset(r, 0, sizeof(*r));
+    r->br = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        return -1;
+    }
+    r->entries = entries;
+    r->bgid = bgid;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)r->br,
+        .ring_entries = entries,
+        .bgid = bgid,
+    };
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        vpn_uring_bufring_free(r);
+        return -1;
+    }
+    return 0;
+}
+
+void vpn_uring_bufring_free(struct vpn_uring_bufring *r) {
+    if (r->br) {
+        munmap(r->br, r->entries * sizeof(struct io_uring_buf));
+        r->br = NULL;
+    }
+}
@@ -0,0 +1,116 @@
+/*
+ * Minimal io_uring wrapper for simple_vpn_server's -m uring engine
+ *
+ * io_uring replaces "wait for readiness, then do the I/O" with "queue the
+ * I/O, then collect the results": requests go into a submission queue (SQ)
+ * and results come back on a completion queue (CQ), both rings shared with
+ * the kernel. A whole batch of requests is submitted, and its completions
+ * waited for, with a single io_uring_enter().
+ *
+ * This is just the part of liburing the VPN needs, on top of the raw
+ * syscalls, so there is nothing to install:
+ *
+ * - vpn_uring_sqe() / vpn_uring_submit_wait() queue requests and submit
+ *   them, optionally waiting for completions with a timeout.
+ * - vpn_uring_peek() / vpn_uring_seen() walk the completions.
+ * - vpn_uring_register_buffers() registers memory up front, so fixed
+ *   buffer reads (IORING_OP_READ_FIXED) skip pinning it on every request.
+ * - struct vpn_uring_bufring is a provided buffer ring: buffers the kernel
+ *   picks from for multishot receives, one completion per datagram.
+ *
+ * Needs Linux 6.0+ (multishot recvmsg).
+ */
+
+#ifndef VPN_URING_H
+#define VPN_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct vpn_uring {
+    int fd;
+    unsigned int sq_mask, cq_mask;
+    unsigned int *sq_head, *sq_tail, *sq_array;
+    unsigned int *cq_head, *cq_tail;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sqe_tail;          // Queued by us, not yet published to the kernel
+    unsigned int sq_entries;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+};
+
+// A provided buffer ring (group bgid): the kernel takes a buffer from it for
+// each datagram a multishot receive completes
+struct vpn_uring_bufring {
+    struct io_uring_buf_ring *br;
+    unsigned int entries;           // Power of two
+    unsigned short bgid;
+    unsigned short tail;            // Added by us, not yet published
+};
+
+// Set up a ring with room for entries requests. Returns 0, or -1 on error
+// (errno set).
+int vpn_uring_init(struct vpn_uring *u, unsigned int entries);
+
+void vpn_uring_free(struct vpn_uring *u);
+
+// Take a zeroed SQE to fill in. The SQ is submitted first if it is full.
+struct io_uring_sqe *vpn_uring_sqe(struct vpn_uring *u);
+
+// Submit the queued SQEs and wait until at least wait_nr completions are
+// there, or timeout_ms has passed (-1: no timeout). Returns 0, or -errno
+// (-ETIME for a timeout, -EINTR for a signal).
+int vpn_uring_submit_wait(struct vpn_uring *u, unsigned int wait_nr, int timeout_ms);
+
+// The next completion, or NULL if there is none yet
+static inline struct io_uring_cqe *vpn_uring_peek(struct vpn_uring *u) {
+    unsigned int head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &u->cqes[head & u->cq_mask];
+}
+
+// Done with the completion vpn_uring_peek() returned: its slot can be reused
+static inline void vpn_uring_seen(struct vpn_uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Register n buffers for fixed buffer I/O (buf_index 0..n-1). Their pages
+// are pinned until the ring is freed. Returns 0, or -1 on error.
+int vpn_uring_register_buffers(struct vpn_uring *u, const struct iovec *iov, unsigned int n);
+
+// Set up and register an empty buffer ring. Returns 0, or -1 on error.
+int vpn_uring_bufring_init(struct vpn_uring *u, struct vpn_uring_bufring *r,
+                           unsigned short bgid, unsigned int entries);
+
+void vpn_uring_bufring_free(struct vpn_uring_bufring *r);
+
+// Hand a buffer (back) to the kernel; it shows up in completions as bid.
+// Nothing is visible to the kernel until vpn_uring_bufring_publish().
+static inline void vpn_uring_bufring_add(struct vpn_uring_bufring *r, void *addr,
+                                         unsigned int len, unsigned short bid) {
+    struct io_uring_buf *buf = &r->br->bufs[r->tail & (r->entries - 1)];
+    buf->addr = (uintptr_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+    r->tail++;
+}
+
+static inline void vpn_uring_bufring_publish(struct vpn_uring_bufring *r) {
+    __atomic_store_n(&r->br->tail, r->tail, __ATOMIC_RELEASE);
+}
+
+// Buffer id of a completion that took a buffer from a ring, or -1
+static inline int vpn_uring_cqe_bid(const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        return -1;
+    }
+    return cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+}
+
+#endif
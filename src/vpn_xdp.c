@@ -0,0 +1,448 @@
+/*
+ * AF_XDP receive path for simple_vpn_server (-X)
+ */
+
+#define _GNU_SOURCE  // syscall()
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "vpn_xdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XSK_COMP_RING_SIZE 64           // Required by the kernel, unused: we never send
+#define FRAME_HEADERS (ETH_HLEN + 20 + 8)  // Ethernet, IPv4 without options, UDP
+
+static int bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// =============================================================================
+// XDP PROGRAM
+// =============================================================================
+
+#define INSN(code, dst, src, off, imm) ((struct bpf_insn){(code), (dst), (src), (off), (imm)})
+#define MOV_REG(dst, src) INSN(BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define MOV_IMM(dst, imm) INSN(BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define ADD_IMM(dst, imm) INSN(BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, imm)
+#define AND_IMM(dst, imm) INSN(BPF_ALU64 | BPF_AND | BPF_K, dst, 0, 0, imm)
+#define LOAD(size, dst, src, off) INSN(BPF_LDX | BPF_MEM | (size), dst, src, off, 0)
+#define MAP_FD(dst, fd) INSN(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd), \
+                        INSN(0, 0, 0, 0, 0)
+#define CALL(helper) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, helper)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+// 32-bit compare: a 64-bit one would sign-extend imm
+#define SKIP_IF_EQ32(dst, imm, skip) INSN(BPF_JMP32 | BPF_JEQ | BPF_K, dst, 0, skip, imm)
+// Jumps with no offset go to the program's last two instructions, which
+// pass the frame on; load_program() fills it in
+#define PASS() INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0)
+#define PASS_IF_GT_REG(dst, src) INSN(BPF_JMP | BPF_JGT | BPF_X, dst, src, 0, 0)
+#define PASS_IF_NE(dst, imm) INSN(BPF_JMP | BPF_JNE | BPF_K, dst, 0, 0, imm)
+
+// Load the program: IPv4 UDP to one of addrs (network order) and port,
+// without options and not a fragment, goes to the XSK in map_fd for the
+// frame's queue, everything else up the stack. Returns its fd, or -1.
+static int load_program(int map_fd, const uint32_t *addrs, int num_addrs, int port) {
+    struct bpf_insn head[] = {
+        MOV_REG(BPF_REG_6, BPF_REG_1),
+        LOAD(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data)),
+        LOAD(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end)),
+        MOV_REG(BPF_REG_4, BPF_REG_2),
+        ADD_IMM(BPF_REG_4, FRAME_HEADERS),
+        PASS_IF_GT_REG(BPF_REG_4, BPF_REG_3),
+        // Loads are in network byte order, compared with network byte order
+        LOAD(BPF_H, BPF_REG_4, BPF_REG_2, 12),                  // EtherType
+        PASS_IF_NE(BPF_REG_4, htons(ETH_P_IP)),
+        LOAD(BPF_B, BPF_REG_4, BPF_REG_2, ETH_HLEN),            // Version, header length
+        PASS_IF_NE(BPF_REG_4, 0x45),
+        LOAD(BPF_B, BPF_REG_4, BPF_REG_2, ETH_HLEN + 9),        // Protocol
+        PASS_IF_NE(BPF_REG_4, IPPROTO_UDP),
+        LOAD(BPF_H, BPF_REG_4, BPF_REG_2, ETH_HLEN + 6),        // More fragments, offset
+        AND_IMM(BPF_REG_4, htons(0x3fff)),
+        PASS_IF_NE(BPF_REG_4, 0),
+        LOAD(BPF_H, BPF_REG_4, BPF_REG_2, ETH_HLEN + 20 + 2),   // Destination port
+        PASS_IF_NE(BPF_REG_4, htons(port)),
+        LOAD(BPF_W, BPF_REG_4, BPF_REG_2, ETH_HLEN + 16),       // Destination address
+    };
+    struct bpf_insn tail[] = {
+        // bpf_redirect_map(map, rx_queue_index, XDP_PASS if no XSK there)
+        LOAD(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, rx_queue_index)),
+        MAP_FD(BPF_REG_1, map_fd),
+        MOV_IMM(BPF_REG_3, XDP_PASS),
+        CALL(BPF_FUNC_redirect_map),
+        EXIT(),
+        MOV_IMM(BPF_REG_0, XDP_PASS),
+        EXIT(),
+    };
+    struct bpf_insn prog[sizeof(head) / sizeof(head[0]) + VPN_XDP_MAX_ADDRS + 1 +
+                         sizeof(tail) / sizeof(tail[0])];
+    int count = 0;
+
+    // One of ours: skip over the rest and the PASS() behind them
+    memcpy(prog, head, sizeof(head));
+    count += sizeof(head) / sizeof(head[0]);
+    for (int i = 0; i < num_addrs; i++) {
+        prog[count++] = SKIP_IF_EQ32(BPF_REG_4, (int32_t)addrs[i], num_addrs - i);
+    }
+    prog[count++] = PASS();
+    memcpy(prog + count, tail, sizeof(tail));
+    count += sizeof(tail) / sizeof(tail[0]);
+
+    int pass = count - 2;
+    for (int i = 0; i < pass; i++) {
+        int jmp = BPF_CLASS(prog[i].code) == BPF_JMP && BPF_OP(prog[i].code) != BPF_CALL &&
+                  BPF_OP(prog[i].code) != BPF_EXIT;
+        if (jmp && prog[i].off == 0) {
+            prog[i].off = pass - (i + 1);
+        }
+    }
+
+    char verifier_log[16384] = "";
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = (uintptr_t)prog;
+    attr.insn_cnt = count;
+    attr.license = (uintptr_t)"GPL";
+    attr.log_buf = (uintptr_t)verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+
+    int fd = bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+        perror("[XDP] Failed to load the XDP program");
+        if (verifier_log[0]) {
+            fprintf(stderr, "%s", verifier_log);
+        }
+    }
+    return fd;
+}
+
+// Count the interface's RX queues; 1 if sysfs doesn't say
+static int count_rx_queues(const char *ifname) {
+    char path[64];
+    int count = 0;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 1;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, "rx-", 3) == 0) {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count > 0 ? count : 1;
+}
+
+// The interface's IPv4 addresses (network order), up to max. Returns how
+// many, or -1.
+static int local_addrs(const char *ifname, uint32_t *addrs, int max) {
+    struct ifaddrs *list;
+    int count = 0;
+
+    if (getifaddrs(&list) < 0) {
+        return -1;
+    }
+    for (struct ifaddrs *ifa = list; ifa && count < max; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+            strcmp(ifa->ifa_name, ifname) == 0) {
+            addrs[count++] = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
+        }
+    }
+    freeifaddrs(list);
+    return count;
+}
+
+int vpn_xdp_attach(struct vpn_xdp *x, const char *ifname, uint32_t addr, int port) {
+    uint32_t addrs[VPN_XDP_MAX_ADDRS] = {addr};
+    int num_addrs = 1;
+    union bpf_attr attr;
+
+    memset(x, 0, sizeof(*x));
+    x->prog_fd = x->map_fd = x->link_fd = -1;
+
+    x->ifindex = if_nametoindex(ifname);
+    if (x->ifindex == 0) {
+        fprintf(stderr, "[XDP] No interface %s\n", ifname);
+        return -1;
+    }
+    x->rx_queues = count_rx_queues(ifname);
+
+    // Only datagrams to us: others for the port may be passing through
+    if (addr == htonl(INADDR_ANY)) {
+        num_addrs = local_addrs(ifname, addrs, VPN_XDP_MAX_ADDRS);
+        if (num_addrs <= 0) {
+            fprintf(stderr, "[XDP] %s has no IPv4 address\n", ifname);
+            return -1;
+        }
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = VPN_XSK_MAX_QUEUES;
+    x->map_fd = bpf(BPF_MAP_CREATE, &attr);
+    if (x->map_fd < 0) {
+        perror("[XDP] Failed to create the XSKMAP (needs root, Linux 5.9+)");
+        vpn_xdp_detach(x);
+        return -1;
+    }
+
+    x->prog_fd = load_program(x->map_fd, addrs, num_addrs, port);
+    if (x->prog_fd < 0) {
+        vpn_xdp_detach(x);
+        return -1;
+    }
+
+    // Native mode if the driver has XDP support, else generic
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = x->prog_fd;
+    attr.link_create.target_ifindex = x->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    x->link_fd = bpf(BPF_LINK_CREATE, &attr);
+    if (x->link_fd < 0 && errno != EBUSY && errno != EEXIST) {
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        x->link_fd = bpf(BPF_LINK_CREATE, &attr);
+        x->generic = 1;
+    }
+    if (x->link_fd < 0) {
+        fprintf(stderr, "[XDP] Failed to attach to %s: %s%s\n", ifname, strerror(errno),
+                errno == EBUSY || errno == EEXIST ? " (another XDP program is attached)" : "");
+        vpn_xdp_detach(x);
+        return -1;
+    }
+
+    printf("[XDP] %s: UDP port %d on %d address%s steered to AF_XDP sockets "
+           "(%s mode, %d RX queues)\n", ifname, port, num_addrs, num_addrs > 1 ? "es" : "",
+           x->generic ? "generic" : "native", x->rx_queues);
+    return 0;
+}
+
+void vpn_xdp_detach(struct vpn_xdp *x) {
+    if (x->link_fd >= 0) {
+        close(x->link_fd);
+    }
+    if (x->prog_fd >= 0) {
+        close(x->prog_fd);
+    }
+    if (x->map_fd >= 0) {
+        close(x->map_fd);
+    }
+    x->prog_fd = x->map_fd = x->link_fd = -1;
+}
+
+// =============================================================================
+// AF_XDP SOCKETS
+// =============================================================================
+
+static int map_ring(struct vpn_xsk_ring *r, int fd, const struct xdp_ring_offset *off,
+                    off_t pgoff, uint32_t size, size_t desc_size) {
+    r->map_size = off->desc + size * desc_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -1;
+    }
+
+    unsigned char *base = r->map;
+    r->producer = (uint32_t *)(base + off->producer);
+    r->consumer = (uint32_t *)(base + off->consumer);
+    r->flags = (uint32_t *)(base + off->flags);
+    r->descs = base + off->desc;
+    r->mask = size - 1;
+    return 0;
+}
+
+int vpn_xsk_open(struct vpn_xsk *s, struct vpn_xdp *x, int queue, struct vpn_pool *umem) {
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+    s->queue = queue;
+    s->umem = umem;
+
+    s->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (s->fd < 0) {
+        return -1;
+    }
+
+    // Each chunk's struct vpn_pkt is headroom the kernel leaves alone
+    struct xdp_umem_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t)umem->arena;
+    reg.len = (uint64_t)umem->count * umem->slot_size;
+    reg.chunk_size = umem->slot_size;
+    reg.headroom = sizeof(struct vpn_pkt);
+
+    int ring_size = VPN_XSK_RING_SIZE, comp_size = XSK_COMP_RING_SIZE;
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+    if (setsockopt(s->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(s->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(s->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &comp_size, sizeof(comp_size)) < 0 ||
+        setsockopt(s->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        getsockopt(s->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) < 0) {
+        goto fail;
+    }
+    if (map_ring(&s->rx, s->fd, &off.rx, XDP_PGOFF_RX_RING, VPN_XSK_RING_SIZE,
+                 sizeof(struct xdp_desc)) < 0 ||
+        map_ring(&s->fill, s->fd, &off.fr, XDP_UMEM_PGOFF_FILL_RING, VPN_XSK_RING_SIZE,
+                 sizeof(uint64_t)) < 0 ||
+        map_ring(&s->comp, s->fd, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, XSK_COMP_RING_SIZE,
+                 sizeof(uint64_t)) < 0) {
+        goto fail;
+    }
+
+    // Zero-copy where the driver can, else copy mode; with need_wakeup the
+    // driver only wants a syscall when it ran out of fill ring entries
+    static const uint16_t bind_flags[] = {
+        XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP, XDP_COPY | XDP_USE_NEED_WAKEUP, XDP_COPY,
+    };
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = x->ifindex,
+        .sxdp_queue_id = queue,
+    };
+    int bound = -1;
+    for (size_t i = 0; i < sizeof(bind_flags) / sizeof(bind_flags[0]) && bound < 0; i++) {
+        sxdp.sxdp_flags = bind_flags[i];
+        bound = bind(s->fd, (struct sockaddr *)&sxdp, sizeof(sxdp));
+    }
+    if (bound < 0) {
+        goto fail;
+    }
+    s->zerocopy = sxdp.sxdp_flags & XDP_ZEROCOPY;
+    vpn_xsk_refill(s);
+
+    union bpf_attr attr;
+    uint32_t key = queue, value = s->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = x->map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    if (bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:;
+    int saved = errno;
+    vpn_xsk_close(s);
+    errno = saved;
+    return -1;
+}
+
+void vpn_xsk_close(struct vpn_xsk *s) {
+    struct vpn_xsk_ring *rings[] = {&s->rx, &s->fill, &s->comp};
+
+    for (int i = 0; i < 3; i++) {
+        if (rings[i]->map) {
+            munmap(rings[i]->map, rings[i]->map_size);
+            rings[i]->map = NULL;
+        }
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+    }
+}
+
+// Check an Ethernet frame the program let through and find its UDP
+// payload. Returns the payload length, or -1.
+static int parse_frame(unsigned char *frame, uint32_t len, struct sockaddr_in *addr,
+                       unsigned char **payload) {
+    if (len < FRAME_HEADERS) {
+        return -1;
+    }
+    unsigned char *ip = frame + ETH_HLEN;
+    unsigned char *udp = ip + 20;
+    int ip_len = ip[2] << 8 | ip[3];
+    int udp_len = udp[4] << 8 | udp[5];
+
+    // The frame may be padded past the IP packet, never cut short of it
+    if (ip[0] != 0x45 || ip[9] != IPPROTO_UDP || ip_len > (int)len - ETH_HLEN ||
+        udp_len < 8 || udp_len > ip_len - 20) {
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    memcpy(&addr->sin_addr, ip + 12, 4);
+    memcpy(&addr->sin_port, udp, 2);
+    *payload = udp + 8;
+    return udp_len - 8;
+}
+
+int vpn_xsk_recv(struct vpn_xsk *s, struct vpn_pkt **pkts, struct sockaddr_in *addrs, int max) {
+    struct vpn_xsk_ring *r = &s->rx;
+    const struct xdp_desc *descs = r->descs;
+    uint32_t cons = *r->consumer;
+    uint32_t prod = __atomic_load_n(r->producer, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    for (; cons != prod && count < max; cons++) {
+        const struct xdp_desc *d = &descs[cons & r->mask];
+        // The frame sits in its chunk behind the headroom; the chunk
+        // starts with its buffer's struct vpn_pkt
+        struct vpn_pkt *pkt = (struct vpn_pkt *)(s->umem->arena +
+                                                 (d->addr & ~(uint64_t)(s->umem->slot_size - 1)));
+        int len = parse_frame(s->umem->arena + d->addr, d->len, &addrs[count], &pkt->data);
+        if (len < 0) {
+            s->dropped++;
+            vpn_pkt_put(s->umem, pkt);
+            continue;
+        }
+        pkt->len = len;
+        pkts[count++] = pkt;
+    }
+    __atomic_store_n(r->consumer, cons, __ATOMIC_RELEASE);
+    return count;
+}
+
+void vpn_xsk_refill(struct vpn_xsk *s) {
+    struct vpn_xsk_ring *r = &s->fill;
+    uint64_t *addrs = r->descs;
+    uint32_t prod = *r->producer;
+    uint32_t room = r->mask + 1 - (prod - __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE));
+    uint32_t n = 0;
+
+    for (; n < room; n++) {
+        struct vpn_pkt *pkt = vpn_pkt_get(s->umem);
+        if (!pkt) {
+            break;
+        }
+        addrs[(prod + n) & r->mask] = (unsigned char *)pkt - s->umem->arena;
+    }
+    if (n > 0) {
+        __atomic_store_n(r->producer, prod + n, __ATOMIC_RELEASE);
+    }
+
+    if (__atomic_load_n(r->flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) {
+        recvfrom(s->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
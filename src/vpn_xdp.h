@@ -0,0 +1,115 @@
+/*
+ * AF_XDP receive path for simple_vpn_server's UDP transport (-X)
+ *
+ * However many datagrams recvmmsg() or a multishot recvmsg takes per
+ * syscall, each one has still gone through the whole stack on the way
+ * there - skb allocation, IP and UDP receive, socket lookup, the socket
+ * queue - in softirq, on the CPU the NIC interrupted. AF_XDP skips all of
+ * it: an XDP program, run by the driver on each frame before any of that,
+ * sends tunnel datagrams straight into an AF_XDP socket (XSK), and the
+ * server reads the frames from a ring it shares with the kernel.
+ *
+ * - The XDP program takes IPv4 UDP frames to the tunnel port at one of
+ *   our own addresses - without IP options, not fragments - and redirects
+ *   them into the XSK bound to the NIC queue they arrived on (an XSKMAP
+ *   indexed by queue). Everything else, and every frame of a queue without
+ *   an XSK, is XDP_PASS: it goes up the normal stack as before. So does
+ *   everything the server sends, and traffic to that port the host only
+ *   forwards. The addresses are the interface's when the program is
+ *   attached; one added later isn't matched.
+ * - Frames land in a UMEM: memory registered with the socket, cut into
+ *   VPN_XSK_FRAME_SIZE chunks. The UMEM is a vpn_pool (vpn_pool.h) of that
+ *   slot size, so each chunk starts with a struct vpn_pkt: the frames the
+ *   kernel doesn't hold are ordinary pool buffers, and a received one is
+ *   decrypted in place and written to TUN from there. Nothing is copied.
+ * - Free frames are handed to the kernel on the fill ring; it hands back
+ *   received ones on the RX ring. With the driver in zero-copy mode, the
+ *   NIC DMAs straight into the UMEM; otherwise the kernel copies each frame
+ *   in (still without the socket layer).
+ *
+ * The program is built from raw BPF instructions and loaded, like the XSK
+ * is set up, with plain syscalls: there is no libbpf or libxdp to install.
+ * It is attached as a bpf_link (Linux 5.9+), in native (driver) mode where
+ * the driver has it, else in generic mode, and goes away with the process.
+ *
+ * Worker N binds queue N, so the NIC's RX queues should match the workers:
+ * ethtool -L IFACE combined N, with -t N. RSS hashes a client's 4-tuple to
+ * one queue, so its datagrams keep arriving at the same worker. Frames
+ * longer than a chunk (jumbo frames) can't be received this way.
+ *
+ * The stack checks UDP checksums, this path doesn't: every DATA, KEEPALIVE
+ * and PROBE is authenticated by its tag, and a corrupted HELLO or RESUME
+ * just fails like a forged one.
+ */
+
+#ifndef VPN_XDP_H
+#define VPN_XDP_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "vpn_pool.h"
+
+#define VPN_XSK_FRAME_SIZE 4096                  // UMEM chunk: one page
+#define VPN_XSK_FRAMES 4096                      // Per socket: 16 MiB of UMEM
+#define VPN_XSK_RING_SIZE 2048                   // Fill and RX ring entries
+#define VPN_XSK_MAX_QUEUES 64
+#define VPN_XDP_MAX_ADDRS 16                     // Local addresses the program matches
+
+// The XDP program and its XSKMAP, attached to one interface
+struct vpn_xdp {
+    int ifindex;
+    int prog_fd, map_fd, link_fd;
+    int generic;                    // Attached in generic (skb) mode
+    int rx_queues;                  // The interface's RX queues
+};
+
+// One side of a ring shared with the kernel
+struct vpn_xsk_ring {
+    uint32_t *producer, *consumer, *flags;
+    void *descs;                    // struct xdp_desc (RX) or uint64_t (fill, completion)
+    uint32_t mask;
+    void *map;
+    size_t map_size;
+};
+
+// An AF_XDP socket on one NIC queue, receiving into a UMEM pool
+struct vpn_xsk {
+    int fd;
+    int queue;
+    int zerocopy;
+    struct vpn_pool *umem;
+    struct vpn_xsk_ring rx, fill, comp;
+    uint64_t dropped;               // Frames that weren't IPv4 UDP after all
+};
+
+// Load the program steering UDP to addr:port into XSKs and attach it to the
+// interface ifname. addr is what the UDP socket is bound to (network
+// order); INADDR_ANY stands for each of ifname's IPv4 addresses. Returns 0,
+// or -1 on error (a message has been printed).
+int vpn_xdp_attach(struct vpn_xdp *x, const char *ifname, uint32_t addr, int port);
+
+// Detach the program: every frame goes up the stack again
+void vpn_xdp_detach(struct vpn_xdp *x);
+
+// Open an XSK on queue of x's interface with umem (a pool with
+// VPN_XSK_FRAME_SIZE slots, whose buffers all go on the fill ring), and
+// add it to the XSKMAP. Returns 0, or -1 on error (errno set).
+int vpn_xsk_open(struct vpn_xsk *s, struct vpn_xdp *x, int queue, struct vpn_pool *umem);
+
+// Close the socket (taking it out of the XSKMAP) and unmap its rings. The
+// UMEM pool can only be freed after this.
+void vpn_xsk_close(struct vpn_xsk *s);
+
+// Take up to max received datagrams off the RX ring. Each pkts[i] is the
+// frame's UMEM buffer, with data and len set to the UDP payload, and
+// addrs[i] is where it came from. The buffers are the caller's until given
+// back with vpn_pkt_put(); vpn_xsk_refill() then hands them to the kernel
+// again. Returns the number of datagrams.
+int vpn_xsk_recv(struct vpn_xsk *s, struct vpn_pkt **pkts, struct sockaddr_in *addrs, int max);
+
+// Put the pool's free buffers on the fill ring, and kick the driver if it
+// is waiting for them
+void vpn_xsk_refill(struct vpn_xsk *s);
+
+#endif